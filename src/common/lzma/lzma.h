@@ -32,6 +32,16 @@ unsigned char	*pInput,
 unsigned int	inputSize,
 unsigned int	*pOutputSize );
 
+//-----------------------------------------------------------------------------
+// Above, at encoder level nLevel, 0 (fastest) to 9 (smallest). -1 is the
+// default of 5, which the other encoding routines always use.
+//-----------------------------------------------------------------------------
+unsigned char *LZMA_Compress(
+unsigned char	*pInput,
+unsigned int	inputSize,
+unsigned int	*pOutputSize,
+int				nLevel );
+
 //-----------------------------------------------------------------------------
 // Above, but returns null if compression would not yield a size improvement
 //-----------------------------------------------------------------------------
@@ -212,30 +212,31 @@ short *CBoneCache::CachedToStudio()
 	return (short *)( (char *)(this+1) + m_cachedToStudioOffset );
 }
 
-// Construct a singleton
-static CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> g_StudioBoneCache( 128 * 1024L );
+// Construct a singleton. Sharded so bone setup on several threads doesn't serialize on one mutex.
+#define BONE_CACHE_SHARDS 8
+static CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex, BONE_CACHE_SHARDS> g_StudioBoneCache( 128 * 1024L );
 
 CBoneCache *Studio_GetBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
+	AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
 	return g_StudioBoneCache.GetResource_NoLock( cacheHandle );
 }
 
 memhandle_t Studio_CreateBoneCache( bonecacheparams_t &params )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
+	// Locks the shard it creates in for the whole create
 	return g_StudioBoneCache.CreateResource( params );
 }
 
 void Studio_DestroyBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
+	AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
 	g_StudioBoneCache.DestroyResource( cacheHandle );
 }
 
 void Studio_InvalidateBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
+	AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
 	CBoneCache *pCache = g_StudioBoneCache.GetResource_NoLock( cacheHandle );
 	if ( pCache )
 	{
@@ -41,6 +41,32 @@ public:
 
 };
 
+/// Eight rays, for Trace8Rays. These are plain floats rather than avx types so that code which
+/// isn't compiled for avx can still build packets and read results; the avx2 kernel loads them
+/// itself. Any eight rays can be put in a packet, but the kd tree can only trace them all at once
+/// if they have the same direction signs.
+struct ALIGN32 EightRays
+{
+	float m_flOrigin[3][8];									// [axis][ray]
+	float m_flDirection[3][8];								// [axis][ray]
+
+	inline void SetRay( int nRay, const Vector &origin, const Vector &direction )
+	{
+		for( int c=0; c<3; c++ )
+		{
+			m_flOrigin[c][nRay] = origin[c];
+			m_flDirection[c][nRay] = direction[c];
+		}
+	}
+
+	// rays 4*nHalf .. 4*nHalf+3 as a FourRays
+	void Get4Rays( int nHalf, FourRays &rays ) const;
+	void Set4Rays( int nHalf, const FourRays &rays );
+
+	// same as FourRays::CalculateDirectionSignMask, for all eight rays
+	int CalculateDirectionSignMask( void ) const;
+} ALIGN32_POST;
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -193,6 +219,48 @@ protected:
 };
 
 
+#define BVHNODE_LEAF_FLAG 0x80000000						// child is a leaf: (start<<4)|count
+#define BVHNODE_EMPTY_CHILD ((int32)BVHNODE_LEAF_FLAG)		// unused child slot (leaf with no triangles)
+#define BVH_MAX_LEAF_TRIANGLES 8							// must fit in the 4 count bits
+
+struct CacheOptimizedBVHNode4
+{
+	// 4-wide bvh node. The child bounds are stored as structure-of-arrays so that one ray can be
+	// tested against all four children with a single fltx4, and a FourRays packet can be tested
+	// against one child by replicating a single lane. The whole node is 112 bytes.
+	//
+	// A child is either the index of another node, or BVHNODE_LEAF_FLAG or'ed with the first
+	// BVHTriangleIndexList entry shifted up 4 bits and the number of triangles in the low 4 bits.
+
+	float m_flMins[3][4];									// [axis][child]
+	float m_flMaxs[3][4];									// [axis][child]
+	int32 m_nChildren[4];
+
+	static inline bool IsLeaf( int32 nChild )
+	{
+		return ( nChild & BVHNODE_LEAF_FLAG ) != 0;
+	}
+
+	static inline int32 LeafTriangleIndexStart( int32 nChild )
+	{
+		assert( IsLeaf( nChild ) );
+		return ( nChild & ~BVHNODE_LEAF_FLAG ) >> 4;
+	}
+
+	static inline int LeafNumberOfTriangles( int32 nChild )
+	{
+		assert( IsLeaf( nChild ) );
+		return nChild & 15;
+	}
+
+	static inline int32 MakeLeaf( int32 nFirstIndex, int nTriangles )
+	{
+		assert( nTriangles <= 15 );
+		return BVHNODE_LEAF_FLAG | ( nFirstIndex << 4 ) | nTriangles;
+	}
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -209,6 +277,17 @@ struct RayTracingResult
 };
 
 
+struct ALIGN32 RayTracingResult8
+{
+	float surface_normal[3][8];								// [axis][ray]
+	int32 HitIds[8];										// -1=no hit. otherwise, triangle index
+	float HitDistance[8];									// distance to intersection
+
+	// copy a 4 ray result into rays 4*nHalf .. 4*nHalf+3
+	void Set4Results( int nHalf, const RayTracingResult &rslt );
+} ALIGN32_POST;
+
+
 class RayTraceLight
 {
 public:
@@ -220,6 +299,7 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_USE_BVH 8									// trace through the 4-wide bvh instead of the kd tree
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -232,9 +312,11 @@ class RayStream
 {
 	friend class RayTracingEnvironment;
 
-	RayTracingSingleResult *PendingStreamOutputs[8][4];
+	// one pending packet per direction sign octant, so that every packet can be traced through
+	// the kd tree as a whole
+	RayTracingSingleResult *PendingStreamOutputs[8][8];
 	int n_in_stream[8];
-	FourRays PendingRays[8];
+	EightRays PendingRays[8];
 
 public:
 	RayStream(void)
@@ -243,6 +325,52 @@ public:
 	}
 };
 
+/// Receives the results of rays traced through a RayQueue.
+class IRayQueueCallback
+{
+public:
+	virtual void RayQueueResult( int nUserData, const RayTracingSingleResult &result ) = 0;
+};
+
+/// A deferred ray queue. Any number of rays can be added; FlushRayQueue sorts them by skip id,
+/// direction octant and origin cell so that nearby rays heading the same way end up in the same
+/// 8 ray packet, traces them, and hands each result to the callback it was queued with. Unlike
+/// RayStream, results are only valid once the queue has been flushed, and they are delivered in
+/// sorted order, not the order the rays were added.
+class RayQueue
+{
+	friend class RayTracingEnvironment;
+
+public:
+	struct QueuedRay_t
+	{
+		Vector m_vecStart;
+		Vector m_vecDelta;
+		int32 m_nSkipID;
+		int m_nUserData;
+		IRayQueueCallback *m_pCallback;
+	};
+
+	void AddRay( Vector const &start, Vector const &end, IRayQueueCallback *pCallback, int nUserData,
+				 int32 skip_id = -1 )
+	{
+		int i = m_Rays.AddToTail();
+		m_Rays[i].m_vecStart = start;
+		m_Rays[i].m_vecDelta = end - start;
+		m_Rays[i].m_nSkipID = skip_id;
+		m_Rays[i].m_nUserData = nUserData;
+		m_Rays[i].m_pCallback = pCallback;
+	}
+
+	int Count( void ) const
+	{
+		return m_Rays.Count();
+	}
+
+private:
+	CUtlVector<QueuedRay_t> m_Rays;
+};
+
 // When transparent triangles are in the list, the caller can provide a callback that will get called at each triangle
 // allowing the callback to stop processing if desired.
 // UNDONE: This is not currently SIMD - it really only supports single rays
@@ -264,17 +392,26 @@ public:
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
+	CUtlVector<CacheOptimizedBVHNode4> OptimizedBVH;		//< the 4-wide bvh. root is 0
+	CUtlVector<int32> BVHTriangleIndexList;					//< triangle indices referenced by bvh leaves
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
 
+	void *m_pMappedCache;									//< .rtc file the tree arrays point into, if any
+	int m_nMappedCacheSize;
+
 public:
 	RayTracingEnvironment() : OptimizedTriangleList( 1024 )
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		m_pMappedCache=NULL;
+		m_nMappedCacheSize=0;
 	}
 
+	~RayTracingEnvironment();
+
 
 	// call AddTriangle to set up the world
 	void AddTriangle(int32 id, const Vector &v1, const Vector &v2, const Vector &v3,
@@ -294,9 +431,26 @@ public:
 										const Vector &color);
 
 
-	// SetupAccelerationStructure to prepare for tracing
+	// SetupAccelerationStructure to prepare for tracing. Builds the bvh if RTE_FLAGS_USE_BVH is
+	// set, otherwise the kd tree.
 	void SetupAccelerationStructure(void);
 
+	// SetupAccelerationStructure, but reuse the kd tree or bvh from pCacheFileName if it was
+	// built from the same triangles. The cache is keyed by a hash of every triangle added so far
+	// and the flags that affect the build; on a miss the structure is built and the cache
+	// rewritten. Returns true if the cached structure was used.
+	bool SetupAccelerationStructureCached( const char *pCacheFileName );
+
+	// gives the tree arrays their own memory again if they were using a mapped cache file, and
+	// unmaps it. Building either tree does this first.
+	void ReleaseMappedCache(void);
+
+	// the pieces of SetupAccelerationStructure. Both trees must be built before the triangles are
+	// converted into intersection format, which is what lets the two be compared on one scene.
+	void BuildKDTree(void);
+	void BuildBVH(void);
+	void ConvertTrianglesToIntersectionFormat(void);
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -305,11 +459,27 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// Trace4Rays through the bvh. Called by Trace4Rays when RTE_FLAGS_USE_BVH is set. The bvh
+	// doesn't care about direction signs, so any four rays can be traced together.
+	void Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+					   RayTracingResult *rslt_out,
+					   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// higher level intersection routine that handles computing the mask and handling rays which do not match in direciton sign
 	void Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// fire 8 rays through the scene. Uses the avx2 kernel when the cpu supports it and there is
+	// no transparency callback (callbacks only understand FourRays), otherwise traces the packet
+	// as two Trace4Rays calls. TMin and TMax are per ray. Results match Trace4Rays.
+	void Trace8Rays(const EightRays &rays, float const TMin[8], float const TMax[8],
+					RayTracingResult8 *rslt_out,
+					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
+	// true if Trace8Rays will use the avx2 kernel on this cpu
+	static bool Has8WideTracing(void);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -330,7 +500,7 @@ public:
 					 
 	/// raytracing stream - lets you trace an array of rays by feeding them to this function.
 	/// results will not be returned until FinishStream is called. This function handles sorting
-	/// the rays by direction, tracing them 4 at a time, and de-interleaving the results.
+	/// the rays by direction, tracing them 8 at a time, and de-interleaving the results.
 
 	void AddToRayStream(RayStream &s,
 						Vector const &start,Vector const &end,RayTracingSingleResult *rslt_out);
@@ -341,6 +511,11 @@ public:
 	/// previously passed to AddToRaySteam will have been filled in.
 	void FinishRayStream(RayStream &s);
 
+	/// trace everything in a RayQueue and empty it. With bThreaded the packets are traced with
+	/// RunThreadsOnIndividual, so the callbacks can be called from several threads at once; that
+	/// can only be used from the main thread, not from inside another RunThreadsOn.
+	void FlushRayQueue(RayQueue &q, bool bThreaded = false);
+
 
 	int MakeLeafNode(int first_tri, int last_tri);
 
@@ -35,10 +35,12 @@
 	for ( KeyValues * kvValue = kvRoot->GetFirstValue(); kvValue != NULL; kvValue = kvValue->GetNextValue() )
 
 class IBaseFileSystem;
+class IFileSystem;
 class CUtlBuffer;
 class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
+class CKeyValuesArena;
 
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
@@ -312,6 +314,9 @@ private:
 	void FreeAllocatedValue();
 	void AllocateValueBlock(int size);
 
+	// Frees a key through whichever allocator it came from
+	static void DestroyKey( KeyValues *pKey );
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -330,12 +335,20 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nAllocFlags; // KEYVALUES_ALLOC_ flags, only set on keys built by a CKeyValuesArena
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
 	KeyValues *m_pChain;// Search here if it's not in our list
 
+	enum
+	{
+		KEYVALUES_ALLOC_ARENA_KEY = 0x1,	// the key itself lives in an arena, don't delete it
+		KEYVALUES_ALLOC_ARENA_VALUE = 0x2,	// m_sValue points into an arena or a mapped file
+	};
+
+	friend class CKeyValuesArena;
+
 private:
 	// Statics to implement the optional growable string table
 	// Function pointers that will determine which mode we are in
@@ -359,6 +372,88 @@ public:
 
 typedef KeyValues::AutoDelete KeyValuesAD;
 
+#define KEYVALUES_ARENA_CHUNK_SIZE	(256 * 1024)
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds KeyValues trees out of one private arena instead of a heap
+//			allocation per key and per string value. The text is copied into the
+//			arena once and string values point straight into that copy, so a whole
+//			file costs a handful of allocations and is released in one go.
+//
+//			A tree can also be saved in a compiled binary form; loading that maps
+//			the file and points string values into the mapping, so later loads skip
+//			tokenizing altogether.
+//
+//			Trees built here are ordinary KeyValues and can be read and modified as
+//			usual. Destroying (or purging) the arena releases them; if keys or values
+//			were set on a tree after it was loaded, call deleteThis() on its root first
+//			so that those heap allocations are released too.
+//-----------------------------------------------------------------------------
+class CKeyValuesArena
+{
+public:
+	CKeyValuesArena( int nChunkSize = KEYVALUES_ARENA_CHUNK_SIZE );
+	~CKeyValuesArena();
+
+	// Parses text into a new tree. Returns the first top level key, with any further
+	// top level keys chained on as its peers, just like KeyValues::LoadFromBuffer.
+	// pBuffer must be null terminated. Returns NULL if there were no keys at all.
+	KeyValues *LoadFromBuffer( const char *resourceName, const char *pBuffer, IBaseFileSystem *pFileSystem = NULL, const char *pPathID = NULL );
+
+	// Loads a file. With bUseCompiledCache, a compiled copy is kept next to it in the
+	// write path ("<resourceName>.kvc") and used as long as the text hasn't changed;
+	// the cache needs file times and full paths, hence the full IFileSystem.
+	KeyValues *LoadFromFile( IFileSystem *filesystem, const char *resourceName, const char *pathID = NULL, bool bUseCompiledCache = false );
+
+	// Compiled form. The source size and time stamp the text it was built from, and
+	// a compiled tree is only loaded if they still match.
+	static bool WriteCompiled( KeyValues *pRoot, CUtlBuffer &buf, int nSourceSize, int64 nSourceTime );
+	KeyValues *LoadCompiled( const char *pFullPath, int nSourceSize, int64 nSourceTime );
+
+	// Same as LoadCompiled, but from memory. Nothing is copied, so pData must stay
+	// valid (and unchanged) for as long as the tree is in use.
+	KeyValues *LoadCompiledFromBuffer( const void *pData, int nDataSize, int nSourceSize, int64 nSourceTime );
+
+	// Parse settings for trees loaded after this; they match KeyValues::UsesEscapeSequences
+	// and KeyValues::UsesConditionals.
+	void UsesEscapeSequences( bool state ) { m_bUsesEscapeSequences = state; }
+	void UsesConditionals( bool state ) { m_bUsesConditionals = state; }
+
+	// Releases everything; any tree built by this arena is gone after this.
+	void Purge();
+
+	int GetBytesUsed() const { return m_nBytesUsed; }
+	int GetAllocationCount() const { return m_Chunks.Count() + m_Mappings.Count(); }
+
+private:
+	struct ParseState_t;
+	struct Mapping_t
+	{
+		void *m_pData;
+		int m_nSize;
+	};
+
+	void *Alloc( int nBytes, int nAlignment = 8 );
+	char *AllocString( const char *pString, int nLen );
+	KeyValues *AllocKey( int nSymbol );
+	void MergeKeys( KeyValues *pDest, KeyValues *pBase );
+
+	KeyValues *ParseText( const char *resourceName, char *pText, IBaseFileSystem *pFileSystem, const char *pPathID, bool *pHasIncludes );
+	KeyValues *ParseFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID, int *pFileSize, bool *pHasIncludes );
+	void RecursiveLoad( ParseState_t &state, KeyValues *pParent );
+	const char *ReadToken( ParseState_t &state, bool &wasQuoted, bool &wasConditional );
+	int GetSymbol( ParseState_t &state, const char *pName );
+
+	CUtlVector< byte * > m_Chunks;
+	CUtlVector< Mapping_t > m_Mappings;
+	byte *m_pNextAlloc;
+	byte *m_pAllocLimit;
+	int m_nChunkSize;
+	int m_nBytesUsed;
+	bool m_bUsesEscapeSequences;
+	bool m_bUsesConditionals;
+};
+
 enum KeyValuesUnpackDestinationTypes_t
 {
 	UNPACK_TYPE_FLOAT,										// dest is a float
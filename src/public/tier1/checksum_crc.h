@@ -17,6 +17,30 @@ void CRC32_ProcessBuffer( CRC32_t *pulCRC, const void *p, int len );
 void CRC32_Final( CRC32_t *pulCRC );
 CRC32_t	CRC32_GetTableEntry( unsigned int slot );
 
+// Continues several independent CRCs at once, e.g. one chunk from each of a set
+// of files being read together. Call it again with the next chunk of each to
+// stream; a buffer with length 0 leaves its CRC alone.
+void CRC32_ProcessBuffers( int nBuffers, CRC32_t *pulCRCs, const void * const *ppBuffers, const int *pnLengths );
+
+// The CRC of A followed by B, given the final CRCs of A and B and the length of B.
+// Lets a large buffer be hashed in pieces on several threads.
+CRC32_t CRC32_Combine( CRC32_t crcA, CRC32_t crcB, int nLengthB );
+
+// CRC32_ProcessBuffer uses the fastest of these the CPU supports. They all give the
+// same answer; these are only here so they can be timed and checked against each other.
+enum CRC32Impl_t
+{
+	CRC32_IMPL_BYTEWISE = 0,	// one table lookup per byte
+	CRC32_IMPL_SLICE8,			// eight lookups per 8 bytes
+	CRC32_IMPL_PCLMUL,			// carry-less multiply folding, x86 with PCLMULQDQ only
+
+	CRC32_IMPL_COUNT
+};
+
+bool CRC32_IsImplAvailable( CRC32Impl_t impl );
+const char *CRC32_GetImplName( CRC32Impl_t impl );
+void CRC32_ProcessBufferWithImpl( CRC32Impl_t impl, CRC32_t *pulCRC, const void *p, int len );
+
 inline CRC32_t CRC32_ProcessSingleBuffer( const void *p, int len )
 {
 	CRC32_t crc;
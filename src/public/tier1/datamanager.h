@@ -81,6 +81,13 @@ protected:
 	// NOTE: you must call this from the destructor of the derived class! (will assert otherwise)
 	void					FreeAllLists()	{ FlushAll(); m_listsAreFreed = true; }
 
+	// Frees least recently used resources until nBytesToFree have gone, regardless of the target size
+	unsigned int			FreeLRU( unsigned int nBytesToFree );
+
+	// Handle serials start at firstSerial and go up by serialStep each time a slot is reused,
+	// so a sharded manager can tell which shard a handle came from by its serial
+	void					SetHandleSerials( unsigned short firstSerial, unsigned short serialStep ) { m_firstSerial = firstSerial; m_serialStep = serialStep; }
+
 							CDataManagerBase( unsigned int maxSize );
 	virtual					~CDataManagerBase();
 	
@@ -124,11 +131,21 @@ protected:
 	unsigned short m_freeList;
 	unsigned short m_listsAreFreed : 1;
 	unsigned short m_unused : 15;
+	unsigned short m_firstSerial;
+	unsigned short m_serialStep;
 
 };
 
-template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE = STORAGE_TYPE *, class MUTEX_TYPE = CThreadNullMutex>
-class CDataManager : public CDataManagerBase
+//-----------------------------------------------------------------------------
+// NUM_SHARDS > 1 splits the manager into that many independent shards, each with
+// its own LRU, mutex and share of the memory budget, so threads working on
+// different resources don't serialize on one mutex. See the sharded version below.
+//-----------------------------------------------------------------------------
+template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE = STORAGE_TYPE *, class MUTEX_TYPE = CThreadNullMutex, int NUM_SHARDS = 1 >
+class CDataManager;
+
+template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE, class MUTEX_TYPE >
+class CDataManager< STORAGE_TYPE, CREATE_PARAMS, LOCK_TYPE, MUTEX_TYPE, 1 > : public CDataManagerBase
 {
 	typedef CDataManagerBase BaseClass;
 public:
@@ -247,6 +264,223 @@ private:
 	MUTEX_TYPE m_mutex;
 };
 
+
+//-----------------------------------------------------------------------------
+// Sharded data manager. Resources are spread round robin over the shards when
+// they're created, and a handle remembers its shard in the low bits of its
+// serial, so every call on an existing handle locks only that shard.
+//
+// Each shard gets an equal share of the budget. A shard may go over its share
+// while the manager as a whole is under budget; once the total is over, new
+// resources push out the least recently used ones, first from shards over
+// their share (starting with the one being created in), then from any shard. The total is summed from the shards without locking,
+// so it can be briefly out of date.
+//-----------------------------------------------------------------------------
+template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE, class MUTEX_TYPE, int NUM_SHARDS >
+class CDataManager
+{
+	COMPILE_TIME_ASSERT( NUM_SHARDS > 1 && NUM_SHARDS <= 256 && ( NUM_SHARDS & ( NUM_SHARDS - 1 ) ) == 0 );
+
+	typedef CDataManager< STORAGE_TYPE, CREATE_PARAMS, LOCK_TYPE, MUTEX_TYPE, 1 > ShardBaseClass;
+
+	class CShard : public ShardBaseClass
+	{
+	public:
+		void InitShard( int iShard )
+		{
+			this->SetHandleSerials( (unsigned short)iShard, (unsigned short)NUM_SHARDS );
+		}
+
+		// Create without evicting anything; the sharded manager decides what goes
+		memhandle_t CreateResourceNoEvict( const CREATE_PARAMS &createParams, bool bCreateLocked )
+		{
+			// Held across the whole thing so nobody sees the handle before it has storage
+			AUTO_LOCK( this->AccessMutex() );
+			unsigned short memoryIndex = this->CreateHandle( bCreateLocked );
+			STORAGE_TYPE *pStore = STORAGE_TYPE::CreateResource( createParams );
+			return this->StoreResourceInHandle( memoryIndex, pStore, (unsigned int) pStore->Size() );
+		}
+
+		unsigned int FreeLRUBytes( unsigned int nBytesToFree )
+		{
+			return this->FreeLRU( nBytesToFree );
+		}
+	};
+
+public:
+	CDataManager( unsigned int size = (unsigned)-1 )
+	{
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_shards[i].InitShard( i );
+		}
+		SetTargetSize( size );
+	}
+
+	LOCK_TYPE LockResource( memhandle_t hMem )						{ return Shard( hMem ).LockResource( hMem ); }
+	int UnlockResource( memhandle_t hMem )							{ return Shard( hMem ).UnlockResource( hMem ); }
+	LOCK_TYPE GetResource_NoLock( memhandle_t hMem )				{ return Shard( hMem ).GetResource_NoLock( hMem ); }
+	LOCK_TYPE GetResource_NoLockNoLRUTouch( memhandle_t hMem )		{ return Shard( hMem ).GetResource_NoLockNoLRUTouch( hMem ); }
+	void DestroyResource( memhandle_t hMem )						{ Shard( hMem ).DestroyResource( hMem ); }
+	void TouchResource( memhandle_t hMem )							{ Shard( hMem ).TouchResource( hMem ); }
+	void MarkAsStale( memhandle_t hMem )							{ Shard( hMem ).MarkAsStale( hMem ); }
+	int LockCount( memhandle_t hMem )								{ return Shard( hMem ).LockCount( hMem ); }
+	int BreakLock( memhandle_t hMem )								{ return Shard( hMem ).BreakLock( hMem ); }
+
+	void NotifySizeChanged( memhandle_t hMem, unsigned int oldSize, unsigned int newSize )
+	{
+		Shard( hMem ).NotifySizeChanged( hMem, oldSize, newSize );
+	}
+
+	memhandle_t CreateResource( const CREATE_PARAMS &createParams, bool bCreateLocked = false )
+	{
+		int iShard = (unsigned int)( ++m_nextShard ) & ( NUM_SHARDS - 1 );
+		EnsureCapacity( (unsigned int)STORAGE_TYPE::EstimatedSize( createParams ), iShard );
+		return m_shards[iShard].CreateResourceNoEvict( createParams, bCreateLocked );
+	}
+
+	// The mutex guarding a handle's shard
+	MUTEX_TYPE &AccessMutex( memhandle_t hMem )						{ return Shard( hMem ).AccessMutex(); }
+
+	// Locks every shard, e.g. to walk the handle lists
+	void Lock()
+	{
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_shards[i].Lock();
+		}
+	}
+
+	void Unlock()
+	{
+		for ( int i = NUM_SHARDS; --i >= 0; )
+		{
+			m_shards[i].Unlock();
+		}
+	}
+
+	int BreakAllLocks()
+	{
+		int nBroken = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			nBroken += m_shards[i].BreakAllLocks();
+		}
+		return nBroken;
+	}
+
+	unsigned int TargetSize()		{ return m_targetMemorySize; }
+	unsigned int UsedSize()
+	{
+		unsigned int nUsed = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			nUsed += m_shards[i].UsedSize();
+		}
+		return nUsed;
+	}
+	unsigned int AvailableSize()	{ return m_targetMemorySize - UsedSize(); }
+
+	void SetTargetSize( unsigned int targetSize )
+	{
+		m_targetMemorySize = targetSize;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_shards[i].SetTargetSize( targetSize / NUM_SHARDS );
+		}
+	}
+
+	unsigned int FlushAllUnlocked()	{ return ForAllShards( &ShardBaseClass::FlushAllUnlocked ); }
+	unsigned int FlushToTargetSize()	{ return EnsureCapacity( 0 ); }
+	unsigned int FlushAll()			{ return ForAllShards( &ShardBaseClass::FlushAll ); }
+
+	unsigned int Purge( unsigned int nBytesToPurge )
+	{
+		unsigned int nFreed = 0;
+		for ( int i = 0; i < NUM_SHARDS && nFreed < nBytesToPurge; i++ )
+		{
+			nFreed += m_shards[i].FreeLRUBytes( nBytesToPurge - nFreed );
+		}
+		return nFreed;
+	}
+
+	unsigned int EnsureCapacity( unsigned int size, int iFirstShard = 0 )
+	{
+		// First bring shards that are over their share back down to it, starting with
+		// the given one, then take from whichever shards still have something
+		unsigned int nFreed = 0;
+		unsigned int nShareSize = m_targetMemorySize / NUM_SHARDS;
+		for ( int nPass = 0; nPass < 2; nPass++ )
+		{
+			for ( int i = 0; i < NUM_SHARDS; i++ )
+			{
+				unsigned int nOver = BytesOverTarget( size );
+				if ( !nOver )
+					return nFreed;
+
+				CShard &shard = m_shards[( iFirstShard + i ) & ( NUM_SHARDS - 1 )];
+				if ( nPass == 0 )
+				{
+					unsigned int nShardUsed = shard.UsedSize();
+					if ( nShardUsed <= nShareSize )
+						continue;
+					nOver = MIN( nOver, nShardUsed - nShareSize );
+				}
+				nFreed += shard.FreeLRUBytes( nOver );
+			}
+		}
+		return nFreed;
+	}
+
+	// Debugging only!!!!
+	void GetLRUHandleList( CUtlVector< memhandle_t >& list )
+	{
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_shards[i].GetLRUHandleList( list );
+		}
+	}
+
+	void GetLockHandleList( CUtlVector< memhandle_t >& list )
+	{
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_shards[i].GetLockHandleList( list );
+		}
+	}
+
+private:
+	unsigned int BytesOverTarget( unsigned int size )
+	{
+		unsigned int nUsed = UsedSize();
+		if ( nUsed > m_targetMemorySize )
+			return nUsed - m_targetMemorySize + size;
+		unsigned int nAvailable = m_targetMemorySize - nUsed;
+		return ( nAvailable < size ) ? size - nAvailable : 0;
+	}
+
+	CShard &Shard( memhandle_t hMem )
+	{
+		// Serials live in the high word of the handle, and each shard's are congruent to its index
+		unsigned int fullWord = (unsigned int)reinterpret_cast<uintp>( hMem );
+		return m_shards[( fullWord >> 16 ) & ( NUM_SHARDS - 1 )];
+	}
+
+	unsigned int ForAllShards( unsigned int ( ShardBaseClass::*pfnFlush )() )
+	{
+		unsigned int nFreed = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			nFreed += ( m_shards[i].*pfnFlush )();
+		}
+		return nFreed;
+	}
+
+	CShard m_shards[NUM_SHARDS];
+	unsigned int m_targetMemorySize;
+	CInterlockedInt m_nextShard;
+};
+
 //-----------------------------------------------------------------------------
 
 inline unsigned short CDataManagerBase::FromHandle( memhandle_t handle )
@@ -69,6 +69,9 @@ public:
 	int Count() const { return m_BlocksAllocated; }
 	int PeakCount() const { return m_PeakAlloc; }
 
+	// Is the block inside one of our blobs?
+	bool IsAllocationWithinPool( void *pMem ) const;
+
 protected:
 	class CBlob
 	{
@@ -106,24 +109,106 @@ protected:
 
 
 //-----------------------------------------------------------------------------
-// 
+// Thread-caching pool. Each thread keeps two small magazines of free blocks, so
+// Alloc and Free normally touch no shared state; when both run dry (or both
+// fill up) a whole magazine is swapped with a depot shared by all threads,
+// under the lock. Threads beyond MEMPOOLMT_MAX_THREADS, and GROW_NONE pools
+// (which can't afford blocks stranded in another thread's magazine), go
+// straight to the locked pool. When a thread exits, its magazines go to each
+// pool's depot and its slot is handed to the next new thread.
+//
+// Clear() must not be called while other threads are using the pool.
 //-----------------------------------------------------------------------------
+#define MEMPOOLMT_MAGAZINE_SIZE		32
+#define MEMPOOLMT_MAX_THREADS		64
+
+struct MemoryPoolMTStats_t
+{
+	int		m_nBlocksAllocated;		// Blocks handed out and not yet freed
+	int		m_nHighWaterBlocks;		// Most blocks ever drawn from the blobs, in use or cached
+	int		m_nCachedBlocks;		// Free blocks held in thread magazines and the depot
+	int		m_nThreadCaches;
+	int64	m_nMagazineHits;		// Alloc/Free served from the calling thread's magazines
+	int64	m_nMagazineMisses;		// Alloc/Free that had to go to the depot
+	int64	m_nUncachedOps;			// Alloc/Free that went straight to the locked pool
+	int64	m_nUnmatchedFrees;		// Frees beyond the freeing thread's own allocs, a lower bound on cross-thread frees
+
+	float	HitRate() const
+	{
+		int64 nTotal = m_nMagazineHits + m_nMagazineMisses;
+		return nTotal ? (float)m_nMagazineHits / (float)nTotal : 0.0f;
+	}
+};
+
 class CMemoryPoolMT : public CUtlMemoryPool
 {
 public:
-	CMemoryPoolMT(int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL) : CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner) {}
-
+	CMemoryPoolMT( int blockSize, int numElements, int growMode = UTLMEMORYPOOL_GROW_FAST, const char *pszAllocOwner = NULL, int nAlignment = 0 );
+	~CMemoryPoolMT();
 
-	void*		Alloc()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
-	void*		Alloc( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc( amount ); }
-	void*		AllocZero()	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero(); }	
-	void*		AllocZero( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero( amount ); }
-	void		Free(void *pMem) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+	void*		Alloc();
+	void*		Alloc( size_t amount );
+	void*		AllocZero();
+	void*		AllocZero( size_t amount );
+	void		Free( void *pMem );
 
 	// Frees everything
-	void		Clear() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Clear(); }
+	void		Clear();
+
+	// Returns number of blocks handed out. PeakCount() is the high-water mark of
+	// blocks drawn from the blobs, which includes those sitting in magazines.
+	// This hides CUtlMemoryPool::Count(), which isn't virtual: called through a
+	// CUtlMemoryPool pointer it counts the cached blocks as handed out too.
+	int			Count() const;
+
+	// Each thread updates its own counters without the lock, so they're approximate while other threads run
+	void		GetStats( MemoryPoolMTStats_t *pStats ) const;
+
+protected:
+	// Returns every cached block to the free list
+	void		FlushCaches();
+
 private:
-	CThreadFastMutex m_mutex; // @TODO: Rework to use tslist (toml 7/6/2007)
+	struct Magazine_t
+	{
+		Magazine_t	*m_pNext;
+		int			m_nCount;
+		void		*m_pBlocks[MEMPOOLMT_MAGAZINE_SIZE];
+	};
+
+	// Only ever touched by its own thread, except by Clear, FlushCaches and GetStats
+	struct ThreadCache_t
+	{
+		Magazine_t	*m_pLoaded;
+		Magazine_t	*m_pPrevious;
+		int64		m_nAllocs;
+		int64		m_nFrees;
+		int64		m_nHits;
+		int64		m_nMisses;
+		int64		m_nUnmatchedFrees;
+		char		m_Pad[128 - 2 * sizeof( Magazine_t * ) - 5 * sizeof( int64 )];	// Keep other threads' caches off our cache lines
+	};
+
+	ThreadCache_t	*GetThreadCache();
+	ThreadCache_t	*CreateThreadCache( int iSlot );
+	void			*AllocFromDepot( ThreadCache_t *pCache );
+	void			FreeToDepot( ThreadCache_t *pCache, void *pMem );
+	Magazine_t		*NewMagazine();
+
+	// Called with the slot list locked when the thread in iSlot exits
+	void			ReleaseThreadCache( int iSlot );
+	friend class CMemoryPoolMTThreadSlots;
+
+	mutable CThreadFastMutex	m_mutex;	// Guards the base pool, the depot and the cache pointers
+	ThreadCache_t		*m_pThreadCaches[MEMPOOLMT_MAX_THREADS];
+	ThreadCache_t		m_RetiredCaches;	// Counters of the caches of threads that have exited
+	CMemoryPoolMT		*m_pNextPool;		// All CMemoryPoolMTs, so exiting threads can find their caches
+	CMemoryPoolMT		*m_pPrevPool;
+	Magazine_t			*m_pFullMagazines;
+	Magazine_t			*m_pEmptyMagazines;
+	int					m_nUncachedAllocated;
+	int64				m_nUncachedOps;
+	bool				m_bCacheBlocks;
 };
 
 
@@ -165,6 +250,24 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// Thread-caching version of CClassMemoryPool
+//-----------------------------------------------------------------------------
+template< class T >
+class CClassMemoryPoolMT : public CMemoryPoolMT
+{
+public:
+	CClassMemoryPoolMT( int numElements, int growMode = GROW_FAST, int nAlignment = 0 ) :
+		CMemoryPoolMT( sizeof(T), numElements, growMode, MEM_ALLOC_CLASSNAME(T), CClassMemoryPool<T>::GetClassMemoryPoolAlignment( nAlignment ) ) {}
+
+	T*		Alloc();
+	T*		AllocZero();
+	void	Free( T *pMem );
+
+	void	Clear();
+};
+
+
 //-----------------------------------------------------------------------------
 // Specialized pool for aligned data management (e.g., Xbox cubemaps)
 //-----------------------------------------------------------------------------
@@ -346,6 +449,86 @@ inline void CClassMemoryPool<T>::Clear()
 }
 
 
+template< class T >
+inline T* CClassMemoryPoolMT<T>::Alloc()
+{
+	T *pRet;
+
+	{
+	MEM_ALLOC_CREDIT_(MEM_ALLOC_CLASSNAME(T));
+	pRet = (T*)CMemoryPoolMT::Alloc();
+	}
+
+	if ( pRet )
+	{
+		Construct( pRet );
+	}
+	return pRet;
+}
+
+template< class T >
+inline T* CClassMemoryPoolMT<T>::AllocZero()
+{
+	T *pRet;
+
+	{
+	MEM_ALLOC_CREDIT_(MEM_ALLOC_CLASSNAME(T));
+	pRet = (T*)CMemoryPoolMT::AllocZero();
+	}
+
+	if ( pRet )
+	{
+		Construct( pRet );
+	}
+	return pRet;
+}
+
+template< class T >
+inline void CClassMemoryPoolMT<T>::Free(T *pMem)
+{
+	if ( pMem )
+	{
+		Destruct( pMem );
+	}
+
+	CMemoryPoolMT::Free( pMem );
+}
+
+template< class T >
+inline void CClassMemoryPoolMT<T>::Clear()
+{
+	// Put the cached blocks back on the free list so they aren't mistaken for live objects
+	FlushCaches();
+
+	CUtlRBTree<void *, int> freeBlocks;
+	SetDefLessFunc( freeBlocks );
+
+	void *pCurFree = m_pHeadOfFreeList;
+	while ( pCurFree != NULL )
+	{
+		freeBlocks.Insert( pCurFree );
+		pCurFree = *((void**)pCurFree);
+	}
+
+	for( CBlob *pCur=m_BlobHead.m_pNext; pCur != &m_BlobHead; pCur=pCur->m_pNext )
+	{
+		int nElements = pCur->m_NumBytes / this->m_BlockSize;
+		T *p = ( T * ) AlignValue( pCur->m_Data, this->m_nAlignment );
+		T *pLimit = p + nElements;
+		while ( p < pLimit )
+		{
+			if ( freeBlocks.Find( p ) == freeBlocks.InvalidIndex() )
+			{
+				Destruct( p );
+			}
+			p++;
+		}
+	}
+
+	CMemoryPoolMT::Clear();
+}
+
+
 //-----------------------------------------------------------------------------
 // Macros that make it simple to make a class use a fixed-size allocator
 // Put DECLARE_FIXEDSIZE_ALLOCATOR in the private section of a class,
@@ -376,7 +559,7 @@ inline void CClassMemoryPool<T>::Clear()
 		static   CMemoryPoolMT   s_Allocator
 
 #define DEFINE_FIXEDSIZE_ALLOCATOR_MT( _class, _initsize, _grow )					\
-	CMemoryPoolMT   _class::s_Allocator(sizeof(_class), _initsize, _grow, #_class " pool")
+	CMemoryPoolMT   _class::s_Allocator(sizeof(_class), _initsize, _grow, #_class " pool", alignof( _class ) )
 
 //-----------------------------------------------------------------------------
 // Macros that make it simple to make a class use a fixed-size allocator
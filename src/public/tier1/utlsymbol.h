@@ -23,6 +23,7 @@
 //-----------------------------------------------------------------------------
 class CUtlSymbolTable;
 class CUtlSymbolTableMT;
+class CUtlSymbolTableMT32;
 
 
 //-----------------------------------------------------------------------------
@@ -67,10 +68,10 @@ protected:
 	static void Initialize();
 	
 	// returns the current symbol table
-	static CUtlSymbolTableMT* CurrTable();
+	static CUtlSymbolTableMT32* CurrTable();
 		
 	// The standard global symbol table
-	static CUtlSymbolTableMT* s_pSymbolTable; 
+	static CUtlSymbolTableMT32* s_pSymbolTable; 
 
 	static bool s_bAllowStaticSymbolTable;
 
@@ -217,6 +218,109 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// CUtlSymbol32: a symbol from a CUtlSymbolTableMT32. Same as CUtlSymbol but with a
+// 32 bit index, and no global table behind it.
+//-----------------------------------------------------------------------------
+typedef unsigned int UtlSymId32_t;
+
+#define UTL_INVAL_SYMBOL32  ((UtlSymId32_t)~0)
+
+class CUtlSymbol32
+{
+public:
+	CUtlSymbol32() : m_Id(UTL_INVAL_SYMBOL32) {}
+	CUtlSymbol32( UtlSymId32_t id ) : m_Id(id) {}
+
+	bool operator==( CUtlSymbol32 const& src ) const { return m_Id == src.m_Id; }
+	bool IsValid() const { return m_Id != UTL_INVAL_SYMBOL32; }
+	operator UtlSymId32_t const() const { return m_Id; }
+
+protected:
+	UtlSymId32_t   m_Id;
+};
+
+
+//-----------------------------------------------------------------------------
+// CUtlSymbolTableMT32:
+// description:
+//    A symbol table that any number of threads can add to and read from at once.
+//    Strings are hashed into one of a number of shards, each an open addressed
+//    hash table. Find and String never lock, and AddString only locks the shard
+//    it's adding to, and only if the string isn't there already.
+//
+//    Symbols are numbered in the order they're added. Strings are copied into
+//    blocks that start small and grow as a shard fills, and never move, so the
+//    pointer String returns stays good until RemoveAll or the table is destroyed.
+//    RemoveAll is not thread safe.
+//
+//    The global CUtlSymbol table is one of these, limited to 64K strings so its
+//    symbols fit a CUtlSymbol. CUtlSymbolTableMT stays the locked CUtlSymbolTable,
+//    since libraries built against its inline code still create their own.
+//-----------------------------------------------------------------------------
+#define UTLSYMBOLMT_SHARD_BITS			4
+#define UTLSYMBOLMT_SHARD_COUNT			( 1 << UTLSYMBOLMT_SHARD_BITS )
+#define UTLSYMBOLMT_SYMBOL_BLOCK_BITS	8		// the first block of the symbol index holds 256 strings
+#define UTLSYMBOLMT_MAX_SYMBOL_BLOCKS	( 32 - UTLSYMBOLMT_SYMBOL_BLOCK_BITS + 1 )
+
+class CUtlSymbolTableMT32
+{
+public:
+	// AddString fails with Error rather than hand out a symbol at or past nMaxSymbols
+	CUtlSymbolTableMT32( int initSize = 32, bool caseInsensitive = false, UtlSymId32_t nMaxSymbols = UTL_INVAL_SYMBOL32 );
+	~CUtlSymbolTableMT32();
+
+	// Finds and/or creates a symbol based on the string
+	CUtlSymbol32 AddString( const char* pString );
+
+	// Finds the symbol for pString
+	CUtlSymbol32 Find( const char* pString ) const;
+
+	// Look up the string associated with a particular symbol
+	const char* String( CUtlSymbol32 id ) const;
+
+	inline bool HasElement( const char* pStr ) const
+	{
+		return Find( pStr ) != UTL_INVAL_SYMBOL32;
+	}
+
+	// Remove all symbols in the table. Nothing else may be using the table.
+	void RemoveAll();
+
+	int GetNumStrings( void ) const
+	{
+		return m_nSymbols;
+	}
+
+private:
+	struct HashTable_t;
+	struct Shard_t;
+
+	static HashTable_t *AllocHashTable( int nSize );
+	Shard_t &GetShard( int i ) const;
+	unsigned int HashSymbolString( const char *pString ) const;
+	UtlSymId32_t FindInTable( const HashTable_t *pTable, const char *pString, unsigned int nHash ) const;
+	void InsertIntoTable( HashTable_t *pTable, const char *pString, unsigned int nHash, UtlSymId32_t id );
+	const char *CopyString( Shard_t &shard, const char *pString );
+	UtlSymId32_t AllocSymbol( const char *pString );
+	void Init();
+	void Purge();
+
+	// Shards, each on its own cache lines
+	Shard_t *m_pShards;
+	void *m_pShardMemory;
+	int m_nInitialTableSize;
+	bool m_bInsensitive;
+
+	// Symbol -> string. Block n holds 256 << n entries, so the blocks never move and
+	// a 32 bit index needs at most UTLSYMBOLMT_MAX_SYMBOL_BLOCKS of them.
+	const char ** volatile m_pSymbolBlocks[UTLSYMBOLMT_MAX_SYMBOL_BLOCKS];
+	CInterlockedInt m_nSymbols;
+	UtlSymId32_t m_nMaxSymbols;
+	CThreadFastMutex m_SymbolBlockMutex;
+};
+
+
 
 //-----------------------------------------------------------------------------
 // CUtlFilenameSymbolTable:
@@ -21,6 +21,7 @@
 #include "zip_uncompressed.h"
 #include "checksum_crc.h"
 #include "byteswap.h"
+#include "tier0/threadtools.h"
 #include "utlstring.h"
 
 #include "tier1/lzmaDecoder.h"
@@ -443,6 +444,9 @@ private:
 	// For fast name lookup and sorting
 	CUtlRBTree< CZipEntry, int > m_Files;
 
+	// Held while AddBufferToZip updates m_Files, so entries can be compressed concurrently
+	CThreadFastMutex	m_AddMutex;
+
 	// Used to buffer zip data, instead of ram
 	bool				m_bUseDiskCacheForWrites;
 	HANDLE				m_hDiskCacheWriteFile;
@@ -1069,6 +1073,9 @@ void CZipFile::AddBufferToZip( const char *relativename, void *data, int length,
 		return;
 	}
 
+	// Everything above works on local data; the directory is shared
+	AUTO_LOCK( m_AddMutex );
+
 	// See if entry is in list already
 	CZipEntry e;
 	e.m_Name = name;
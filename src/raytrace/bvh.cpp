@@ -0,0 +1,456 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// 4-wide bounding volume hierarchy builder for RayTracingEnvironment. This is an alternative to
+// the kd tree built by RefineNode: every triangle is referenced by exactly one leaf, splits are
+// chosen with a binned surface area heuristic, and the subtrees below the top few levels are
+// built in parallel.
+
+#include "raytrace.h"
+#include <cmdlib.h>
+#include "threads.h"
+#include "pacifier.h"
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_DEPTH 48									// Trace4RaysBVH's stack is sized for this
+#define BVH_MIN_PARALLEL_TRIANGLES 2048						// smaller subtrees aren't worth a task
+
+#define BVH_COST_OF_TRAVERSAL 1.0f
+#define BVH_COST_OF_INTERSECTION 2.0f
+
+
+struct BVHBuildRef_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+	Vector m_Centroid;
+	int32 m_nTriangle;
+};
+
+struct BVHBounds_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+
+	void Clear()
+	{
+		m_Mins.Init( 1.0e30, 1.0e30, 1.0e30 );
+		m_Maxs.Init( -1.0e30, -1.0e30, -1.0e30 );
+	}
+
+	void Add( const Vector &vecMins, const Vector &vecMaxs )
+	{
+		VectorMin( m_Mins, vecMins, m_Mins );
+		VectorMax( m_Maxs, vecMaxs, m_Maxs );
+	}
+
+	float SurfaceArea() const
+	{
+		if ( m_Mins.x > m_Maxs.x )
+			return 0.0f;
+		Vector vecDim = m_Maxs - m_Mins;
+		return 2.0f * ( vecDim.x * vecDim.y + vecDim.x * vecDim.z + vecDim.y * vecDim.z );
+	}
+};
+
+// the output of a build - either the whole tree, or one subtree built on its own thread
+struct BVHBuildOutput_t
+{
+	CUtlVector<CacheOptimizedBVHNode4> m_Nodes;
+	CUtlVector<int32> m_TriangleIndices;
+};
+
+// a subtree deferred until the parallel phase
+struct BVHBuildTask_t
+{
+	int m_nFirst;
+	int m_nCount;
+	int m_nDepth;
+	int m_nParentNode;										// node and slot to patch with the result
+	int m_nParentSlot;
+	int32 m_nRootChild;
+	BVHBuildOutput_t m_Output;
+};
+
+
+class CBVHBuilder
+{
+public:
+	CBVHBuilder( RayTracingEnvironment *pEnv ) : m_pEnv( pEnv ), m_nDeferThreshold( 0 ) {}
+
+	void Build();
+	void BuildTask( int nTask );
+
+private:
+	int32 BuildChild( BVHBuildOutput_t &out, int nFirst, int nCount, int nDepth, bool bAllowDefer,
+					  int nParentNode, int nParentSlot );
+	int BuildNode( BVHBuildOutput_t &out, int nFirst, int nCount, int nDepth, bool bAllowDefer );
+	int32 MakeLeaf( BVHBuildOutput_t &out, int nFirst, int nCount );
+	bool FindSplit( int nFirst, int nCount, int nDepth, bool bForce, int *pLeftCount );
+	void CalculateBounds( int nFirst, int nCount, BVHBounds_t *pBounds, BVHBounds_t *pCentroidBounds );
+	void Merge( BVHBuildOutput_t &out, BVHBuildTask_t *pTask );
+
+	RayTracingEnvironment *m_pEnv;
+	CUtlVector<BVHBuildRef_t> m_Refs;
+	CUtlVector<BVHBuildTask_t *> m_Tasks;
+	int m_nDeferThreshold;
+};
+
+
+void CBVHBuilder::CalculateBounds( int nFirst, int nCount, BVHBounds_t *pBounds, BVHBounds_t *pCentroidBounds )
+{
+	pBounds->Clear();
+	if ( pCentroidBounds )
+		pCentroidBounds->Clear();
+	for ( int i = nFirst; i < nFirst + nCount; i++ )
+	{
+		pBounds->Add( m_Refs[i].m_Mins, m_Refs[i].m_Maxs );
+		if ( pCentroidBounds )
+			pCentroidBounds->Add( m_Refs[i].m_Centroid, m_Refs[i].m_Centroid );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Binned SAH: drop the centroids into BVH_NUM_BINS bins along each axis, sweep the bins to get the
+// cost of every bin boundary, and partition the refs around the cheapest one. Returns false if
+// a leaf is cheaper, unless bForce is set in which case it falls back to splitting the range in half.
+//-----------------------------------------------------------------------------
+bool CBVHBuilder::FindSplit( int nFirst, int nCount, int nDepth, bool bForce, int *pLeftCount )
+{
+	BVHBounds_t bounds, centroidBounds;
+	CalculateBounds( nFirst, nCount, &bounds, &centroidBounds );
+
+	float flBestCost = 1.0e30;
+	int nBestAxis = -1;
+	int nBestBin = 0;
+
+	// past the depth limit only even splits are allowed, which keeps the depth logarithmic
+	if ( nDepth < BVH_MAX_DEPTH )
+	{
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			float flExtent = centroidBounds.m_Maxs[axis] - centroidBounds.m_Mins[axis];
+			if ( flExtent <= 0.0f )
+				continue;
+			float flScale = BVH_NUM_BINS * ( 1.0f - 1.0e-5f ) / flExtent;
+
+			BVHBounds_t binBounds[BVH_NUM_BINS];
+			int binCount[BVH_NUM_BINS];
+			for ( int b = 0; b < BVH_NUM_BINS; b++ )
+			{
+				binBounds[b].Clear();
+				binCount[b] = 0;
+			}
+			for ( int i = nFirst; i < nFirst + nCount; i++ )
+			{
+				int b = (int)( ( m_Refs[i].m_Centroid[axis] - centroidBounds.m_Mins[axis] ) * flScale );
+				b = clamp( b, 0, BVH_NUM_BINS - 1 );
+				binBounds[b].Add( m_Refs[i].m_Mins, m_Refs[i].m_Maxs );
+				binCount[b]++;
+			}
+
+			// sweep from the right to get the area/count to the right of each boundary
+			float flRightArea[BVH_NUM_BINS];
+			int nRightCount[BVH_NUM_BINS];
+			BVHBounds_t accum;
+			accum.Clear();
+			int nAccum = 0;
+			for ( int b = BVH_NUM_BINS - 1; b > 0; b-- )
+			{
+				accum.Add( binBounds[b].m_Mins, binBounds[b].m_Maxs );
+				nAccum += binCount[b];
+				flRightArea[b] = accum.SurfaceArea();
+				nRightCount[b] = nAccum;
+			}
+
+			accum.Clear();
+			nAccum = 0;
+			for ( int b = 1; b < BVH_NUM_BINS; b++ )
+			{
+				accum.Add( binBounds[b-1].m_Mins, binBounds[b-1].m_Maxs );
+				nAccum += binCount[b-1];
+				if ( nAccum == 0 || nRightCount[b] == 0 )
+					continue;
+				float flCost = accum.SurfaceArea() * nAccum + flRightArea[b] * nRightCount[b];
+				if ( flCost < flBestCost )
+				{
+					flBestCost = flCost;
+					nBestAxis = axis;
+					nBestBin = b;
+				}
+			}
+		}
+	}
+
+	if ( nBestAxis != -1 )
+	{
+		float flParentArea = bounds.SurfaceArea();
+		float flSplitCost = BVH_COST_OF_TRAVERSAL;
+		if ( flParentArea > 0.0f )
+			flSplitCost += BVH_COST_OF_INTERSECTION * flBestCost / flParentArea;
+		float flLeafCost = BVH_COST_OF_INTERSECTION * nCount;
+		if ( !bForce && flLeafCost <= flSplitCost )
+			return false;
+
+		// partition in place around the chosen bin boundary
+		float flExtent = centroidBounds.m_Maxs[nBestAxis] - centroidBounds.m_Mins[nBestAxis];
+		float flScale = BVH_NUM_BINS * ( 1.0f - 1.0e-5f ) / flExtent;
+		int nLeft = nFirst;
+		int nRight = nFirst + nCount - 1;
+		while ( nLeft <= nRight )
+		{
+			int b = (int)( ( m_Refs[nLeft].m_Centroid[nBestAxis] - centroidBounds.m_Mins[nBestAxis] ) * flScale );
+			if ( clamp( b, 0, BVH_NUM_BINS - 1 ) < nBestBin )
+			{
+				nLeft++;
+			}
+			else
+			{
+				V_swap( m_Refs[nLeft], m_Refs[nRight] );
+				nRight--;
+			}
+		}
+		*pLeftCount = nLeft - nFirst;
+		if ( *pLeftCount > 0 && *pLeftCount < nCount )
+			return true;
+	}
+
+	if ( !bForce )
+		return false;
+
+	// every centroid is in the same place (or we're too deep) - any split is as good as another
+	*pLeftCount = nCount / 2;
+	return true;
+}
+
+
+int32 CBVHBuilder::MakeLeaf( BVHBuildOutput_t &out, int nFirst, int nCount )
+{
+	Assert( nCount > 0 && nCount <= BVH_MAX_LEAF_TRIANGLES );
+	int32 nStart = out.m_TriangleIndices.Count();
+	for ( int i = nFirst; i < nFirst + nCount; i++ )
+		out.m_TriangleIndices.AddToTail( m_Refs[i].m_nTriangle );
+	return CacheOptimizedBVHNode4::MakeLeaf( nStart, nCount );
+}
+
+
+int32 CBVHBuilder::BuildChild( BVHBuildOutput_t &out, int nFirst, int nCount, int nDepth, bool bAllowDefer,
+							   int nParentNode, int nParentSlot )
+{
+	if ( nCount <= BVH_MAX_LEAF_TRIANGLES )
+	{
+		int nLeftCount;
+		if ( !FindSplit( nFirst, nCount, nDepth, false, &nLeftCount ) )
+			return MakeLeaf( out, nFirst, nCount );
+	}
+
+	if ( bAllowDefer && nCount <= m_nDeferThreshold )
+	{
+		BVHBuildTask_t *pTask = new BVHBuildTask_t;
+		pTask->m_nFirst = nFirst;
+		pTask->m_nCount = nCount;
+		pTask->m_nDepth = nDepth;
+		pTask->m_nParentNode = nParentNode;
+		pTask->m_nParentSlot = nParentSlot;
+		pTask->m_nRootChild = BVHNODE_EMPTY_CHILD;
+		m_Tasks.AddToTail( pTask );
+		return BVHNODE_EMPTY_CHILD;							// patched in Merge
+	}
+
+	return BuildNode( out, nFirst, nCount, nDepth, bAllowDefer );
+}
+
+
+//-----------------------------------------------------------------------------
+// Makes a 4-wide node by splitting the range in two and then splitting the larger
+// halves again until there are four children or nothing left worth splitting.
+//-----------------------------------------------------------------------------
+int CBVHBuilder::BuildNode( BVHBuildOutput_t &out, int nFirst, int nCount, int nDepth, bool bAllowDefer )
+{
+	int nNode = out.m_Nodes.AddToTail();
+	{
+		CacheOptimizedBVHNode4 &node = out.m_Nodes[nNode];
+		for ( int i = 0; i < 4; i++ )
+		{
+			for ( int c = 0; c < 3; c++ )
+			{
+				node.m_flMins[c][i] = 1.0e30;
+				node.m_flMaxs[c][i] = -1.0e30;
+			}
+			node.m_nChildren[i] = BVHNODE_EMPTY_CHILD;
+		}
+	}
+
+	int groupFirst[4] = { nFirst };
+	int groupCount[4] = { nCount };
+	bool groupFinal[4] = { false };
+	int nGroups = 1;
+	while ( nGroups < 4 )
+	{
+		// split the biggest group which is still splittable
+		int nSplit = -1;
+		for ( int g = 0; g < nGroups; g++ )
+		{
+			if ( !groupFinal[g] && groupCount[g] > 1 && ( nSplit == -1 || groupCount[g] > groupCount[nSplit] ) )
+				nSplit = g;
+		}
+		if ( nSplit == -1 )
+			break;
+
+		int nLeftCount;
+		bool bMustSplit = ( groupCount[nSplit] > BVH_MAX_LEAF_TRIANGLES );
+		if ( !FindSplit( groupFirst[nSplit], groupCount[nSplit], nDepth, bMustSplit, &nLeftCount ) )
+		{
+			groupFinal[nSplit] = true;
+			continue;
+		}
+
+		groupFirst[nGroups] = groupFirst[nSplit] + nLeftCount;
+		groupCount[nGroups] = groupCount[nSplit] - nLeftCount;
+		groupFinal[nGroups] = false;
+		groupCount[nSplit] = nLeftCount;
+		nGroups++;
+	}
+
+	for ( int g = 0; g < nGroups; g++ )
+	{
+		BVHBounds_t bounds;
+		CalculateBounds( groupFirst[g], groupCount[g], &bounds, NULL );
+		int32 nChild = BuildChild( out, groupFirst[g], groupCount[g], nDepth + 1, bAllowDefer, nNode, g );
+
+		// out.m_Nodes may have grown, so don't hold a reference across BuildChild
+		CacheOptimizedBVHNode4 &node = out.m_Nodes[nNode];
+		for ( int c = 0; c < 3; c++ )
+		{
+			node.m_flMins[c][g] = bounds.m_Mins[c];
+			node.m_flMaxs[c][g] = bounds.m_Maxs[c];
+		}
+		node.m_nChildren[g] = nChild;
+	}
+
+	return nNode;
+}
+
+
+void CBVHBuilder::BuildTask( int nTask )
+{
+	BVHBuildTask_t *pTask = m_Tasks[nTask];
+	pTask->m_Output.m_Nodes.EnsureCapacity( pTask->m_nCount / 2 );
+	pTask->m_Output.m_TriangleIndices.EnsureCapacity( pTask->m_nCount );
+	pTask->m_nRootChild = BuildNode( pTask->m_Output, pTask->m_nFirst, pTask->m_nCount, pTask->m_nDepth, false );
+}
+
+
+// appends a subtree's nodes and triangle indices to the tree, and hooks it up to its parent
+void CBVHBuilder::Merge( BVHBuildOutput_t &out, BVHBuildTask_t *pTask )
+{
+	int nNodeBase = out.m_Nodes.Count();
+	int nTriangleBase = out.m_TriangleIndices.Count();
+
+	out.m_TriangleIndices.AddMultipleToTail( pTask->m_Output.m_TriangleIndices.Count(), pTask->m_Output.m_TriangleIndices.Base() );
+	for ( int n = 0; n < pTask->m_Output.m_Nodes.Count(); n++ )
+	{
+		CacheOptimizedBVHNode4 &node = out.m_Nodes[ out.m_Nodes.AddToTail( pTask->m_Output.m_Nodes[n] ) ];
+		for ( int i = 0; i < 4; i++ )
+		{
+			int32 nChild = node.m_nChildren[i];
+			if ( nChild == BVHNODE_EMPTY_CHILD )
+				continue;
+			if ( CacheOptimizedBVHNode4::IsLeaf( nChild ) )
+			{
+				node.m_nChildren[i] = CacheOptimizedBVHNode4::MakeLeaf(
+					CacheOptimizedBVHNode4::LeafTriangleIndexStart( nChild ) + nTriangleBase,
+					CacheOptimizedBVHNode4::LeafNumberOfTriangles( nChild ) );
+			}
+			else
+			{
+				node.m_nChildren[i] = nChild + nNodeBase;
+			}
+		}
+	}
+
+	out.m_Nodes[pTask->m_nParentNode].m_nChildren[pTask->m_nParentSlot] = pTask->m_nRootChild + nNodeBase;
+	pTask->m_Output.m_Nodes.Purge();
+	pTask->m_Output.m_TriangleIndices.Purge();
+}
+
+
+static CBVHBuilder *s_pBVHBuilder;
+
+static void BuildBVHTaskThread( int iThread, int nTask )
+{
+	s_pBVHBuilder->BuildTask( nTask );
+}
+
+
+void CBVHBuilder::Build()
+{
+	int nTris = m_pEnv->OptimizedTriangleList.Count();
+	m_Refs.SetCount( nTris );
+
+	BVHBounds_t sceneBounds;
+	sceneBounds.Clear();
+	for ( int t = 0; t < nTris; t++ )
+	{
+		const CacheOptimizedTriangle &tri = m_pEnv->OptimizedTriangleList[t];
+		BVHBuildRef_t &ref = m_Refs[t];
+		ref.m_Mins = tri.Vertex( 0 );
+		ref.m_Maxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( ref.m_Mins, tri.Vertex( v ), ref.m_Mins );
+			VectorMax( ref.m_Maxs, tri.Vertex( v ), ref.m_Maxs );
+		}
+		ref.m_Centroid = 0.5f * ( ref.m_Mins + ref.m_Maxs );
+		ref.m_nTriangle = t;
+		sceneBounds.Add( ref.m_Mins, ref.m_Maxs );
+	}
+
+	BVHBuildOutput_t out;
+	out.m_TriangleIndices.EnsureCapacity( nTris );
+	if ( nTris == 0 )
+	{
+		m_pEnv->m_MinBound = vec3_origin;
+		m_pEnv->m_MaxBound = vec3_origin;
+		m_pEnv->OptimizedBVH.Purge();
+		m_pEnv->BVHTriangleIndexList.Purge();
+		return;
+	}
+
+	// build the top of the tree here, leaving subtrees below the threshold for the worker threads
+	int nThreads = MAX( numthreads, 1 );
+	m_nDeferThreshold = MAX( BVH_MIN_PARALLEL_TRIANGLES, nTris / ( nThreads * 8 ) );
+	bool bParallel = ( nThreads > 1 && nTris > m_nDeferThreshold );
+	BuildNode( out, 0, nTris, 0, bParallel );
+
+	if ( m_Tasks.Count() )
+	{
+		s_pBVHBuilder = this;
+		SuppressPacifier( true );
+		RunThreadsOnIndividual( m_Tasks.Count(), false, BuildBVHTaskThread );
+		SuppressPacifier( false );
+		s_pBVHBuilder = NULL;
+
+		// merge in task order so the layout doesn't depend on thread timing
+		for ( int i = 0; i < m_Tasks.Count(); i++ )
+		{
+			Merge( out, m_Tasks[i] );
+			delete m_Tasks[i];
+		}
+		m_Tasks.RemoveAll();
+	}
+
+	m_pEnv->m_MinBound = sceneBounds.m_Mins;
+	m_pEnv->m_MaxBound = sceneBounds.m_Maxs;
+	m_pEnv->OptimizedBVH.Swap( out.m_Nodes );
+	m_pEnv->BVHTriangleIndexList.Swap( out.m_TriangleIndices );
+}
+
+
+void RayTracingEnvironment::BuildBVH(void)
+{
+	ReleaseMappedCache();
+	CBVHBuilder builder( this );
+	builder.Build();
+}
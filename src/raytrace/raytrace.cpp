@@ -274,10 +274,115 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// intersect four rays with one triangle, and replace the results for any rays which hit it
+// closer than their current hit. Shared by the kd tree and bvh traversal loops.
+static FORCEINLINE void IntersectTriangle4( const FourRays &rays, TriIntersectData_t const *tri, int32 tnum,
+											RayTracingResult *rslt_out, ITransparentTriangleCallback *pCallback )
+{
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_USE_BVH )
+	{
+		// no need to split up rays by direction sign
+		Trace4RaysBVH(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
@@ -346,6 +451,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_USE_BVH )
+	{
+		Trace4RaysBVH(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	rays.Check();
 
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
@@ -475,100 +586,7 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					IntersectTriangle4( rays, tri, tnum, rslt_out, pCallback );
 				}
 			} while (--ntris);
 			// now, check if all rays have terminated
@@ -592,6 +610,123 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+#define MAX_BVH_STACK_LEN 256
+
+struct BVHNodeToVisit {
+	int32 child;
+	fltx4 TMin;
+};
+
+void RayTracingEnvironment::Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+										  RayTracingResult *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+
+	if ( OptimizedBVH.Count() == 0 )
+		return;
+
+	FourVectors OneOverRayDir=rays.direction;
+	OneOverRayDir.MakeReciprocalSaturate();
+
+	// rays are clipped against the scene bounds first, same as the kd tree
+	for(int c=0;c<3;c++)
+	{
+		fltx4 isect_min_t=
+			MulSIMD(SubSIMD(ReplicateX4(m_MinBound[c]),rays.origin[c]),OneOverRayDir[c]);
+		fltx4 isect_max_t=
+			MulSIMD(SubSIMD(ReplicateX4(m_MaxBound[c]),rays.origin[c]),OneOverRayDir[c]);
+		TMin=MaxSIMD(TMin,MinSIMD(isect_min_t,isect_max_t));
+		TMax=MinSIMD(TMax,MaxSIMD(isect_min_t,isect_max_t));
+	}
+	if (! IsAnyNegative( CmpLeSIMD(TMin,TMax) ) )
+		return;												// missed bounding box
+
+	BVHNodeToVisit NodeStack[MAX_BVH_STACK_LEN];
+	BVHNodeToVisit *stack_ptr=NodeStack;
+	stack_ptr->child=0;
+	stack_ptr->TMin=TMin;
+	stack_ptr++;
+
+	while( stack_ptr != NodeStack )
+	{
+		--stack_ptr;
+		int32 child=stack_ptr->child;
+
+		// skip entries that are further away than everything which has been hit since they were pushed
+		fltx4 TFar=MinSIMD(TMax,rslt_out->HitDistance);
+		if (! IsAnyNegative( CmpLeSIMD(stack_ptr->TMin,TFar) ) )
+			continue;
+
+		if ( CacheOptimizedBVHNode4::IsLeaf( child ) )
+		{
+			int ntris=CacheOptimizedBVHNode4::LeafNumberOfTriangles( child );
+			int32 const *tlist=BVHTriangleIndexList.Base()+CacheOptimizedBVHNode4::LeafTriangleIndexStart( child );
+			for(int t=0;t<ntris;t++)
+			{
+				int tnum=tlist[t];
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangle4( rays, tri, tnum, rslt_out, pCallback );
+			}
+			continue;
+		}
+
+		// test the packet against each child box, replicating one lane of the node at a time
+		CacheOptimizedBVHNode4 const &node=OptimizedBVH[child];
+		int32 hitChildren[4];
+		fltx4 hitTMin[4];
+		float hitDist[4];
+		int nHit=0;
+		for(int i=0;i<4;i++)
+		{
+			if ( node.m_nChildren[i] == BVHNODE_EMPTY_CHILD )
+				continue;
+
+			fltx4 tnear=TMin;
+			fltx4 tfar=TFar;
+			for(int c=0;c<3;c++)
+			{
+				fltx4 t0=MulSIMD(SubSIMD(ReplicateX4(node.m_flMins[c][i]),rays.origin[c]),OneOverRayDir[c]);
+				fltx4 t1=MulSIMD(SubSIMD(ReplicateX4(node.m_flMaxs[c][i]),rays.origin[c]),OneOverRayDir[c]);
+				tnear=MaxSIMD(tnear,MinSIMD(t0,t1));
+				tfar=MinSIMD(tfar,MaxSIMD(t0,t1));
+			}
+			fltx4 hit=CmpLeSIMD(tnear,tfar);
+			if (! IsAnyNegative(hit) )
+				continue;
+
+			// order by the closest entry distance of any ray which hits the box
+			fltx4 entry=OrSIMD(AndSIMD(hit,tnear),AndNotSIMD(hit,ReplicateX4(1.0e23)));
+			float flClosest=min(min(SubFloat(entry,0),SubFloat(entry,1)),min(SubFloat(entry,2),SubFloat(entry,3)));
+
+			// insertion sort, furthest first, so the closest child is pushed last and popped first
+			int slot=nHit++;
+			while( slot>0 && hitDist[slot-1]<flClosest )
+			{
+				hitChildren[slot]=hitChildren[slot-1];
+				hitTMin[slot]=hitTMin[slot-1];
+				hitDist[slot]=hitDist[slot-1];
+				slot--;
+			}
+			hitChildren[slot]=node.m_nChildren[i];
+			hitTMin[slot]=tnear;
+			hitDist[slot]=flClosest;
+		}
+
+		assert(stack_ptr+nHit<=NodeStack+MAX_BVH_STACK_LEN);
+		for(int i=0;i<nHit;i++)
+		{
+			stack_ptr->child=hitChildren[i];
+			stack_ptr->TMin=hitTMin[i];
+			stack_ptr++;
+		}
+	}
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -869,8 +1004,12 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+void RayTracingEnvironment::BuildKDTree(void)
 {
+	ReleaseMappedCache();
+	OptimizedKDTree.RemoveAll();
+	TriangleIndexList.RemoveAll();
+
 	CacheOptimizedKDNode root{};
 	OptimizedKDTree.AddToTail(root);
 	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
@@ -880,13 +1019,28 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 								m_MaxBound);
 	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
+}
 
-	// now, convert all triangles to "intersection format"
+
+void RayTracingEnvironment::ConvertTrianglesToIntersectionFormat(void)
+{
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
 }
 
 
+void RayTracingEnvironment::SetupAccelerationStructure(void)
+{
+	if ( Flags & RTE_FLAGS_USE_BVH )
+		BuildBVH();
+	else
+		BuildKDTree();
+
+	// now, convert all triangles to "intersection format"
+	ConvertTrianglesToIntersectionFormat();
+}
+
+
 
 void RayTracingEnvironment::AddInfinitePointLight(Vector position, Vector intensity)
 {
@@ -0,0 +1,364 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// On-disk cache of the kd tree / bvh. The file is a header followed by the node array and the
+// triangle index array exactly as they are laid out in memory, so it is mapped and the arrays
+// used in place; files MapFile can't map (relative paths, vmpi workers) are read instead. The
+// triangles themselves aren't stored - they have already been added by the time the cache is
+// checked, and they're what the cache key is computed from.
+
+#include "raytrace.h"
+#include <filesystem_tools.h>
+#include <cmdlib.h>
+#include "tier1/checksum_md5.h"
+
+#define RTCACHE_ID			( ( 'C' << 24 ) + ( 'T' << 16 ) + ( 'R' << 8 ) + 'V' )
+#define RTCACHE_VERSION		2
+
+// flags which change what gets built
+#define RTCACHE_KEY_FLAGS	( RTE_FLAGS_USE_BVH | RTE_FLAGS_FAST_TREE_GENERATION )
+
+struct RayTraceCacheHeader_t
+{
+	int32 m_nId;
+	int32 m_nVersion;
+	uint8 m_Key[MD5_DIGEST_LENGTH];
+	int32 m_nFlags;											// RTCACHE_KEY_FLAGS part of Flags
+	int32 m_nTriangles;
+	float m_flMinBound[3];
+	float m_flMaxBound[3];
+	int32 m_nNodeSize;										// sizeof the node type
+	int32 m_nNodes;
+	int32 m_nTriangleIndices;
+	int32 m_nPad[3];										// so the mapped node array is 16 byte aligned
+};
+COMPILE_TIME_ASSERT( sizeof( RayTraceCacheHeader_t ) % 16 == 0 );
+
+
+static void ComputeCacheKey( RayTracingEnvironment &env, uint8 key[MD5_DIGEST_LENGTH] )
+{
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+
+	int32 nHeader[3] = { RTCACHE_VERSION, (int32)( env.Flags & RTCACHE_KEY_FLAGS ), env.OptimizedTriangleList.Count() };
+	MD5Update( &ctx, (unsigned char const *)nHeader, sizeof( nHeader ) );
+
+	// only the parts of the triangle that the builders look at
+	for ( int i = 0; i < env.OptimizedTriangleList.Count(); i++ )
+	{
+		TriGeometryData_t const &tri = env.OptimizedTriangleList[i].m_Data.m_GeometryData;
+		MD5Update( &ctx, (unsigned char const *)&tri.m_nTriangleID, sizeof( tri.m_nTriangleID ) );
+		MD5Update( &ctx, (unsigned char const *)tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		MD5Update( &ctx, (unsigned char const *)&tri.m_nFlags, sizeof( tri.m_nFlags ) );
+	}
+
+	MD5Final( key, &ctx );
+}
+
+
+// make sure a cached tree can't send traversal outside of its arrays
+static bool ValidateKDTree( RayTracingEnvironment &env )
+{
+	int nNodes = env.OptimizedKDTree.Count();
+	int nIndices = env.TriangleIndexList.Count();
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		CacheOptimizedKDNode const &node = env.OptimizedKDTree[i];
+		if ( node.NodeType() == KDNODE_STATE_LEAF )
+		{
+			int nTris = node.NumberOfTrianglesInLeaf();
+			if ( node.TriangleIndexStart() < 0 || nTris < 0 || node.TriangleIndexStart() + nTris > nIndices )
+				return false;
+		}
+		else if ( node.LeftChild() <= i || node.RightChild() >= nNodes )
+		{
+			return false;
+		}
+	}
+	return nNodes > 0;
+}
+
+static bool ValidateBVH( RayTracingEnvironment &env )
+{
+	int nNodes = env.OptimizedBVH.Count();
+	int nIndices = env.BVHTriangleIndexList.Count();
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		for ( int c = 0; c < 4; c++ )
+		{
+			int32 nChild = env.OptimizedBVH[i].m_nChildren[c];
+			if ( CacheOptimizedBVHNode4::IsLeaf( nChild ) )
+			{
+				if ( CacheOptimizedBVHNode4::LeafTriangleIndexStart( nChild ) +
+					 CacheOptimizedBVHNode4::LeafNumberOfTriangles( nChild ) > nIndices )
+					return false;
+			}
+			else if ( nChild <= i || nChild >= nNodes )
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool ValidateTriangleIndices( int32 const *pIndices, int nIndices, int nTriangles )
+{
+	for ( int i = 0; i < nIndices; i++ )
+	{
+		if ( pIndices[i] < 0 || pIndices[i] >= nTriangles )
+			return false;
+	}
+	return true;
+}
+
+
+static bool IsCacheHeaderValid( RayTracingEnvironment &env, RayTraceCacheHeader_t const &header, unsigned int nFileSize,
+								uint8 const key[MD5_DIGEST_LENGTH], int nNodeSize )
+{
+	return header.m_nId == RTCACHE_ID &&
+		header.m_nVersion == RTCACHE_VERSION &&
+		!memcmp( header.m_Key, key, MD5_DIGEST_LENGTH ) &&
+		header.m_nFlags == (int32)( env.Flags & RTCACHE_KEY_FLAGS ) &&
+		header.m_nTriangles == env.OptimizedTriangleList.Count() &&
+		header.m_nNodeSize == nNodeSize &&
+		header.m_nNodes >= 0 && header.m_nTriangleIndices >= 0 &&
+		nFileSize == sizeof( header ) + (uint64)header.m_nNodes * nNodeSize + (uint64)header.m_nTriangleIndices * sizeof( int32 );
+}
+
+// points the tree arrays at the node and index arrays in the mapped file
+template< class T >
+static void UseMappedArrays( CUtlVector<T> &nodes, CUtlVector<int32> &indices, RayTraceCacheHeader_t const *pHeader )
+{
+	T *pNodes = (T *)( pHeader + 1 );
+	CUtlVector<T> mappedNodes( pNodes, pHeader->m_nNodes, pHeader->m_nNodes );
+	CUtlVector<int32> mappedIndices( (int32 *)( pNodes + pHeader->m_nNodes ), pHeader->m_nTriangleIndices, pHeader->m_nTriangleIndices );
+	nodes.Swap( mappedNodes );
+	indices.Swap( mappedIndices );
+}
+
+static bool MapAccelerationStructure( RayTracingEnvironment &env, const char *pFileName, uint8 const key[MD5_DIGEST_LENGTH],
+									  bool bBVH, int nNodeSize, bool *pMapped )
+{
+	void *pData;
+	int nFileSize = MapFile( pFileName, &pData );
+	*pMapped = ( nFileSize >= 0 );
+	if ( !*pMapped )
+		return false;
+
+	RayTraceCacheHeader_t const *pHeader = (RayTraceCacheHeader_t const *)pData;
+	if ( nFileSize < (int)sizeof( *pHeader ) || !IsCacheHeaderValid( env, *pHeader, nFileSize, key, nNodeSize ) )
+	{
+		UnmapFile( pData, nFileSize );
+		return false;
+	}
+
+	env.ReleaseMappedCache();
+	env.m_pMappedCache = pData;
+	env.m_nMappedCacheSize = nFileSize;
+
+	bool bOk;
+	if ( bBVH )
+	{
+		UseMappedArrays( env.OptimizedBVH, env.BVHTriangleIndexList, pHeader );
+		bOk = ValidateBVH( env ) &&
+			ValidateTriangleIndices( env.BVHTriangleIndexList.Base(), pHeader->m_nTriangleIndices, pHeader->m_nTriangles );
+	}
+	else
+	{
+		UseMappedArrays( env.OptimizedKDTree, env.TriangleIndexList, pHeader );
+		bOk = ValidateKDTree( env ) &&
+			ValidateTriangleIndices( env.TriangleIndexList.Base(), pHeader->m_nTriangleIndices, pHeader->m_nTriangles );
+	}
+
+	if ( !bOk )
+	{
+		env.ReleaseMappedCache();
+		return false;
+	}
+
+	env.m_MinBound.Init( pHeader->m_flMinBound[0], pHeader->m_flMinBound[1], pHeader->m_flMinBound[2] );
+	env.m_MaxBound.Init( pHeader->m_flMaxBound[0], pHeader->m_flMaxBound[1], pHeader->m_flMaxBound[2] );
+	return true;
+}
+
+static bool LoadAccelerationStructure( RayTracingEnvironment &env, const char *pFileName, uint8 const key[MD5_DIGEST_LENGTH] )
+{
+	if ( !g_pFileSystem->FileExists( pFileName ) )
+		return false;
+
+	bool bBVH = ( env.Flags & RTE_FLAGS_USE_BVH ) != 0;
+	int nNodeSize = bBVH ? sizeof( CacheOptimizedBVHNode4 ) : sizeof( CacheOptimizedKDNode );
+
+	bool bMapped;
+	if ( MapAccelerationStructure( env, pFileName, key, bBVH, nNodeSize, &bMapped ) )
+		return true;
+	if ( bMapped )
+		return false;	// it was there, just stale or bad
+
+	FileHandle_t fp = g_pFileSystem->Open( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	RayTraceCacheHeader_t header;
+	unsigned int nFileSize = g_pFileSystem->Size( fp );
+	if ( nFileSize < sizeof( header ) ||
+		 g_pFileSystem->Read( &header, sizeof( header ), fp ) != sizeof( header ) ||
+		 !IsCacheHeaderValid( env, header, nFileSize, key, nNodeSize ) )
+	{
+		g_pFileSystem->Close( fp );
+		return false;
+	}
+
+	env.ReleaseMappedCache();
+
+	bool bOk;
+	if ( bBVH )
+	{
+		env.OptimizedBVH.SetCount( header.m_nNodes );
+		env.BVHTriangleIndexList.SetCount( header.m_nTriangleIndices );
+		bOk = g_pFileSystem->Read( env.OptimizedBVH.Base(), header.m_nNodes * nNodeSize, fp ) == header.m_nNodes * nNodeSize &&
+			g_pFileSystem->Read( env.BVHTriangleIndexList.Base(), header.m_nTriangleIndices * sizeof( int32 ), fp ) == (int)( header.m_nTriangleIndices * sizeof( int32 ) ) &&
+			ValidateBVH( env ) &&
+			ValidateTriangleIndices( env.BVHTriangleIndexList.Base(), header.m_nTriangleIndices, header.m_nTriangles );
+		if ( !bOk )
+		{
+			env.OptimizedBVH.Purge();
+			env.BVHTriangleIndexList.Purge();
+		}
+	}
+	else
+	{
+		env.OptimizedKDTree.SetCount( header.m_nNodes );
+		env.TriangleIndexList.SetCount( header.m_nTriangleIndices );
+		bOk = g_pFileSystem->Read( env.OptimizedKDTree.Base(), header.m_nNodes * nNodeSize, fp ) == header.m_nNodes * nNodeSize &&
+			g_pFileSystem->Read( env.TriangleIndexList.Base(), header.m_nTriangleIndices * sizeof( int32 ), fp ) == (int)( header.m_nTriangleIndices * sizeof( int32 ) ) &&
+			ValidateKDTree( env ) &&
+			ValidateTriangleIndices( env.TriangleIndexList.Base(), header.m_nTriangleIndices, header.m_nTriangles );
+		if ( !bOk )
+		{
+			env.OptimizedKDTree.Purge();
+			env.TriangleIndexList.Purge();
+		}
+	}
+	g_pFileSystem->Close( fp );
+
+	if ( bOk )
+	{
+		env.m_MinBound.Init( header.m_flMinBound[0], header.m_flMinBound[1], header.m_flMinBound[2] );
+		env.m_MaxBound.Init( header.m_flMaxBound[0], header.m_flMaxBound[1], header.m_flMaxBound[2] );
+	}
+	return bOk;
+}
+
+
+static void SaveAccelerationStructure( RayTracingEnvironment &env, const char *pFileName, uint8 const key[MD5_DIGEST_LENGTH] )
+{
+	// Written to the side and renamed into place: another compile may have the old file mapped,
+	// and truncating it under that mapping would crash it
+	char szTempName[MAX_PATH];
+	V_snprintf( szTempName, sizeof( szTempName ), "%s.tmp", pFileName );
+
+	FileHandle_t fp = g_pFileSystem->Open( szTempName, "wb" );
+	if ( !fp )
+	{
+		Warning( "Unable to write ray-trace cache %s\n", pFileName );
+		return;
+	}
+
+	bool bBVH = ( env.Flags & RTE_FLAGS_USE_BVH ) != 0;
+
+	RayTraceCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = RTCACHE_ID;
+	header.m_nVersion = RTCACHE_VERSION;
+	memcpy( header.m_Key, key, MD5_DIGEST_LENGTH );
+	header.m_nFlags = env.Flags & RTCACHE_KEY_FLAGS;
+	header.m_nTriangles = env.OptimizedTriangleList.Count();
+	for ( int c = 0; c < 3; c++ )
+	{
+		header.m_flMinBound[c] = env.m_MinBound[c];
+		header.m_flMaxBound[c] = env.m_MaxBound[c];
+	}
+	header.m_nNodeSize = bBVH ? sizeof( CacheOptimizedBVHNode4 ) : sizeof( CacheOptimizedKDNode );
+	header.m_nNodes = bBVH ? env.OptimizedBVH.Count() : env.OptimizedKDTree.Count();
+	header.m_nTriangleIndices = bBVH ? env.BVHTriangleIndexList.Count() : env.TriangleIndexList.Count();
+
+	void const *pNodes = bBVH ? (void const *)env.OptimizedBVH.Base() : (void const *)env.OptimizedKDTree.Base();
+	void const *pIndices = bBVH ? env.BVHTriangleIndexList.Base() : env.TriangleIndexList.Base();
+	int nNodeBytes = header.m_nNodes * header.m_nNodeSize;
+	int nIndexBytes = header.m_nTriangleIndices * sizeof( int32 );
+	bool bOk = g_pFileSystem->Write( &header, sizeof( header ), fp ) == sizeof( header ) &&
+		g_pFileSystem->Write( pNodes, nNodeBytes, fp ) == nNodeBytes &&
+		g_pFileSystem->Write( pIndices, nIndexBytes, fp ) == nIndexBytes;
+	g_pFileSystem->Close( fp );
+
+	if ( bOk )
+	{
+#ifdef _WIN32
+		// rename won't replace an existing file here
+		remove( pFileName );
+#endif
+		bOk = ( rename( szTempName, pFileName ) == 0 );
+	}
+
+	if ( !bOk )
+	{
+		Warning( "Unable to write ray-trace cache %s\n", pFileName );
+		remove( szTempName );
+	}
+}
+
+
+// swaps a fresh vector in if vec points into the mapped file; the one swapped out doesn't own its
+// memory, so it just forgets it
+template< class T >
+static void ReleaseIfMapped( CUtlVector<T> &vec, char const *pStart, char const *pEnd )
+{
+	if ( (char const *)vec.Base() >= pStart && (char const *)vec.Base() <= pEnd )
+	{
+		CUtlVector<T> owned;
+		vec.Swap( owned );
+	}
+}
+
+void RayTracingEnvironment::ReleaseMappedCache( void )
+{
+	if ( !m_pMappedCache )
+		return;
+
+	char const *pStart = (char const *)m_pMappedCache;
+	char const *pEnd = pStart + m_nMappedCacheSize;
+	ReleaseIfMapped( OptimizedKDTree, pStart, pEnd );
+	ReleaseIfMapped( TriangleIndexList, pStart, pEnd );
+	ReleaseIfMapped( OptimizedBVH, pStart, pEnd );
+	ReleaseIfMapped( BVHTriangleIndexList, pStart, pEnd );
+
+	UnmapFile( m_pMappedCache, m_nMappedCacheSize );
+	m_pMappedCache = NULL;
+	m_nMappedCacheSize = 0;
+}
+
+RayTracingEnvironment::~RayTracingEnvironment()
+{
+	ReleaseMappedCache();
+}
+
+bool RayTracingEnvironment::SetupAccelerationStructureCached( const char *pCacheFileName )
+{
+	uint8 key[MD5_DIGEST_LENGTH];
+	ComputeCacheKey( *this, key );
+
+	bool bLoaded = LoadAccelerationStructure( *this, pCacheFileName, key );
+	if ( !bLoaded )
+	{
+		if ( Flags & RTE_FLAGS_USE_BVH )
+			BuildBVH();
+		else
+			BuildKDTree();
+		SaveAccelerationStructure( *this, pCacheFileName, key );
+	}
+
+	ConvertTrianglesToIntersectionFormat();
+	return bLoaded;
+}
@@ -2,6 +2,9 @@
 // $Id$
 #include "raytrace.h"
 #include <mathlib/halton.h>
+#include <cmdlib.h>
+#include "threads.h"
+#include "pacifier.h"
 
 static uint32 MapDistanceToPixel(float t)
 {
@@ -303,25 +306,42 @@ static unsigned int GetSignMask(Vector const &v)
 }
 
 
+// normalize the directions of a packet whose directions are start->end deltas, and set up the
+// t range to cover each ray.
+static void NormalizeEightRays(EightRays &rays,float *tmin,float *tmax)
+{
+	for(int h=0;h<2;h++)
+	{
+		FourRays halfrays;
+		rays.Get4Rays(h,halfrays);
+		fltx4 len=halfrays.direction.length();
+		fltx4 scl=ReciprocalSaturateSIMD(len);
+		halfrays.direction*=scl;						// normalize
+		rays.Set4Rays(h,halfrays);
+		StoreAlignedSIMD(tmin+4*h,Four_Zeros);
+		StoreAlignedSIMD(tmax+4*h,len);
+	}
+}
+
 inline void RayTracingEnvironment::FlushStreamEntry(RayStream &s,int msk)
 {
 	assert(msk>=0);
 	assert(msk<8);
-	fltx4 tmax=s.PendingRays[msk].direction.length();
-	fltx4 scl=ReciprocalSaturateSIMD(tmax);
-	s.PendingRays[msk].direction*=scl;					// normalize
-	RayTracingResult tmpresult;
-	Trace4Rays(s.PendingRays[msk],Four_Zeros,tmax,msk,&tmpresult);
+	ALIGN32 float tmin[8] ALIGN32_POST;
+	ALIGN32 float tmax[8] ALIGN32_POST;
+	NormalizeEightRays(s.PendingRays[msk],tmin,tmax);
+	RayTracingResult8 tmpresult;
+	Trace8Rays(s.PendingRays[msk],tmin,tmax,&tmpresult);
 	// now, write out results
-	for(int r=0;r<4;r++)
+	for(int r=0;r<8;r++)
 	{
 		RayTracingSingleResult *out=s.PendingStreamOutputs[msk][r];
-		out->ray_length=SubFloat( tmax, r );
-		out->surface_normal.x=tmpresult.surface_normal.X(r);
-		out->surface_normal.y=tmpresult.surface_normal.Y(r);
-		out->surface_normal.z=tmpresult.surface_normal.Z(r);
+		out->ray_length=tmax[r];
+		out->surface_normal.x=tmpresult.surface_normal[0][r];
+		out->surface_normal.y=tmpresult.surface_normal[1][r];
+		out->surface_normal.z=tmpresult.surface_normal[2][r];
 		out->HitID=tmpresult.HitIds[r];
-		out->HitDistance=SubFloat( tmpresult.HitDistance, r );
+		out->HitDistance=tmpresult.HitDistance[r];
 	}
 	s.n_in_stream[msk]=0;
 }
@@ -336,15 +356,10 @@ void RayTracingEnvironment::AddToRayStream(RayStream &s,
 	assert(msk>=0);
 	assert(msk<8);
 	int pos=s.n_in_stream[msk];
-	assert(pos<4);
-	s.PendingRays[msk].origin.X(pos)=start.x;
-	s.PendingRays[msk].origin.Y(pos)=start.y;
-	s.PendingRays[msk].origin.Z(pos)=start.z;
-	s.PendingRays[msk].direction.X(pos)=delta.x;
-	s.PendingRays[msk].direction.Y(pos)=delta.y;
-	s.PendingRays[msk].direction.Z(pos)=delta.z;
+	assert(pos<8);
+	s.PendingRays[msk].SetRay(pos,start,delta);
 	s.PendingStreamOutputs[msk][pos]=rslt_out;
-	if (pos==3)
+	if (pos==7)
 	{
 		FlushStreamEntry(s,msk);
 	}
@@ -360,17 +375,169 @@ void RayTracingEnvironment::FinishRayStream(RayStream &s)
 		if (cnt)
 		{
 			// fill in unfilled entries with dups of first
-			for(int c=cnt;c<4;c++)
+			for(int c=cnt;c<8;c++)
 			{
-				s.PendingRays[msk].origin.X(c) = s.PendingRays[msk].origin.X(0);
-				s.PendingRays[msk].origin.Y(c) = s.PendingRays[msk].origin.Y(0);
-				s.PendingRays[msk].origin.Z(c) = s.PendingRays[msk].origin.Z(0);
-				s.PendingRays[msk].direction.X(c) = s.PendingRays[msk].direction.X(0);
-				s.PendingRays[msk].direction.Y(c) = s.PendingRays[msk].direction.Y(0);
-				s.PendingRays[msk].direction.Z(c) = s.PendingRays[msk].direction.Z(0);
+				for(int a=0;a<3;a++)
+				{
+					s.PendingRays[msk].m_flOrigin[a][c] = s.PendingRays[msk].m_flOrigin[a][0];
+					s.PendingRays[msk].m_flDirection[a][c] = s.PendingRays[msk].m_flDirection[a][0];
+				}
 				s.PendingStreamOutputs[msk][c]=s.PendingStreamOutputs[msk][0];
 			}
 			FlushStreamEntry(s,msk);
 		}
 	}
 }
+
+
+//-----------------------------------------------------------------------------
+// RayQueue
+//-----------------------------------------------------------------------------
+#define RAYQUEUE_CELL_BITS 9								// origin cells per axis = 1<<RAYQUEUE_CELL_BITS
+#define RAYQUEUE_PACKETS_PER_WORK_ITEM 64
+
+struct RayQueueSortEntry_t
+{
+	int32 m_nSkipID;
+	uint32 m_nKey;											// octant, then morton order of the origin cell
+	int m_nRay;
+};
+
+static int __cdecl CompareRayQueueEntries(const RayQueueSortEntry_t *a, const RayQueueSortEntry_t *b)
+{
+	if (a->m_nSkipID!=b->m_nSkipID)
+		return (a->m_nSkipID<b->m_nSkipID)?-1:1;
+	if (a->m_nKey!=b->m_nKey)
+		return (a->m_nKey<b->m_nKey)?-1:1;
+	return a->m_nRay-b->m_nRay;
+}
+
+// spread the low RAYQUEUE_CELL_BITS bits of n out to every third bit
+static uint32 SpreadBits3(uint32 n)
+{
+	uint32 ret=0;
+	for(int b=0;b<RAYQUEUE_CELL_BITS;b++)
+		ret|=((n>>b)&1)<<(3*b);
+	return ret;
+}
+
+static uint32 OriginCell(float v,float minv,float scale)
+{
+	int c=(int)((v-minv)*scale);
+	return (uint32)clamp(c,0,(1<<RAYQUEUE_CELL_BITS)-1);
+}
+
+// state for the threaded flush. RunThreadsOn can't be nested, so there is only ever one.
+static RayTracingEnvironment *s_pRayQueueEnv;
+static RayQueue::QueuedRay_t const *s_pRayQueueRays;
+static CUtlVector<RayQueueSortEntry_t> *s_pRayQueueOrder;
+static CUtlVector<int> *s_pRayQueuePackets;
+
+static void TraceRayQueuePackets(RayTracingEnvironment *pEnv,RayQueue::QueuedRay_t const *pRays,
+								 CUtlVector<RayQueueSortEntry_t> const &order,
+								 CUtlVector<int> const &packets,int first_packet,int last_packet)
+{
+	ALIGN32 float tmin[8] ALIGN32_POST;
+	ALIGN32 float tmax[8] ALIGN32_POST;
+	for(int p=first_packet;p<last_packet;p++)
+	{
+		int first=packets[p];
+		int cnt=packets[p+1]-first;
+		EightRays rays;
+		for(int r=0;r<8;r++)
+		{
+			// fill in unfilled entries with dups of first
+			RayQueue::QueuedRay_t const &ray=pRays[order[first+(r<cnt?r:0)].m_nRay];
+			rays.SetRay(r,ray.m_vecStart,ray.m_vecDelta);
+		}
+		NormalizeEightRays(rays,tmin,tmax);
+
+		RayTracingResult8 tmpresult;
+		pEnv->Trace8Rays(rays,tmin,tmax,&tmpresult,order[first].m_nSkipID);
+		for(int r=0;r<cnt;r++)
+		{
+			RayQueue::QueuedRay_t const &ray=pRays[order[first+r].m_nRay];
+			RayTracingSingleResult out;
+			out.ray_length=tmax[r];
+			out.surface_normal.x=tmpresult.surface_normal[0][r];
+			out.surface_normal.y=tmpresult.surface_normal[1][r];
+			out.surface_normal.z=tmpresult.surface_normal[2][r];
+			out.HitID=tmpresult.HitIds[r];
+			out.HitDistance=tmpresult.HitDistance[r];
+			ray.m_pCallback->RayQueueResult(ray.m_nUserData,out);
+		}
+	}
+}
+
+static void RayQueueThread(int iThread,int iWorkItem)
+{
+	int first_packet=iWorkItem*RAYQUEUE_PACKETS_PER_WORK_ITEM;
+	int last_packet=min(first_packet+RAYQUEUE_PACKETS_PER_WORK_ITEM,s_pRayQueuePackets->Count()-1);
+	TraceRayQueuePackets(s_pRayQueueEnv,s_pRayQueueRays,*s_pRayQueueOrder,*s_pRayQueuePackets,
+						 first_packet,last_packet);
+}
+
+void RayTracingEnvironment::FlushRayQueue(RayQueue &q, bool bThreaded)
+{
+	int nRays=q.m_Rays.Count();
+	if (!nRays)
+		return;
+
+	// sort by skip id (a packet can only have one), then direction octant, then origin cell
+	Vector scale=m_MaxBound-m_MinBound;
+	for(int c=0;c<3;c++)
+		scale[c]=(scale[c]>0)?(1<<RAYQUEUE_CELL_BITS)/scale[c]:0;
+
+	CUtlVector<RayQueueSortEntry_t> order;
+	order.SetCount(nRays);
+	for(int i=0;i<nRays;i++)
+	{
+		RayQueue::QueuedRay_t const &ray=q.m_Rays[i];
+		uint32 morton=
+			SpreadBits3(OriginCell(ray.m_vecStart.x,m_MinBound.x,scale.x))|
+			(SpreadBits3(OriginCell(ray.m_vecStart.y,m_MinBound.y,scale.y))<<1)|
+			(SpreadBits3(OriginCell(ray.m_vecStart.z,m_MinBound.z,scale.z))<<2);
+		order[i].m_nSkipID=ray.m_nSkipID;
+		order[i].m_nKey=(GetSignMask(ray.m_vecDelta)<<(3*RAYQUEUE_CELL_BITS))|morton;
+		order[i].m_nRay=i;
+	}
+	order.Sort(CompareRayQueueEntries);
+
+	// cut the sorted list into packets of up to 8 rays that share a skip id. packets[p] is the
+	// first entry of packet p, with an extra entry at the end.
+	CUtlVector<int> packets;
+	packets.EnsureCapacity(nRays/8+2);
+	for(int i=0;i<nRays;)
+	{
+		packets.AddToTail(i);
+		int end=min(i+8,nRays);
+		int j=i+1;
+		while(j<end && order[j].m_nSkipID==order[i].m_nSkipID)
+			j++;
+		i=j;
+	}
+	packets.AddToTail(nRays);
+	int nPackets=packets.Count()-1;
+
+	if (bThreaded)
+	{
+		s_pRayQueueEnv=this;
+		s_pRayQueueRays=q.m_Rays.Base();
+		s_pRayQueueOrder=&order;
+		s_pRayQueuePackets=&packets;
+		int nWorkItems=(nPackets+RAYQUEUE_PACKETS_PER_WORK_ITEM-1)/RAYQUEUE_PACKETS_PER_WORK_ITEM;
+		SuppressPacifier(true);
+		RunThreadsOnIndividual(nWorkItems,false,RayQueueThread);
+		SuppressPacifier(false);
+		s_pRayQueueEnv=NULL;
+		s_pRayQueueRays=NULL;
+		s_pRayQueueOrder=NULL;
+		s_pRayQueuePackets=NULL;
+	}
+	else
+	{
+		TraceRayQueuePackets(this,q.m_Rays.Base(),order,packets,0,nPackets);
+	}
+
+	q.m_Rays.RemoveAll();
+}
@@ -0,0 +1,519 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// 8-wide ray packets. Trace8Rays runs an avx2 port of the kd tree and bvh traversal loops when
+// the cpu supports it, and falls back to two Trace4Rays calls otherwise. This file is built
+// without any special compiler flags - only the kernels below are compiled for avx2, so nothing
+// that gets inlined from the shared headers ends up using instructions older cpus don't have.
+
+#include "raytrace.h"
+#include <cmdlib.h>
+#include <immintrin.h>
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+#if defined( __GNUC__ )
+#define AVX2_FUNCTION __attribute__(( target( "avx2" ) ))
+#else
+#define AVX2_FUNCTION
+#endif
+
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+#define MAX_BVH_STACK_LEN 256
+
+
+void EightRays::Get4Rays( int nHalf, FourRays &rays ) const
+{
+	for( int c=0; c<3; c++ )
+	{
+		rays.origin[c] = LoadUnalignedSIMD( &m_flOrigin[c][4*nHalf] );
+		rays.direction[c] = LoadUnalignedSIMD( &m_flDirection[c][4*nHalf] );
+	}
+}
+
+void EightRays::Set4Rays( int nHalf, const FourRays &rays )
+{
+	for( int c=0; c<3; c++ )
+	{
+		StoreUnalignedSIMD( &m_flOrigin[c][4*nHalf], rays.origin[c] );
+		StoreUnalignedSIMD( &m_flDirection[c][4*nHalf], rays.direction[c] );
+	}
+}
+
+int EightRays::CalculateDirectionSignMask( void ) const
+{
+	// like the FourRays version, this looks at the sign bits so -0 counts as negative
+	int ret=0;
+	for( int c=0; c<3; c++ )
+	{
+		int32 const *treat_as_int=( int32 const * ) m_flDirection[c];
+		int32 ormask=treat_as_int[0];
+		int32 andmask=treat_as_int[0];
+		for( int i=1; i<8; i++ )
+		{
+			ormask|=treat_as_int[i];
+			andmask&=treat_as_int[i];
+		}
+		if ( ormask<0 )
+		{
+			if ( andmask>=0 )
+				return -1;
+			ret|=( 1<<c );
+		}
+	}
+	return ret;
+}
+
+void RayTracingResult8::Set4Results( int nHalf, const RayTracingResult &rslt )
+{
+	for( int i=0; i<4; i++ )
+	{
+		surface_normal[0][4*nHalf+i] = rslt.surface_normal.X( i );
+		surface_normal[1][4*nHalf+i] = rslt.surface_normal.Y( i );
+		surface_normal[2][4*nHalf+i] = rslt.surface_normal.Z( i );
+		HitIds[4*nHalf+i] = rslt.HitIds[i];
+		HitDistance[4*nHalf+i] = SubFloat( rslt.HitDistance, i );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Cpu detection. tier0's CPUInformation knows about avx but not avx2.
+//-----------------------------------------------------------------------------
+static bool CheckForAVX2( void )
+{
+#if defined( __GNUC__ )
+	__builtin_cpu_init();
+	return __builtin_cpu_supports( "avx2" ) != 0;
+#elif defined( _WIN32 )
+	// m_bAVX includes the check that the OS saves the ymm registers
+	if ( !GetCPUInformation()->m_bAVX )
+		return false;
+	int regs[4];
+	__cpuid( regs, 0 );
+	if ( regs[0] < 7 )
+		return false;
+	__cpuidex( regs, 7, 0 );
+	return ( regs[1] & ( 1 << 5 ) ) != 0;
+#else
+	return false;
+#endif
+}
+
+bool RayTracingEnvironment::Has8WideTracing( void )
+{
+	static int s_nHasAVX2 = -1;
+	if ( s_nHasAVX2 < 0 )
+		s_nHasAVX2 = CheckForAVX2() ? 1 : 0;
+	return s_nHasAVX2 != 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// The avx2 kernels. These are straight ports of the 4-wide loops in raytrace.cpp, down to the
+// epsilons and the reciprocal approximation, so that both paths find the same hits.
+//-----------------------------------------------------------------------------
+struct Rays8_t
+{
+	__m256 origin[3];
+	__m256 direction[3];
+	__m256 OneOverRayDir[3];
+};
+
+struct Result8_t
+{
+	__m256 surface_normal[3];
+	__m256 HitIds;											// int32s, kept as floats for blending
+	__m256 HitDistance;
+};
+
+static AVX2_FUNCTION inline bool IsAnyNegative8( __m256 a )
+{
+	return _mm256_movemask_ps( a ) != 0;
+}
+
+static AVX2_FUNCTION inline __m256 Blend8( __m256 mask, __m256 a, __m256 b )		// mask ? a : b
+{
+	return _mm256_or_ps( _mm256_and_ps( a, mask ), _mm256_andnot_ps( mask, b ) );
+}
+
+static AVX2_FUNCTION inline float HorizontalMin8( __m256 a )
+{
+	__m128 m = _mm_min_ps( _mm256_castps256_ps128( a ), _mm256_extractf128_ps( a, 1 ) );
+	m = _mm_min_ps( m, _mm_movehl_ps( m, m ) );
+	m = _mm_min_ss( m, _mm_shuffle_ps( m, m, 1 ) );
+	return _mm_cvtss_f32( m );
+}
+
+// same as ReciprocalSaturateSIMD: 1/0 gives a big but finite number
+static AVX2_FUNCTION inline __m256 ReciprocalSaturate8( __m256 a )
+{
+	__m256 zero_mask = _mm256_cmp_ps( a, _mm256_setzero_ps(), _CMP_EQ_OQ );
+	a = _mm256_or_ps( a, _mm256_and_ps( _mm256_set1_ps( SubFloat( Four_Epsilons, 0 ) ), zero_mask ) );
+	__m256 ret = _mm256_rcp_ps( a );
+	// newton iteration is: Y(n+1) = 2*Y(n)-a*Y(n)^2
+	return _mm256_sub_ps( _mm256_add_ps( ret, ret ), _mm256_mul_ps( a, _mm256_mul_ps( ret, ret ) ) );
+}
+
+static AVX2_FUNCTION void LoadRays8( const EightRays &rays, Rays8_t &r )
+{
+	for( int c=0; c<3; c++ )
+	{
+		r.origin[c] = _mm256_loadu_ps( rays.m_flOrigin[c] );
+		r.direction[c] = _mm256_loadu_ps( rays.m_flDirection[c] );
+		r.OneOverRayDir[c] = ReciprocalSaturate8( r.direction[c] );
+	}
+}
+
+static AVX2_FUNCTION void ClearResult8( Result8_t &rslt )
+{
+	for( int c=0; c<3; c++ )
+		rslt.surface_normal[c] = _mm256_setzero_ps();
+	rslt.HitIds = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	rslt.HitDistance = _mm256_set1_ps( 1.0e23 );
+}
+
+static AVX2_FUNCTION void StoreResult8( const Result8_t &rslt, RayTracingResult8 *rslt_out )
+{
+	for( int c=0; c<3; c++ )
+		_mm256_storeu_ps( rslt_out->surface_normal[c], rslt.surface_normal[c] );
+	_mm256_storeu_ps( ( float * ) rslt_out->HitIds, rslt.HitIds );
+	_mm256_storeu_ps( rslt_out->HitDistance, rslt.HitDistance );
+}
+
+// clip rays against the scene bounds. returns false if they all miss.
+static AVX2_FUNCTION bool ClipRaysToBounds8( const Rays8_t &r, const Vector &mins, const Vector &maxs,
+											 __m256 &TMin, __m256 &TMax )
+{
+	for( int c=0; c<3; c++ )
+	{
+		__m256 isect_min_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( mins[c] ), r.origin[c] ), r.OneOverRayDir[c] );
+		__m256 isect_max_t = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( maxs[c] ), r.origin[c] ), r.OneOverRayDir[c] );
+		TMin = _mm256_max_ps( TMin, _mm256_min_ps( isect_min_t, isect_max_t ) );
+		TMax = _mm256_min_ps( TMax, _mm256_max_ps( isect_min_t, isect_max_t ) );
+	}
+	return IsAnyNegative8( _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ ) );
+}
+
+static AVX2_FUNCTION inline void IntersectTriangle8( const Rays8_t &r, TriIntersectData_t const *tri, int32 tnum,
+													 Result8_t &rslt )
+{
+	// raytrace.cpp's FourZeros and FourEpsilons are both 1.0e-10
+	__m256 eps = _mm256_set1_ps( 1.0e-10 );
+	__m256 negeps = _mm256_set1_ps( -1.0e-10 );
+
+	// compute plane intersection
+	__m256 N[3];
+	N[0] = _mm256_set1_ps( tri->m_flNx );
+	N[1] = _mm256_set1_ps( tri->m_flNy );
+	N[2] = _mm256_set1_ps( tri->m_flNz );
+
+	__m256 DDotN = _mm256_mul_ps( r.direction[0], N[0] );
+	DDotN = _mm256_add_ps( _mm256_mul_ps( r.direction[1], N[1] ), DDotN );
+	DDotN = _mm256_add_ps( _mm256_mul_ps( r.direction[2], N[2] ), DDotN );
+	// mask off zero or near zero (ray parallel to surface)
+	__m256 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, eps, _CMP_GT_OQ ),
+								   _mm256_cmp_ps( DDotN, negeps, _CMP_LT_OQ ) );
+
+	__m256 ODotN = _mm256_mul_ps( r.origin[0], N[0] );
+	ODotN = _mm256_add_ps( _mm256_mul_ps( r.origin[1], N[1] ), ODotN );
+	ODotN = _mm256_add_ps( _mm256_mul_ps( r.origin[2], N[2] ), ODotN );
+	__m256 numerator = _mm256_sub_ps( _mm256_set1_ps( tri->m_flD ), ODotN );
+
+	__m256 isect_t = _mm256_div_ps( numerator, DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, eps, _CMP_GT_OQ ) );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, rslt.HitDistance, _CMP_LT_OQ ) );
+
+	if ( !IsAnyNegative8( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	__m256 hitc1 = _mm256_add_ps( r.origin[tri->m_nCoordSelect0], _mm256_mul_ps( isect_t, r.direction[tri->m_nCoordSelect0] ) );
+	__m256 hitc2 = _mm256_add_ps( r.origin[tri->m_nCoordSelect1], _mm256_mul_ps( isect_t, r.direction[tri->m_nCoordSelect1] ) );
+
+	// do barycentric coordinate check
+	__m256 B0 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+	B0 = _mm256_add_ps( B0, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = _mm256_add_ps( B0, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[2] ) );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, eps, _CMP_GE_OQ ) );
+
+	__m256 B1 = _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = _mm256_add_ps( B1, _mm256_mul_ps( _mm256_set1_ps( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) );
+	B1 = _mm256_add_ps( B1, _mm256_set1_ps( tri->m_ProjectedEdgeEquations[5] ) );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, eps, _CMP_GE_OQ ) );
+
+	__m256 B2 = _mm256_add_ps( B1, B0 );
+	did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, _mm256_set1_ps( 1.0f ), _CMP_LE_OQ ) );
+
+	if ( !IsAnyNegative8( did_hit ) )
+		return;
+
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	rslt.HitIds = Blend8( did_hit, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), rslt.HitIds );
+	rslt.HitDistance = Blend8( did_hit, isect_t, rslt.HitDistance );
+	for( int c=0; c<3; c++ )
+		rslt.surface_normal[c] = Blend8( did_hit, N[c], rslt.surface_normal[c] );
+}
+
+
+struct KDNodeToVisit8
+{
+	CacheOptimizedKDNode const *node;
+	__m256 TMin;
+	__m256 TMax;
+};
+
+static AVX2_FUNCTION void Trace8RaysKDTree_AVX2( RayTracingEnvironment &env, const EightRays &rays,
+												 float const *pTMin, float const *pTMax, int DirectionSignMask,
+												 RayTracingResult8 *rslt_out, int32 skip_id )
+{
+	Rays8_t r;
+	LoadRays8( rays, r );
+	Result8_t rslt;
+	ClearResult8( rslt );
+
+	__m256 TMin = _mm256_loadu_ps( pTMin );
+	__m256 TMax = _mm256_loadu_ps( pTMax );
+	if ( !ClipRaysToBounds8( r, env.m_MinBound, env.m_MaxBound, TMin, TMax ) )
+	{
+		StoreResult8( rslt, rslt_out );
+		return;
+	}
+
+	int32 mailboxids[MAILBOX_HASH_SIZE];					// used to avoid redundant triangle tests
+	memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+	// based on ray direction, whether to visit left or right node first
+	int front_idx[3], back_idx[3];
+	for( int c=0; c<3; c++ )
+	{
+		front_idx[c] = ( DirectionSignMask & ( 1<<c ) ) ? 1 : 0;
+		back_idx[c] = 1 - front_idx[c];
+	}
+
+	KDNodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+	CacheOptimizedKDNode const *CurNode = &( env.OptimizedKDTree[0] );
+	KDNodeToVisit8 *stack_ptr = &NodeQueue[MAX_NODE_STACK_LEN];
+	while( 1 )
+	{
+		while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+		{
+			int split_plane_number = CurNode->NodeType();
+			CacheOptimizedKDNode const *FrontChild = &( env.OptimizedKDTree[CurNode->LeftChild()] );
+
+			__m256 dist_to_sep_plane =						// dist=(split-org)/dir
+				_mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( CurNode->SplittingPlaneValue ), r.origin[split_plane_number] ),
+							   r.OneOverRayDir[split_plane_number] );
+			__m256 active = _mm256_cmp_ps( TMin, TMax, _CMP_LE_OQ );
+
+			// now, decide how to traverse children. can either do front,back, or do front and push
+			// back.
+			__m256 hits_front = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMin, _CMP_GE_OQ ) );
+			if ( !IsAnyNegative8( hits_front ) )
+			{
+				// missed the front. only traverse back
+				CurNode = FrontChild + back_idx[split_plane_number];
+				TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+			}
+			else
+			{
+				__m256 hits_back = _mm256_and_ps( active, _mm256_cmp_ps( dist_to_sep_plane, TMax, _CMP_LE_OQ ) );
+				if ( !IsAnyNegative8( hits_back ) )
+				{
+					// missed the back - only need to traverse front node
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+				else
+				{
+					// at least some rays hit both nodes.
+					// must push far, traverse near
+					assert( stack_ptr > NodeQueue );
+					--stack_ptr;
+					stack_ptr->node = FrontChild + back_idx[split_plane_number];
+					stack_ptr->TMin = _mm256_max_ps( TMin, dist_to_sep_plane );
+					stack_ptr->TMax = TMax;
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = _mm256_min_ps( TMax, dist_to_sep_plane );
+				}
+			}
+		}
+		// hit a leaf! must do intersection check
+		int ntris = CurNode->NumberOfTrianglesInLeaf();
+		if ( ntris )
+		{
+			int32 const *tlist = &( env.TriangleIndexList[CurNode->TriangleIndexStart()] );
+			do
+			{
+				int tnum = *( tlist++ );
+				// check mailbox
+				int mbox_slot = tnum & ( MAILBOX_HASH_SIZE-1 );
+				TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
+				{
+					mailboxids[mbox_slot] = tnum;
+					IntersectTriangle8( r, tri, tnum, rslt );
+				}
+			} while ( --ntris );
+			// now, check if all rays have terminated
+			__m256 raydone = _mm256_cmp_ps( TMax, rslt.HitDistance, _CMP_LE_OQ );
+			if ( !IsAnyNegative8( raydone ) )
+				break;
+		}
+
+		if ( stack_ptr == &NodeQueue[MAX_NODE_STACK_LEN] )
+			break;
+
+		// pop stack!
+		CurNode = stack_ptr->node;
+		TMin = stack_ptr->TMin;
+		TMax = stack_ptr->TMax;
+		stack_ptr++;
+	}
+
+	StoreResult8( rslt, rslt_out );
+}
+
+
+struct BVHNodeToVisit8
+{
+	int32 child;
+	__m256 TMin;
+};
+
+static AVX2_FUNCTION void Trace8RaysBVH_AVX2( RayTracingEnvironment &env, const EightRays &rays,
+											  float const *pTMin, float const *pTMax,
+											  RayTracingResult8 *rslt_out, int32 skip_id )
+{
+	Rays8_t r;
+	LoadRays8( rays, r );
+	Result8_t rslt;
+	ClearResult8( rslt );
+
+	__m256 TMin = _mm256_loadu_ps( pTMin );
+	__m256 TMax = _mm256_loadu_ps( pTMax );
+	if ( env.OptimizedBVH.Count() == 0 || !ClipRaysToBounds8( r, env.m_MinBound, env.m_MaxBound, TMin, TMax ) )
+	{
+		StoreResult8( rslt, rslt_out );
+		return;
+	}
+
+	BVHNodeToVisit8 NodeStack[MAX_BVH_STACK_LEN];
+	BVHNodeToVisit8 *stack_ptr = NodeStack;
+	stack_ptr->child = 0;
+	stack_ptr->TMin = TMin;
+	stack_ptr++;
+
+	while( stack_ptr != NodeStack )
+	{
+		--stack_ptr;
+		int32 child = stack_ptr->child;
+
+		// skip entries that are further away than everything which has been hit since they were pushed
+		__m256 TFar = _mm256_min_ps( TMax, rslt.HitDistance );
+		if ( !IsAnyNegative8( _mm256_cmp_ps( stack_ptr->TMin, TFar, _CMP_LE_OQ ) ) )
+			continue;
+
+		if ( CacheOptimizedBVHNode4::IsLeaf( child ) )
+		{
+			int ntris = CacheOptimizedBVHNode4::LeafNumberOfTriangles( child );
+			int32 const *tlist = env.BVHTriangleIndexList.Base() + CacheOptimizedBVHNode4::LeafTriangleIndexStart( child );
+			for( int t=0; t<ntris; t++ )
+			{
+				int tnum = tlist[t];
+				TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangle8( r, tri, tnum, rslt );
+			}
+			continue;
+		}
+
+		// test the packet against each child box, replicating one lane of the node at a time
+		CacheOptimizedBVHNode4 const &node = env.OptimizedBVH[child];
+		int32 hitChildren[4];
+		__m256 hitTMin[4];
+		float hitDist[4];
+		int nHit = 0;
+		for( int i=0; i<4; i++ )
+		{
+			if ( node.m_nChildren[i] == BVHNODE_EMPTY_CHILD )
+				continue;
+
+			__m256 tnear = TMin;
+			__m256 tfar = TFar;
+			for( int c=0; c<3; c++ )
+			{
+				__m256 t0 = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( node.m_flMins[c][i] ), r.origin[c] ), r.OneOverRayDir[c] );
+				__m256 t1 = _mm256_mul_ps( _mm256_sub_ps( _mm256_set1_ps( node.m_flMaxs[c][i] ), r.origin[c] ), r.OneOverRayDir[c] );
+				tnear = _mm256_max_ps( tnear, _mm256_min_ps( t0, t1 ) );
+				tfar = _mm256_min_ps( tfar, _mm256_max_ps( t0, t1 ) );
+			}
+			__m256 hit = _mm256_cmp_ps( tnear, tfar, _CMP_LE_OQ );
+			if ( !IsAnyNegative8( hit ) )
+				continue;
+
+			// order by the closest entry distance of any ray which hits the box
+			float flClosest = HorizontalMin8( Blend8( hit, tnear, _mm256_set1_ps( 1.0e23 ) ) );
+
+			// insertion sort, furthest first, so the closest child is pushed last and popped first
+			int slot = nHit++;
+			while( slot > 0 && hitDist[slot-1] < flClosest )
+			{
+				hitChildren[slot] = hitChildren[slot-1];
+				hitTMin[slot] = hitTMin[slot-1];
+				hitDist[slot] = hitDist[slot-1];
+				slot--;
+			}
+			hitChildren[slot] = node.m_nChildren[i];
+			hitTMin[slot] = tnear;
+			hitDist[slot] = flClosest;
+		}
+
+		assert( stack_ptr + nHit <= NodeStack + MAX_BVH_STACK_LEN );
+		for( int i=0; i<nHit; i++ )
+		{
+			stack_ptr->child = hitChildren[i];
+			stack_ptr->TMin = hitTMin[i];
+			stack_ptr++;
+		}
+	}
+
+	StoreResult8( rslt, rslt_out );
+}
+
+
+void RayTracingEnvironment::Trace8Rays(const EightRays &rays, float const TMin[8], float const TMax[8],
+									   RayTracingResult8 *rslt_out,
+									   int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	if ( !pCallback && Has8WideTracing() )
+	{
+		if ( Flags & RTE_FLAGS_USE_BVH )
+		{
+			Trace8RaysBVH_AVX2( *this, rays, TMin, TMax, rslt_out, skip_id );
+			return;
+		}
+
+		// the kd tree can only trace the whole packet if all the direction signs agree
+		int msk = rays.CalculateDirectionSignMask();
+		if ( msk != -1 )
+		{
+			Trace8RaysKDTree_AVX2( *this, rays, TMin, TMax, msk, rslt_out, skip_id );
+			return;
+		}
+	}
+
+	for( int h=0; h<2; h++ )
+	{
+		FourRays halfrays;
+		rays.Get4Rays( h, halfrays );
+		RayTracingResult tmpresult;
+		Trace4Rays( halfrays, LoadUnalignedSIMD( TMin + 4*h ), LoadUnalignedSIMD( TMax + 4*h ),
+					&tmpresult, skip_id, pCallback );
+		rslt_out->Set4Results( h, tmpresult );
+	}
+}
@@ -10,6 +10,10 @@
 #include <windows.h>		// for WideCharToMultiByte and MultiByteToWideChar
 #elif defined(POSIX)
 #include <wchar.h> // wcslen()
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #define _alloca alloca
 #define _wtoi(arg) wcstol(arg, NULL, 10)
 #define _wtoi64(arg) wcstoll(arg, NULL, 10)
@@ -26,6 +30,8 @@
 #include "tier0/mem.h"
 #include "utlbuffer.h"
 #include "utlhash.h"
+#include "utlmap.h"
+#include "generichash.h"
 #include "utlvector.h"
 #include "utlqueue.h"
 #include "UtlSortVector.h"
@@ -462,8 +468,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nAllocFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -487,20 +492,48 @@ void KeyValues::RemoveEverything()
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		DestroyKey( dat );
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		DestroyKey( dat );
 	}
 
-	delete [] m_sValue;
+	FreeAllocatedValue();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the string values, unless they belong to an arena
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if ( !( m_nAllocFlags & KEYVALUES_ALLOC_ARENA_VALUE ) )
+	{
+		delete [] m_sValue;
+		delete [] m_wsValue;
+	}
 	m_sValue = NULL;
-	delete [] m_wsValue;
 	m_wsValue = NULL;
+	m_nAllocFlags &= ~KEYVALUES_ALLOC_ARENA_VALUE;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees a key; arena keys are only destructed, their memory goes
+//			back when the arena does
+//-----------------------------------------------------------------------------
+void KeyValues::DestroyKey( KeyValues *pKey )
+{
+	if ( pKey->m_nAllocFlags & KEYVALUES_ALLOC_ARENA_KEY )
+	{
+		pKey->~KeyValues();
+	}
+	else
+	{
+		delete pKey;
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -1595,11 +1628,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, make sure we're not storing the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1629,11 +1659,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 			return;
 		}
 
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1658,11 +1685,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, make sure we're not storing the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1702,11 +1726,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, make sure we're not storing the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof(uint64)];
 		*((uint64 *)dat->m_sValue) = value;
@@ -1877,7 +1898,9 @@ void KeyValues::CopyKeyValue( const KeyValues& src, size_t tmpBufferSizeB, char*
 KeyValues& KeyValues::operator=( const KeyValues& src )
 {
 	RemoveEverything();
+	char nArenaKey = m_nAllocFlags & KEYVALUES_ALLOC_ARENA_KEY;
 	Init();	// reset all values
+	m_nAllocFlags = nArenaKey;
 	CopyKeyValuesFromRecursive( src );
 	return *this;
 }
@@ -2017,7 +2040,10 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	if ( m_pSub )
+	{
+		DestroyKey( m_pSub );
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -2039,7 +2065,7 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
-	delete this;
+	DestroyKey( this );
 }
 
 //-----------------------------------------------------------------------------
@@ -2419,6 +2445,63 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, const char *pBuffer, I
 	return retVal;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Works out whether a value token is an int, a float, a 64 bit hex
+//			value or just a string
+//-----------------------------------------------------------------------------
+static KeyValues::types_t ClassifyValueToken( const char *value, int len, int &ival, float &fval, uint64 &u64val )
+{
+	// Here, let's determine if we got a float or an int....
+	char* pIEnd;	// pos where int scan ended
+	char* pFEnd;	// pos where float scan ended
+	const char* pSEnd = value + len ; // pos where token ends
+
+	ival = strtol( value, &pIEnd, 10 );
+	fval = (float)strtod( value, &pFEnd );
+	bool bOverflow = ( ival == LONG_MAX || ival == LONG_MIN ) && errno == ERANGE;
+#ifdef POSIX
+	// strtod supports hex representation in strings under posix but we DON'T
+	// want that support in keyvalues, so undo it here if needed
+	if ( len > 1 &&  tolower(value[1]) == 'x' )
+	{
+		fval = 0.0f;
+		pFEnd = (char *)value;
+	}
+#endif
+		
+	if ( *value == 0 )
+	{
+		return KeyValues::TYPE_STRING;	
+	}
+	else if ( ( 18 == len ) && ( value[0] == '0' ) && ( value[1] == 'x' ) )
+	{
+		// an 18-byte value prefixed with "0x" (followed by 16 hex digits) is an int64 value
+		int64 retVal = 0;
+		for( int i=2; i < 2 + 16; i++ )
+		{
+			char digit = value[i];
+			if ( digit >= 'a' ) 
+				digit -= 'a' - ( '9' + 1 );
+			else
+				if ( digit >= 'A' )
+					digit -= 'A' - ( '9' + 1 );
+			retVal = ( retVal * 16 ) + ( digit - '0' );
+		}
+		u64val = retVal;
+		return KeyValues::TYPE_UINT64;
+	}
+	else if ( (pFEnd > pIEnd) && (pFEnd == pSEnd) )
+	{
+		return KeyValues::TYPE_FLOAT;
+	}
+	else if (pIEnd == pSEnd && !bOverflow)
+	{
+		return KeyValues::TYPE_INT;
+	}
+
+	return KeyValues::TYPE_STRING;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -2516,62 +2599,24 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 
 			int len = Q_strlen( value );
 
-			// Here, let's determine if we got a float or an int....
-			char* pIEnd;	// pos where int scan ended
-			char* pFEnd;	// pos where float scan ended
-			const char* pSEnd = value + len ; // pos where token ends
-
-			int ival = strtol( value, &pIEnd, 10 );
-			float fval = (float)strtod( value, &pFEnd );
-			bool bOverflow = ( ival == LONG_MAX || ival == LONG_MIN ) && errno == ERANGE;
-#ifdef POSIX
-			// strtod supports hex representation in strings under posix but we DON'T
-			// want that support in keyvalues, so undo it here if needed
-			if ( len > 1 &&  tolower(value[1]) == 'x' )
-			{
-				fval = 0.0f;
-				pFEnd = (char *)value;
-			}
-#endif
-				
-			if ( *value == 0 )
-			{
-				dat->m_iDataType = TYPE_STRING;	
-			}
-			else if ( ( 18 == len ) && ( value[0] == '0' ) && ( value[1] == 'x' ) )
+			int ival;
+			float fval;
+			uint64 u64val;
+			dat->m_iDataType = ClassifyValueToken( value, len, ival, fval, u64val );
+			if ( dat->m_iDataType == TYPE_UINT64 )
 			{
-				// an 18-byte value prefixed with "0x" (followed by 16 hex digits) is an int64 value
-				int64 retVal = 0;
-				for( int i=2; i < 2 + 16; i++ )
-				{
-					char digit = value[i];
-					if ( digit >= 'a' ) 
-						digit -= 'a' - ( '9' + 1 );
-					else
-						if ( digit >= 'A' )
-							digit -= 'A' - ( '9' + 1 );
-					retVal = ( retVal * 16 ) + ( digit - '0' );
-				}
 				dat->m_sValue = new char[sizeof(uint64)];
-				*((uint64 *)dat->m_sValue) = retVal;
-				dat->m_iDataType = TYPE_UINT64;
+				*((uint64 *)dat->m_sValue) = u64val;
 			}
-			else if ( (pFEnd > pIEnd) && (pFEnd == pSEnd) )
+			else if ( dat->m_iDataType == TYPE_FLOAT )
 			{
 				dat->m_flValue = fval; 
-				dat->m_iDataType = TYPE_FLOAT;
 			}
-			else if (pIEnd == pSEnd && !bOverflow)
+			else if ( dat->m_iDataType == TYPE_INT )
 			{
 				dat->m_iValue = ival; 
-				dat->m_iDataType = TYPE_INT;
 			}
 			else
-			{
-				dat->m_iDataType = TYPE_STRING;
-			}
-
-			if (dat->m_iDataType == TYPE_STRING)
 			{
 				// copy in the string information
 				dat->m_sValue = new char[len+1];
@@ -2727,7 +2772,9 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		return false;
 
 	RemoveEverything(); // remove current content
+	char nArenaKey = m_nAllocFlags & KEYVALUES_ALLOC_ARENA_KEY;
 	Init();	// reset
+	m_nAllocFlags = nArenaKey;
 	
 	if ( nStackDepth > 100 )
 	{
@@ -2838,6 +2885,1051 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 	return buffer.IsValid();
 }
 
+//-----------------------------------------------------------------------------
+// CKeyValuesArena
+//-----------------------------------------------------------------------------
+
+#define KEYVALUES_COMPILED_ID				(('1'<<24)+('C'<<16)+('V'<<8)+'K')	// little-endian "KVC1"
+#define KEYVALUES_COMPILED_VERSION			1
+
+#define KEYVALUES_COMPILED_ESCAPES			0x1
+#define KEYVALUES_COMPILED_CONDITIONALS		0x2
+
+#define KEYVALUES_SYMBOL_CACHE_SIZE			256
+
+// Compiled files are a header, the nodes in depth first order, a table of name
+// offsets and then a pool of null terminated strings, all native endian.
+struct KeyValuesCompiledHeader_t
+{
+	int		m_nId;
+	int		m_nVersion;
+	int64	m_nSourceTime;		// the text this was compiled from
+	int		m_nSourceSize;
+	int		m_nFlags;			// KEYVALUES_COMPILED_ flags it was parsed with
+	int		m_nConditionals;	// which conditionals were true when it was parsed
+	int		m_nNodes;
+	int		m_nNames;
+	int		m_nStringsOffset;	// from the start of the file, 8 byte aligned
+	int		m_nStringBytes;
+};
+
+struct KeyValuesCompiledNode_t
+{
+	int		m_nName;			// index into the name table
+	int		m_nFirstSub;		// node index, -1 if none
+	int		m_nNextPeer;		// node index, -1 if none
+	int		m_nType;			// KeyValues::types_t
+	int		m_nValue;			// int or float bits, or the offset of the value in the string pool
+};
+
+struct CKeyValuesArena::ParseState_t
+{
+	char *m_pCur;				// next character to tokenize; the text is null terminated
+	CUtlCharConversion *m_pConv;
+	bool m_bEvaluateConditionals;
+	bool m_bHasIncludes;
+
+	// one token of look ahead, for the conditional that may follow a value
+	const char *m_pPendingToken;
+	bool m_bPendingQuoted;
+	bool m_bPendingConditional;
+
+	const char *m_pResourceName;
+	IBaseFileSystem *m_pFileSystem;
+	const char *m_pPathID;
+
+	// recently seen key names, so repeated names skip the global symbol table
+	struct SymbolCacheEntry_t
+	{
+		const char *m_pName;
+		int m_nSymbol;
+	};
+	SymbolCacheEntry_t m_SymbolCache[KEYVALUES_SYMBOL_CACHE_SIZE];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Which conditionals are currently true, as a bitfield
+//-----------------------------------------------------------------------------
+static int GetTrueConditionals()
+{
+	static const char *s_pConditionals[] = { "$DECK", "$X360", "$WIN32", "$WINDOWS", "$OSX", "$LINUX", "$POSIX" };
+
+	int nConditionals = 0;
+	for ( int i = 0; i < (int)ARRAYSIZE( s_pConditionals ); i++ )
+	{
+		if ( EvaluateConditional( s_pConditionals[i] ) )
+		{
+			nConditionals |= ( 1 << i );
+		}
+	}
+	return nConditionals;
+}
+
+CKeyValuesArena::CKeyValuesArena( int nChunkSize )
+{
+	m_pNextAlloc = NULL;
+	m_pAllocLimit = NULL;
+	m_nChunkSize = nChunkSize;
+	m_nBytesUsed = 0;
+	m_bUsesEscapeSequences = false;
+	m_bUsesConditionals = true;
+}
+
+CKeyValuesArena::~CKeyValuesArena()
+{
+	Purge();
+}
+
+void CKeyValuesArena::Purge()
+{
+	for ( int i = 0; i < m_Mappings.Count(); i++ )
+	{
+#if defined( _WIN32 ) && !defined( _X360 )
+		UnmapViewOfFile( m_Mappings[i].m_pData );
+#elif defined( POSIX )
+		munmap( m_Mappings[i].m_pData, m_Mappings[i].m_nSize );
+#endif
+	}
+	m_Mappings.Purge();
+
+	for ( int i = 0; i < m_Chunks.Count(); i++ )
+	{
+		delete [] m_Chunks[i];
+	}
+	m_Chunks.Purge();
+
+	m_pNextAlloc = NULL;
+	m_pAllocLimit = NULL;
+	m_nBytesUsed = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Allocates from the current chunk, starting a new one when it's full
+//-----------------------------------------------------------------------------
+void *CKeyValuesArena::Alloc( int nBytes, int nAlignment )
+{
+	m_nBytesUsed += nBytes;
+
+	if ( nBytes + nAlignment > m_nChunkSize / 4 )
+	{
+		// big blocks (the text of a whole file) get a chunk of their own
+		byte *pChunk = new byte[nBytes + nAlignment];
+		m_Chunks.AddToTail( pChunk );
+		return AlignValue( pChunk, nAlignment );
+	}
+
+	byte *pResult = AlignValue( m_pNextAlloc, nAlignment );
+	if ( !m_pNextAlloc || m_pAllocLimit - pResult < nBytes )
+	{
+		byte *pChunk = new byte[m_nChunkSize];
+		m_Chunks.AddToTail( pChunk );
+		m_pAllocLimit = pChunk + m_nChunkSize;
+		pResult = AlignValue( pChunk, nAlignment );
+	}
+
+	m_pNextAlloc = pResult + nBytes;
+	return pResult;
+}
+
+char *CKeyValuesArena::AllocString( const char *pString, int nLen )
+{
+	char *pResult = (char *)Alloc( nLen + 1, 1 );
+	Q_memcpy( pResult, pString, nLen );
+	pResult[nLen] = 0;
+	return pResult;
+}
+
+KeyValues *CKeyValuesArena::AllocKey( int nSymbol )
+{
+	KeyValues *pKey = (KeyValues *)Alloc( sizeof( KeyValues ) );
+	pKey->Init();
+	pKey->m_iKeyName = nSymbol;
+	pKey->m_nAllocFlags = KeyValues::KEYVALUES_ALLOC_ARENA_KEY;
+	pKey->m_bHasEscapeSequences = m_bUsesEscapeSequences;
+	pKey->m_bEvaluateConditionals = m_bUsesConditionals;
+	return pKey;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Looks a key name up in the symbol table, going through a small
+//			cache first since the same few names make up most of any file
+//-----------------------------------------------------------------------------
+int CKeyValuesArena::GetSymbol( ParseState_t &state, const char *pName )
+{
+	// names live as long as the arena, so the cache can just point at them
+	ParseState_t::SymbolCacheEntry_t &entry = state.m_SymbolCache[ HashString( pName ) & ( KEYVALUES_SYMBOL_CACHE_SIZE - 1 ) ];
+	if ( entry.m_pName && !Q_strcmp( entry.m_pName, pName ) )
+		return entry.m_nSymbol;
+
+	entry.m_pName = pName;
+	entry.m_nSymbol = KeyValues::CallGetSymbolForString( pName, true );
+	return entry.m_nSymbol;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Read a single token. Same rules as KeyValues::ReadToken, but the
+//			token is terminated (and unescaped) in place in the arena's copy of
+//			the text instead of being copied out to a token buffer.
+//-----------------------------------------------------------------------------
+const char *CKeyValuesArena::ReadToken( ParseState_t &state, bool &wasQuoted, bool &wasConditional )
+{
+	if ( state.m_pPendingToken )
+	{
+		const char *pToken = state.m_pPendingToken;
+		wasQuoted = state.m_bPendingQuoted;
+		wasConditional = state.m_bPendingConditional;
+		state.m_pPendingToken = NULL;
+		return pToken;
+	}
+
+	wasQuoted = false;
+	wasConditional = false;
+
+	char *c = state.m_pCur;
+
+	// eating white spaces and remarks loop
+	while ( true )
+	{
+		while ( isspace( (unsigned char)*c ) )
+		{
+			c++;
+		}
+
+		// stop if it's not a comment; a new token starts here
+		if ( c[0] != '/' || c[1] != '/' )
+			break;
+
+		while ( *c && *c != '\n' )
+		{
+			c++;
+		}
+	}
+
+	if ( !*c )
+	{
+		// file ends after reading whitespaces
+		state.m_pCur = c;
+		return NULL;
+	}
+
+	// read quoted strings specially; the closing quote makes room for the terminator
+	if ( *c == '\"' )
+	{
+		wasQuoted = true;
+
+		CUtlCharConversion *pConv = state.m_pConv;
+		char *pToken = ++c;
+		char *pOut = pToken;
+		while ( *c )
+		{
+			if ( *c == '\"' )
+			{
+				c++;
+				break;
+			}
+
+			char ch = *c++;
+			if ( ch == pConv->GetEscapeChar() )
+			{
+				int nLength;
+				ch = pConv->FindConversion( c, &nLength );
+				c += nLength;
+			}
+			*pOut++ = ch;
+		}
+		*pOut = 0;
+
+		state.m_pCur = c;
+		return pToken;
+	}
+
+	if ( *c == '{' || *c == '}' )
+	{
+		// it's a control char, just return this one char
+		state.m_pCur = c + 1;
+		return ( *c == '{' ) ? "{" : "}";
+	}
+
+	// read in the token until we hit a whitespace or a control character
+	char *pToken = c;
+	bool bConditionalStart = false;
+	while ( *c )
+	{
+		// break if any control character appears in non quoted tokens
+		if ( *c == '"' || *c == '{' || *c == '}' )
+			break;
+
+		if ( *c == '[' )
+			bConditionalStart = true;
+
+		if ( *c == ']' && bConditionalStart )
+		{
+			wasConditional = true;
+		}
+
+		// break on whitespace
+		if ( isspace( (unsigned char)*c ) )
+			break;
+
+		c++;
+	}
+
+	if ( !*c )
+	{
+		// already terminated by the end of the text
+		state.m_pCur = c;
+		return pToken;
+	}
+
+	if ( isspace( (unsigned char)*c ) )
+	{
+		// the whitespace after the token is free to terminate it with
+		*c = 0;
+		state.m_pCur = c + 1;
+		return pToken;
+	}
+
+	// up against a control character that still has to be read, so take a copy
+	state.m_pCur = c;
+	return AllocString( pToken, c - pToken );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Arena version of KeyValues::RecursiveLoadFromBuffer
+//-----------------------------------------------------------------------------
+void CKeyValuesArena::RecursiveLoad( ParseState_t &state, KeyValues *pParent )
+{
+	CKeyErrorContext errorReport( pParent );
+	bool wasQuoted;
+	bool wasConditional;
+	if ( errorReport.GetStackLevel() > 100 )
+	{
+		g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  recursion overflow" );
+		return;
+	}
+
+	// keep this out of the stack until a key is parsed
+	CKeyErrorContext errorKey( INVALID_KEY_SYMBOL );
+
+	// the parent is always new, so it has no children yet
+	KeyValues *pLastChild = NULL;
+
+	// Keep parsing until we hit the closing brace which terminates this block, or a parse error
+	while ( 1 )
+	{
+		bool bAccepted = true;
+
+		// get the key name
+		const char *name = ReadToken( state, wasQuoted, wasConditional );
+
+		if ( !name )	// EOF stop reading
+		{
+			g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  got EOF instead of keyname" );
+			break;
+		}
+
+		if ( !*name ) // empty token, maybe "" or EOF
+		{
+			g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  got empty keyname" );
+			break;
+		}
+
+		if ( *name == '}' && !wasQuoted )	// top level closed, stop reading
+			break;
+
+		// Always create the key; note that this could potentially
+		// cause some duplication, but that's what we want sometimes
+		KeyValues *dat = AllocKey( GetSymbol( state, name ) );
+		if ( pLastChild )
+		{
+			pLastChild->m_pPeer = dat;
+		}
+		else
+		{
+			pParent->m_pSub = dat;
+		}
+
+		errorKey.Reset( dat->m_iKeyName );
+
+		// get the value
+		const char *value = ReadToken( state, wasQuoted, wasConditional );
+
+		if ( wasConditional && value )
+		{
+			bAccepted = !state.m_bEvaluateConditionals || EvaluateConditional( value );
+
+			// get the real value
+			value = ReadToken( state, wasQuoted, wasConditional );
+		}
+
+		if ( !value )
+		{
+			g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  got NULL key" );
+			break;
+		}
+
+		if ( *value == '}' && !wasQuoted )
+		{
+			g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  got } in key" );
+			break;
+		}
+
+		if ( *value == '{' && !wasQuoted )
+		{
+			// this isn't a key, it's a section
+			errorKey.Reset( INVALID_KEY_SYMBOL );
+			// sub value list
+			RecursiveLoad( state, dat );
+		}
+		else
+		{
+			if ( wasConditional )
+			{
+				g_KeyValuesErrorStack.ReportError( "RecursiveLoadFromBuffer:  got conditional between key and value" );
+				break;
+			}
+
+			int ival;
+			float fval;
+			uint64 u64val;
+			dat->m_iDataType = ClassifyValueToken( value, Q_strlen( value ), ival, fval, u64val );
+			if ( dat->m_iDataType == KeyValues::TYPE_UINT64 )
+			{
+				dat->m_sValue = (char *)Alloc( sizeof( uint64 ) );
+				*((uint64 *)dat->m_sValue) = u64val;
+				dat->m_nAllocFlags |= KeyValues::KEYVALUES_ALLOC_ARENA_VALUE;
+			}
+			else if ( dat->m_iDataType == KeyValues::TYPE_FLOAT )
+			{
+				dat->m_flValue = fval;
+			}
+			else if ( dat->m_iDataType == KeyValues::TYPE_INT )
+			{
+				dat->m_iValue = ival;
+			}
+			else
+			{
+				// the token already lives in the arena
+				dat->m_sValue = const_cast< char * >( value );
+				dat->m_nAllocFlags |= KeyValues::KEYVALUES_ALLOC_ARENA_VALUE;
+			}
+
+			// Look ahead one token for a conditional tag
+			const char *peek = ReadToken( state, wasQuoted, wasConditional );
+			if ( wasConditional )
+			{
+				bAccepted = !state.m_bEvaluateConditionals || EvaluateConditional( peek );
+			}
+			else
+			{
+				state.m_pPendingToken = peek;
+				state.m_bPendingQuoted = wasQuoted;
+				state.m_bPendingConditional = wasConditional;
+			}
+		}
+
+		if ( bAccepted )
+		{
+			pLastChild = dat;
+		}
+		else if ( pLastChild )
+		{
+			pLastChild->m_pPeer = NULL;
+		}
+		else
+		{
+			pParent->m_pSub = NULL;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Arena version of KeyValues::RecursiveMergeKeyValues. The base tree
+//			is thrown away afterwards, so its keys are moved rather than copied.
+//-----------------------------------------------------------------------------
+void CKeyValuesArena::MergeKeys( KeyValues *pDest, KeyValues *pBase )
+{
+	KeyValues *pNextBaseChild;
+	for ( KeyValues *pBaseChild = pBase->m_pSub; pBaseChild != NULL; pBaseChild = pNextBaseChild )
+	{
+		pNextBaseChild = pBaseChild->m_pPeer;
+
+		// If we have a child by the same name, merge those keys
+		KeyValues *pMatch = NULL;
+		for ( KeyValues *pChild = pDest->m_pSub; pChild != NULL; pChild = pChild->m_pPeer )
+		{
+			if ( !Q_strcmp( pBaseChild->GetName(), pChild->GetName() ) )
+			{
+				pMatch = pChild;
+				break;
+			}
+		}
+
+		if ( pMatch )
+		{
+			MergeKeys( pMatch, pBaseChild );
+		}
+		else
+		{
+			pBaseChild->m_pPeer = NULL;
+			pDest->AddSubKey( pBaseChild );
+		}
+	}
+	pBase->m_pSub = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Parses text that's already in the arena, same as KeyValues::LoadFromBuffer
+//-----------------------------------------------------------------------------
+KeyValues *CKeyValuesArena::ParseText( const char *resourceName, char *pText, IBaseFileSystem *pFileSystem, const char *pPathID, bool *pHasIncludes )
+{
+	AUTO_LOCK( g_KVMutex );
+
+	// Translate Unicode files into UTF-8 before proceeding
+	if ( (uint8)pText[0] == 0xFF && (uint8)pText[1] == 0xFE && pText[2] )
+	{
+		int nUTF8Len = V_UnicodeToUTF8( (wchar_t*)(pText+2), NULL, 0 );
+		char *pUTF8Buf = (char *)Alloc( nUTF8Len, 1 );
+		V_UnicodeToUTF8( (wchar_t*)(pText+2), pUTF8Buf, nUTF8Len );
+		pText = pUTF8Buf;
+	}
+
+	ParseState_t state;
+	state.m_pCur = pText;
+	state.m_pConv = m_bUsesEscapeSequences ? GetCStringCharConversion() : GetNoEscCharConversion();
+	state.m_bEvaluateConditionals = m_bUsesConditionals;
+	state.m_bHasIncludes = false;
+	state.m_pPendingToken = NULL;
+	state.m_pResourceName = resourceName;
+	state.m_pFileSystem = pFileSystem;
+	state.m_pPathID = pPathID;
+	memset( state.m_SymbolCache, 0, sizeof( state.m_SymbolCache ) );
+
+	KeyValues *pRoot = NULL;
+	KeyValues *pPreviousKey = NULL;
+	CUtlVector< KeyValues * > includedKeys;
+	CUtlVector< KeyValues * > baseKeys;
+	bool wasQuoted;
+	bool wasConditional;
+	g_KeyValuesErrorStack.SetFilename( resourceName );
+	while ( true )
+	{
+		bool bAccepted = true;
+
+		// the first thing must be a key
+		const char *s = ReadToken( state, wasQuoted, wasConditional );
+		if ( !s || *s == 0 )
+			break;
+
+		bool bInclude = !Q_stricmp( s, "#include" );
+		if ( bInclude || !Q_stricmp( s, "#base" ) )	// special include macros (not key names)
+		{
+			s = ReadToken( state, wasQuoted, wasConditional );
+			// Name of subfile to load is now in s
+
+			if ( !s || *s == 0 )
+			{
+				g_KeyValuesErrorStack.ReportError( bInclude ? "#include is NULL " : "#base is NULL " );
+			}
+			else if ( pFileSystem )
+			{
+				state.m_bHasIncludes = true;
+
+				// relative to the directory this file is in
+				char fullpath[ 512 ];
+				Q_ExtractFilePath( resourceName, fullpath, sizeof( fullpath ) );
+				Q_strncat( fullpath, s, sizeof( fullpath ), COPY_ALL_CHARACTERS );
+
+				KeyValues *pIncluded = ParseFile( pFileSystem, fullpath, pPathID, NULL, NULL );
+				if ( pIncluded )
+				{
+					( bInclude ? includedKeys : baseKeys ).AddToTail( pIncluded );
+				}
+				else
+				{
+					DevMsg( "KeyValues::ParseIncludedKeys: Couldn't load included keyvalue file %s\n", fullpath );
+				}
+				g_KeyValuesErrorStack.SetFilename( resourceName );
+			}
+
+			continue;
+		}
+
+		KeyValues *pCurrentKey = AllocKey( GetSymbol( state, s ) );
+
+		// get the '{'
+		s = ReadToken( state, wasQuoted, wasConditional );
+
+		if ( wasConditional )
+		{
+			bAccepted = !state.m_bEvaluateConditionals || EvaluateConditional( s );
+
+			// Now get the '{'
+			s = ReadToken( state, wasQuoted, wasConditional );
+		}
+
+		if ( s && *s == '{' && !wasQuoted )
+		{
+			// header is valid so load the file
+			RecursiveLoad( state, pCurrentKey );
+		}
+		else
+		{
+			g_KeyValuesErrorStack.ReportError( "LoadFromBuffer: missing {" );
+		}
+
+		if ( bAccepted )
+		{
+			if ( pPreviousKey )
+			{
+				pPreviousKey->m_pPeer = pCurrentKey;
+			}
+			else
+			{
+				pRoot = pCurrentKey;
+			}
+			pPreviousKey = pCurrentKey;
+		}
+	}
+
+	// Append any included keys, too...
+	for ( int i = 0; i < includedKeys.Count(); i++ )
+	{
+		if ( !pRoot )
+		{
+			pRoot = includedKeys[i];
+			continue;
+		}
+
+		KeyValues *insertSpot = pRoot;
+		while ( insertSpot->m_pPeer )
+		{
+			insertSpot = insertSpot->m_pPeer;
+		}
+		insertSpot->m_pPeer = includedKeys[i];
+	}
+
+	if ( pRoot )
+	{
+		for ( int i = 0; i < baseKeys.Count(); i++ )
+		{
+			MergeKeys( pRoot, baseKeys[i] );
+		}
+	}
+
+	g_KeyValuesErrorStack.SetFilename( "" );
+
+	if ( pHasIncludes )
+	{
+		*pHasIncludes = state.m_bHasIncludes;
+	}
+	return pRoot;
+}
+
+KeyValues *CKeyValuesArena::LoadFromBuffer( const char *resourceName, const char *pBuffer, IBaseFileSystem *pFileSystem, const char *pPathID )
+{
+	if ( !pBuffer )
+		return NULL;
+
+	// tokens are terminated and unescaped in place, so they need a copy to work on
+	char *pText;
+	int nLen = Q_strlen( pBuffer );
+	if ( nLen > 2 && (uint8)pBuffer[0] == 0xFF && (uint8)pBuffer[1] == 0xFE )
+	{
+		// Translate Unicode files into UTF-8 on the way in
+		int nUTF8Len = V_UnicodeToUTF8( (wchar_t*)(pBuffer+2), NULL, 0 );
+		pText = (char *)Alloc( nUTF8Len + 1, 1 );
+		V_UnicodeToUTF8( (wchar_t*)(pBuffer+2), pText, nUTF8Len );
+		pText[nUTF8Len] = 0;
+	}
+	else
+	{
+		pText = AllocString( pBuffer, nLen );
+	}
+
+	return ParseText( resourceName, pText, pFileSystem, pPathID, NULL );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a text file straight into the arena and parses it
+//-----------------------------------------------------------------------------
+KeyValues *CKeyValuesArena::ParseFile( IBaseFileSystem *filesystem, const char *resourceName, const char *pathID, int *pFileSize, bool *pHasIncludes )
+{
+	FileHandle_t f = filesystem->Open( resourceName, "rb", pathID );
+	if ( !f )
+		return NULL;
+
+	// double terminated in case this is a unicode file
+	int fileSize = filesystem->Size( f );
+	char *pText = (char *)Alloc( fileSize + 2, 1 );
+	bool bRetOK = ( filesystem->Read( pText, fileSize, f ) == fileSize );
+	filesystem->Close( f );
+	if ( !bRetOK )
+		return NULL;
+
+	pText[fileSize] = 0;
+	pText[fileSize+1] = 0;
+
+	if ( pFileSize )
+	{
+		*pFileSize = fileSize;
+	}
+	return ParseText( resourceName, pText, filesystem, pathID, pHasIncludes );
+}
+
+KeyValues *CKeyValuesArena::LoadFromFile( IFileSystem *filesystem, const char *resourceName, const char *pathID, bool bUseCompiledCache )
+{
+	Assert( filesystem );
+
+	if ( !bUseCompiledCache )
+		return ParseFile( filesystem, resourceName, pathID, NULL, NULL );
+
+	int fileSize = filesystem->Size( resourceName, pathID );
+	int64 nSourceTime = filesystem->GetFileTime( resourceName, pathID );
+
+	char compiledName[MAX_PATH];
+	Q_snprintf( compiledName, sizeof( compiledName ), "%s.kvc", resourceName );
+
+	char fullPath[MAX_PATH];
+	if ( filesystem->RelativePathToFullPath( compiledName, "DEFAULT_WRITE_PATH", fullPath, sizeof( fullPath ) ) )
+	{
+		KeyValues *pCompiled = LoadCompiled( fullPath, fileSize, nSourceTime );
+		if ( pCompiled )
+			return pCompiled;
+	}
+
+	bool bHasIncludes;
+	KeyValues *pRoot = ParseFile( filesystem, resourceName, pathID, &fileSize, &bHasIncludes );
+
+	// a stamp on this file says nothing about the ones it includes, so those aren't compiled
+	if ( pRoot && !bHasIncludes )
+	{
+		CUtlBuffer buf;
+		if ( WriteCompiled( pRoot, buf, fileSize, nSourceTime ) )
+		{
+			FileHandle_t hCompiled = filesystem->Open( compiledName, "wb", "DEFAULT_WRITE_PATH" );
+			if ( hCompiled )
+			{
+				filesystem->Write( buf.Base(), buf.TellPut(), hCompiled );
+				filesystem->Close( hCompiled );
+			}
+		}
+	}
+
+	return pRoot;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Flattens a list of peers (and their subkeys) into compiled nodes,
+//			returns the index of the first one
+//-----------------------------------------------------------------------------
+struct KeyValuesCompileContext_t
+{
+	KeyValuesCompileContext_t() : m_NameIndices( 0, 0, DefLessFunc( int ) ) {}
+
+	CUtlVector< KeyValuesCompiledNode_t > m_Nodes;
+	CUtlVector< int > m_Names;
+	CUtlMap< int, int > m_NameIndices;	// symbol -> name table index
+	CUtlBuffer m_Strings;
+};
+
+static int AddCompiledString( KeyValuesCompileContext_t &ctx, const void *pData, int nBytes, int nAlignment )
+{
+	while ( ctx.m_Strings.TellPut() % nAlignment )
+	{
+		ctx.m_Strings.PutChar( 0 );
+	}
+	int nOffset = ctx.m_Strings.TellPut();
+	ctx.m_Strings.Put( pData, nBytes );
+	return nOffset;
+}
+
+static bool CompileKeys( KeyValues *pFirst, KeyValuesCompileContext_t &ctx, int &nFirst )
+{
+	nFirst = -1;
+	int nPrev = -1;
+	for ( KeyValues *pKey = pFirst; pKey != NULL; pKey = pKey->GetNextKey() )
+	{
+		KeyValuesCompiledNode_t node;
+		node.m_nFirstSub = -1;
+		node.m_nNextPeer = -1;
+		node.m_nType = pKey->GetDataType();
+		node.m_nValue = 0;
+
+		int nNameIndex = ctx.m_NameIndices.Find( pKey->GetNameSymbol() );
+		if ( nNameIndex == ctx.m_NameIndices.InvalidIndex() )
+		{
+			const char *pName = pKey->GetName();
+			int nName = ctx.m_Names.AddToTail( AddCompiledString( ctx, pName, Q_strlen( pName ) + 1, 1 ) );
+			nNameIndex = ctx.m_NameIndices.Insert( pKey->GetNameSymbol(), nName );
+		}
+		node.m_nName = ctx.m_NameIndices[nNameIndex];
+
+		switch ( node.m_nType )
+		{
+		case KeyValues::TYPE_NONE:
+			break;
+		case KeyValues::TYPE_STRING:
+			{
+				const char *pString = pKey->GetString();
+				node.m_nValue = AddCompiledString( ctx, pString, Q_strlen( pString ) + 1, 1 );
+			}
+			break;
+		case KeyValues::TYPE_INT:
+			node.m_nValue = pKey->GetInt();
+			break;
+		case KeyValues::TYPE_FLOAT:
+			{
+				float flValue = pKey->GetFloat();
+				Q_memcpy( &node.m_nValue, &flValue, sizeof( flValue ) );
+			}
+			break;
+		case KeyValues::TYPE_UINT64:
+			{
+				uint64 nValue = pKey->GetUint64();
+				node.m_nValue = AddCompiledString( ctx, &nValue, sizeof( nValue ), sizeof( nValue ) );
+			}
+			break;
+		default:
+			// pointers, colors and wide strings never come out of a text file
+			return false;
+		}
+
+		int nNode = ctx.m_Nodes.AddToTail( node );
+		if ( nPrev >= 0 )
+		{
+			ctx.m_Nodes[nPrev].m_nNextPeer = nNode;
+		}
+		else
+		{
+			nFirst = nNode;
+		}
+		nPrev = nNode;
+
+		if ( pKey->GetFirstSubKey() )
+		{
+			int nFirstSub;
+			if ( !CompileKeys( pKey->GetFirstSubKey(), ctx, nFirstSub ) )
+				return false;
+			ctx.m_Nodes[nNode].m_nFirstSub = nFirstSub;
+		}
+	}
+	return true;
+}
+
+bool CKeyValuesArena::WriteCompiled( KeyValues *pRoot, CUtlBuffer &buf, int nSourceSize, int64 nSourceTime )
+{
+	if ( !pRoot || buf.IsText() )
+		return false;
+
+	KeyValuesCompileContext_t ctx;
+	int nFirst;
+	if ( !CompileKeys( pRoot, ctx, nFirst ) )
+		return false;
+
+	KeyValuesCompiledHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = KEYVALUES_COMPILED_ID;
+	header.m_nVersion = KEYVALUES_COMPILED_VERSION;
+	header.m_nSourceTime = nSourceTime;
+	header.m_nSourceSize = nSourceSize;
+	header.m_nFlags = ( pRoot->m_bHasEscapeSequences ? KEYVALUES_COMPILED_ESCAPES : 0 ) | ( pRoot->m_bEvaluateConditionals ? KEYVALUES_COMPILED_CONDITIONALS : 0 );
+	header.m_nConditionals = GetTrueConditionals();
+	header.m_nNodes = ctx.m_Nodes.Count();
+	header.m_nNames = ctx.m_Names.Count();
+	header.m_nStringBytes = ctx.m_Strings.TellPut();
+
+	int nTablesEnd = sizeof( header ) + header.m_nNodes * sizeof( KeyValuesCompiledNode_t ) + header.m_nNames * sizeof( int );
+	header.m_nStringsOffset = AlignValue( nTablesEnd, 8 );
+
+	buf.Put( &header, sizeof( header ) );
+	buf.Put( ctx.m_Nodes.Base(), header.m_nNodes * sizeof( KeyValuesCompiledNode_t ) );
+	buf.Put( ctx.m_Names.Base(), header.m_nNames * sizeof( int ) );
+	for ( int i = nTablesEnd; i < header.m_nStringsOffset; i++ )
+	{
+		buf.PutChar( 0 );
+	}
+	buf.Put( ctx.m_Strings.Base(), header.m_nStringBytes );
+
+	return buf.IsValid();
+}
+
+KeyValues *CKeyValuesArena::LoadCompiledFromBuffer( const void *pData, int nDataSize, int nSourceSize, int64 nSourceTime )
+{
+	const KeyValuesCompiledHeader_t *pHeader = (const KeyValuesCompiledHeader_t *)pData;
+	if ( nDataSize < (int)sizeof( *pHeader ) || pHeader->m_nId != KEYVALUES_COMPILED_ID || pHeader->m_nVersion != KEYVALUES_COMPILED_VERSION )
+		return NULL;
+
+	// stale?
+	int nFlags = ( m_bUsesEscapeSequences ? KEYVALUES_COMPILED_ESCAPES : 0 ) | ( m_bUsesConditionals ? KEYVALUES_COMPILED_CONDITIONALS : 0 );
+	if ( pHeader->m_nSourceSize != nSourceSize || pHeader->m_nSourceTime != nSourceTime ||
+		 pHeader->m_nFlags != nFlags || pHeader->m_nConditionals != GetTrueConditionals() )
+		return NULL;
+
+	// everything has to fit, and the last string has to be terminated
+	int nNodes = pHeader->m_nNodes;
+	int nNames = pHeader->m_nNames;
+	int nStringBytes = pHeader->m_nStringBytes;
+	int64 nTablesEnd = (int64)sizeof( *pHeader ) + (int64)nNodes * sizeof( KeyValuesCompiledNode_t ) + (int64)nNames * sizeof( int );
+	if ( nNodes <= 0 || nNames <= 0 || nStringBytes <= 0 || ( pHeader->m_nStringsOffset & 7 ) ||
+		 pHeader->m_nStringsOffset < nTablesEnd || (int64)pHeader->m_nStringsOffset + nStringBytes != nDataSize )
+		return NULL;
+
+	const KeyValuesCompiledNode_t *pNodes = (const KeyValuesCompiledNode_t *)( pHeader + 1 );
+	const int *pNames = (const int *)( pNodes + nNodes );
+
+	// values point straight at the data, which is why it has to outlive the tree
+	char *pStrings = (char *)pData + pHeader->m_nStringsOffset;
+	if ( pStrings[nStringBytes - 1] != 0 )
+		return NULL;
+
+	// each distinct name goes through the symbol table once
+	int *pSymbols = (int *)Alloc( nNames * sizeof( int ), sizeof( int ) );
+	for ( int i = 0; i < nNames; i++ )
+	{
+		if ( pNames[i] < 0 || pNames[i] >= nStringBytes )
+			return NULL;
+		pSymbols[i] = KeyValues::CallGetSymbolForString( pStrings + pNames[i], true );
+	}
+
+	// every node but the root has exactly one parent or previous peer; a node linked
+	// twice would be freed twice by deleteThis
+	CUtlVector< bool > linked;
+	linked.SetCount( nNodes );
+	V_memset( linked.Base(), 0, nNodes * sizeof( bool ) );
+
+	KeyValues *pKeys = (KeyValues *)Alloc( nNodes * sizeof( KeyValues ) );
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		const KeyValuesCompiledNode_t &node = pNodes[i];
+
+		// nodes are stored depth first, so links only ever point forward and can't loop
+		if ( node.m_nName < 0 || node.m_nName >= nNames ||
+			 ( node.m_nFirstSub != -1 && ( node.m_nFirstSub <= i || node.m_nFirstSub >= nNodes || linked[node.m_nFirstSub] ) ) ||
+			 ( node.m_nNextPeer != -1 && ( node.m_nNextPeer <= i || node.m_nNextPeer >= nNodes || linked[node.m_nNextPeer] ) ) ||
+			 ( node.m_nFirstSub != -1 && node.m_nFirstSub == node.m_nNextPeer ) )
+			return NULL;
+
+		if ( node.m_nFirstSub != -1 )
+		{
+			linked[node.m_nFirstSub] = true;
+		}
+		if ( node.m_nNextPeer != -1 )
+		{
+			linked[node.m_nNextPeer] = true;
+		}
+
+		KeyValues *dat = &pKeys[i];
+		dat->Init();
+		dat->m_iKeyName = pSymbols[node.m_nName];
+		dat->m_nAllocFlags = KeyValues::KEYVALUES_ALLOC_ARENA_KEY;
+		dat->m_bHasEscapeSequences = m_bUsesEscapeSequences;
+		dat->m_bEvaluateConditionals = m_bUsesConditionals;
+		dat->m_iDataType = node.m_nType;
+		dat->m_pSub = ( node.m_nFirstSub != -1 ) ? &pKeys[node.m_nFirstSub] : NULL;
+		dat->m_pPeer = ( node.m_nNextPeer != -1 ) ? &pKeys[node.m_nNextPeer] : NULL;
+
+		switch ( node.m_nType )
+		{
+		case KeyValues::TYPE_NONE:
+			break;
+		case KeyValues::TYPE_STRING:
+			if ( node.m_nValue < 0 || node.m_nValue >= nStringBytes )
+				return NULL;
+			dat->m_sValue = pStrings + node.m_nValue;
+			dat->m_nAllocFlags |= KeyValues::KEYVALUES_ALLOC_ARENA_VALUE;
+			break;
+		case KeyValues::TYPE_INT:
+		case KeyValues::TYPE_FLOAT:
+			dat->m_iValue = node.m_nValue;
+			break;
+		case KeyValues::TYPE_UINT64:
+			if ( node.m_nValue < 0 || node.m_nValue > nStringBytes - (int)sizeof( uint64 ) || ( node.m_nValue & 7 ) )
+				return NULL;
+			dat->m_sValue = pStrings + node.m_nValue;
+			dat->m_nAllocFlags |= KeyValues::KEYVALUES_ALLOC_ARENA_VALUE;
+			break;
+		default:
+			return NULL;
+		}
+	}
+
+	// and none is left out, which would mean a link went missing
+	for ( int i = 1; i < nNodes; i++ )
+	{
+		if ( !linked[i] )
+			return NULL;
+	}
+
+	return &pKeys[0];
+}
+
+KeyValues *CKeyValuesArena::LoadCompiled( const char *pFullPath, int nSourceSize, int64 nSourceTime )
+{
+	// Map it copy-on-write; the string values point into the mapping from here on
+	void *pData = NULL;
+	int nSize = 0;
+#if defined( _WIN32 ) && !defined( _X360 )
+	HANDLE hFile = CreateFile( pFullPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return NULL;
+
+	LARGE_INTEGER size;
+	if ( !GetFileSizeEx( hFile, &size ) || size.QuadPart <= 0 || size.QuadPart >= INT_MAX )
+	{
+		CloseHandle( hFile );
+		return NULL;
+	}
+
+	HANDLE hMapping = CreateFileMapping( hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+	CloseHandle( hFile );
+	if ( !hMapping )
+		return NULL;
+
+	pData = MapViewOfFile( hMapping, FILE_MAP_COPY, 0, 0, 0 );
+	CloseHandle( hMapping );
+	if ( !pData )
+		return NULL;
+	nSize = (int)size.QuadPart;
+#elif defined( POSIX )
+	int fd = open( pFullPath, O_RDONLY );
+	if ( fd < 0 )
+		return NULL;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size <= 0 || st.st_size >= INT_MAX )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	pData = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( pData == MAP_FAILED )
+		return NULL;
+	nSize = (int)st.st_size;
+#else
+	return NULL;
+#endif
+
+	Mapping_t mapping;
+	mapping.m_pData = pData;
+	mapping.m_nSize = nSize;
+	m_Mappings.AddToTail( mapping );
+
+	KeyValues *pRoot = LoadCompiledFromBuffer( pData, nSize, nSourceSize, nSourceTime );
+	if ( !pRoot )
+	{
+#if defined( _WIN32 ) && !defined( _X360 )
+		UnmapViewOfFile( pData );
+#elif defined( POSIX )
+		munmap( pData, nSize );
+#endif
+		m_Mappings.RemoveMultipleFromTail( 1 );
+	}
+	return pRoot;
+}
+
 #include "tier0/memdbgoff.h"
 
 //-----------------------------------------------------------------------------
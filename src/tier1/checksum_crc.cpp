@@ -7,6 +7,7 @@
 #include "basetypes.h"
 #include "commonmacros.h"
 #include "checksum_crc.h"
+#include "tier0/threadtools.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -98,7 +99,7 @@ CRC32_t	CRC32_GetTableEntry( unsigned int slot )
 	return pulCRCTable[(unsigned char)slot];
 }
 
-void CRC32_ProcessBuffer(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
+static void CRC32_ProcessBufferBytewise(CRC32_t *pulCRC, const void *pBuffer, int nBuffer)
 {
 	CRC32_t ulCrc = *pulCRC;
 	unsigned char *pb = (unsigned char *)pBuffer;
@@ -178,3 +179,431 @@ JustAfew:
     nBuffer &= 7;
     goto JustAfew;
 }
+
+//-----------------------------------------------------------------------------
+// Slice-by-8. s_CRCSliceTable[k][i] is the CRC of byte i followed by k zero bytes,
+// so eight bytes can be folded in with eight independent lookups instead of a
+// chain of eight dependent ones.
+//-----------------------------------------------------------------------------
+static CRC32_t s_CRCSliceTable[8][NUM_BYTES];
+
+static void CRC32_BuildSliceTables()
+{
+	for ( int i = 0; i < NUM_BYTES; i++ )
+	{
+		CRC32_t ulCrc = pulCRCTable[i];
+		s_CRCSliceTable[0][i] = ulCrc;
+		for ( int k = 1; k < 8; k++ )
+		{
+			ulCrc = pulCRCTable[(unsigned char)ulCrc] ^ (ulCrc >> 8);
+			s_CRCSliceTable[k][i] = ulCrc;
+		}
+	}
+}
+
+static FORCEINLINE CRC32_t CRC32_LoadLittleLong( const unsigned char *pb )
+{
+	CRC32_t ul;
+	memcpy( &ul, pb, sizeof( ul ) );
+	return LittleLong( ul );
+}
+
+static FORCEINLINE CRC32_t CRC32_Slice8Step( CRC32_t ulCrc, const unsigned char *pb )
+{
+	CRC32_t ulLow = CRC32_LoadLittleLong( pb ) ^ ulCrc;
+	CRC32_t ulHigh = CRC32_LoadLittleLong( pb + 4 );
+	return s_CRCSliceTable[7][ulLow & 0xff] ^
+		s_CRCSliceTable[6][(ulLow >> 8) & 0xff] ^
+		s_CRCSliceTable[5][(ulLow >> 16) & 0xff] ^
+		s_CRCSliceTable[4][ulLow >> 24] ^
+		s_CRCSliceTable[3][ulHigh & 0xff] ^
+		s_CRCSliceTable[2][(ulHigh >> 8) & 0xff] ^
+		s_CRCSliceTable[1][(ulHigh >> 16) & 0xff] ^
+		s_CRCSliceTable[0][ulHigh >> 24];
+}
+
+static CRC32_t CRC32_Slice8( CRC32_t ulCrc, const unsigned char *pb, int nBuffer )
+{
+	for ( ; nBuffer >= 8; nBuffer -= 8, pb += 8 )
+	{
+		ulCrc = CRC32_Slice8Step( ulCrc, pb );
+	}
+
+	while ( nBuffer-- > 0 )
+	{
+		ulCrc = pulCRCTable[*pb++ ^ (unsigned char)ulCrc] ^ (ulCrc >> 8);
+	}
+	return ulCrc;
+}
+
+static void CRC32_ProcessBufferSlice8( CRC32_t *pulCRC, const void *pBuffer, int nBuffer )
+{
+	*pulCRC = CRC32_Slice8( *pulCRC, (const unsigned char *)pBuffer, nBuffer );
+}
+
+//-----------------------------------------------------------------------------
+// PCLMULQDQ folding, after Gopal et al, "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction". Four 128 bit lanes are folded 64 bytes
+// at a time, reduced to one lane, then Barrett reduced to 32 bits. The constants
+// are x^n mod P for the bit-reflected CRC32 polynomial.
+//-----------------------------------------------------------------------------
+#if defined( PLATFORM_INTEL ) && ( defined( __GNUC__ ) || defined( _MSC_VER ) )
+#define CRC32_HAS_PCLMUL
+
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _WIN32
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined( __GNUC__ )
+#define PCLMUL_FUNCTION __attribute__(( target( "pclmul,sse2" ) ))
+#else
+#define PCLMUL_FUNCTION
+#endif
+
+// Below this the setup and reduction cost more than the table does
+#define CRC32_PCLMUL_MIN_LENGTH 64
+
+static bool CRC32_CheckForPCLMUL()
+{
+#if defined( _WIN32 )
+	int regs[4];
+	__cpuid( regs, 1 );
+	return ( regs[2] & ( 1 << 1 ) ) != 0 && ( regs[3] & ( 1 << 26 ) ) != 0;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if ( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+		return false;
+	return ( ecx & ( 1 << 1 ) ) != 0 && ( edx & ( 1 << 26 ) ) != 0;
+#endif
+}
+
+// nBuffer must be at least 64 and a multiple of 16
+PCLMUL_FUNCTION static CRC32_t CRC32_FoldPCLMUL( CRC32_t ulCrc, const unsigned char *pb, int nBuffer )
+{
+	const __m128i k1k2 = _mm_set_epi64x( 0x01c6e41596LL, 0x0154442bd4LL );
+	const __m128i k3k4 = _mm_set_epi64x( 0x00ccaa009eLL, 0x01751997d0LL );
+	const __m128i k5 = _mm_set_epi64x( 0, 0x0163cd6124LL );
+	const __m128i poly = _mm_set_epi64x( 0x01f7011641LL, 0x01db710641LL );
+	const __m128i mask32 = _mm_setr_epi32( ~0, 0, ~0, 0 );
+
+	__m128i x1 = _mm_loadu_si128( (const __m128i *)( pb + 0x00 ) );
+	__m128i x2 = _mm_loadu_si128( (const __m128i *)( pb + 0x10 ) );
+	__m128i x3 = _mm_loadu_si128( (const __m128i *)( pb + 0x20 ) );
+	__m128i x4 = _mm_loadu_si128( (const __m128i *)( pb + 0x30 ) );
+	x1 = _mm_xor_si128( x1, _mm_cvtsi32_si128( (int)ulCrc ) );
+	pb += 64;
+	nBuffer -= 64;
+
+	while ( nBuffer >= 64 )
+	{
+		__m128i x5 = _mm_clmulepi64_si128( x1, k1k2, 0x00 );
+		__m128i x6 = _mm_clmulepi64_si128( x2, k1k2, 0x00 );
+		__m128i x7 = _mm_clmulepi64_si128( x3, k1k2, 0x00 );
+		__m128i x8 = _mm_clmulepi64_si128( x4, k1k2, 0x00 );
+
+		x1 = _mm_clmulepi64_si128( x1, k1k2, 0x11 );
+		x2 = _mm_clmulepi64_si128( x2, k1k2, 0x11 );
+		x3 = _mm_clmulepi64_si128( x3, k1k2, 0x11 );
+		x4 = _mm_clmulepi64_si128( x4, k1k2, 0x11 );
+
+		x1 = _mm_xor_si128( _mm_xor_si128( x1, x5 ), _mm_loadu_si128( (const __m128i *)( pb + 0x00 ) ) );
+		x2 = _mm_xor_si128( _mm_xor_si128( x2, x6 ), _mm_loadu_si128( (const __m128i *)( pb + 0x10 ) ) );
+		x3 = _mm_xor_si128( _mm_xor_si128( x3, x7 ), _mm_loadu_si128( (const __m128i *)( pb + 0x20 ) ) );
+		x4 = _mm_xor_si128( _mm_xor_si128( x4, x8 ), _mm_loadu_si128( (const __m128i *)( pb + 0x30 ) ) );
+
+		pb += 64;
+		nBuffer -= 64;
+	}
+
+	// fold the four lanes into one
+	__m128i x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+	x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+	x1 = _mm_xor_si128( _mm_xor_si128( x1, x2 ), x5 );
+
+	x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+	x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+	x1 = _mm_xor_si128( _mm_xor_si128( x1, x3 ), x5 );
+
+	x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+	x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+	x1 = _mm_xor_si128( _mm_xor_si128( x1, x4 ), x5 );
+
+	// any 16 byte blocks left over
+	while ( nBuffer >= 16 )
+	{
+		x5 = _mm_clmulepi64_si128( x1, k3k4, 0x00 );
+		x1 = _mm_clmulepi64_si128( x1, k3k4, 0x11 );
+		x1 = _mm_xor_si128( _mm_xor_si128( x1, _mm_loadu_si128( (const __m128i *)pb ) ), x5 );
+		pb += 16;
+		nBuffer -= 16;
+	}
+
+	// 128 bits down to 64
+	x2 = _mm_clmulepi64_si128( x1, k3k4, 0x10 );
+	x1 = _mm_xor_si128( _mm_srli_si128( x1, 8 ), x2 );
+
+	x2 = _mm_srli_si128( x1, 4 );
+	x1 = _mm_and_si128( x1, mask32 );
+	x1 = _mm_clmulepi64_si128( x1, k5, 0x00 );
+	x1 = _mm_xor_si128( x1, x2 );
+
+	// Barrett reduction to 32 bits
+	x2 = _mm_and_si128( x1, mask32 );
+	x2 = _mm_clmulepi64_si128( x2, poly, 0x10 );
+	x2 = _mm_and_si128( x2, mask32 );
+	x2 = _mm_clmulepi64_si128( x2, poly, 0x00 );
+	x1 = _mm_xor_si128( x1, x2 );
+
+	return (CRC32_t)_mm_cvtsi128_si32( _mm_srli_si128( x1, 4 ) );
+}
+
+static void CRC32_ProcessBufferPCLMUL( CRC32_t *pulCRC, const void *pBuffer, int nBuffer )
+{
+	const unsigned char *pb = (const unsigned char *)pBuffer;
+	CRC32_t ulCrc = *pulCRC;
+	if ( nBuffer >= CRC32_PCLMUL_MIN_LENGTH )
+	{
+		int nFold = nBuffer & ~15;
+		ulCrc = CRC32_FoldPCLMUL( ulCrc, pb, nFold );
+		pb += nFold;
+		nBuffer -= nFold;
+	}
+	*pulCRC = CRC32_Slice8( ulCrc, pb, nBuffer );
+}
+#endif // PLATFORM_INTEL
+
+//-----------------------------------------------------------------------------
+// Runtime dispatch. Set up on first use rather than at static init time since
+// CRCs get taken from other modules' constructors.
+//-----------------------------------------------------------------------------
+typedef void (*CRC32ProcessBufferFn_t)( CRC32_t *pulCRC, const void *pBuffer, int nBuffer );
+
+static CRC32ProcessBufferFn_t s_pfnProcessBuffer = NULL;
+static bool s_bHasPCLMUL = false;
+
+static void CRC32_InitDispatch()
+{
+	// Racing threads all write the same values here, so no lock is needed. The
+	// barrier keeps the tables visible before the function pointer is.
+	CRC32_BuildSliceTables();
+
+	CRC32ProcessBufferFn_t pfnProcessBuffer = CRC32_ProcessBufferSlice8;
+#ifdef CRC32_HAS_PCLMUL
+	s_bHasPCLMUL = CRC32_CheckForPCLMUL();
+	if ( s_bHasPCLMUL )
+	{
+		pfnProcessBuffer = CRC32_ProcessBufferPCLMUL;
+	}
+#endif
+
+	ThreadMemoryBarrier();
+	s_pfnProcessBuffer = pfnProcessBuffer;
+}
+
+static FORCEINLINE CRC32ProcessBufferFn_t CRC32_GetProcessBuffer()
+{
+	if ( !s_pfnProcessBuffer )
+	{
+		CRC32_InitDispatch();
+	}
+	return s_pfnProcessBuffer;
+}
+
+void CRC32_ProcessBuffer( CRC32_t *pulCRC, const void *pBuffer, int nBuffer )
+{
+	CRC32_GetProcessBuffer()( pulCRC, pBuffer, nBuffer );
+}
+
+bool CRC32_IsImplAvailable( CRC32Impl_t impl )
+{
+	CRC32_GetProcessBuffer();
+	switch ( impl )
+	{
+	case CRC32_IMPL_BYTEWISE:
+	case CRC32_IMPL_SLICE8:
+		return true;
+	case CRC32_IMPL_PCLMUL:
+		return s_bHasPCLMUL;
+	default:
+		return false;
+	}
+}
+
+const char *CRC32_GetImplName( CRC32Impl_t impl )
+{
+	switch ( impl )
+	{
+	case CRC32_IMPL_BYTEWISE:	return "bytewise";
+	case CRC32_IMPL_SLICE8:		return "slice-by-8";
+	case CRC32_IMPL_PCLMUL:		return "pclmul";
+	default:					return "unknown";
+	}
+}
+
+void CRC32_ProcessBufferWithImpl( CRC32Impl_t impl, CRC32_t *pulCRC, const void *pBuffer, int nBuffer )
+{
+	Assert( CRC32_IsImplAvailable( impl ) );
+	CRC32_GetProcessBuffer();
+	switch ( impl )
+	{
+	case CRC32_IMPL_BYTEWISE:
+		CRC32_ProcessBufferBytewise( pulCRC, pBuffer, nBuffer );
+		break;
+#ifdef CRC32_HAS_PCLMUL
+	case CRC32_IMPL_PCLMUL:
+		if ( s_bHasPCLMUL )
+		{
+			CRC32_ProcessBufferPCLMUL( pulCRC, pBuffer, nBuffer );
+			break;
+		}
+		// fall through
+#endif
+	default:
+		CRC32_ProcessBufferSlice8( pulCRC, pBuffer, nBuffer );
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Each slice-by-8 step is a chain of loads that depend on the previous step, so
+// one stream leaves the CPU waiting on L1. Stepping N streams together keeps N
+// chains in flight.
+//-----------------------------------------------------------------------------
+template < int N >
+static void CRC32_Slice8Interleaved( CRC32_t *pulCRCs, const void * const *ppBuffers, const int *pnLengths )
+{
+	const unsigned char *pb[N];
+	CRC32_t ulCrc[N];
+	int nCommon = pnLengths[0];
+	for ( int i = 0; i < N; i++ )
+	{
+		pb[i] = (const unsigned char *)ppBuffers[i];
+		ulCrc[i] = pulCRCs[i];
+		nCommon = MIN( nCommon, pnLengths[i] );
+	}
+	nCommon &= ~7;
+
+	for ( int nOffset = 0; nOffset < nCommon; nOffset += 8 )
+	{
+		for ( int i = 0; i < N; i++ )
+		{
+			ulCrc[i] = CRC32_Slice8Step( ulCrc[i], pb[i] + nOffset );
+		}
+	}
+
+	for ( int i = 0; i < N; i++ )
+	{
+		pulCRCs[i] = CRC32_Slice8( ulCrc[i], pb[i] + nCommon, pnLengths[i] - nCommon );
+	}
+}
+
+void CRC32_ProcessBuffers( int nBuffers, CRC32_t *pulCRCs, const void * const *ppBuffers, const int *pnLengths )
+{
+	CRC32ProcessBufferFn_t pfnProcessBuffer = CRC32_GetProcessBuffer();
+
+	// The folding path already keeps four independent lanes busy per buffer
+	if ( pfnProcessBuffer != CRC32_ProcessBufferSlice8 )
+	{
+		for ( int i = 0; i < nBuffers; i++ )
+		{
+			pfnProcessBuffer( &pulCRCs[i], ppBuffers[i], pnLengths[i] );
+		}
+		return;
+	}
+
+	int i = 0;
+	for ( ; i + 4 <= nBuffers; i += 4 )
+	{
+		CRC32_Slice8Interleaved< 4 >( &pulCRCs[i], &ppBuffers[i], &pnLengths[i] );
+	}
+
+	switch ( nBuffers - i )
+	{
+	case 3:
+		CRC32_Slice8Interleaved< 3 >( &pulCRCs[i], &ppBuffers[i], &pnLengths[i] );
+		break;
+	case 2:
+		CRC32_Slice8Interleaved< 2 >( &pulCRCs[i], &ppBuffers[i], &pnLengths[i] );
+		break;
+	case 1:
+		CRC32_ProcessBufferSlice8( &pulCRCs[i], ppBuffers[i], pnLengths[i] );
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CRC32_Combine. Appending n zero bytes to a message is a linear map on the CRC
+// register, so it's applied as a 32x32 GF(2) matrix raised to the n'th power by
+// repeated squaring (as in zlib's crc32_combine).
+//-----------------------------------------------------------------------------
+static CRC32_t CRC32_MatrixTimes( const CRC32_t *pMatrix, CRC32_t ulVec )
+{
+	CRC32_t ulSum = 0;
+	for ( ; ulVec; ulVec >>= 1, pMatrix++ )
+	{
+		if ( ulVec & 1 )
+		{
+			ulSum ^= *pMatrix;
+		}
+	}
+	return ulSum;
+}
+
+static void CRC32_MatrixSquare( CRC32_t *pSquare, const CRC32_t *pMatrix )
+{
+	for ( int n = 0; n < 32; n++ )
+	{
+		pSquare[n] = CRC32_MatrixTimes( pMatrix, pMatrix[n] );
+	}
+}
+
+CRC32_t CRC32_Combine( CRC32_t crcA, CRC32_t crcB, int nLengthB )
+{
+	if ( nLengthB <= 0 )
+		return crcA;
+
+	CRC32_t even[32];	// even powers of two zeros operator
+	CRC32_t odd[32];	// odd powers of two zeros operator
+
+	// operator for one zero bit
+	odd[0] = 0xedb88320UL;
+	CRC32_t ulRow = 1;
+	for ( int n = 1; n < 32; n++ )
+	{
+		odd[n] = ulRow;
+		ulRow <<= 1;
+	}
+
+	// two zero bits, then four
+	CRC32_MatrixSquare( even, odd );
+	CRC32_MatrixSquare( odd, even );
+
+	// apply nLengthB zero bytes to crcA; the first square puts one zero byte in even
+	unsigned int nLength = nLengthB;
+	for ( ;; )
+	{
+		CRC32_MatrixSquare( even, odd );
+		if ( nLength & 1 )
+		{
+			crcA = CRC32_MatrixTimes( even, crcA );
+		}
+		nLength >>= 1;
+		if ( !nLength )
+			break;
+
+		CRC32_MatrixSquare( odd, even );
+		if ( nLength & 1 )
+		{
+			crcA = CRC32_MatrixTimes( odd, crcA );
+		}
+		nLength >>= 1;
+		if ( !nLength )
+			break;
+	}
+
+	return crcA ^ crcB;
+}
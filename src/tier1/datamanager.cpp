@@ -19,6 +19,8 @@ CDataManagerBase::CDataManagerBase( unsigned int maxSize )
 	m_lockList = m_memoryLists.CreateList();
 	m_freeList = m_memoryLists.CreateList();
 	m_listsAreFreed = 0;
+	m_firstSerial = 1;
+	m_serialStep = 1;
 }
 
 CDataManagerBase::~CDataManagerBase() 
@@ -286,6 +288,7 @@ unsigned short CDataManagerBase::CreateHandle( bool bCreateLocked )
 	else
 	{
 		memoryIndex = m_memoryLists.AddToTail( list );
+		m_memoryLists[memoryIndex].serial = m_firstSerial;
 	}
 
 	if ( bCreateLocked )
@@ -362,6 +365,28 @@ unsigned int CDataManagerBase::EnsureCapacity( unsigned int size )
 	return ( nBytesInitial - MemUsed_Inline() );
 }
 
+unsigned int CDataManagerBase::FreeLRU( unsigned int nBytesToFree )
+{
+	unsigned int nFreed = 0;
+	while ( nFreed < nBytesToFree )
+	{
+		Lock();
+		int lruIndex = m_memoryLists.Head( m_lruList );
+		if ( lruIndex == m_memoryLists.InvalidIndex() )
+		{
+			Unlock();
+			break;
+		}
+		unsigned int nUsedBefore = MemUsed_Inline();
+		m_memoryLists.Unlink( m_lruList, lruIndex );
+		void *p = GetForFreeByIndex( lruIndex );
+		nFreed += nUsedBefore - MemUsed_Inline();
+		Unlock();
+		DestroyResourceStorage( p );
+	}
+	return nFreed;
+}
+
 // free this resource and move the handle to the free list
 void *CDataManagerBase::GetForFreeByIndex( unsigned short memoryIndex )
 {
@@ -380,7 +405,7 @@ void *CDataManagerBase::GetForFreeByIndex( unsigned short memoryIndex )
 		m_memUsed -= size;
 		p = mem.pStore;
 		mem.pStore = NULL;
-		mem.serial++;
+		mem.serial += m_serialStep;
 		m_memoryLists.LinkToTail( m_freeList, memoryIndex );
 	}
 	return p;
@@ -11,6 +11,12 @@
 #include "tier0/dbg.h"
 #include <ctype.h>
 #include "tier1/strtools.h"
+#if defined( _WIN32 ) && !defined( _X360 )
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>		// for FlsAlloc
+#elif defined( POSIX )
+#include <pthread.h>
+#endif
 
 // Should be last include
 #include "tier0/memdbgon.h"
@@ -310,3 +316,605 @@ void CUtlMemoryPool::Free( void *memBlock )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Is the block inside one of our blobs?
+//-----------------------------------------------------------------------------
+bool CUtlMemoryPool::IsAllocationWithinPool( void *pMem ) const
+{
+	for( const CBlob *pCur = m_BlobHead.m_pNext; pCur != &m_BlobHead; pCur = pCur->m_pNext )
+	{
+		const char *pData = (const char *)AlignValue( pCur->m_Data, m_nAlignment );
+		if ( (const char *)pMem >= pData && (const char *)pMem < pData + pCur->m_NumBytes )
+			return true;
+	}
+	return false;
+}
+
+
+//-----------------------------------------------------------------------------
+// Each thread gets a slot the first time it touches any CMemoryPoolMT; the slot
+// picks its cache in every pool. When the thread exits its caches are flushed
+// to the depots and the slot is freed for reuse, so only threads beyond the
+// first MEMPOOLMT_MAX_THREADS running at once use the locked path.
+//-----------------------------------------------------------------------------
+class CMemoryPoolMTThreadSlots
+{
+public:
+	// Returns the calling thread's slot, MEMPOOLMT_MAX_THREADS or more if it has none
+	static int GetSlot()
+	{
+		int iSlot = ThreadSlot();
+		if ( !iSlot )
+		{
+			iSlot = AssignSlot();
+		}
+		return iSlot - 1;
+	}
+
+	static void AddPool( CMemoryPoolMT *pPool );
+	static void RemovePool( CMemoryPoolMT *pPool );
+
+private:
+	static int AssignSlot();
+	static bool SetExitHook( int iSlot );
+#ifdef _WIN32
+	static void WINAPI OnThreadExit( void *pSlot );
+#else
+	static void OnThreadExit( void *pSlot );
+#endif
+
+	// Function statics so pools used during static construction are safe
+	static CTHREADLOCALINT &ThreadSlot()
+	{
+		static CTHREADLOCALINT s_iThreadSlot;	// Slot + 1, 0 until assigned
+		return s_iThreadSlot;
+	}
+
+	static CThreadFastMutex &Mutex()
+	{
+		static CThreadFastMutex s_Mutex;		// Guards the slots and the pool list
+		return s_Mutex;
+	}
+
+	static bool				s_bSlotInUse[MEMPOOLMT_MAX_THREADS];
+	static CMemoryPoolMT	*s_pPools;
+};
+
+bool CMemoryPoolMTThreadSlots::s_bSlotInUse[MEMPOOLMT_MAX_THREADS];
+CMemoryPoolMT *CMemoryPoolMTThreadSlots::s_pPools;
+
+
+void CMemoryPoolMTThreadSlots::AddPool( CMemoryPoolMT *pPool )
+{
+	AUTO_LOCK( Mutex() );
+	pPool->m_pPrevPool = NULL;
+	pPool->m_pNextPool = s_pPools;
+	if ( s_pPools )
+	{
+		s_pPools->m_pPrevPool = pPool;
+	}
+	s_pPools = pPool;
+}
+
+
+void CMemoryPoolMTThreadSlots::RemovePool( CMemoryPoolMT *pPool )
+{
+	AUTO_LOCK( Mutex() );
+	if ( pPool->m_pPrevPool )
+	{
+		pPool->m_pPrevPool->m_pNextPool = pPool->m_pNextPool;
+	}
+	else
+	{
+		s_pPools = pPool->m_pNextPool;
+	}
+
+	if ( pPool->m_pNextPool )
+	{
+		pPool->m_pNextPool->m_pPrevPool = pPool->m_pPrevPool;
+	}
+}
+
+
+int CMemoryPoolMTThreadSlots::AssignSlot()
+{
+	AUTO_LOCK( Mutex() );
+
+	// A thread that can't get a slot, or can't be told apart when it exits,
+	// stays on the locked path for good
+	int iSlot = MEMPOOLMT_MAX_THREADS + 1;
+	for ( int i = 0; i < MEMPOOLMT_MAX_THREADS; i++ )
+	{
+		if ( !s_bSlotInUse[i] )
+		{
+			if ( SetExitHook( i + 1 ) )
+			{
+				s_bSlotInUse[i] = true;
+				iSlot = i + 1;
+			}
+			break;
+		}
+	}
+
+	ThreadSlot() = iSlot;
+	return iSlot;
+}
+
+
+//-----------------------------------------------------------------------------
+// Arranges for OnThreadExit to be called with iSlot when the calling thread exits
+//-----------------------------------------------------------------------------
+bool CMemoryPoolMTThreadSlots::SetExitHook( int iSlot )
+{
+#ifdef _WIN32
+	static DWORD s_nExitHook = FLS_OUT_OF_INDEXES;
+	if ( s_nExitHook == FLS_OUT_OF_INDEXES )
+	{
+		s_nExitHook = FlsAlloc( OnThreadExit );
+		if ( s_nExitHook == FLS_OUT_OF_INDEXES )
+			return false;
+	}
+	return FlsSetValue( s_nExitHook, (void *)(intp)iSlot ) != FALSE;
+#else
+	static pthread_key_t s_ExitHook;
+	static bool s_bHaveExitHook;
+	if ( !s_bHaveExitHook )
+	{
+		if ( pthread_key_create( &s_ExitHook, OnThreadExit ) != 0 )
+			return false;
+		s_bHaveExitHook = true;
+	}
+	return pthread_setspecific( s_ExitHook, (void *)(intp)iSlot ) == 0;
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// Runs on the exiting thread: hands its cached blocks to the depots and frees the slot
+//-----------------------------------------------------------------------------
+#ifdef _WIN32
+void WINAPI CMemoryPoolMTThreadSlots::OnThreadExit( void *pSlot )
+#else
+void CMemoryPoolMTThreadSlots::OnThreadExit( void *pSlot )
+#endif
+{
+	int iSlot = (int)(intp)pSlot - 1;
+	if ( iSlot < 0 || iSlot >= MEMPOOLMT_MAX_THREADS )
+		return;
+
+	AUTO_LOCK( Mutex() );
+	for ( CMemoryPoolMT *pPool = s_pPools; pPool; pPool = pPool->m_pNextPool )
+	{
+		pPool->ReleaseThreadCache( iSlot );
+	}
+	s_bSlotInUse[iSlot] = false;
+
+	// A pool used by a later destructor on this thread gets a fresh slot
+	ThreadSlot() = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor
+//-----------------------------------------------------------------------------
+CMemoryPoolMT::CMemoryPoolMT( int blockSize, int numElements, int growMode, const char *pszAllocOwner, int nAlignment ) :
+	CUtlMemoryPool( blockSize, numElements, growMode, pszAllocOwner, nAlignment )
+{
+	memset( m_pThreadCaches, 0, sizeof( m_pThreadCaches ) );
+	memset( &m_RetiredCaches, 0, sizeof( m_RetiredCaches ) );
+	m_pFullMagazines = NULL;
+	m_pEmptyMagazines = NULL;
+	m_nUncachedAllocated = 0;
+	m_nUncachedOps = 0;
+	m_bCacheBlocks = ( growMode != UTLMEMORYPOOL_GROW_NONE );
+	CMemoryPoolMTThreadSlots::AddPool( this );
+}
+
+
+CMemoryPoolMT::~CMemoryPoolMT()
+{
+	CMemoryPoolMTThreadSlots::RemovePool( this );
+
+	// Cached blocks go back to the free list so only real leaks get reported
+	FlushCaches();
+
+	for ( int i = 0; i < MEMPOOLMT_MAX_THREADS; i++ )
+	{
+		ThreadCache_t *pCache = m_pThreadCaches[i];
+		if ( pCache )
+		{
+			delete pCache->m_pLoaded;
+			delete pCache->m_pPrevious;
+			delete pCache;
+		}
+	}
+
+	while ( m_pEmptyMagazines )
+	{
+		Magazine_t *pNext = m_pEmptyMagazines->m_pNext;
+		delete m_pEmptyMagazines;
+		m_pEmptyMagazines = pNext;
+	}
+}
+
+
+CMemoryPoolMT::Magazine_t *CMemoryPoolMT::NewMagazine()
+{
+	MEM_ALLOC_CREDIT_( m_pszAllocOwner );
+	Magazine_t *pMagazine = new Magazine_t;
+	pMagazine->m_pNext = NULL;
+	pMagazine->m_nCount = 0;
+	return pMagazine;
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns the calling thread's cache, or NULL if it should use the locked path
+//-----------------------------------------------------------------------------
+inline CMemoryPoolMT::ThreadCache_t *CMemoryPoolMT::GetThreadCache()
+{
+	if ( !m_bCacheBlocks )
+		return NULL;
+
+	int iSlot = CMemoryPoolMTThreadSlots::GetSlot();
+	if ( iSlot >= MEMPOOLMT_MAX_THREADS )
+		return NULL;
+
+	ThreadCache_t *pCache = m_pThreadCaches[iSlot];
+	return pCache ? pCache : CreateThreadCache( iSlot );
+}
+
+
+CMemoryPoolMT::ThreadCache_t *CMemoryPoolMT::CreateThreadCache( int iSlot )
+{
+	MEM_ALLOC_CREDIT_( m_pszAllocOwner );
+	ThreadCache_t *pCache = new ThreadCache_t;
+	memset( pCache, 0, sizeof( *pCache ) );
+	pCache->m_pLoaded = NewMagazine();
+	pCache->m_pPrevious = NewMagazine();
+
+	// Only this thread sets the slot, but Clear and GetStats walk the array
+	AUTO_LOCK( m_mutex );
+	m_pThreadCaches[iSlot] = pCache;
+	return pCache;
+}
+
+
+//-----------------------------------------------------------------------------
+// The thread in iSlot has exited: its blocks go to the depot, where any thread
+// can pick them up, and its counters to m_RetiredCaches
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::ReleaseThreadCache( int iSlot )
+{
+	AUTO_LOCK( m_mutex );
+
+	ThreadCache_t *pCache = m_pThreadCaches[iSlot];
+	if ( !pCache )
+		return;
+	m_pThreadCaches[iSlot] = NULL;
+
+	Magazine_t *pMagazines[2] = { pCache->m_pLoaded, pCache->m_pPrevious };
+	for ( int j = 0; j < 2; j++ )
+	{
+		// The depot's full list takes partly filled magazines too
+		Magazine_t **ppList = pMagazines[j]->m_nCount ? &m_pFullMagazines : &m_pEmptyMagazines;
+		pMagazines[j]->m_pNext = *ppList;
+		*ppList = pMagazines[j];
+	}
+
+	m_RetiredCaches.m_nAllocs += pCache->m_nAllocs;
+	m_RetiredCaches.m_nFrees += pCache->m_nFrees;
+	m_RetiredCaches.m_nHits += pCache->m_nHits;
+	m_RetiredCaches.m_nMisses += pCache->m_nMisses;
+	m_RetiredCaches.m_nUnmatchedFrees += pCache->m_nUnmatchedFrees;
+	delete pCache;
+}
+
+
+//-----------------------------------------------------------------------------
+// Both magazines are empty: trade one for a full magazine from the depot, or
+// fill it from the pool when the depot has none
+//-----------------------------------------------------------------------------
+void *CMemoryPoolMT::AllocFromDepot( ThreadCache_t *pCache )
+{
+	Magazine_t *pLoaded = pCache->m_pLoaded;
+	pCache->m_nMisses++;
+
+	{
+		AUTO_LOCK( m_mutex );
+		if ( m_pFullMagazines )
+		{
+			Magazine_t *pFull = m_pFullMagazines;
+			m_pFullMagazines = pFull->m_pNext;
+
+			pLoaded->m_pNext = m_pEmptyMagazines;
+			m_pEmptyMagazines = pLoaded;
+
+			pLoaded = pCache->m_pLoaded = pFull;
+		}
+		else
+		{
+			while ( pLoaded->m_nCount < MEMPOOLMT_MAGAZINE_SIZE )
+			{
+				void *pBlock = CUtlMemoryPool::Alloc( m_BlockSize );
+				if ( !pBlock )
+					break;
+				pLoaded->m_pBlocks[pLoaded->m_nCount++] = pBlock;
+			}
+		}
+	}
+
+	if ( !pLoaded->m_nCount )
+		return NULL;
+
+	pCache->m_nAllocs++;
+	return pLoaded->m_pBlocks[--pLoaded->m_nCount];
+}
+
+
+//-----------------------------------------------------------------------------
+// Both magazines are full: hand the older one to the depot and start an empty one
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::FreeToDepot( ThreadCache_t *pCache, void *pMem )
+{
+	Magazine_t *pEmpty;
+	pCache->m_nMisses++;
+
+	{
+		AUTO_LOCK( m_mutex );
+		pCache->m_pPrevious->m_pNext = m_pFullMagazines;
+		m_pFullMagazines = pCache->m_pPrevious;
+
+		pEmpty = m_pEmptyMagazines;
+		if ( pEmpty )
+		{
+			m_pEmptyMagazines = pEmpty->m_pNext;
+		}
+	}
+
+	if ( !pEmpty )
+	{
+		pEmpty = NewMagazine();
+	}
+
+	pCache->m_pPrevious = pCache->m_pLoaded;
+	pCache->m_pLoaded = pEmpty;
+	pEmpty->m_pBlocks[pEmpty->m_nCount++] = pMem;
+}
+
+
+void* CMemoryPoolMT::Alloc()
+{
+	return Alloc( m_BlockSize );
+}
+
+
+void* CMemoryPoolMT::AllocZero()
+{
+	return AllocZero( m_BlockSize );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Allocs a single block, from the thread's magazines when it can
+//-----------------------------------------------------------------------------
+void *CMemoryPoolMT::Alloc( size_t amount )
+{
+	if ( amount > (unsigned int)m_BlockSize )
+		return NULL;
+
+	ThreadCache_t *pCache = GetThreadCache();
+	if ( !pCache )
+	{
+		AUTO_LOCK( m_mutex );
+		void *pMem = CUtlMemoryPool::Alloc( amount );
+		if ( pMem )
+		{
+			m_nUncachedAllocated++;
+		}
+		m_nUncachedOps++;
+		return pMem;
+	}
+
+	Magazine_t *pLoaded = pCache->m_pLoaded;
+	if ( !pLoaded->m_nCount )
+	{
+		if ( !pCache->m_pPrevious->m_nCount )
+			return AllocFromDepot( pCache );
+
+		pCache->m_pLoaded = pCache->m_pPrevious;
+		pCache->m_pPrevious = pLoaded;
+		pLoaded = pCache->m_pLoaded;
+	}
+
+	pCache->m_nHits++;
+	pCache->m_nAllocs++;
+	return pLoaded->m_pBlocks[--pLoaded->m_nCount];
+}
+
+
+void *CMemoryPoolMT::AllocZero( size_t amount )
+{
+	void *mem = Alloc( amount );
+	if ( mem )
+	{
+		memset( mem, 0x00, amount );
+	}
+	return mem;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees a block into the thread's magazines. Blocks may be freed by a
+//			different thread than the one that allocated them.
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::Free( void *pMem )
+{
+	if ( !pMem )
+		return;
+
+	ThreadCache_t *pCache = GetThreadCache();
+	if ( !pCache )
+	{
+		AUTO_LOCK( m_mutex );
+		CUtlMemoryPool::Free( pMem );
+		m_nUncachedAllocated--;
+		m_nUncachedOps++;
+		return;
+	}
+
+#ifdef _DEBUG
+	// invalidate the memory
+	memset( pMem, 0xDD, m_BlockSize );
+#endif
+
+	// A thread can only free more than it allocated by freeing someone else's blocks
+	if ( pCache->m_nFrees >= pCache->m_nAllocs )
+	{
+		pCache->m_nUnmatchedFrees++;
+	}
+	pCache->m_nFrees++;
+
+	Magazine_t *pLoaded = pCache->m_pLoaded;
+	if ( pLoaded->m_nCount == MEMPOOLMT_MAGAZINE_SIZE )
+	{
+		if ( pCache->m_pPrevious->m_nCount == MEMPOOLMT_MAGAZINE_SIZE )
+		{
+			FreeToDepot( pCache, pMem );
+			return;
+		}
+
+		pCache->m_pLoaded = pCache->m_pPrevious;
+		pCache->m_pPrevious = pLoaded;
+		pLoaded = pCache->m_pLoaded;
+	}
+
+	pCache->m_nHits++;
+	pLoaded->m_pBlocks[pLoaded->m_nCount++] = pMem;
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns every cached block to the free list
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::FlushCaches()
+{
+	AUTO_LOCK( m_mutex );
+
+	for ( int i = 0; i < MEMPOOLMT_MAX_THREADS; i++ )
+	{
+		ThreadCache_t *pCache = m_pThreadCaches[i];
+		if ( !pCache )
+			continue;
+
+		Magazine_t *pMagazines[2] = { pCache->m_pLoaded, pCache->m_pPrevious };
+		for ( int j = 0; j < 2; j++ )
+		{
+			while ( pMagazines[j]->m_nCount )
+			{
+				CUtlMemoryPool::Free( pMagazines[j]->m_pBlocks[--pMagazines[j]->m_nCount] );
+			}
+		}
+	}
+
+	while ( m_pFullMagazines )
+	{
+		Magazine_t *pMagazine = m_pFullMagazines;
+		m_pFullMagazines = pMagazine->m_pNext;
+
+		while ( pMagazine->m_nCount )
+		{
+			CUtlMemoryPool::Free( pMagazine->m_pBlocks[--pMagazine->m_nCount] );
+		}
+
+		pMagazine->m_pNext = m_pEmptyMagazines;
+		m_pEmptyMagazines = pMagazine;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Frees everything
+//-----------------------------------------------------------------------------
+void CMemoryPoolMT::Clear()
+{
+	AUTO_LOCK( m_mutex );
+
+	// The blocks are about to go away with the blobs, so just empty the magazines
+	for ( int i = 0; i < MEMPOOLMT_MAX_THREADS; i++ )
+	{
+		ThreadCache_t *pCache = m_pThreadCaches[i];
+		if ( pCache )
+		{
+			pCache->m_pLoaded->m_nCount = 0;
+			pCache->m_pPrevious->m_nCount = 0;
+			pCache->m_nAllocs = pCache->m_nFrees = 0;
+		}
+	}
+	m_RetiredCaches.m_nAllocs = m_RetiredCaches.m_nFrees = 0;
+
+	while ( m_pFullMagazines )
+	{
+		Magazine_t *pMagazine = m_pFullMagazines;
+		m_pFullMagazines = pMagazine->m_pNext;
+		pMagazine->m_nCount = 0;
+		pMagazine->m_pNext = m_pEmptyMagazines;
+		m_pEmptyMagazines = pMagazine;
+	}
+
+	m_nUncachedAllocated = 0;
+	CUtlMemoryPool::Clear();
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns number of blocks handed out
+//-----------------------------------------------------------------------------
+int CMemoryPoolMT::Count() const
+{
+	// The lock keeps exiting threads from freeing caches under us
+	AUTO_LOCK( m_mutex );
+
+	int64 nAllocated = m_nUncachedAllocated + m_RetiredCaches.m_nAllocs - m_RetiredCaches.m_nFrees;
+	for ( int i = 0; i < MEMPOOLMT_MAX_THREADS; i++ )
+	{
+		const ThreadCache_t *pCache = m_pThreadCaches[i];
+		if ( pCache )
+		{
+			nAllocated += pCache->m_nAllocs - pCache->m_nFrees;
+		}
+	}
+	return (int)nAllocated;
+}
+
+
+void CMemoryPoolMT::GetStats( MemoryPoolMTStats_t *pStats ) const
+{
+	memset( pStats, 0, sizeof( *pStats ) );
+
+	AUTO_LOCK( m_mutex );
+
+	const ThreadCache_t *pRetired = &m_RetiredCaches;
+	int64 nAllocated = m_nUncachedAllocated + pRetired->m_nAllocs - pRetired->m_nFrees;
+	pStats->m_nMagazineHits = pRetired->m_nHits;
+	pStats->m_nMagazineMisses = pRetired->m_nMisses;
+	pStats->m_nUnmatchedFrees = pRetired->m_nUnmatchedFrees;
+
+	for ( int i = 0; i < MEMPOOLMT_MAX_THREADS; i++ )
+	{
+		const ThreadCache_t *pCache = m_pThreadCaches[i];
+		if ( pCache )
+		{
+			nAllocated += pCache->m_nAllocs - pCache->m_nFrees;
+			pStats->m_nThreadCaches++;
+			pStats->m_nMagazineHits += pCache->m_nHits;
+			pStats->m_nMagazineMisses += pCache->m_nMisses;
+			pStats->m_nUnmatchedFrees += pCache->m_nUnmatchedFrees;
+		}
+	}
+
+	pStats->m_nBlocksAllocated = (int)nAllocated;
+	pStats->m_nHighWaterBlocks = m_PeakAlloc;
+	pStats->m_nCachedBlocks = m_BlocksAllocated - pStats->m_nBlocksAllocated;
+	pStats->m_nUncachedOps = m_nUncachedOps;
+}
@@ -15,6 +15,7 @@
 #include "stringpool.h"
 #include "utlhashtable.h"
 #include "utlstring.h"
+#include "generichash.h"
 
 // Ensure that everybody has the right compiler version installed. The version
 // number can be obtained by looking at the compiler output when you type 'cl'
@@ -44,7 +45,7 @@
 // globals
 //-----------------------------------------------------------------------------
 
-CUtlSymbolTableMT* CUtlSymbol::s_pSymbolTable = 0; 
+CUtlSymbolTableMT32* CUtlSymbol::s_pSymbolTable = 0; 
 bool CUtlSymbol::s_bAllowStaticSymbolTable = true;
 
 
@@ -63,7 +64,8 @@ void CUtlSymbol::Initialize()
 	static bool symbolsInitialized = false;
 	if (!symbolsInitialized)
 	{
-		s_pSymbolTable = new CUtlSymbolTableMT;
+		// Capped so every symbol it hands out fits in a UtlSymId_t
+		s_pSymbolTable = new CUtlSymbolTableMT32( 32, false, UTL_INVAL_SYMBOL );
 		symbolsInitialized = true;
 	}
 }
@@ -83,7 +85,7 @@ public:
 
 static CCleanupUtlSymbolTable g_CleanupSymbolTable;
 
-CUtlSymbolTableMT* CUtlSymbol::CurrTable()
+CUtlSymbolTableMT32* CUtlSymbol::CurrTable()
 {
 	Initialize();
 	return s_pSymbolTable; 
@@ -96,12 +98,13 @@ CUtlSymbolTableMT* CUtlSymbol::CurrTable()
 
 CUtlSymbol::CUtlSymbol( const char* pStr )
 {
-	m_Id = CurrTable()->AddString( pStr );
+	CUtlSymbol32 id = CurrTable()->AddString( pStr );
+	m_Id = id.IsValid() ? (UtlSymId_t)(UtlSymId32_t)id : UTL_INVAL_SYMBOL;
 }
 
 const char* CUtlSymbol::String( ) const
 {
-	return CurrTable()->String(m_Id);
+	return CurrTable()->String( IsValid() ? CUtlSymbol32( m_Id ) : CUtlSymbol32() );
 }
 
 void CUtlSymbol::DisableStaticSymbolTable()
@@ -289,6 +292,367 @@ void CUtlSymbolTable::RemoveAll()
 
 
 
+//-----------------------------------------------------------------------------
+// CUtlSymbolTableMT32
+//-----------------------------------------------------------------------------
+
+#define UTLSYMBOLMT_MIN_STRING_BLOCK	1024	// a shard's first string block; each one after is twice the size
+#define UTLSYMBOLMT_MAX_STRING_BLOCK	( 64 * 1024 )
+#define UTLSYMBOLMT_MIN_TABLE_SIZE		16
+#define UTLSYMBOLMT_CACHE_LINE			64
+#define UTLSYMBOLMT_SHARD_SIZE			AlignValue( (int)sizeof( CUtlSymbolTableMT32::Shard_t ), UTLSYMBOLMT_CACHE_LINE )
+
+// One slot in a shard's hash table. A slot is published by writing m_pString last,
+// so a reader that sees the string can trust the hash and symbol next to it.
+struct CUtlSymbolTableMT32::HashTable_t
+{
+	struct Entry_t
+	{
+		const char * volatile m_pString;
+		unsigned int m_nHash;
+		UtlSymId32_t m_Id;
+	};
+
+	unsigned int m_nMask;
+	Entry_t m_Entries[1];
+};
+
+struct CUtlSymbolTableMT32::Shard_t
+{
+	CThreadFastMutex m_Mutex;
+
+	// Replaced, never changed in place, when it fills up past half way
+	HashTable_t * volatile m_pTable;
+	int m_nCount;
+
+	char *m_pStringBlock;
+	int m_nStringBlockSize;
+	int m_nStringBlockUsed;
+
+	// String blocks, and tables that were outgrown but might still be in use by a reader
+	CUtlVector< void * > m_Allocations;
+};
+
+inline CUtlSymbolTableMT32::Shard_t &CUtlSymbolTableMT32::GetShard( int i ) const
+{
+	return *(Shard_t *)( (byte *)m_pShards + i * UTLSYMBOLMT_SHARD_SIZE );
+}
+
+static inline int SymbolBlockSize( int nBlock )
+{
+	return ( 1 << UTLSYMBOLMT_SYMBOL_BLOCK_BITS ) << nBlock;
+}
+
+static inline void SymbolBlockAndOffset( UtlSymId32_t id, int &nBlock, int &nOffset )
+{
+	unsigned int n = ( id >> UTLSYMBOLMT_SYMBOL_BLOCK_BITS ) + 1;
+	nBlock = 0;
+	while ( n >>= 1 )
+	{
+		nBlock++;
+	}
+	nOffset = id - ( ( ( 1u << nBlock ) - 1 ) << UTLSYMBOLMT_SYMBOL_BLOCK_BITS );
+}
+
+CUtlSymbolTableMT32::CUtlSymbolTableMT32( int initSize, bool caseInsensitive, UtlSymId32_t nMaxSymbols ) : m_bInsensitive( caseInsensitive ), m_nMaxSymbols( nMaxSymbols )
+{
+	// Room for initSize strings at half load, spread over the shards
+	int nTableSize = UTLSYMBOLMT_MIN_TABLE_SIZE;
+	while ( nTableSize * UTLSYMBOLMT_SHARD_COUNT < initSize * 2 )
+	{
+		nTableSize <<= 1;
+	}
+	m_nInitialTableSize = nTableSize;
+
+	// Pad each shard out to its own cache lines so the mutexes don't share one
+	m_pShardMemory = malloc( UTLSYMBOLMT_SHARD_SIZE * UTLSYMBOLMT_SHARD_COUNT + UTLSYMBOLMT_CACHE_LINE );
+	m_pShards = (Shard_t *)AlignValue( (byte *)m_pShardMemory, UTLSYMBOLMT_CACHE_LINE );
+	for ( int i = 0; i < UTLSYMBOLMT_SHARD_COUNT; i++ )
+	{
+		Construct( &GetShard( i ) );
+	}
+
+	memset( (void *)m_pSymbolBlocks, 0, sizeof( m_pSymbolBlocks ) );
+	Init();
+}
+
+CUtlSymbolTableMT32::~CUtlSymbolTableMT32()
+{
+	Purge();
+
+	for ( int i = 0; i < UTLSYMBOLMT_SHARD_COUNT; i++ )
+	{
+		Destruct( &GetShard( i ) );
+	}
+	free( m_pShardMemory );
+}
+
+void CUtlSymbolTableMT32::Init()
+{
+	for ( int i = 0; i < UTLSYMBOLMT_SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = GetShard( i );
+		shard.m_pTable = AllocHashTable( m_nInitialTableSize );
+		shard.m_nCount = 0;
+		shard.m_pStringBlock = NULL;
+		shard.m_nStringBlockSize = 0;
+		shard.m_nStringBlockUsed = 0;
+	}
+	m_nSymbols = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Remove all symbols in the table. Nothing else may be using the table.
+//-----------------------------------------------------------------------------
+void CUtlSymbolTableMT32::RemoveAll()
+{
+	Purge();
+	Init();
+}
+
+void CUtlSymbolTableMT32::Purge()
+{
+	for ( int i = 0; i < UTLSYMBOLMT_SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = GetShard( i );
+		for ( int j = 0; j < shard.m_Allocations.Count(); j++ )
+		{
+			free( shard.m_Allocations[j] );
+		}
+		shard.m_Allocations.Purge();
+
+		free( shard.m_pTable );
+		shard.m_pTable = NULL;
+	}
+
+	for ( int i = 0; i < UTLSYMBOLMT_MAX_SYMBOL_BLOCKS; i++ )
+	{
+		free( (void *)m_pSymbolBlocks[i] );
+		m_pSymbolBlocks[i] = NULL;
+	}
+	m_nSymbols = 0;
+}
+
+CUtlSymbolTableMT32::HashTable_t *CUtlSymbolTableMT32::AllocHashTable( int nSize )
+{
+	Assert( IsPowerOfTwo( nSize ) );
+	int nBytes = sizeof( HashTable_t ) + ( nSize - 1 ) * sizeof( HashTable_t::Entry_t );
+	HashTable_t *pTable = (HashTable_t *)malloc( nBytes );
+	memset( pTable, 0, nBytes );
+	pTable->m_nMask = nSize - 1;
+	return pTable;
+}
+
+//-----------------------------------------------------------------------------
+// FNV-1a, then mixed so the top bits (the shard) and the bottom bits (the slot)
+// both depend on the whole string
+//-----------------------------------------------------------------------------
+unsigned int CUtlSymbolTableMT32::HashSymbolString( const char *pString ) const
+{
+	unsigned int nHash = 2166136261u;
+	const unsigned char *p = (const unsigned char *)pString;
+	if ( m_bInsensitive )
+	{
+		for ( ; *p; p++ )
+		{
+			nHash = ( nHash ^ FastASCIIToLower( *p ) ) * 16777619u;
+		}
+	}
+	else
+	{
+		for ( ; *p; p++ )
+		{
+			nHash = ( nHash ^ *p ) * 16777619u;
+		}
+	}
+	return HashIntAlternate( nHash );
+}
+
+UtlSymId32_t CUtlSymbolTableMT32::FindInTable( const HashTable_t *pTable, const char *pString, unsigned int nHash ) const
+{
+	for ( unsigned int i = nHash; ; i++ )
+	{
+		const HashTable_t::Entry_t &entry = pTable->m_Entries[i & pTable->m_nMask];
+		const char *pEntryString = entry.m_pString;
+		if ( !pEntryString )
+			return UTL_INVAL_SYMBOL32;
+
+		ThreadMemoryBarrier();
+		if ( entry.m_nHash == nHash )
+		{
+			if ( m_bInsensitive ? !V_stricmp( pEntryString, pString ) : !V_strcmp( pEntryString, pString ) )
+				return entry.m_Id;
+		}
+	}
+}
+
+void CUtlSymbolTableMT32::InsertIntoTable( HashTable_t *pTable, const char *pString, unsigned int nHash, UtlSymId32_t id )
+{
+	unsigned int i = nHash;
+	while ( pTable->m_Entries[i & pTable->m_nMask].m_pString )
+	{
+		i++;
+	}
+
+	HashTable_t::Entry_t &entry = pTable->m_Entries[i & pTable->m_nMask];
+	entry.m_nHash = nHash;
+	entry.m_Id = id;
+	ThreadMemoryBarrier();
+	entry.m_pString = pString;
+}
+
+//-----------------------------------------------------------------------------
+// Copies a string into the shard's current block, starting a bigger one when it's
+// full, so a table with few strings stays small. Long strings get their own.
+//-----------------------------------------------------------------------------
+const char *CUtlSymbolTableMT32::CopyString( Shard_t &shard, const char *pString )
+{
+	int nLen = V_strlen( pString ) + 1;
+	char *pCopy;
+	if ( nLen > UTLSYMBOLMT_MAX_STRING_BLOCK / 4 )
+	{
+		pCopy = (char *)malloc( nLen );
+		shard.m_Allocations.AddToTail( pCopy );
+	}
+	else
+	{
+		if ( !shard.m_pStringBlock || shard.m_nStringBlockUsed + nLen > shard.m_nStringBlockSize )
+		{
+			int nSize = shard.m_pStringBlock ? MIN( shard.m_nStringBlockSize * 2, UTLSYMBOLMT_MAX_STRING_BLOCK ) : UTLSYMBOLMT_MIN_STRING_BLOCK;
+			while ( nSize < nLen )
+			{
+				nSize *= 2;
+			}
+
+			shard.m_pStringBlock = (char *)malloc( nSize );
+			shard.m_nStringBlockSize = nSize;
+			shard.m_nStringBlockUsed = 0;
+			shard.m_Allocations.AddToTail( shard.m_pStringBlock );
+		}
+		pCopy = shard.m_pStringBlock + shard.m_nStringBlockUsed;
+		shard.m_nStringBlockUsed += nLen;
+	}
+
+	memcpy( pCopy, pString, nLen );
+	return pCopy;
+}
+
+//-----------------------------------------------------------------------------
+// Takes the next symbol and points it at the string
+//-----------------------------------------------------------------------------
+UtlSymId32_t CUtlSymbolTableMT32::AllocSymbol( const char *pString )
+{
+	UtlSymId32_t id = (UtlSymId32_t)( ++m_nSymbols - 1 );
+	if ( id >= m_nMaxSymbols )
+	{
+		Error( "CUtlSymbolTableMT32 overflow! (%u symbols max)\n", m_nMaxSymbols );
+	}
+
+	int nBlock, nOffset;
+	SymbolBlockAndOffset( id, nBlock, nOffset );
+
+	const char **pBlock = m_pSymbolBlocks[nBlock];
+	if ( !pBlock )
+	{
+		m_SymbolBlockMutex.Lock();
+		pBlock = m_pSymbolBlocks[nBlock];
+		if ( !pBlock )
+		{
+			pBlock = (const char **)malloc( SymbolBlockSize( nBlock ) * sizeof( const char * ) );
+			ThreadMemoryBarrier();
+			m_pSymbolBlocks[nBlock] = pBlock;
+		}
+		m_SymbolBlockMutex.Unlock();
+	}
+
+	pBlock[nOffset] = pString;
+	return id;
+}
+
+//-----------------------------------------------------------------------------
+// Finds and/or creates a symbol based on the string
+//-----------------------------------------------------------------------------
+CUtlSymbol32 CUtlSymbolTableMT32::Find( const char* pString ) const
+{
+	if ( !pString )
+		return CUtlSymbol32();
+
+	unsigned int nHash = HashSymbolString( pString );
+	const Shard_t &shard = GetShard( nHash >> ( 32 - UTLSYMBOLMT_SHARD_BITS ) );
+
+	const HashTable_t *pTable = shard.m_pTable;
+	ThreadMemoryBarrier();
+	return CUtlSymbol32( FindInTable( pTable, pString, nHash ) );
+}
+
+CUtlSymbol32 CUtlSymbolTableMT32::AddString( const char* pString )
+{
+	if ( !pString )
+		return CUtlSymbol32();
+
+	unsigned int nHash = HashSymbolString( pString );
+	Shard_t &shard = GetShard( nHash >> ( 32 - UTLSYMBOLMT_SHARD_BITS ) );
+
+	// Most adds are for strings that are already there, which doesn't need the lock
+	HashTable_t *pTable = shard.m_pTable;
+	ThreadMemoryBarrier();
+	UtlSymId32_t id = FindInTable( pTable, pString, nHash );
+	if ( id != UTL_INVAL_SYMBOL32 )
+		return CUtlSymbol32( id );
+
+	shard.m_Mutex.Lock();
+
+	// Someone else may have added it, or replaced the table, since we looked
+	pTable = shard.m_pTable;
+	id = FindInTable( pTable, pString, nHash );
+	if ( id == UTL_INVAL_SYMBOL32 )
+	{
+		if ( ( shard.m_nCount + 1 ) * 2 > (int)( pTable->m_nMask + 1 ) )
+		{
+			// Readers may still be probing the old table, so keep it around until RemoveAll
+			HashTable_t *pNewTable = AllocHashTable( ( pTable->m_nMask + 1 ) * 2 );
+			for ( unsigned int i = 0; i <= pTable->m_nMask; i++ )
+			{
+				const HashTable_t::Entry_t &entry = pTable->m_Entries[i];
+				if ( entry.m_pString )
+				{
+					InsertIntoTable( pNewTable, entry.m_pString, entry.m_nHash, entry.m_Id );
+				}
+			}
+			shard.m_Allocations.AddToTail( pTable );
+
+			ThreadMemoryBarrier();
+			shard.m_pTable = pNewTable;
+			pTable = pNewTable;
+		}
+
+		const char *pCopy = CopyString( shard, pString );
+		id = AllocSymbol( pCopy );
+		InsertIntoTable( pTable, pCopy, nHash, id );
+		shard.m_nCount++;
+	}
+
+	shard.m_Mutex.Unlock();
+	return CUtlSymbol32( id );
+}
+
+//-----------------------------------------------------------------------------
+// Look up the string associated with a particular symbol
+//-----------------------------------------------------------------------------
+const char* CUtlSymbolTableMT32::String( CUtlSymbol32 id ) const
+{
+	if ( !id.IsValid() )
+		return "";
+
+	Assert( (int)(UtlSymId32_t)id < m_nSymbols );
+
+	int nBlock, nOffset;
+	SymbolBlockAndOffset( id, nBlock, nOffset );
+	return m_pSymbolBlocks[nBlock][nOffset];
+}
+
+
+
 class CUtlFilenameSymbolTable::HashTable : public CUtlStableHashtable<CUtlConstString>
 {
 };
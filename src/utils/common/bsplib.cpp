@@ -28,6 +28,7 @@
 #include "vtf/vtf.h"
 #include "lzma/lzma.h"
 #include "tier1/lzmaDecoder.h"
+#include "threads.h"
 
 #include "tier0/memdbgon.h"
 
@@ -707,6 +708,10 @@ template< class T > static void AddLump( int lumpnum, CUtlVector<T> &data, int v
 dheader_t		*g_pBSPHeader;
 FileHandle_t	g_hBSPFile;
 
+// Size of the file behind g_pBSPHeader, and whether it's mapped rather than read into the heap.
+static int		s_nBSPFileSize;
+static bool		s_bBSPFileMapped;
+
 struct Lump_t
 {
 	void	*pLumps[HEADER_LUMPS];
@@ -1833,6 +1838,13 @@ bool HasLump( int lump )
 
 void ValidateLump( int lump, int length, int size, int forceVersion )
 {
+	// A mapped file faults instead of reading garbage past the end, so catch bad headers here.
+	const lump_t &l = g_pBSPHeader->lumps[lump];
+	if ( s_nBSPFileSize && l.filelen && ( (unsigned)l.fileofs > (unsigned)s_nBSPFileSize || (unsigned)l.filelen > (unsigned)( s_nBSPFileSize - l.fileofs ) ) )
+	{
+		Error( "ValidateLump: lump %d extends past the end of the file", lump );
+	}
+
 	if ( length % size )
 	{
 		Error( "ValidateLump: odd size for lump %d", lump );
@@ -1987,6 +1999,26 @@ int CopyVariableLump( int lump, void **dest, int forceVersion = -1 )
 	return CopyLumpInternal<T>( lump, (T*)*dest, forceVersion );
 }
 
+//-----------------------------------------------------------------------------
+//	Read-only access to a lump in the open BSP, without copying it
+//-----------------------------------------------------------------------------
+const void *GetLumpData( int lump, int elementSize, int *pLength, int forceVersion )
+{
+	Assert( g_pBSPHeader );
+
+	// Only bytes can be used as they are in a file of the other endianness
+	if ( g_bSwapOnLoad && elementSize != 1 )
+	{
+		Error( "GetLumpData: lump %d needs byte swapping, use CopyLump", lump );
+	}
+
+	const lump_t &l = g_pBSPHeader->lumps[lump];
+	ValidateLump( lump, l.filelen, elementSize, forceVersion );
+
+	*pLength = l.filelen;
+	return l.filelen ? (byte*)g_pBSPHeader + l.fileofs : NULL;
+}
+
 //-----------------------------------------------------------------------------
 //	Add/Write unknown lumps
 //-----------------------------------------------------------------------------
@@ -2175,16 +2207,52 @@ void ValidateHeader( const char *filename, const dheader_t *pHeader )
 	}
 }
 
+//-----------------------------------------------------------------------------
+//	Maps the file into g_pBSPHeader, or reads it into memory if it can't be mapped.
+//	The mapping is copy-on-write so the header and game lumps can be swapped in place.
+//-----------------------------------------------------------------------------
+static void LoadBSPHeader( const char *filename, bool bAllowMapping = true )
+{
+	s_nBSPFileSize = bAllowMapping ? MapFile( filename, (void **)&g_pBSPHeader ) : -1;
+	s_bBSPFileMapped = ( s_nBSPFileSize >= 0 );
+	if ( !s_bBSPFileMapped )
+	{
+		s_nBSPFileSize = LoadFile( filename, (void **)&g_pBSPHeader );
+	}
+
+	if ( !g_pBSPHeader || s_nBSPFileSize < (int)sizeof( dheader_t ) )
+	{
+		Error( "%s is not a IBSP file", filename );
+	}
+}
+
+static void FreeBSPHeader( void )
+{
+	if ( s_bBSPFileMapped )
+	{
+		UnmapFile( g_pBSPHeader, s_nBSPFileSize );
+	}
+	else
+	{
+		free( g_pBSPHeader );
+	}
+
+	g_pBSPHeader = NULL;
+	s_nBSPFileSize = 0;
+	s_bBSPFileMapped = false;
+}
+
 //-----------------------------------------------------------------------------
 //	Low level BSP opener for external parsing. Parses headers, but nothing else.
+//	Lumps can be read in place with GetLumpSpan() until the BSP is closed.
 //	You must close the BSP, via CloseBSPFile().
 //-----------------------------------------------------------------------------
-void OpenBSPFile( const char *filename )
+void OpenBSPFile( const char *filename, bool bAllowMapping )
 {
 	Lumps_Init();
 
 	// load the file header
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	LoadBSPHeader( filename, bAllowMapping );
 
 	if ( g_bSwapOnLoad )
 	{
@@ -2202,8 +2270,7 @@ void OpenBSPFile( const char *filename )
 //-----------------------------------------------------------------------------
 void CloseBSPFile( void )
 {
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	FreeBSPHeader();
 }
 
 //-----------------------------------------------------------------------------
@@ -2304,9 +2371,10 @@ void LoadBSPFile( const char *filename )
 	}
 	*/
 		
-	// Load PAK file lump into appropriate data structure
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	// Load PAK file lump into appropriate data structure, straight from the file
+	g_Lumps.bLumpParsed[LUMP_PAKFILE] = true;
+	int paksize;
+	void *pakbuffer = const_cast<void *>( GetLumpData( LUMP_PAKFILE, 1, &paksize, -1 ) );
 	if ( paksize > 0 )
 	{
 		GetPakFile()->ActivateByteSwapping( IsX360() );
@@ -2317,8 +2385,6 @@ void LoadBSPFile( const char *filename )
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
-
 	g_GameLumps.ParseGameLump( g_pBSPHeader );
 
 	// NOTE: Do NOT call CopyLump after Lumps_Parse() it parses all un-Copied lumps
@@ -2449,13 +2515,13 @@ void LoadBSPFile_FileSystemOnly( const char *filename )
 	//
 	// load the file header
 	//
-	LoadFile( filename, (void **)&g_pBSPHeader );
+	LoadBSPHeader( filename );
 
 	ValidateHeader( filename, g_pBSPHeader );
 
 	// Load PAK file lump into appropriate data structure
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer, 1 );
+	int paksize;
+	void *pakbuffer = const_cast<void *>( GetLumpData( LUMP_PAKFILE, 1, &paksize, 1 ) );
 	if ( paksize > 0 )
 	{
 		GetPakFile()->ParseFromBuffer( pakbuffer, paksize );
@@ -2465,11 +2531,8 @@ void LoadBSPFile_FileSystemOnly( const char *filename )
 		GetPakFile()->Reset();
 	}
 
-	free( pakbuffer );
-
 	// everything has been copied out
-	free( g_pBSPHeader );
-	g_pBSPHeader = NULL;
+	FreeBSPHeader();
 }
 
 void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
@@ -2479,29 +2542,32 @@ void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName )
 	//
 	// load the file header
 	//
-	LoadFile( pBSPFileName, (void **)&g_pBSPHeader);
+	LoadBSPHeader( pBSPFileName );
 
 	ValidateHeader( pBSPFileName, g_pBSPHeader );
 
-	byte *pakbuffer = NULL;
-	int paksize = CopyVariableLump<byte>( FIELD_CHARACTER, LUMP_PAKFILE, ( void ** )&pakbuffer );
+	int paksize;
+	const void *pakbuffer = GetLumpData( LUMP_PAKFILE, 1, &paksize, -1 );
 	if ( paksize > 0 )
 	{
 		FILE *fp;
 		fp = fopen( pZipFileName, "wb" );
-		if( !fp )
+		if( fp )
+		{
+			fwrite( pakbuffer, paksize, 1, fp );
+			fclose( fp );
+		}
+		else
 		{
 			fprintf( stderr, "can't open %s\n", pZipFileName );
-			return;
 		}
-
-		fwrite( pakbuffer, paksize, 1, fp );
-		fclose( fp );
 	}
 	else
 	{		
 		fprintf( stderr, "zip file is zero length!\n" );
 	}
+
+	FreeBSPHeader();
 }
 
 /*
@@ -2960,6 +3026,122 @@ void PrintBSPFileSizes (void)
 	// areaportals, portals, texdata, clusters, worldlights, portalverts
 }
 
+/*
+=============
+PrintBSPFileSizes
+
+Same as above, but for a file on disk. Sizes come straight from the lump
+headers, so nothing is loaded.
+=============
+*/
+template< class T >
+static int LumpCount( int lump )
+{
+	return g_pBSPHeader->lumps[lump].filelen / sizeof( T );
+}
+
+void PrintBSPFileSizes( const char *pBSPFilename )
+{
+	int	totalmemory = 0;
+
+	OpenBSPFile( pBSPFilename );
+
+	Msg("\n");
+	Msg( "%-17s %16s %16s %9s \n", "Object names", "Objects/Maxobjs", "Memory / Maxmem", "Fullness" );
+	Msg( "%-17s %16s %16s %9s \n",  "------------", "---------------", "---------------", "--------" );
+
+	totalmemory += ArrayUsage( "models",		LumpCount<dmodel_t>( LUMP_MODELS ),			ENTRIES(dmodels),		ENTRYSIZE(dmodels) );
+	totalmemory += ArrayUsage( "brushes",		LumpCount<dbrush_t>( LUMP_BRUSHES ),		ENTRIES(dbrushes),		ENTRYSIZE(dbrushes) );
+	totalmemory += ArrayUsage( "brushsides",	LumpCount<dbrushside_t>( LUMP_BRUSHSIDES ),	ENTRIES(dbrushsides),	ENTRYSIZE(dbrushsides) );
+	totalmemory += ArrayUsage( "planes",		LumpCount<dplane_t>( LUMP_PLANES ),			ENTRIES(dplanes),		ENTRYSIZE(dplanes) );
+	totalmemory += ArrayUsage( "vertexes",		LumpCount<dvertex_t>( LUMP_VERTEXES ),		ENTRIES(dvertexes),		ENTRYSIZE(dvertexes) );
+	totalmemory += ArrayUsage( "nodes",			LumpCount<dnode_t>( LUMP_NODES ),			ENTRIES(dnodes),		ENTRYSIZE(dnodes) );
+	totalmemory += ArrayUsage( "texinfos",		LumpCount<texinfo_t>( LUMP_TEXINFO ),		MAX_MAP_TEXINFO,		sizeof(texinfo_t) );
+	totalmemory += ArrayUsage( "texdata",		LumpCount<dtexdata_t>( LUMP_TEXDATA ),		ENTRIES(dtexdata),		ENTRYSIZE(dtexdata) );
+
+	totalmemory += ArrayUsage( "dispinfos",		LumpCount<ddispinfo_t>( LUMP_DISPINFO ),	0,	sizeof( ddispinfo_t ) );
+	totalmemory += ArrayUsage( "disp_verts",	LumpCount<CDispVert>( LUMP_DISP_VERTS ),	0,	sizeof( CDispVert ) );
+	totalmemory += ArrayUsage( "disp_tris",		LumpCount<CDispTri>( LUMP_DISP_TRIS ),		0,	sizeof( CDispTri ) );
+	totalmemory += ArrayUsage( "disp_lmsamples",LumpCount<byte>( LUMP_DISP_LIGHTMAP_SAMPLE_POSITIONS ),0,sizeof( byte ) );
+
+	totalmemory += ArrayUsage( "faces",			LumpCount<dface_t>( LUMP_FACES ),			ENTRIES(dfaces),		ENTRYSIZE(dfaces) );
+	totalmemory += ArrayUsage( "hdr faces",		LumpCount<dface_t>( LUMP_FACES_HDR ),		ENTRIES(dfaces_hdr),	ENTRYSIZE(dfaces_hdr) );
+	totalmemory += ArrayUsage( "origfaces",		LumpCount<dface_t>( LUMP_ORIGINALFACES ),	ENTRIES(dorigfaces),	ENTRYSIZE(dorigfaces) );
+	int numfileleafs = LumpVersion( LUMP_LEAFS ) == 0 ? LumpCount<dleaf_version_0_t>( LUMP_LEAFS ) : LumpCount<dleaf_t>( LUMP_LEAFS );
+	totalmemory += ArrayUsage( "leaves",		numfileleafs,								ENTRIES(dleafs),		ENTRYSIZE(dleafs) );
+	totalmemory += ArrayUsage( "leaffaces",		LumpCount<unsigned short>( LUMP_LEAFFACES ),	ENTRIES(dleaffaces),	ENTRYSIZE(dleaffaces) );
+	totalmemory += ArrayUsage( "leafbrushes",	LumpCount<unsigned short>( LUMP_LEAFBRUSHES ),	ENTRIES(dleafbrushes),	ENTRYSIZE(dleafbrushes) );
+	totalmemory += ArrayUsage( "areas",			LumpCount<darea_t>( LUMP_AREAS ),			ENTRIES(dareas),		ENTRYSIZE(dareas) );
+	totalmemory += ArrayUsage( "surfedges",		LumpCount<int>( LUMP_SURFEDGES ),			ENTRIES(dsurfedges),	ENTRYSIZE(dsurfedges) );
+	totalmemory += ArrayUsage( "edges",			LumpCount<dedge_t>( LUMP_EDGES ),			ENTRIES(dedges),		ENTRYSIZE(dedges) );
+	totalmemory += ArrayUsage( "LDR worldlights",	LumpCount<dworldlight_t>( LUMP_WORLDLIGHTS ),		ENTRIES(dworldlightsLDR),	ENTRYSIZE(dworldlightsLDR) );
+	totalmemory += ArrayUsage( "HDR worldlights",	LumpCount<dworldlight_t>( LUMP_WORLDLIGHTS_HDR ),	ENTRIES(dworldlightsHDR),	ENTRYSIZE(dworldlightsHDR) );
+
+	totalmemory += ArrayUsage( "leafwaterdata",	LumpCount<dleafwaterdata_t>( LUMP_LEAFWATERDATA ),	ENTRIES(dleafwaterdata),	ENTRYSIZE(dleafwaterdata) );
+	totalmemory += ArrayUsage( "waterstrips",	LumpCount<dprimitive_t>( LUMP_PRIMITIVES ),		ENTRIES(g_primitives),	ENTRYSIZE(g_primitives) );
+	totalmemory += ArrayUsage( "waterverts",	LumpCount<dprimvert_t>( LUMP_PRIMVERTS ),		ENTRIES(g_primverts),	ENTRYSIZE(g_primverts) );
+	totalmemory += ArrayUsage( "waterindices",	LumpCount<unsigned short>( LUMP_PRIMINDICES ),	ENTRIES(g_primindices),	ENTRYSIZE(g_primindices) );
+	totalmemory += ArrayUsage( "cubemapsamples", LumpCount<dcubemapsample_t>( LUMP_CUBEMAPS ),	ENTRIES(g_CubemapSamples),	ENTRYSIZE(g_CubemapSamples) );
+	totalmemory += ArrayUsage( "overlays",		LumpCount<doverlay_t>( LUMP_OVERLAYS ),			ENTRIES(g_Overlays),	ENTRYSIZE(g_Overlays) );
+
+	totalmemory += GlobUsage( "LDR lightdata",	LumpCount<byte>( LUMP_LIGHTING ),		0 );
+	totalmemory += GlobUsage( "HDR lightdata",	LumpCount<byte>( LUMP_LIGHTING_HDR ),	0 );
+	totalmemory += GlobUsage( "visdata",		LumpCount<byte>( LUMP_VISIBILITY ),		sizeof(dvisdata) );
+	totalmemory += GlobUsage( "entdata",		LumpCount<byte>( LUMP_ENTITIES ),		384*1024 );	// goal is <384K
+
+	totalmemory += ArrayUsage( "LDR ambient table", LumpCount<dleafambientindex_t>( LUMP_LEAF_AMBIENT_INDEX ), MAX_MAP_LEAFS, sizeof( dleafambientindex_t ) );
+	totalmemory += ArrayUsage( "HDR ambient table", LumpCount<dleafambientindex_t>( LUMP_LEAF_AMBIENT_INDEX_HDR ), MAX_MAP_LEAFS, sizeof( dleafambientindex_t ) );
+	totalmemory += ArrayUsage( "LDR leaf ambient lighting", LumpCount<dleafambientlighting_t>( LUMP_LEAF_AMBIENT_LIGHTING ), MAX_MAP_LEAFS, sizeof( dleafambientlighting_t ) );
+	totalmemory += ArrayUsage( "HDR leaf ambient lighting", LumpCount<dleafambientlighting_t>( LUMP_LEAF_AMBIENT_LIGHTING_HDR ), MAX_MAP_LEAFS, sizeof( dleafambientlighting_t ) );
+
+	// The game lump directory is small; walk it in place rather than loading the lumps
+	if ( !g_bSwapOnLoad && HasLump( LUMP_GAME_LUMP ) )
+	{
+		int length;
+		const dgamelumpheader_t *pGameLumpHeader = (const dgamelumpheader_t *)GetLumpData( LUMP_GAME_LUMP, 1, &length );
+		const dgamelump_t *pGameLump = (const dgamelump_t *)( pGameLumpHeader + 1 );
+		for ( int i = 0; i < pGameLumpHeader->lumpCount; ++i )
+		{
+			const char *pName = NULL;
+			switch ( pGameLump[i].id )
+			{
+			case GAMELUMP_DETAIL_PROPS:					pName = "detail props"; break;
+			case GAMELUMP_DETAIL_PROP_LIGHTING:			pName = "dtl prp lght"; break;
+			case GAMELUMP_DETAIL_PROP_LIGHTING_HDR:		pName = "HDR dtl prp lght"; break;
+			case GAMELUMP_STATIC_PROPS:					pName = "static props"; break;
+			}
+			if ( pName )
+				totalmemory += GlobUsage( pName, 1, pGameLump[i].filelen );
+		}
+	}
+
+	totalmemory += GlobUsage( "pakfile",		LumpCount<byte>( LUMP_PAKFILE ), 0 );
+	// HACKHACK: Set physics limit at 4MB, in reality this is totally dynamic
+	totalmemory += GlobUsage( "physics",		LumpCount<byte>( LUMP_PHYSCOLLIDE ), 4*1024*1024 );
+	totalmemory += GlobUsage( "physics terrain",		LumpCount<byte>( LUMP_PHYSDISP ), 1*1024*1024 );
+
+	if ( !g_bSwapOnLoad )
+	{
+		CBSPLumpSpan<dflagslump_t> flags = GetLumpSpan<dflagslump_t>( LUMP_MAP_FLAGS );
+		Msg( "\nLevel flags = %x\n", flags.Count() ? flags[0].m_LevelFlags : 0 );
+
+		Msg( "\n" );
+
+		int triangleCount = 0;
+
+		CBSPLumpSpan<dface_t> faces = GetLumpSpan<dface_t>( LUMP_FACES, LUMP_FACES_VERSION );
+		for ( int i = 0; i < faces.Count(); i++ )
+		{
+			// face tris = numedges - 2
+			triangleCount += faces[i].numedges - 2;
+		}
+		Msg("Total triangle count: %d\n", triangleCount );
+	}
+
+	CloseBSPFile();
+	g_Swap.ActivateByteSwapping( false );
+}
+
 /*
 =============
 PrintBSPPackDirectory
@@ -4447,20 +4629,181 @@ int SortLumpsByOffset( const SortedLump_t *pSortedLumpA, const SortedLump_t *pSo
 	return 0;
 }
 
-bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+//-----------------------------------------------------------------------------
+// RepackBSP compresses each lump, game lump and pakfile entry as its own job so
+// they can all run on the tool threads. Jobs only fill in their own buffers;
+// the output is then assembled serially in the input's lump order, so it's the
+// same no matter how many threads ran or in what order the jobs finished.
+//-----------------------------------------------------------------------------
+enum RepackJobType_t
 {
-	CByteswap	byteSwap;
+	REPACK_JOB_LUMP,
+	REPACK_JOB_GAME_LUMP,
+	REPACK_JOB_PAKFILE_ENTRY,
+};
+
+struct RepackJob_t
+{
+	RepackJobType_t	type;
+	int				lumpNum;
+	byte			*pSource;			// data as it is in the input
+	int				sourceSize;
+	bool			bSourceCompressed;
+	unsigned int	uncompressedSize;	// expected size of compressed sources, 0 to trust the LZMA header
+	char			szName[MAX_PATH];	// pakfile entries
+
+	CUtlBuffer		inputBuffer;
+	CUtlBuffer		compressedBuffer;
+	bool			bCompressed;
+	double			flTime;
+};
 
+static CUtlVector< RepackJob_t * >	s_RepackJobs;
+static CUtlVector< int >			s_RepackJobOrder;
+static CompressFunc_t				s_pRepackCompressFunc;
+static IZip							*s_pRepackOldPak;
+static IZip							*s_pRepackNewPak;
+static IZip::eCompressionType		s_RepackPakCompression;
+static int							s_nRepackLZMALevel = -1;
+
+static RepackJob_t *AddRepackJob( RepackJobType_t type, int lumpNum, byte *pSource, int sourceSize, bool bSourceCompressed, unsigned int uncompressedSize )
+{
+	RepackJob_t *pJob = new RepackJob_t;
+	pJob->type = type;
+	pJob->lumpNum = lumpNum;
+	pJob->pSource = pSource;
+	pJob->sourceSize = sourceSize;
+	pJob->bSourceCompressed = bSourceCompressed;
+	pJob->uncompressedSize = uncompressedSize;
+	pJob->szName[0] = 0;
+	pJob->bCompressed = false;
+	pJob->flTime = 0;
+	s_RepackJobs.AddToTail( pJob );
+	return pJob;
+}
+
+static int RepackJobCost( const RepackJob_t *pJob )
+{
+	return pJob->bSourceCompressed ? pJob->uncompressedSize : pJob->sourceSize;
+}
+
+static int RepackJobCompare( const int *pA, const int *pB )
+{
+	// biggest first so a large lump doesn't start last and hold everything up
+	int costA = RepackJobCost( s_RepackJobs[*pA] );
+	int costB = RepackJobCost( s_RepackJobs[*pB] );
+	if ( costA != costB )
+		return ( costA > costB ) ? -1 : 1;
+	return *pA - *pB;
+}
+
+static void RepackBSP_ReadSource( RepackJob_t *pJob )
+{
+	if ( !pJob->bSourceCompressed )
+	{
+		// Just use input
+		pJob->inputBuffer.SetExternalBuffer( pJob->pSource, pJob->sourceSize, pJob->sourceSize );
+		return;
+	}
+
+	unsigned int expectedSize = pJob->uncompressedSize ? pJob->uncompressedSize : CLZMA::GetActualSize( pJob->pSource );
+	if ( CLZMA::IsCompressed( pJob->pSource ) && expectedSize == CLZMA::GetActualSize( pJob->pSource ) )
+	{
+		pJob->inputBuffer.EnsureCapacity( expectedSize );
+		unsigned int outSize = CLZMA::Uncompress( pJob->pSource, (unsigned char *)pJob->inputBuffer.Base() );
+		pJob->inputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, outSize );
+		if ( outSize != expectedSize )
+		{
+			Warning( "Decompressed size differs from header, BSP may be corrupt\n" );
+		}
+	}
+	else
+	{
+		Assert( CLZMA::IsCompressed( pJob->pSource ) );
+		Warning( pJob->type == REPACK_JOB_GAME_LUMP ? "Unsupported BSP: Unrecognized compressed game lump\n" : "Unsupported BSP: Unrecognized compressed lump\n" );
+	}
+}
+
+static void RepackBSP_Thread( int iThread, int iWorkItem )
+{
+	RepackJob_t *pJob = s_RepackJobs[ s_RepackJobOrder[iWorkItem] ];
+	double flStart = Plat_FloatTime();
+
+	if ( pJob->type == REPACK_JOB_PAKFILE_ENTRY )
+	{
+		// The old pak is only safe to read from one thread; the new one takes care of itself
+		ThreadLock();
+		bool bOK = ReadFileFromPak( s_pRepackOldPak, pJob->szName, false, pJob->inputBuffer );
+		ThreadUnlock();
+		if ( !bOK )
+		{
+			Error( "Failed to load '%s' from lump pak for repacking.\n", pJob->szName );
+		}
+
+		AddBufferToPak( s_pRepackNewPak, pJob->szName, pJob->inputBuffer.Base(), pJob->inputBuffer.TellMaxPut(), false, s_RepackPakCompression );
+		pJob->inputBuffer.Purge();
+
+		DevMsg( "Repacking BSP: Created '%s' in lump pak\n", pJob->szName );
+	}
+	else
+	{
+		RepackBSP_ReadSource( pJob );
+
+		pJob->bCompressed = s_pRepackCompressFunc ? s_pRepackCompressFunc( pJob->inputBuffer, pJob->compressedBuffer ) : false;
+		if ( pJob->bCompressed )
+		{
+			// only the compressed data gets written
+			pJob->uncompressedSize = pJob->inputBuffer.TellPut();
+			pJob->inputBuffer.Purge();
+		}
+	}
+
+	pJob->flTime = Plat_FloatTime() - flStart;
+}
+
+static void RepackBSP_AddGameLumpJobs( dheader_t *pInBSPHeader )
+{
 	dgamelumpheader_t* pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
 	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
 
 	if ( IsX360() )
 	{
+		CByteswap	byteSwap;
 		byteSwap.ActivateByteSwapping( true );
 		byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
 		byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
 	}
 
+	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
+	{
+		if ( !pInGameLump[i].filelen )
+			continue;
+
+		byte *pSource = ((byte *)pInBSPHeader) + pInGameLump[i].fileofs;
+		RepackJob_t *pJob = AddRepackJob( REPACK_JOB_GAME_LUMP, LUMP_GAME_LUMP, pSource, pInGameLump[i].filelen,
+			( pInGameLump[i].flags & GAMELUMPFLAG_COMPRESSED ) != 0, 0 );
+		if ( pJob->bSourceCompressed )
+		{
+			pJob->uncompressedSize = CLZMA::IsCompressed( pSource ) ? CLZMA::GetActualSize( pSource ) : 0;
+		}
+		V_snprintf( pJob->szName, sizeof( pJob->szName ), "%c%c%c%c", 
+			( pInGameLump[i].id >> 24 ) & 0xFF, ( pInGameLump[i].id >> 16 ) & 0xFF, ( pInGameLump[i].id >> 8 ) & 0xFF, pInGameLump[i].id & 0xFF );
+	}
+}
+
+static bool RepackBSP_WriteGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, int &iJob )
+{
+	CByteswap	byteSwap;
+
+	// Already swapped by RepackBSP_AddGameLumpJobs
+	dgamelumpheader_t* pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
+	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
+
+	if ( IsX360() )
+	{
+		byteSwap.ActivateByteSwapping( true );
+	}
+
 	unsigned int newOffset = outputBuffer.TellPut();
 	// Make room for gamelump header and gamelump structs, which we'll write at the end
 	outputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, sizeof( dgamelumpheader_t ) );
@@ -4481,52 +4824,23 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 
 	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
 	{
-		CUtlBuffer inputBuffer;
-		CUtlBuffer compressedBuffer;
-
 		sOutGameLump[i].fileofs = AlignBuffer( outputBuffer, 4 );
 
 		if ( pInGameLump[i].filelen )
 		{
-			if ( pInGameLump[i].flags & GAMELUMPFLAG_COMPRESSED )
-			{
-				byte *pCompressedLump = ((byte *)pInBSPHeader) + pInGameLump[i].fileofs;
-				if ( CLZMA::IsCompressed( pCompressedLump ) )
-				{
-					inputBuffer.EnsureCapacity( CLZMA::GetActualSize( pCompressedLump ) );
-					unsigned int outSize = CLZMA::Uncompress( pCompressedLump, (unsigned char *)inputBuffer.Base() );
-					inputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, outSize );
-					if ( outSize != CLZMA::GetActualSize( pCompressedLump ) )
-					{
-						Warning( "Decompressed size differs from header, BSP may be corrupt\n" );
-					}
-				}
-				else
-				{
-					Assert( CLZMA::IsCompressed( pCompressedLump ) );
-					Warning( "Unsupported BSP: Unrecognized compressed game lump\n" );
-				}
+			RepackJob_t *pJob = s_RepackJobs[iJob++];
+			Assert( pJob->type == REPACK_JOB_GAME_LUMP );
 
-			}
-			else
-			{
-				inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs,
-				                               pInGameLump[i].filelen, pInGameLump[i].filelen );
-			}
-
-			bool bCompressed = pCompressFunc ? pCompressFunc( inputBuffer, compressedBuffer ) : false;
-			if ( bCompressed )
+			if ( pJob->bCompressed )
 			{
 				sOutGameLump[i].flags |= GAMELUMPFLAG_COMPRESSED;
-
-				outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-				compressedBuffer.Purge();
+				outputBuffer.Put( pJob->compressedBuffer.Base(), pJob->compressedBuffer.TellPut() );
 			}
 			else
 			{
 				// as is, clear compression flag from input lump
 				sOutGameLump[i].flags &= ~GAMELUMPFLAG_COMPRESSED;
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( pJob->inputBuffer.Base(), pJob->inputBuffer.TellPut() );
 			}
 		}
 	}
@@ -4558,6 +4872,42 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Per-lump sizes and compression time (summed over threads) for the last repack
+//-----------------------------------------------------------------------------
+static void RepackBSP_PrintReport( const dheader_t *pOutBSPHeader, double flWallTime )
+{
+	Msg( "%-32s %10s %10s %7s %8s\n", "Lump", "Original", "Packed", "Ratio", "Time" );
+
+	unsigned int totalIn = 0, totalOut = 0;
+	double flTotalTime = 0;
+	for ( int lumpNum = 0; lumpNum < HEADER_LUMPS; lumpNum++ )
+	{
+		unsigned int in = 0;
+		double flTime = 0;
+		for ( int i = 0; i < s_RepackJobs.Count(); i++ )
+		{
+			const RepackJob_t *pJob = s_RepackJobs[i];
+			if ( pJob->lumpNum != lumpNum )
+				continue;
+
+			in += ( pJob->type == REPACK_JOB_PAKFILE_ENTRY || pJob->bCompressed ) ? pJob->uncompressedSize : pJob->inputBuffer.TellPut();
+			flTime += pJob->flTime;
+		}
+
+		unsigned int out = pOutBSPHeader->lumps[lumpNum].filelen;
+		if ( !out )
+			continue;
+
+		Msg( "%-32s %10u %10u %6.1f%% %7.2fs\n", GetLumpName( lumpNum ), in, out, in ? out * 100.0 / in : 100.0, flTime );
+		totalIn += in;
+		totalOut += out;
+		flTotalTime += flTime;
+	}
+
+	Msg( "%-32s %10u %10u %6.1f%% %7.2fs (%.2fs elapsed)\n", "total", totalIn, totalOut, totalIn ? totalOut * 100.0 / totalIn : 100.0, flTotalTime, flWallTime );
+}
+
 //-----------------------------------------------------------------------------
 // Compress callback for RepackBSP
 //-----------------------------------------------------------------------------
@@ -4572,11 +4922,10 @@ bool RepackBSPCallback_LZMA( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer )
 	unsigned int originalSize = inputBuffer.TellPut() - inputBuffer.TellGet();
 	unsigned int compressedSize = 0;
 	unsigned char *pCompressedOutput = LZMA_Compress( (unsigned char *)inputBuffer.Base() + inputBuffer.TellGet(),
-													  originalSize, &compressedSize );
+													  originalSize, &compressedSize, s_nRepackLZMALevel );
 	if ( pCompressedOutput )
 	{
 		outputBuffer.Put( pCompressedOutput, compressedSize );
-		DevMsg( "Compressed bsp lump %u -> %u bytes\n", originalSize, compressedSize );
 		free( pCompressedOutput );
 		return true;
 	}
@@ -4585,7 +4934,14 @@ bool RepackBSPCallback_LZMA( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer )
 }
 
 
-bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression )
+//-----------------------------------------------------------------------------
+// Rewrites a BSP with its lumps compressed by pCompressFunc and its pakfile
+// entries recompressed with packfileCompression. pCompressFunc is called from
+// several threads at once. While it runs, RepackBSPCallback_LZMA encodes at
+// nLZMALevel, 0 (fastest) to 9 (smallest), -1 for the default of 5. Pakfile
+// entries are compressed by the zip code, which always uses the default.
+//-----------------------------------------------------------------------------
+bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression, int nLZMALevel )
 {
 	dheader_t *pInBSPHeader = (dheader_t *)inputBuffer.Base();
 	// The 360 swaps this header to disk. For some reason.
@@ -4603,6 +4959,8 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 		byteSwap.SwapFieldsToTargetEndian( pInBSPHeader );
 	}
 
+	double flStart = Plat_FloatTime();
+
 	unsigned int headerOffset = outputBuffer.TellPut();
 	outputBuffer.Put( pInBSPHeader, sizeof( dheader_t ) );
 
@@ -4620,7 +4978,88 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 	}
 	sortedLumps.Sort( SortLumpsByOffset );
 
+	// Gather all the work in sorted order, which is also the order it's written in
+	s_pRepackCompressFunc = pCompressFunc;
+	s_RepackPakCompression = packfileCompression;
+	s_nRepackLZMALevel = nLZMALevel;
+	s_pRepackOldPak = NULL;
+	s_pRepackNewPak = NULL;
+
+	for ( int i = 0; i < HEADER_LUMPS; ++i )
+	{
+		SortedLump_t *pSortedLump = &sortedLumps[i];
+		int lumpNum = pSortedLump->lumpNum;
+		if ( !pSortedLump->pLump->filelen ) // Otherwise its degenerate
+			continue;
+
+		byte *pSource = ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs;
+		if ( lumpNum == LUMP_GAME_LUMP )
+		{
+			// the game lump has to have each of its components individually compressed
+			RepackBSP_AddGameLumpJobs( pInBSPHeader );
+		}
+		else if ( lumpNum == LUMP_PAKFILE )
+		{
+			// Both paks only ever see the lowercase names, so the new pak's
+			// order is fixed here rather than by which thread adds first
+			s_pRepackNewPak = IZip::CreateZip( NULL );
+			s_pRepackOldPak = IZip::CreateZip( NULL );
+			if ( pSortedLump->pLump->uncompressedSize )
+			{
+				RepackJob_t pakLump;
+				pakLump.pSource = pSource;
+				pakLump.sourceSize = pSortedLump->pLump->filelen;
+				pakLump.bSourceCompressed = true;
+				pakLump.uncompressedSize = pSortedLump->pLump->uncompressedSize;
+				pakLump.type = REPACK_JOB_LUMP;
+				RepackBSP_ReadSource( &pakLump );
+				s_pRepackOldPak->ParseFromBuffer( pakLump.inputBuffer.Base(), pakLump.inputBuffer.TellPut() );
+			}
+			else
+			{
+				s_pRepackOldPak->ParseFromBuffer( pSource, pSortedLump->pLump->filelen );
+			}
+
+			int id = -1;
+			int fileSize;
+			char relativeName[MAX_PATH];
+			while ( ( id = GetNextFilename( s_pRepackOldPak, id, relativeName, sizeof( relativeName ), fileSize ) ) != -1 )
+			{
+				RepackJob_t *pJob = AddRepackJob( REPACK_JOB_PAKFILE_ENTRY, LUMP_PAKFILE, NULL, 0, false, fileSize );
+				V_strncpy( pJob->szName, relativeName, sizeof( pJob->szName ) );
+				V_strlower( relativeName );
+				CUtlSymbol name( relativeName );
+			}
+		}
+		else
+		{
+			AddRepackJob( REPACK_JOB_LUMP, lumpNum, pSource, pSortedLump->pLump->filelen,
+				pSortedLump->pLump->uncompressedSize != 0, pSortedLump->pLump->uncompressedSize );
+		}
+	}
+
+	s_RepackJobOrder.SetCount( s_RepackJobs.Count() );
+	for ( int i = 0; i < s_RepackJobs.Count(); i++ )
+	{
+		s_RepackJobOrder[i] = i;
+	}
+	s_RepackJobOrder.Sort( RepackJobCompare );
+
+	if ( GetCurrentToolThreadIndex() >= 0 )
+	{
+		// Already on a tool thread, RunThreadsOn can't nest
+		for ( int i = 0; i < s_RepackJobOrder.Count(); i++ )
+		{
+			RepackBSP_Thread( 0, i );
+		}
+	}
+	else
+	{
+		RunThreadsOnIndividual( s_RepackJobOrder.Count(), false, RepackBSP_Thread );
+	}
+
 	// iterate in sorted order
+	int iJob = 0;
 	for ( int i = 0; i < HEADER_LUMPS; ++i )
 	{
 		SortedLump_t *pSortedLump = &sortedLumps[i];
@@ -4641,101 +5080,58 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 			}
 			unsigned int newOffset = AlignBuffer( outputBuffer, alignment );
 
-			CUtlBuffer inputBuffer;
-			if ( pSortedLump->pLump->uncompressedSize )
-			{
-				byte *pCompressedLump = ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs;
-				if ( CLZMA::IsCompressed( pCompressedLump ) && pSortedLump->pLump->uncompressedSize == CLZMA::GetActualSize( pCompressedLump ) )
-				{
-					inputBuffer.EnsureCapacity( CLZMA::GetActualSize( pCompressedLump ) );
-					unsigned int outSize = CLZMA::Uncompress( pCompressedLump, (unsigned char *)inputBuffer.Base() );
-					inputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, outSize );
-					if ( outSize != pSortedLump->pLump->uncompressedSize )
-					{
-						Warning( "Decompressed size differs from header, BSP may be corrupt\n" );
-					}
-				}
-				else
-				{
-					Assert( CLZMA::IsCompressed( pCompressedLump ) &&
-					        pSortedLump->pLump->uncompressedSize == CLZMA::GetActualSize( pCompressedLump ) );
-					Warning( "Unsupported BSP: Unrecognized compressed lump\n" );
-				}
-			}
-			else
-			{
-				// Just use input
-				inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs,
-				                               pSortedLump->pLump->filelen, pSortedLump->pLump->filelen );
-			}
-
 			if ( lumpNum == LUMP_GAME_LUMP )
 			{
-				// the game lump has to have each of its components individually compressed
-				CompressGameLump( pInBSPHeader, &sOutBSPHeader, outputBuffer, pCompressFunc );
+				RepackBSP_WriteGameLump( pInBSPHeader, &sOutBSPHeader, outputBuffer, iJob );
 			}
 			else if ( lumpNum == LUMP_PAKFILE )
 			{
-				IZip *newPakFile = IZip::CreateZip( NULL );
-				IZip *oldPakFile = IZip::CreateZip( NULL );
-				oldPakFile->ParseFromBuffer( inputBuffer.Base(), inputBuffer.Size() );
-
-				int id = -1;
-				int fileSize;
-				while ( 1 )
+				while ( iJob < s_RepackJobs.Count() && s_RepackJobs[iJob]->type == REPACK_JOB_PAKFILE_ENTRY )
 				{
-					char relativeName[MAX_PATH];
-					id = GetNextFilename( oldPakFile, id, relativeName, sizeof( relativeName ), fileSize );
-					if ( id == -1 )
-						break;
-
-					CUtlBuffer sourceBuf;
-					CUtlBuffer targetBuf;
-
-					bool bOK = ReadFileFromPak( oldPakFile, relativeName, false, sourceBuf );
-					if ( !bOK )
-					{
-						Error( "Failed to load '%s' from lump pak for repacking.\n", relativeName );
-						continue;
-					}
-
-					AddBufferToPak( newPakFile, relativeName, sourceBuf.Base(), sourceBuf.TellMaxPut(), false, packfileCompression );
-
-					DevMsg( "Repacking BSP: Created '%s' in lump pak\n", relativeName );
+					iJob++;
 				}
 
 				// save new pack to buffer
-				newPakFile->SaveToBuffer( outputBuffer );
+				s_pRepackNewPak->SaveToBuffer( outputBuffer );
 				sOutBSPHeader.lumps[lumpNum].fileofs = newOffset;
 				sOutBSPHeader.lumps[lumpNum].filelen = outputBuffer.TellPut() - newOffset;
 				// Note that this *lump* is uncompressed, it just contains a packfile that uses compression, so we're
 				// not setting lumps[lumpNum].uncompressedSize
 
-				IZip::ReleaseZip( oldPakFile );
-				IZip::ReleaseZip( newPakFile );
+				IZip::ReleaseZip( s_pRepackOldPak );
+				IZip::ReleaseZip( s_pRepackNewPak );
+				s_pRepackOldPak = NULL;
+				s_pRepackNewPak = NULL;
 			}
 			else
 			{
-				CUtlBuffer compressedBuffer;
-				bool bCompressed = pCompressFunc ? pCompressFunc( inputBuffer, compressedBuffer ) : false;
-				if ( bCompressed )
+				RepackJob_t *pJob = s_RepackJobs[iJob++];
+				Assert( pJob->type == REPACK_JOB_LUMP && pJob->lumpNum == lumpNum );
+
+				sOutBSPHeader.lumps[lumpNum].fileofs = newOffset;
+				if ( pJob->bCompressed )
 				{
-					sOutBSPHeader.lumps[lumpNum].uncompressedSize = inputBuffer.TellPut();
-					sOutBSPHeader.lumps[lumpNum].filelen = compressedBuffer.TellPut();
-					sOutBSPHeader.lumps[lumpNum].fileofs = newOffset;
-					outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
-					compressedBuffer.Purge();
+					sOutBSPHeader.lumps[lumpNum].uncompressedSize = pJob->uncompressedSize;
+					sOutBSPHeader.lumps[lumpNum].filelen = pJob->compressedBuffer.TellPut();
+					outputBuffer.Put( pJob->compressedBuffer.Base(), pJob->compressedBuffer.TellPut() );
 				}
 				else
 				{
 					// add as is
-					sOutBSPHeader.lumps[lumpNum].fileofs = newOffset;
-					sOutBSPHeader.lumps[lumpNum].filelen = inputBuffer.TellPut();
-					outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+					sOutBSPHeader.lumps[lumpNum].filelen = pJob->inputBuffer.TellPut();
+					outputBuffer.Put( pJob->inputBuffer.Base(), pJob->inputBuffer.TellPut() );
 				}
+				pJob->compressedBuffer.Purge();
 			}
 		}
 	}
+	Assert( iJob == s_RepackJobs.Count() );
+
+	RepackBSP_PrintReport( &sOutBSPHeader, Plat_FloatTime() - flStart );
+
+	s_RepackJobs.PurgeAndDeleteElements();
+	s_RepackJobOrder.Purge();
+	s_nRepackLZMALevel = -1;
 
 	if ( IsX360() )
 	{
@@ -4976,6 +5372,19 @@ bool SwapBSPFile( const char *pInFilename, const char *pOutFilename, bool bSwapO
 	return true;
 }
 
+//-----------------------------------------------------------------------------
+// Reads just the ident to see if a BSP is in the other byte order
+//-----------------------------------------------------------------------------
+static bool IsBSPFileSwapped( const char *pBSPFilename )
+{
+	int ident = 0;
+	FileHandle_t hFile = SafeOpenRead( pBSPFilename );
+	SafeRead( hFile, &ident, sizeof( ident ) );
+	g_pFileSystem->Close( hFile );
+
+	return ( ident == BigLong( IDBSPHEADER ) );
+}
+
 //-----------------------------------------------------------------------------
 // Get the pak lump from a BSP
 //-----------------------------------------------------------------------------
@@ -4991,10 +5400,7 @@ bool GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize )
 	}
 
 	// determine endian nature
-	dheader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBSPFileSwapped( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = !bSwap;
@@ -5078,15 +5484,20 @@ bool SetPakFileLump( const char *pBSPFilename, const char *pNewFilename, void *p
 	}
 
 	// determine endian nature
-	dheader_t *pHeader;
-	LoadFile( pBSPFilename, (void **)&pHeader );
-	bool bSwap = ( pHeader->ident == BigLong( IDBSPHEADER ) );
-	free( pHeader );
+	bool bSwap = IsBSPFileSwapped( pBSPFilename );
 
 	g_bSwapOnLoad = bSwap;
 	g_bSwapOnWrite = bSwap;
 
-	OpenBSPFile( pBSPFilename );
+	// The lumps are copied straight from the source file, which can't be mapped
+	// while it's also being rewritten in place.
+	char szBSPPath[MAX_PATH], szNewPath[MAX_PATH];
+	V_MakeAbsolutePath( szBSPPath, sizeof( szBSPPath ), pBSPFilename );
+	V_MakeAbsolutePath( szNewPath, sizeof( szNewPath ), pNewFilename );
+	V_FixSlashes( szBSPPath );
+	V_FixSlashes( szNewPath );
+
+	OpenBSPFile( pBSPFilename, V_stricmp( szBSPPath, szNewPath ) != 0 );
 
 	// save a copy of the old header
 	// generating a new bsp is a destructive operation
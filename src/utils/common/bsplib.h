@@ -287,18 +287,19 @@ int					TexDataStringTable_AddOrFindString( const char *pString );
 void	DecompressVis (byte *in, byte *decompressed);
 int		CompressVis (byte *vis, byte *dest);
 
-void	OpenBSPFile( const char *filename );
+void	OpenBSPFile( const char *filename, bool bAllowMapping = true );
 void	CloseBSPFile(void);
 void	LoadBSPFile( const char *filename );
 void	LoadBSPFile_FileSystemOnly( const char *filename );
 void	LoadBSPFileTexinfo( const char *filename );
 void	WriteBSPFile( const char *filename, char *pUnused = NULL );
 void	PrintBSPFileSizes(void);
+void	PrintBSPFileSizes( const char *pBSPFilename );
 void	PrintBSPPackDirectory(void);
 void	ReleasePakFileLumps(void);
 
 bool	RepackBSPCallback_LZMA( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
-bool	RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression );
+bool	RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression, int nLZMALevel = -1 );
 bool	SwapBSPFile( const char *filename, const char *swapFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc );
 
 bool	GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize );
@@ -308,6 +309,38 @@ void	WriteLumpToFile( char *filename, int lump, int nLumpVersion, void *pBuffer,
 bool	GetBSPDependants( const char *pBSPFilename, CUtlVector< CUtlString > *pList );
 void	UnloadBSPFile();
 
+//-----------------------------------------------------------------------------
+// Read-only view of a lump in the file opened by OpenBSPFile(). The file is
+// mapped where possible, so this doesn't copy anything, but the data is only
+// valid until CloseBSPFile() and only for files in native byte order.
+// Use CopyLump (via LoadBSPFile) for lumps that are going to be modified.
+//-----------------------------------------------------------------------------
+const void *GetLumpData( int lump, int elementSize, int *pLength, int forceVersion = -1 );
+
+template< class T >
+class CBSPLumpSpan
+{
+public:
+	CBSPLumpSpan( const T *pBase = NULL, int nCount = 0 ) : m_pBase( pBase ), m_nCount( nCount ) {}
+
+	const T &operator[]( int i ) const	{ Assert( i >= 0 && i < m_nCount ); return m_pBase[i]; }
+	const T *Base() const				{ return m_pBase; }
+	int Count() const					{ return m_nCount; }
+	bool IsEmpty() const				{ return m_nCount == 0; }
+
+private:
+	const T	*m_pBase;
+	int		m_nCount;
+};
+
+template< class T >
+inline CBSPLumpSpan<T> GetLumpSpan( int lump, int forceVersion = -1 )
+{
+	int nLength;
+	const T *pData = (const T *)GetLumpData( lump, sizeof( T ), &nLength, forceVersion );
+	return CBSPLumpSpan<T>( pData, nLength / sizeof( T ) );
+}
+
 void	ParseEntities (void);
 void	UnparseEntities (void);
 void	PrintEntity (entity_t *ent);
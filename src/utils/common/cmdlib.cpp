@@ -36,6 +36,10 @@
 
 #if defined( _WIN32 ) || defined( WIN32 )
 #include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #if defined( _X360 )
@@ -870,6 +874,90 @@ int    LoadFile ( const char *filename, void **bufferptr )
 
 
 
+
+/*
+==============
+MapFile
+==============
+*/
+int    MapFile ( const char *filename, void **bufferptr )
+{
+	*bufferptr = NULL;
+
+	// Relative names and base paths are resolved by the filesystem's search paths, which
+	// we can't see from here. VMPI workers on Windows read everything through the master.
+	int pathLength;
+	if ( !V_IsAbsolutePath( filename ) || CmdLib_HasBasePath( filename, pathLength ) )
+		return -1;
+#if defined( MPI ) && defined( _WIN32 )
+	if ( g_bUseMPI && !g_bMPIMaster )
+		return -1;
+#endif
+
+#ifdef _WIN32
+	HANDLE hFile = CreateFile( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return -1;
+
+	LARGE_INTEGER size;
+	if ( !GetFileSizeEx( hFile, &size ) || size.QuadPart <= 0 || size.QuadPart >= INT_MAX )
+	{
+		CloseHandle( hFile );
+		return -1;
+	}
+
+	HANDLE hMapping = CreateFileMapping( hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL );
+	CloseHandle( hFile );
+	if ( !hMapping )
+		return -1;
+
+	void *buffer = MapViewOfFile( hMapping, FILE_MAP_COPY, 0, 0, 0 );
+	CloseHandle( hMapping );
+	if ( !buffer )
+		return -1;
+
+	*bufferptr = buffer;
+	return (int)size.QuadPart;
+#else
+	int fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+		return -1;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) || st.st_size <= 0 || st.st_size >= INT_MAX )
+	{
+		close( fd );
+		return -1;
+	}
+
+	void *buffer = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( buffer == MAP_FAILED )
+		return -1;
+
+	*bufferptr = buffer;
+	return (int)st.st_size;
+#endif
+}
+
+
+/*
+==============
+UnmapFile
+==============
+*/
+void    UnmapFile ( void *buffer, int length )
+{
+	if ( !buffer )
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile( buffer );
+#else
+	munmap( buffer, length );
+#endif
+}
+
 /*
 ==============
 SaveFile
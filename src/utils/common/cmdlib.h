@@ -102,6 +102,11 @@ void			SafeRead( FileHandle_t f, void *buffer, int count);
 void			SafeWrite( FileHandle_t f, void *buffer, int count);
 
 int		LoadFile ( const char *filename, void **bufferptr );
+// Maps a file copy-on-write instead of reading it into memory. Only absolute paths to plain
+// files on disk are mapped; returns -1 otherwise and the caller should fall back to LoadFile.
+// Writes to the mapping are private and never reach the file.
+int		MapFile ( const char *filename, void **bufferptr );
+void	UnmapFile ( void *buffer, int length );
 void	SaveFile ( const char *filename, void *buffer, int count );
 qboolean	FileExists ( const char *filename );
 
@@ -161,7 +161,15 @@ bool FileSystem_Init( const char *pBSPFilename, int maxMemoryUsage, FSInitType_t
 		}
 		else
 		{
+#ifdef _WIN32
 			g_pFileSystem = g_pFullFileSystem = VMPI_FileSystem_Init( maxMemoryUsage, NULL );
+#else
+			// No file transfer here; workers read the same paths as the master directly.
+			if ( !FileSystem_Init_Normal( pBSPFilename, initType, bOnlyUseFilename ) )
+				return false;
+
+			g_pFileSystem = g_pFullFileSystem = VMPI_FileSystem_Init( maxMemoryUsage, g_pFullFileSystem );
+#endif
 			RecvQDirInfo();
 		}
 		return true;
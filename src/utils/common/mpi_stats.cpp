@@ -6,17 +6,24 @@
 //=============================================================================//
 
 // Nasty headers!
+#ifdef _WIN32
 #include "MySqlDatabase.h"
+#endif
 #include "tier1/strtools.h"
 #include "vmpi.h"
 #include "vmpi_dispatch.h"
 #include "mpi_stats.h"
 #include "cmdlib.h"
+#ifdef _WIN32
 #include "imysqlwrapper.h"
+#endif
 #include "threadhelpers.h"
 #include "vmpi_tools_shared.h"
 #include "tier0/icommandline.h"
 
+
+#ifdef _WIN32
+
 /*
 
 -- MySQL code to create the databases, create the users, and set access privileges.
@@ -34,7 +41,6 @@ grant select,insert,update on vrad.* to vrad_worker;
 grant select on vrad.* to vmpi_browser;
 flush privileges;
 
-/*
 
 -- SQL code to (re)create the tables.
 
@@ -836,4 +842,50 @@ unsigned long StatsDB_GetUniqueJobID()
 unsigned long VMPI_Stats_GetJobWorkerID()
 {
 	return g_JobWorkerID;
-}
\ No newline at end of file
+}
+
+
+#else // _WIN32
+
+// The stats database goes through the Win32 MySQL wrapper DLL, so there are no stats
+// on other platforms. The master and workers both skip the DB info exchange.
+
+void VMPI_Stats_InstallSpewHook()
+{
+}
+
+bool VMPI_Stats_Init_Master( const char *pHostName, const char *pDBName, const char *pUserName, const char *pBSPFilename, unsigned long *pDBJobID )
+{
+	*pDBJobID = 0;
+	return false;
+}
+
+bool VMPI_Stats_Init_Worker( const char *pHostName, const char *pDBName, const char *pUserName, unsigned long DBJobID )
+{
+	return false;
+}
+
+void VMPI_Stats_Term()
+{
+}
+
+void StatsDB_InitStatsDatabase( 
+	int argc, 
+	char **argv, 
+	const char *pDBInfoFilename )
+{
+	if ( g_bMPIMaster && ( g_bMPI_Stats || VMPI_IsParamUsed( mpi_Job_Watch ) ) )
+		Warning( "%s: the VMPI stats database isn't supported on this platform.\n", VMPI_GetParamString( mpi_Stats ) );
+}
+
+unsigned long StatsDB_GetUniqueJobID()
+{
+	return 0;
+}
+
+unsigned long VMPI_Stats_GetJobWorkerID()
+{
+	return 0;
+}
+
+#endif // _WIN32
@@ -32,6 +32,7 @@ void pw(winding_t *w)
 }
 
 winding_t *winding_pool[MAX_POINTS_ON_WINDING+4];
+static winding_t *s_ThreadWindingPool[MAX_TOOL_THREADS][MAX_POINTS_ON_WINDING+4];
 
 /*
 =============
@@ -50,18 +51,28 @@ winding_t *AllocWinding (int points)
 		if (c_active_windings > c_peak_windings)
 			c_peak_windings = c_active_windings;
 	}
-	ThreadLock();
-	if (winding_pool[points])
+	int iThread = GetCurrentToolThreadIndex();
+	if (iThread >= 0)
 	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
+		// tool threads keep their own pool, so there's no lock to fight over
+		w = s_ThreadWindingPool[iThread][points];
+		if (w)
+			s_ThreadWindingPool[iThread][points] = w->next;
 	}
 	else
+	{
+		ThreadLock();
+		w = winding_pool[points];
+		if (w)
+			winding_pool[points] = w->next;
+		ThreadUnlock();
+	}
+
+	if (!w)
 	{
 		w = (winding_t *)malloc(sizeof(*w));
 		w->p = (Vector *)calloc( points, sizeof(Vector) );
 	}
-	ThreadUnlock();
 	w->numpoints = 0; // None are occupied yet even though allocated.
 	w->maxpoints = points;
 	w->next = NULL;
@@ -73,8 +84,18 @@ void FreeWinding (winding_t *w)
 	if (w->numpoints == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
 	
-	ThreadLock();
 	w->numpoints = 0xdeaddead; // flag as freed
+
+	// Windings freed on a tool thread go back to that thread's pool, wherever they came from.
+	int iThread = GetCurrentToolThreadIndex();
+	if (iThread >= 0)
+	{
+		w->next = s_ThreadWindingPool[iThread][w->maxpoints];
+		s_ThreadWindingPool[iThread][w->maxpoints] = w;
+		return;
+	}
+
+	ThreadLock();
 	w->next = winding_pool[w->maxpoints];
 	winding_pool[w->maxpoints] = w;
 	ThreadUnlock();
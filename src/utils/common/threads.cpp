@@ -1,6 +1,6 @@
 //========= Copyright Valve Corporation, All rights reserved. ============//
 //
-// Purpose: 
+// Purpose:
 //
 // $Workfile:     $
 // $Date:         $
@@ -13,13 +13,16 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
-
-#define	MAX_THREADS	16
+#include "tier0/threadtools.h"
 
 
 class CRunThreadsData
@@ -30,18 +33,146 @@ public:
 	RunThreadsFn m_Fn;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CRunThreadsData g_RunThreadsData[MAX_TOOL_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+ThreadHandle_t g_ThreadHandles[MAX_TOOL_THREADS];
 
+// The RunThreadsOn index of the calling thread plus one. Thread locals start out
+// zero, so any thread that isn't one of ours reads as "no index".
+static CTHREADLOCALINT g_iToolThreadIndexPlusOne;
+
+
+/*
+===================================================================
+
+WORK STEALING
+
+Each thread owns a contiguous range of work items. The range is packed
+into one 64-bit value (next item in the low word, end in the high word)
+so the owner popping from the front and a thief splitting off the back
+half can both update it with a single compare-exchange. Ranges live on
+their own cache lines so the owner's pops don't contend with anyone
+until its range is stolen from.
+
+===================================================================
+*/
+
+struct ALIGN128 CThreadWorkRange
+{
+	int64 volatile m_Range;
+} ALIGN128_POST;
+
+static CThreadWorkRange g_ThreadWorkRanges[MAX_TOOL_THREADS];
+static int g_nWorkRanges;
+
+// Set by RunThreadsOnIndividualInOrder to put all of the work in one range.
+static bool g_bWorkInOrder = false;
+
+// How many pops thread 0 does between pacifier updates.
+#define PACIFIER_UPDATE_INTERVAL	16
+
+
+static inline int64 MakeWorkRange( int iStart, int iEnd )
+{
+	return (int64)( ( (uint64)(uint32)iEnd << 32 ) | (uint32)iStart );
+}
+
+static inline int WorkRangeStart( int64 range )
+{
+	return (int)(uint32)( (uint64)range & 0xFFFFFFFF );
+}
+
+static inline int WorkRangeEnd( int64 range )
+{
+	return (int)(uint32)( (uint64)range >> 32 );
+}
+
+
+// Splits [0,workcnt) into one contiguous chunk per thread.
+static void InitWorkRanges( int workcnt, int nThreads )
+{
+	g_nWorkRanges = MAX( nThreads, 1 );
+	for ( int i=0; i < g_nWorkRanges; i++ )
+	{
+		int iStart = (int)( (int64)workcnt * i / g_nWorkRanges );
+		int iEnd = (int)( (int64)workcnt * (i+1) / g_nWorkRanges );
+		g_ThreadWorkRanges[i].m_Range = MakeWorkRange( iStart, iEnd );
+	}
+}
+
+
+// Takes the next item from the front of iThread's range.
+static bool PopWorkItem( int iThread, int *pItem )
+{
+	int64 volatile *pRange = &g_ThreadWorkRanges[iThread].m_Range;
+	while ( 1 )
+	{
+		int64 cur = *pRange;
+		int iStart = WorkRangeStart( cur );
+		int iEnd = WorkRangeEnd( cur );
+		if ( iStart >= iEnd )
+			return false;
+
+		if ( ThreadInterlockedAssignIf64( pRange, MakeWorkRange( iStart+1, iEnd ), cur ) )
+		{
+			*pItem = iStart;
+			return true;
+		}
+	}
+}
+
+
+// Moves the back half of some other thread's range into iThread's (empty) range.
+static bool StealWorkRange( int iThread )
+{
+	for ( int iOffset=1; iOffset < g_nWorkRanges; iOffset++ )
+	{
+		int iVictim = ( iThread + iOffset ) % g_nWorkRanges;
+		int64 volatile *pVictim = &g_ThreadWorkRanges[iVictim].m_Range;
+		while ( 1 )
+		{
+			int64 cur = *pVictim;
+			int iStart = WorkRangeStart( cur );
+			int iEnd = WorkRangeEnd( cur );
+			if ( iStart >= iEnd )
+				break;
+
+			int iSplit = iEnd - ( iEnd - iStart + 1 ) / 2;
+			if ( ThreadInterlockedAssignIf64( pVictim, MakeWorkRange( iStart, iSplit ), cur ) )
+			{
+				// Nobody else writes to an empty range, so this doesn't need to be a compare-exchange.
+				ThreadInterlockedExchange64( &g_ThreadWorkRanges[iThread].m_Range, MakeWorkRange( iSplit, iEnd ) );
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+static int CountRemainingWork()
+{
+	int nRemaining = 0;
+	for ( int i=0; i < g_nWorkRanges; i++ )
+	{
+		int64 cur = g_ThreadWorkRanges[i].m_Range;
+		nRemaining += MAX( WorkRangeEnd( cur ) - WorkRangeStart( cur ), 0 );
+	}
+	return nRemaining;
+}
+
+
+int GetCurrentToolThreadIndex()
+{
+	return g_iToolThreadIndexPlusOne - 1;
+}
 
 
 /*
@@ -52,21 +183,32 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
+	int iThread = GetCurrentToolThreadIndex();
+	int r;
 
-	if (dispatch == workcount)
+	if ( iThread < 0 || iThread >= g_nWorkRanges )
 	{
-		ThreadUnlock ();
+		// Not one of the RunThreadsOn threads, so it has no range of its own - take from anybody's.
+		for ( int i=0; i < g_nWorkRanges; i++ )
+		{
+			if ( PopWorkItem( i, &r ) )
+				return r;
+		}
 		return -1;
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	while ( !PopWorkItem( iThread, &r ) )
+	{
+		if ( !StealWorkRange( iThread ) )
+			return -1;
+	}
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+	// The pacifier isn't thread safe, so only one thread draws it.
+	static int s_nPops = 0;
+	if ( iThread == 0 && pacifier && ( ++s_nPops % PACIFIER_UPDATE_INTERVAL ) == 0 && workcount > 0 )
+	{
+		UpdatePacifier( (float)( workcount - CountRemainingWork() ) / workcount );
+	}
 
 	return r;
 }
@@ -83,7 +225,7 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 		work = GetThreadWork ();
 		if (work == -1)
 			break;
-		 
+
 		workfunction( iThread, work );
 	}
 }
@@ -92,54 +234,57 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 {
 	if (numthreads == -1)
 		ThreadSetDefault ();
-	
+
 	workfunction = func;
 	RunThreadsOn (workcnt, showpacifier, ThreadWorkerFunction);
 }
 
+// With a single range, thread 0 pops from the front of it and every other thread
+// takes the GetThreadWork path for threads without a range of their own, which
+// also pops from the front - so items are handed out in order.
+void RunThreadsOnIndividualInOrder (int workcnt, qboolean showpacifier, ThreadWorkerFn func)
+{
+	g_bWorkInOrder = true;
+	RunThreadsOnIndividual (workcnt, showpacifier, func);
+	g_bWorkInOrder = false;
+}
+
 
 /*
 ===================================================================
 
-WIN32
+THREADS
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex	crit;
 static int enter;
 
 
-class CCritInit
-{
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
-
-
-
 void SetLowPriority()
 {
+#ifdef _WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	setpriority( PRIO_PROCESS, 0, 19 );
+#endif
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		numthreads = GetCPUInformation()->m_nLogicalProcessors;
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if (numthreads > MAX_TOOL_THREADS)
+		numthreads = MAX_TOOL_THREADS;
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -148,7 +293,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -161,15 +306,17 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+static uintp InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iToolThreadIndexPlusOne = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iToolThreadIndexPlusOne = 0;
 	return 0;
 }
 
@@ -188,23 +335,16 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
 
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
+				ThreadSetPriority( g_ThreadHandles[i], TP_PRIORITY_LOWEST );
 		}
 		else if ( ePriority == k_eRunThreadsPriority_Idle )
 		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+			ThreadSetPriority( g_ThreadHandles[i], TP_PRIORITY_LOWEST );
 		}
 	}
 }
@@ -212,13 +352,15 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
 
 	threaded = false;
 }
-	
+
 
 /*
 =============
@@ -229,9 +371,12 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 {
 	int		start, end;
 
+	if (numthreads == -1)
+		ThreadSetDefault ();
+
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
+	InitWorkRanges( workcnt, g_bWorkInOrder ? 1 : MIN( numthreads, MAX_TOOL_THREADS ) );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -241,7 +386,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
-	
+
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
@@ -253,5 +398,3 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 		printf (" (%i)\n", end-start);
 	}
 }
-
-
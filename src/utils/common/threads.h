@@ -18,7 +18,8 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+// This is only an array bound - numthreads defaults to the logical core count.
+#define MAX_TOOL_THREADS	256
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -43,10 +44,23 @@ enum ERunThreadsPriority
 void SetLowPriority();
 
 void ThreadSetDefault (void);
+
+// Returns the next work item for the calling thread, or -1 when all of the work
+// handed to RunThreadsOn has been dispatched. Each thread pulls from its own range
+// of items and steals half of another thread's remaining range when it runs dry,
+// so this never takes ThreadLock.
 int	GetThreadWork (void);
 
+// Returns the RunThreadsOn thread index of the calling thread, or -1 if it isn't a tool thread.
+int GetCurrentToolThreadIndex();
+
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
 
+// Same as RunThreadsOnIndividual, but all threads take items from one shared range so
+// the items are started strictly in order. Use this when later items reuse the results
+// of earlier ones and would lose that by being started early on another thread.
+void RunThreadsOnIndividualInOrder ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
+
 void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
 
 // This version doesn't track work items - it just runs your function and waits for it to finish.
@@ -60,6 +74,7 @@ void ThreadUnlock (void);
 #ifndef NO_THREAD_NAMES
 #define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
 #define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOnIndividualInOrder(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividualInOrder(n,p,f); }
 #endif
 
 #endif // THREADS_H
@@ -4,15 +4,22 @@
 //
 //=============================================================================//
 
+#ifdef _WIN32
 #include <windows.h>
 #include <dbghelp.h>
+#else
+#include <unistd.h>
+#endif
 #include "vmpi.h"
 #include "cmdlib.h"
 #include "vmpi_tools_shared.h"
 #include "tier1/strtools.h"
 #include "mpi_stats.h"
 #include "iphelpers.h"
+#include "tier0/threadtools.h"
+#ifdef _WIN32
 #include "tier0/minidump.h"
+#endif
 
 
 // ----------------------------------------------------------------------------- //
@@ -68,6 +75,7 @@ bool SharedDispatch( MessageBuffer *pBuf, int iSource, int iPacketID )
 			case 't':
 				Warning( "\nWorker '%s' dead: %s\n", VMPI_GetMachineName( iSource ), pInPos );
 				break;
+#ifdef _WIN32
 			case 'f':
 				{
 					int iFileSize = * reinterpret_cast< int const * >( pInPos );
@@ -125,6 +133,7 @@ bool SharedDispatch( MessageBuffer *pBuf, int iSource, int iPacketID )
 					}
 				}
 				break;
+#endif
 			}
 		}
 		return true;
@@ -180,6 +189,7 @@ void RecvDBInfo( CDBInfo *pInfo, unsigned long *pJobPrimaryID )
 	*pJobPrimaryID = g_JobPrimaryID;
 }
 
+#ifdef _WIN32
 // If the file is successfully opened, read and sent returns the size of the file in bytes
 // otherwise returns 0 and nothing is sent
 int VMPI_SendFileChunk( const void *pvChunkPrefix, int lenPrefix, tchar const *ptchFileName )
@@ -226,11 +236,12 @@ done:
 
 	return iResult;
 }
+#endif
 
 void VMPI_HandleCrash( const char *pMessage, void *pvExceptionInfo, bool bAssert )
 {
-	static LONG crashHandlerCount = 0;
-	if ( InterlockedIncrement( &crashHandlerCount ) == 1 )
+	static CInterlockedInt crashHandlerCount = 0;
+	if ( ++crashHandlerCount == 1 )
 	{
 		Msg( "\nFAILURE: '%s' (assert: %d)\n", pMessage, bAssert );
 
@@ -244,6 +255,7 @@ void VMPI_HandleCrash( const char *pMessage, void *pvExceptionInfo, bool bAssert
 			strlen( pMessage ) + 1,
 			VMPI_MASTER_ID );
 
+#ifdef _WIN32
 		// Now attempt to create a minidump with the given exception information
 		if ( pvExceptionInfo )
 		{
@@ -263,15 +275,19 @@ void VMPI_HandleCrash( const char *pMessage, void *pvExceptionInfo, bool bAssert
 				::DeleteFile( tchMinidumpFileName );
 			}
 		}
+#endif
 
 		// Let the messages go out.
-		Sleep( 500 );
+		VMPI_Sleep( 500 );
 	}
 
-	InterlockedDecrement( &crashHandlerCount );
+	--crashHandlerCount;
 }
 
 
+#ifdef _WIN32
+
+
 // This is called if we crash inside our crash handler. It just terminates the process immediately.
 LONG __stdcall VMPI_SecondExceptionFilter( struct _EXCEPTION_POINTERS *ExceptionInfo )
 {
@@ -338,6 +354,19 @@ void VMPI_ExceptionFilter( unsigned long uCode, void *pvExceptionInfo )
 	TerminateProcess( GetCurrentProcess(), 1 );
 }
 
+#else
+
+void VMPI_ExceptionFilter( unsigned long uCode, void *pvExceptionInfo )
+{
+	char chReason[32];
+	V_snprintf( chReason, sizeof( chReason ), "Signal %lu", uCode );
+	VMPI_HandleCrash( chReason, NULL, true );
+
+	_exit( 1 );
+}
+
+#endif
+
 
 void HandleMPIDisconnect( int procID, const char *pReason )
 {
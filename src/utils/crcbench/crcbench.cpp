@@ -0,0 +1,248 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times each CRC32 implementation against the bytewise one over a range
+//			of buffer sizes, checks they all agree, and streams any files given on
+//			the command line through CRC32_ProcessBuffers together, e.g.
+//
+//			crcbench -mb 64 maps/*.bsp
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlvector.h"
+#include "tier1/strtools.h"
+
+#define FILE_CHUNK_SIZE		(1024*1024)
+#define MAX_STREAMS			64
+
+void Usage( void )
+{
+	printf( "Usage: crcbench [-mb n] [file1 file2 ...]\n" );
+	printf( "  -mb n  : hash this many megabytes per test (default 256)\n" );
+	exit( -1 );
+}
+
+static CRC32_t TimeImpl( CRC32Impl_t impl, const unsigned char *pData, int nBufferSize, int nTotal, double &flSeconds )
+{
+	int nBuffers = MAX( nTotal / nBufferSize, 1 );
+
+	CRC32_t crc = 0;
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nBuffers; i++ )
+	{
+		CRC32_t ulCrc;
+		CRC32_Init( &ulCrc );
+		CRC32_ProcessBufferWithImpl( impl, &ulCrc, pData + ( i & 15 ), nBufferSize );
+		CRC32_Final( &ulCrc );
+		crc ^= ulCrc;
+	}
+	flSeconds = Plat_FloatTime() - flStart;
+	return crc;
+}
+
+static void BenchmarkBufferSizes( const unsigned char *pData, int nDataSize, int nTotal )
+{
+	static const int s_BufferSizes[] = { 16, 64, 256, 4096, 65536, 1024*1024, 16*1024*1024 };
+
+	printf( "%10s", "bytes" );
+	for ( int impl = 0; impl < CRC32_IMPL_COUNT; impl++ )
+	{
+		printf( "  %14s", CRC32_GetImplName( (CRC32Impl_t)impl ) );
+	}
+	printf( "   (MB/s, speedup over bytewise)\n" );
+
+	for ( int iSize = 0; iSize < (int)ARRAYSIZE( s_BufferSizes ); iSize++ )
+	{
+		int nBufferSize = s_BufferSizes[iSize];
+		if ( nBufferSize + 16 > nDataSize )
+			break;
+
+		printf( "%10d", nBufferSize );
+
+		double flBytewise = 0.0;
+		CRC32_t crcBytewise = TimeImpl( CRC32_IMPL_BYTEWISE, pData, nBufferSize, nTotal, flBytewise );
+		double flMB = (double)MAX( nTotal / nBufferSize, 1 ) * nBufferSize / ( 1024.0 * 1024.0 );
+		printf( "  %8.0f      ", flMB / flBytewise );
+
+		for ( int impl = CRC32_IMPL_BYTEWISE + 1; impl < CRC32_IMPL_COUNT; impl++ )
+		{
+			if ( !CRC32_IsImplAvailable( (CRC32Impl_t)impl ) )
+			{
+				printf( "  %14s", "n/a" );
+				continue;
+			}
+
+			double flSeconds = 0.0;
+			CRC32_t crc = TimeImpl( (CRC32Impl_t)impl, pData, nBufferSize, nTotal, flSeconds );
+			printf( "  %8.0f %4.1fx", flMB / flSeconds, flBytewise / flSeconds );
+			if ( crc != crcBytewise )
+			{
+				printf( " MISMATCH" );
+			}
+		}
+		printf( "\n" );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Four streams one after another vs. through CRC32_ProcessBuffers together
+//-----------------------------------------------------------------------------
+static void BenchmarkMultiBuffer( const unsigned char *pData, int nDataSize, int nTotal )
+{
+	const int nStreams = 4;
+	const int nChunk = 64 * 1024;
+	if ( nChunk * nStreams > nDataSize )
+		return;
+
+	int nRounds = MAX( nTotal / ( nChunk * nStreams ), 1 );
+
+	const void *pBuffers[nStreams];
+	int nLengths[nStreams];
+	CRC32_t crcSerial[nStreams];
+	CRC32_t crcMulti[nStreams];
+	for ( int i = 0; i < nStreams; i++ )
+	{
+		pBuffers[i] = pData + i * nChunk;
+		nLengths[i] = nChunk;
+		CRC32_Init( &crcSerial[i] );
+		CRC32_Init( &crcMulti[i] );
+	}
+
+	double flStart = Plat_FloatTime();
+	for ( int r = 0; r < nRounds; r++ )
+	{
+		for ( int i = 0; i < nStreams; i++ )
+		{
+			CRC32_ProcessBuffer( &crcSerial[i], pBuffers[i], nLengths[i] );
+		}
+	}
+	double flSerial = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int r = 0; r < nRounds; r++ )
+	{
+		CRC32_ProcessBuffers( nStreams, crcMulti, pBuffers, nLengths );
+	}
+	double flMulti = Plat_FloatTime() - flStart;
+
+	double flMB = (double)nRounds * nChunk * nStreams / ( 1024.0 * 1024.0 );
+	printf( "\n%d streams x %d byte chunks: one at a time %.0f MB/s, together %.0f MB/s%s\n",
+		nStreams, nChunk, flMB / flSerial, flMB / flMulti,
+		V_memcmp( crcSerial, crcMulti, sizeof( crcSerial ) ) ? " MISMATCH" : "" );
+
+	// split one buffer in four and put it back together with CRC32_Combine
+	CRC32_t crcWhole = CRC32_ProcessSingleBuffer( pData, nChunk * nStreams );
+	CRC32_t crcJoined = 0;
+	for ( int i = 0; i < nStreams; i++ )
+	{
+		CRC32_t crcPart = CRC32_ProcessSingleBuffer( pBuffers[i], nLengths[i] );
+		crcJoined = i ? CRC32_Combine( crcJoined, crcPart, nLengths[i] ) : crcPart;
+	}
+	printf( "CRC32_Combine of %d parts %s\n", nStreams, crcJoined == crcWhole ? "matches" : "MISMATCH" );
+}
+
+//-----------------------------------------------------------------------------
+// Hash the files a chunk at a time, all of them in each CRC32_ProcessBuffers call
+//-----------------------------------------------------------------------------
+static void HashFiles( int nFiles, char **ppFilenames )
+{
+	nFiles = MIN( nFiles, MAX_STREAMS );
+
+	FILE *fps[MAX_STREAMS];
+	CRC32_t crcs[MAX_STREAMS];
+	int64 nSizes[MAX_STREAMS];
+	const void *pBuffers[MAX_STREAMS];
+	int nLengths[MAX_STREAMS];
+	CUtlVector< unsigned char > chunks[MAX_STREAMS];
+
+	for ( int i = 0; i < nFiles; i++ )
+	{
+		fps[i] = fopen( ppFilenames[i], "rb" );
+		if ( !fps[i] )
+		{
+			printf( "%s: couldn't open file\n", ppFilenames[i] );
+		}
+		CRC32_Init( &crcs[i] );
+		nSizes[i] = 0;
+		chunks[i].SetCount( FILE_CHUNK_SIZE );
+		pBuffers[i] = chunks[i].Base();
+	}
+
+	double flStart = Plat_FloatTime();
+	int64 nTotal = 0;
+	for ( ;; )
+	{
+		int nRead = 0;
+		for ( int i = 0; i < nFiles; i++ )
+		{
+			nLengths[i] = fps[i] ? fread( chunks[i].Base(), 1, FILE_CHUNK_SIZE, fps[i] ) : 0;
+			nSizes[i] += nLengths[i];
+			nRead += nLengths[i];
+		}
+		if ( !nRead )
+			break;
+
+		CRC32_ProcessBuffers( nFiles, crcs, pBuffers, nLengths );
+		nTotal += nRead;
+	}
+	double flSeconds = Plat_FloatTime() - flStart;
+
+	printf( "\n" );
+	for ( int i = 0; i < nFiles; i++ )
+	{
+		if ( !fps[i] )
+			continue;
+
+		fclose( fps[i] );
+		CRC32_Final( &crcs[i] );
+		printf( "%08x  %12lld  %s\n", crcs[i], (long long)nSizes[i], ppFilenames[i] );
+	}
+	printf( "%lld bytes in %.3f s (%.0f MB/s including reads)\n", (long long)nTotal, flSeconds,
+		flSeconds > 0.0 ? nTotal / ( 1024.0 * 1024.0 ) / flSeconds : 0.0 );
+}
+
+int main( int argc, char **argv )
+{
+	int nMegabytes = 256;
+
+	int i;
+	for ( i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-mb" ) && i + 1 < argc )
+		{
+			nMegabytes = atoi( argv[++i] );
+			nMegabytes = MAX( nMegabytes, 1 );
+		}
+		else if ( argv[i][0] == '-' )
+		{
+			Usage();
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	int nTotal = nMegabytes * 1024 * 1024;
+	int nDataSize = 16 * 1024 * 1024 + 16;
+	unsigned char *pData = new unsigned char[nDataSize];
+	unsigned int nSeed = 0x12345678;
+	for ( int j = 0; j < nDataSize; j++ )
+	{
+		nSeed = nSeed * 1103515245 + 12345;
+		pData[j] = (unsigned char)( nSeed >> 16 );
+	}
+
+	BenchmarkBufferSizes( pData, nDataSize, nTotal );
+	BenchmarkMultiBuffer( pData, nDataSize, nTotal );
+	delete [] pData;
+
+	if ( i < argc )
+	{
+		HashFiles( argc - i, &argv[i] );
+	}
+
+	return 0;
+}
@@ -0,0 +1,223 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times KeyValues loading three ways - the classic parser, the arena
+//			parser and compiled (mapped) loads - and how many allocations each one
+//			makes. The classic count is estimated from the tree it built, e.g.
+//
+//			kvbench -iterations 20 scripts/items/items_game.txt scripts/game_sounds.txt
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include "tier0/platform.h"
+#include "tier1/KeyValues.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/strtools.h"
+
+void Usage( void )
+{
+	printf( "Usage: kvbench [-iterations n] [-escapes] file.txt [file2.txt ...]\n" );
+	printf( "  Writes file.txt.kvc next to each file for the compiled loads.\n" );
+	exit( -1 );
+}
+
+static char *ReadTextFile( const char *pFilename, int &nSize )
+{
+	FILE *fp = fopen( pFilename, "rb" );
+	if ( !fp )
+		return NULL;
+
+	fseek( fp, 0, SEEK_END );
+	nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+
+	// double terminated in case it's a unicode file
+	char *pText = new char[nSize + 2];
+	nSize = fread( pText, 1, nSize, fp );
+	pText[nSize] = 0;
+	pText[nSize+1] = 0;
+	fclose( fp );
+	return pText;
+}
+
+//-----------------------------------------------------------------------------
+// Keys in a tree, and an estimate of the heap allocations the classic parser made
+// for them: one per key, plus one per string or 64 bit value. Anything else it
+// allocates along the way, such as symbol table growth, isn't counted.
+//-----------------------------------------------------------------------------
+static void CountKeys( KeyValues *pKey, int &nKeys, int &nAllocations )
+{
+	for ( ; pKey; pKey = pKey->GetNextKey() )
+	{
+		nKeys++;
+		nAllocations++;
+
+		KeyValues::types_t type = pKey->GetDataType();
+		if ( type == KeyValues::TYPE_STRING || type == KeyValues::TYPE_UINT64 )
+		{
+			nAllocations++;
+		}
+
+		CountKeys( pKey->GetFirstSubKey(), nKeys, nAllocations );
+	}
+}
+
+static void BenchmarkFile( const char *pFilename, int nIterations, bool bEscapes )
+{
+	int nSize;
+	char *pText = ReadTextFile( pFilename, nSize );
+	if ( !pText )
+	{
+		printf( "%s: couldn't read file\n", pFilename );
+		return;
+	}
+
+	struct stat st;
+	stat( pFilename, &st );
+	int64 nSourceTime = st.st_mtime;
+
+	char compiledName[MAX_PATH];
+	V_snprintf( compiledName, sizeof( compiledName ), "%s.kvc", pFilename );
+
+	printf( "%s (%d bytes)\n", pFilename, nSize );
+
+	// classic
+	int nKeys = 0;
+	int nAllocations = 0;
+	double flParseTime = 0.0;
+	double flFreeTime = 0.0;
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		KeyValues *pKV = new KeyValues( "" );
+		pKV->UsesEscapeSequences( bEscapes );
+
+		double flStart = Plat_FloatTime();
+		pKV->LoadFromBuffer( pFilename, pText );
+		double flParsed = Plat_FloatTime();
+
+		if ( i == 0 )
+		{
+			CountKeys( pKV, nKeys, nAllocations );
+		}
+
+		pKV->deleteThis();
+		flParseTime += flParsed - flStart;
+		flFreeTime += Plat_FloatTime() - flParsed;
+	}
+	printf( "  classic:   %8.3f ms parse  %8.3f ms free ~%8d allocations  (estimated, %d keys)\n",
+		flParseTime * 1000.0 / nIterations, flFreeTime * 1000.0 / nIterations, nAllocations, nKeys );
+
+	// arena
+	int nArenaKeys = 0;
+	int nUnused = 0;
+	flParseTime = 0.0;
+	flFreeTime = 0.0;
+	CKeyValuesArena arena;
+	arena.UsesEscapeSequences( bEscapes );
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		double flStart = Plat_FloatTime();
+		KeyValues *pKV = arena.LoadFromBuffer( pFilename, pText );
+		double flParsed = Plat_FloatTime();
+
+		if ( i == 0 )
+		{
+			CountKeys( pKV, nArenaKeys, nUnused );
+			nAllocations = arena.GetAllocationCount();
+
+			// leave the last tree behind for the compiled form
+			CUtlBuffer buf;
+			if ( pKV && CKeyValuesArena::WriteCompiled( pKV, buf, nSize, nSourceTime ) )
+			{
+				FILE *fp = fopen( compiledName, "wb" );
+				if ( fp )
+				{
+					fwrite( buf.Base(), 1, buf.TellPut(), fp );
+					fclose( fp );
+				}
+			}
+		}
+
+		arena.Purge();
+		flParseTime += flParsed - flStart;
+		flFreeTime += Plat_FloatTime() - flParsed;
+	}
+	printf( "  arena:     %8.3f ms parse  %8.3f ms free  %8d allocations\n",
+		flParseTime * 1000.0 / nIterations, flFreeTime * 1000.0 / nIterations, nAllocations );
+
+	// compiled
+	int nCompiledKeys = 0;
+	flParseTime = 0.0;
+	flFreeTime = 0.0;
+	for ( int i = 0; i < nIterations; i++ )
+	{
+		double flStart = Plat_FloatTime();
+		KeyValues *pKV = arena.LoadCompiled( compiledName, nSize, nSourceTime );
+		double flParsed = Plat_FloatTime();
+
+		if ( !pKV )
+		{
+			printf( "  compiled:  couldn't load %s\n", compiledName );
+			break;
+		}
+
+		if ( i == 0 )
+		{
+			CountKeys( pKV, nCompiledKeys, nUnused );
+			nAllocations = arena.GetAllocationCount();
+		}
+
+		arena.Purge();
+		flParseTime += flParsed - flStart;
+		flFreeTime += Plat_FloatTime() - flParsed;
+	}
+	if ( nCompiledKeys )
+	{
+		printf( "  compiled:  %8.3f ms load   %8.3f ms free  %8d allocations\n",
+			flParseTime * 1000.0 / nIterations, flFreeTime * 1000.0 / nIterations, nAllocations );
+	}
+
+	if ( nArenaKeys != nKeys || ( nCompiledKeys && nCompiledKeys != nKeys ) )
+	{
+		printf( "  WARNING: key counts differ (classic %d, arena %d, compiled %d)\n", nKeys, nArenaKeys, nCompiledKeys );
+	}
+
+	delete [] pText;
+}
+
+int main( int argc, char **argv )
+{
+	int nIterations = 10;
+	bool bEscapes = false;
+
+	int i;
+	for ( i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-iterations" ) && i + 1 < argc )
+		{
+			nIterations = atoi( argv[++i] );
+			nIterations = MAX( nIterations, 1 );
+		}
+		else if ( !V_stricmp( argv[i], "-escapes" ) )
+		{
+			bEscapes = true;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if ( i >= argc )
+	{
+		Usage();
+	}
+
+	for ( ; i < argc; i++ )
+	{
+		BenchmarkFile( argv[i], nIterations, bEscapes );
+	}
+
+	return 0;
+}
@@ -113,7 +113,8 @@ LzmaEncode( const Byte *inBuffer,
             size_t     inSize,
             Byte       *outBuffer,
             size_t     outSize,
-            size_t     *outSizeProcessed )
+            size_t     *outSizeProcessed,
+            int        nLevel )
 {
 	// Based on Encode helper in SDK/LzmaUtil
 	*outSizeProcessed = 0;
@@ -135,6 +136,10 @@ LzmaEncode( const Byte *inBuffer,
 	}
 
 	LzmaEncProps_Init( &props );
+	props.level = ( nLevel < 0 ) ? -1 : ( nLevel > 9 ? 9 : nLevel );
+	// Don't use a dictionary bigger than the input, the encoder needs ~10x the
+	// dictionary size in memory and several of these can be running at once.
+	props.reduceSize = inSize;
 	res = LzmaEnc_SetProps( enc, &props );
 
 	if ( res != SZ_OK )
@@ -189,11 +194,12 @@ LzmaEncode( const Byte *inBuffer,
 
 //-----------------------------------------------------------------------------
 // Encoding glue. Returns non-null Compressed buffer if successful.
-// Caller must free.
+// Caller must free. nLevel is 0 (fastest) to 9 (smallest), -1 for the default of 5.
 //-----------------------------------------------------------------------------
 unsigned char *LZMA_Compress( unsigned char *pInput,
                               unsigned int  inputSize,
-                              unsigned int  *pOutputSize )
+                              unsigned int  *pOutputSize,
+                              int           nLevel )
 {
 	*pOutputSize = 0;
 
@@ -207,7 +213,7 @@ unsigned char *LZMA_Compress( unsigned char *pInput,
 
 	// compress, skipping past our header
 	size_t compressedSize;
-	int result = LzmaEncode( pInput, inputSize, pOutputBuffer + sizeof( lzma_header_t ), outSize - sizeof( lzma_header_t ), &compressedSize );
+	int result = LzmaEncode( pInput, inputSize, pOutputBuffer + sizeof( lzma_header_t ), outSize - sizeof( lzma_header_t ), &compressedSize, nLevel );
 	if ( result != SZ_OK )
 	{
 		Warning( "LZMA encode failed (%i)\n", result );
@@ -234,6 +240,16 @@ unsigned char *LZMA_Compress( unsigned char *pInput,
 	return pOutputBuffer;
 }
 
+//-----------------------------------------------------------------------------
+// Above, at the default level
+//-----------------------------------------------------------------------------
+unsigned char *LZMA_Compress( unsigned char *pInput,
+                              unsigned int  inputSize,
+                              unsigned int  *pOutputSize )
+{
+	return LZMA_Compress( pInput, inputSize, pOutputSize, -1 );
+}
+
 //-----------------------------------------------------------------------------
 // Above, but returns null if compression would not yield a size improvement
 //-----------------------------------------------------------------------------
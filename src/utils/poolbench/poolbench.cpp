@@ -0,0 +1,227 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times fixed-size allocation from several threads at once, through a
+//			CUtlMemoryPool behind one lock (how CMemoryPoolMT used to work) and
+//			through the thread-caching CMemoryPoolMT, e.g.
+//
+//			poolbench -size 64 -ops 2000000 -threads 8
+//
+//			Half of each thread's blocks are freed by the next thread over, so
+//			cross-thread frees get exercised too.
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/mempool.h"
+#include "tier1/strtools.h"
+
+#define MAX_BENCH_THREADS	64
+#define BENCH_BATCH			256
+
+void Usage( void )
+{
+	printf( "Usage: poolbench [-size n] [-ops n] [-threads n]\n" );
+	printf( "  -size n    : block size in bytes (default 64)\n" );
+	printf( "  -ops n     : Alloc+Free pairs per thread (default 2000000)\n" );
+	printf( "  -threads n : most threads to try (default: number of cpus)\n" );
+	exit( -1 );
+}
+
+//-----------------------------------------------------------------------------
+// The single lock version, for comparison
+//-----------------------------------------------------------------------------
+class CLockedMemoryPool : public CUtlMemoryPool
+{
+public:
+	CLockedMemoryPool( int blockSize, int numElements ) : CUtlMemoryPool( blockSize, numElements, UTLMEMORYPOOL_GROW_SLOW ) {}
+
+	void *Alloc()				{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Alloc(); }
+	void Free( void *pMem )		{ AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
+
+private:
+	CThreadFastMutex m_mutex;
+};
+
+struct BenchThread_t
+{
+	int m_nOps;
+	int m_nSize;
+	int m_nThread;
+	int m_nErrors;
+	void *m_pPool;
+
+	// Blocks this thread hands to the next one to free
+	void *m_pHandoff[BENCH_BATCH / 2];
+	CInterlockedInt m_bHandoffFull;
+	BenchThread_t *m_pNext;
+};
+
+//-----------------------------------------------------------------------------
+// Each thread allocates a batch, scribbles on it, checks it and frees it. Every
+// other block of a batch is passed to the next thread, which frees it when it
+// gets around to it.
+//-----------------------------------------------------------------------------
+template < class POOL >
+static uintp BenchThreadFunc( void *pParam )
+{
+	BenchThread_t *pThread = (BenchThread_t *)pParam;
+	POOL *pPool = (POOL *)pThread->m_pPool;
+	unsigned char nTag = (unsigned char)( pThread->m_nThread + 1 );
+
+	void *pBlocks[BENCH_BATCH];
+	for ( int nDone = 0; nDone < pThread->m_nOps; nDone += BENCH_BATCH )
+	{
+		for ( int i = 0; i < BENCH_BATCH; i++ )
+		{
+			pBlocks[i] = pPool->Alloc();
+			memset( pBlocks[i], nTag, pThread->m_nSize );
+		}
+
+		for ( int i = 0; i < BENCH_BATCH; i++ )
+		{
+			if ( ( (unsigned char *)pBlocks[i] )[pThread->m_nSize - 1] != nTag )
+			{
+				pThread->m_nErrors++;
+			}
+		}
+
+		// Free anything the previous thread left us
+		if ( pThread->m_bHandoffFull )
+		{
+			for ( int i = 0; i < BENCH_BATCH / 2; i++ )
+			{
+				pPool->Free( pThread->m_pHandoff[i] );
+			}
+			pThread->m_bHandoffFull = 0;
+		}
+
+		BenchThread_t *pNext = pThread->m_pNext;
+		bool bHandoff = ( pNext != pThread && !pNext->m_bHandoffFull );
+		for ( int i = 0; i < BENCH_BATCH; i++ )
+		{
+			if ( bHandoff && ( i & 1 ) )
+			{
+				pNext->m_pHandoff[i / 2] = pBlocks[i];
+			}
+			else
+			{
+				pPool->Free( pBlocks[i] );
+			}
+		}
+		if ( bHandoff )
+		{
+			pNext->m_bHandoffFull = 1;
+		}
+	}
+	return 0;
+}
+
+template < class POOL >
+static double RunBenchmark( POOL *pPool, int nThreads, int nOps, int nSize, int &nErrors )
+{
+	static BenchThread_t threads[MAX_BENCH_THREADS];
+	ThreadHandle_t handles[MAX_BENCH_THREADS];
+
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads[i].m_nOps = nOps;
+		threads[i].m_nSize = nSize;
+		threads[i].m_nThread = i;
+		threads[i].m_nErrors = 0;
+		threads[i].m_pPool = pPool;
+		threads[i].m_bHandoffFull = 0;
+		threads[i].m_pNext = &threads[( i + 1 ) % nThreads];
+	}
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		handles[i] = CreateSimpleThread( BenchThreadFunc< POOL >, &threads[i] );
+	}
+
+	nErrors = 0;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( handles[i] );
+		ReleaseThreadHandle( handles[i] );
+		nErrors += threads[i].m_nErrors;
+	}
+	double flSeconds = Plat_FloatTime() - flStart;
+
+	// Blocks still waiting to be handed off
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		if ( threads[i].m_bHandoffFull )
+		{
+			for ( int j = 0; j < BENCH_BATCH / 2; j++ )
+			{
+				pPool->Free( threads[i].m_pHandoff[j] );
+			}
+		}
+	}
+
+	if ( pPool->Count() != 0 )
+	{
+		nErrors++;
+	}
+	return flSeconds;
+}
+
+int main( int argc, char **argv )
+{
+	int nSize = 64;
+	int nOps = 2000000;
+	int nMaxThreads = GetCPUInformation()->m_nLogicalProcessors;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-size" ) && i + 1 < argc )
+		{
+			nSize = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-ops" ) && i + 1 < argc )
+		{
+			nOps = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-threads" ) && i + 1 < argc )
+		{
+			nMaxThreads = atoi( argv[++i] );
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	nSize = MAX( nSize, (int)sizeof( void * ) );
+	nMaxThreads = clamp( nMaxThreads, 1, MAX_BENCH_THREADS );
+	nOps = MAX( nOps, BENCH_BATCH );
+
+	printf( "%d byte blocks, %d Alloc+Free per thread\n", nSize, nOps );
+	printf( "%8s  %20s  %20s  %8s  %10s\n", "threads", "locked (M ops/s)", "cached (M ops/s)", "hit rate", "unmatched" );
+	for ( int nThreads = 1; ; nThreads = MIN( nThreads * 2, nMaxThreads ) )
+	{
+		int nLockedErrors, nCachedErrors;
+
+		CLockedMemoryPool *pLocked = new CLockedMemoryPool( nSize, 1024 );
+		double flLocked = RunBenchmark( pLocked, nThreads, nOps, nSize, nLockedErrors );
+		delete pLocked;
+
+		CMemoryPoolMT *pCached = new CMemoryPoolMT( nSize, 1024, UTLMEMORYPOOL_GROW_SLOW );
+		double flCached = RunBenchmark( pCached, nThreads, nOps, nSize, nCachedErrors );
+		MemoryPoolMTStats_t stats;
+		pCached->GetStats( &stats );
+		delete pCached;
+
+		double flOps = (double)nThreads * nOps / 1000000.0;
+		printf( "%8d  %20.2f  %14.2f %4.1fx  %7.1f%%  %10lld%s\n", nThreads, flOps / flLocked, flOps / flCached, flLocked / flCached,
+			100.0f * stats.HitRate(), (long long)stats.m_nUnmatchedFrees, ( nLockedErrors || nCachedErrors ) ? " ERRORS" : "" );
+
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+
+	return 0;
+}
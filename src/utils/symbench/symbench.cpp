@@ -0,0 +1,189 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times string interning from several threads at once, through a
+//			CUtlSymbolTable behind a read/write lock (the same as CUtlSymbolTableMT,
+//			wrapped for 32 bit ids) and through the sharded CUtlSymbolTableMT32, e.g.
+//
+//			symbench -strings 50000 -lookups 2000000 -threads 8
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlvector.h"
+#include "tier1/strtools.h"
+
+#define MAX_BENCH_THREADS	64
+
+void Usage( void )
+{
+	printf( "Usage: symbench [-strings n] [-lookups n] [-threads n]\n" );
+	printf( "  -strings n : distinct names to intern (default 50000, at most 65000)\n" );
+	printf( "  -lookups n : AddString calls per thread (default 1000000)\n" );
+	printf( "  -threads n : most threads to try (default: number of cpus)\n" );
+	exit( -1 );
+}
+
+//-----------------------------------------------------------------------------
+// The single lock version, for comparison
+//-----------------------------------------------------------------------------
+class CLockedSymbolTable : private CUtlSymbolTable
+{
+public:
+	UtlSymId32_t AddString( const char *pString )
+	{
+		m_lock.LockForWrite();
+		CUtlSymbol result = CUtlSymbolTable::AddString( pString );
+		m_lock.UnlockWrite();
+		return result.IsValid() ? (UtlSymId_t)result : UTL_INVAL_SYMBOL32;
+	}
+
+	const char *String( UtlSymId32_t id ) const
+	{
+		m_lock.LockForRead();
+		const char *pszResult = CUtlSymbolTable::String( CUtlSymbol( (UtlSymId_t)id ) );
+		m_lock.UnlockRead();
+		return pszResult;
+	}
+
+private:
+#if defined(WIN32) || defined(_WIN32)
+	mutable CThreadSpinRWLock m_lock;
+#else
+	mutable CThreadRWLock m_lock;
+#endif
+};
+
+struct BenchThread_t
+{
+	const CUtlVector< char * > *m_pNames;
+	int m_nLookups;
+	int m_nThread;
+	int m_nErrors;
+	void *m_pTable;
+};
+
+//-----------------------------------------------------------------------------
+// Each thread walks the names in its own order, interning each one and reading it
+// back, so early on most calls add and later on nearly all of them find
+//-----------------------------------------------------------------------------
+template < class TABLE >
+static uintp BenchThreadFunc( void *pParam )
+{
+	BenchThread_t *pThread = (BenchThread_t *)pParam;
+	TABLE *pTable = (TABLE *)pThread->m_pTable;
+	const CUtlVector< char * > &names = *pThread->m_pNames;
+	int nNames = names.Count();
+
+	unsigned int nIndex = pThread->m_nThread * 7919;
+	unsigned int nStep = 2 * pThread->m_nThread + 1;
+	for ( int i = 0; i < pThread->m_nLookups; i++ )
+	{
+		nIndex = ( nIndex + nStep ) % nNames;
+		const char *pName = names[nIndex];
+		UtlSymId32_t id = pTable->AddString( pName );
+		if ( V_strcmp( pTable->String( id ), pName ) )
+		{
+			pThread->m_nErrors++;
+		}
+	}
+	return 0;
+}
+
+template < class TABLE >
+static double RunBenchmark( const CUtlVector< char * > &names, int nThreads, int nLookups, int &nErrors )
+{
+	TABLE *pTable = new TABLE;
+
+	BenchThread_t threads[MAX_BENCH_THREADS];
+	ThreadHandle_t handles[MAX_BENCH_THREADS];
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads[i].m_pNames = &names;
+		threads[i].m_nLookups = nLookups;
+		threads[i].m_nThread = i;
+		threads[i].m_nErrors = 0;
+		threads[i].m_pTable = pTable;
+		handles[i] = CreateSimpleThread( BenchThreadFunc< TABLE >, &threads[i] );
+	}
+
+	nErrors = 0;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( handles[i] );
+		ReleaseThreadHandle( handles[i] );
+		nErrors += threads[i].m_nErrors;
+	}
+	double flSeconds = Plat_FloatTime() - flStart;
+
+	delete pTable;
+	return flSeconds;
+}
+
+int main( int argc, char **argv )
+{
+	int nStrings = 50000;
+	int nLookups = 1000000;
+	int nMaxThreads = GetCPUInformation()->m_nLogicalProcessors;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-strings" ) && i + 1 < argc )
+		{
+			nStrings = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-lookups" ) && i + 1 < argc )
+		{
+			nLookups = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-threads" ) && i + 1 < argc )
+		{
+			nMaxThreads = atoi( argv[++i] );
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	// The locked table has 16 bit symbols
+	nStrings = clamp( nStrings, 1, 65000 );
+	nMaxThreads = clamp( nMaxThreads, 1, MAX_BENCH_THREADS );
+	nLookups = MAX( nLookups, 1 );
+
+	static const char *s_pDirs[] = { "models/props_c17", "sound/ambient/machines", "materials/concrete", "scripts/talker" };
+	static const char *s_pExts[] = { ".mdl", ".wav", ".vmt", ".txt" };
+	CUtlVector< char * > names;
+	for ( int i = 0; i < nStrings; i++ )
+	{
+		char name[MAX_PATH];
+		V_snprintf( name, sizeof( name ), "%s/object_%05d_lod%d%s", s_pDirs[i & 3], i, ( i >> 2 ) % 3, s_pExts[i & 3] );
+		names.AddToTail( V_strdup( name ) );
+	}
+
+	printf( "%d names, %d AddString+String per thread\n", nStrings, nLookups );
+	printf( "%8s  %20s  %20s\n", "threads", "locked (M ops/s)", "sharded (M ops/s)" );
+	for ( int nThreads = 1; ; nThreads = MIN( nThreads * 2, nMaxThreads ) )
+	{
+		int nLockedErrors, nShardedErrors;
+		double flLocked = RunBenchmark< CLockedSymbolTable >( names, nThreads, nLookups, nLockedErrors );
+		double flSharded = RunBenchmark< CUtlSymbolTableMT32 >( names, nThreads, nLookups, nShardedErrors );
+
+		double flOps = (double)nThreads * nLookups / 1000000.0;
+		printf( "%8d  %20.2f  %14.2f %4.1fx%s\n", nThreads, flOps / flLocked, flOps / flSharded, flLocked / flSharded,
+			( nLockedErrors || nShardedErrors ) ? " ERRORS" : "" );
+
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+
+	for ( int i = 0; i < names.Count(); i++ )
+	{
+		delete [] names[i];
+	}
+	return 0;
+}
@@ -7,12 +7,16 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "mathlib/ssemath.h"
 
 
 int		c_nodes;
 int		c_nonvis;
 int		c_active_brushes;
 
+// Threads to build the tree with. vbsp runs single threaded everywhere else.
+int		g_nBrushBSPThreads = 1;
+
 // if a brush just barely pokes onto the other side,
 // let it slide by without chopping
 #define	PLANESIDE_EPSILON	0.001
@@ -310,21 +314,70 @@ AllocNode
 */
 node_t *AllocNode (void)
 {
-	static int s_NodeCount = 0;
+	static CInterlockedInt s_NodeCount;
 
 	node_t	*node;
 
 	node = (node_t*)malloc(sizeof(*node));
 	memset (node, 0, sizeof(*node));
-	node->id = s_NodeCount;
+	node->id = s_NodeCount++;
 	node->diskId = -1;
 
-	s_NodeCount++;
-
 	return node;
 }
 
 
+//-----------------------------------------------------------------------------
+// Brushes are carved out of large blocks and recycled through free lists kept
+// per side count. Each tool thread has its own blocks and lists, so the threaded
+// BrushBSP never locks to allocate; anything else shares one set under ThreadLock.
+// A brush freed on another thread just goes onto that thread's lists.
+//-----------------------------------------------------------------------------
+#define	BRUSH_BLOCK_SIZE		(256*1024)
+#define	MAX_POOLED_BRUSH_SIDES	64
+
+struct brushheader_t
+{
+	int				maxsides;
+	brushheader_t	*next;		// when on a free list
+};
+
+struct brushpool_t
+{
+	brushheader_t	*freelist[MAX_POOLED_BRUSH_SIDES+1];
+	byte			*blockpos;
+	int				blockleft;
+};
+
+static brushpool_t s_BrushPools[MAX_TOOL_THREADS+1];
+
+static int BrushSize( int numsides )
+{
+	return (int)(size_t)&(((bspbrush_t *)0)->sides[numsides]);
+}
+
+static brushheader_t *AllocFromBrushPool( brushpool_t *pool, int numsides )
+{
+	brushheader_t *header = pool->freelist[numsides];
+	if (header)
+	{
+		pool->freelist[numsides] = header->next;
+		return header;
+	}
+
+	int c = ALIGN_VALUE( sizeof(brushheader_t) + BrushSize( numsides ), 16 );
+	if (pool->blockleft < c)
+	{
+		pool->blockpos = (byte*)malloc( BRUSH_BLOCK_SIZE );
+		pool->blockleft = BRUSH_BLOCK_SIZE;
+	}
+
+	header = (brushheader_t*)pool->blockpos;
+	pool->blockpos += c;
+	pool->blockleft -= c;
+	return header;
+}
+
 /*
 ================
 AllocBrush
@@ -332,13 +385,34 @@ AllocBrush
 */
 bspbrush_t *AllocBrush (int numsides)
 {
-	static int s_BrushId = 0;
+	static CInterlockedInt s_BrushId;
 
+	brushheader_t	*header;
 	bspbrush_t	*bb;
 	int			c;
 
-	c = (int)&(((bspbrush_t *)0)->sides[numsides]);
-	bb = (bspbrush_t*)malloc(c);
+	c = BrushSize (numsides);
+	if (numsides <= MAX_POOLED_BRUSH_SIDES)
+	{
+		int iThread = GetCurrentToolThreadIndex();
+		if (iThread >= 0)
+		{
+			header = AllocFromBrushPool (&s_BrushPools[iThread], numsides);
+		}
+		else
+		{
+			ThreadLock();
+			header = AllocFromBrushPool (&s_BrushPools[THREADINDEX_MAIN], numsides);
+			ThreadUnlock();
+		}
+	}
+	else
+	{
+		header = (brushheader_t*)malloc(sizeof(brushheader_t) + c);
+	}
+	header->maxsides = numsides;
+
+	bb = (bspbrush_t*)(header + 1);
 	memset (bb, 0, c);
 	bb->id = s_BrushId++;
 	if (numthreads == 1)
@@ -358,7 +432,26 @@ void FreeBrush (bspbrush_t *brushes)
 	for (i=0 ; i<brushes->numsides ; i++)
 		if (brushes->sides[i].winding)
 			FreeWinding(brushes->sides[i].winding);
-	free (brushes);
+
+	brushheader_t *header = (brushheader_t*)brushes - 1;
+	if (header->maxsides > MAX_POOLED_BRUSH_SIDES)
+	{
+		free (header);
+	}
+	else
+	{
+		int iThread = GetCurrentToolThreadIndex();
+		if (iThread < 0)
+			ThreadLock();
+
+		brushpool_t *pool = &s_BrushPools[iThread >= 0 ? iThread : THREADINDEX_MAIN];
+		header->next = pool->freelist[header->maxsides];
+		pool->freelist[header->maxsides] = header;
+
+		if (iThread < 0)
+			ThreadUnlock();
+	}
+
 	if (numthreads == 1)
 		c_active_brushes--;
 }
@@ -394,7 +487,7 @@ bspbrush_t *CopyBrush (bspbrush_t *brush)
 	int			size;
 	int			i;
 	
-	size = (int)&(((bspbrush_t *)0)->sides[brush->numsides]);
+	size = BrushSize (brush->numsides);
 
 	newbrush = AllocBrush (brush->numsides);
 	memcpy (newbrush, brush, size);
@@ -839,6 +932,351 @@ qboolean CheckPlaneAgainstVolume (int pnum, node_t *node)
 	return good;
 }
 
+//-----------------------------------------------------------------------------
+// Split scoring.
+//
+// Every candidate plane gets tested against every brush in the node, which is
+// where vbsp spends most of its time on big maps. The brush bounds are copied
+// into SoA arrays so the box tests run four brushes at a time, and the brushes
+// that have a side on each plane (and so are always "facing" it) are found up
+// front with one sort instead of scanning every brush's sides per candidate.
+// Only brushes whose box straddles the plane go through the full
+// TestBrushToPlanenum to count split faces.
+//-----------------------------------------------------------------------------
+
+// Below this many brush tests in a node, scoring its candidates on threads isn't worth it.
+#define	MIN_THREADED_SPLIT_TESTS	(1<<18)
+
+struct brushfacing_t
+{
+	int		pnum;		// positive facing plane
+	int		brush;		// index into splitscratch_t::brushes
+	int		side;		// PSIDE_FACING | front or back
+};
+
+struct splitcandidate_t
+{
+	side_t	*side;
+	int		pnum;
+	bool	valid;		// false if it would produce a tiny volume
+	int		value;
+};
+
+struct splitscratch_t
+{
+	CUtlVector<bspbrush_t*>			brushes;
+	CUtlVector<float>				bounds[6];		// mins xyz then maxs xyz, padded to a multiple of 4
+	CUtlVector<brushfacing_t>		facing;			// sorted by pnum, then brush
+	CUtlVector<splitcandidate_t>	candidates;
+};
+
+static splitscratch_t s_SplitScratch[MAX_TOOL_THREADS+1];
+
+// Set while the main thread is building the top of the tree, when the other threads are free.
+static bool s_bThreadedBSPTop = false;
+
+// Used by ScoreSplitCandidate_Thread.
+static splitscratch_t *s_pScoringScratch;
+static node_t *s_pScoringNode;
+
+static const int s_BitCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// Comparing a float against these gives the same answer as promoting it to double
+// and comparing against d, which is what the PLANESIDE_EPSILON tests do.
+static float FloatAtOrBelow( double d )
+{
+	float f = (float)d;
+	if ( (double)f > d )
+		f = nextafterf( f, -FLT_MAX );
+	return f;
+}
+
+static float FloatAtOrAbove( double d )
+{
+	float f = (float)d;
+	if ( (double)f < d )
+		f = nextafterf( f, FLT_MAX );
+	return f;
+}
+
+static int CompareBrushFacing( const void *a, const void *b )
+{
+	const brushfacing_t *pA = (const brushfacing_t*)a;
+	const brushfacing_t *pB = (const brushfacing_t*)b;
+	if ( pA->pnum != pB->pnum )
+		return pA->pnum - pB->pnum;
+	return pA->brush - pB->brush;
+}
+
+static splitscratch_t *GetSplitScratch()
+{
+	int iThread = GetCurrentToolThreadIndex();
+	return &s_SplitScratch[iThread >= 0 ? iThread : THREADINDEX_MAIN];
+}
+
+static void SetupSplitScratch( splitscratch_t *pScratch, bspbrush_t *brushes )
+{
+	pScratch->brushes.RemoveAll();
+	pScratch->facing.RemoveAll();
+	for ( bspbrush_t *brush = brushes; brush; brush = brush->next )
+	{
+		int iBrush = pScratch->brushes.AddToTail( brush );
+
+		// TestBrushToPlanenum goes by the first side on the plane
+		for ( int i=0; i < brush->numsides; i++ )
+		{
+			int num = brush->sides[i].planenum;
+			if ( num >= 0x10000 )
+				Error ("bad planenum");
+
+			int j;
+			for ( j=0; j < i; j++ )
+			{
+				if ( (brush->sides[j].planenum & ~1) == (num & ~1) )
+					break;
+			}
+			if ( j < i )
+				continue;
+
+			brushfacing_t &facing = pScratch->facing[pScratch->facing.AddToTail()];
+			facing.pnum = num & ~1;
+			facing.brush = iBrush;
+			facing.side = PSIDE_FACING | ( (num & 1) ? PSIDE_FRONT : PSIDE_BACK );
+		}
+	}
+
+	if ( pScratch->facing.Count() )
+	{
+		qsort( pScratch->facing.Base(), pScratch->facing.Count(), sizeof( brushfacing_t ), CompareBrushFacing );
+	}
+
+	int nBrushes = pScratch->brushes.Count();
+	int nPadded = ALIGN_VALUE( nBrushes, 4 );
+	for ( int i=0; i < 6; i++ )
+	{
+		pScratch->bounds[i].SetCount( nPadded );
+		for ( int j=nBrushes; j < nPadded; j++ )
+			pScratch->bounds[i][j] = 0;
+	}
+
+	for ( int i=0; i < nBrushes; i++ )
+	{
+		bspbrush_t *brush = pScratch->brushes[i];
+		for ( int j=0; j < 3; j++ )
+		{
+			pScratch->bounds[j][i] = brush->mins[j];
+			pScratch->bounds[3+j][i] = brush->maxs[j];
+		}
+	}
+}
+
+// Returns the index of the first brushfacing_t for pnum (or where it would be).
+static int FindBrushFacing( const splitscratch_t *pScratch, int pnum )
+{
+	int lo = 0, hi = pScratch->facing.Count();
+	while ( lo < hi )
+	{
+		int mid = (lo + hi) / 2;
+		if ( pScratch->facing[mid].pnum < pnum )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// BrushBspBoxOnPlaneSide for the brushes in [iFirst, iFirst+4) as front and back bitmasks.
+class CBoxPlaneTest
+{
+public:
+	CBoxPlaneTest( const splitscratch_t *pScratch, const plane_t *plane )
+	{
+		m_pScratch = pScratch;
+		m_Type = plane->type;
+		if ( m_Type < 3 )
+		{
+			m_Front = ReplicateX4( FloatAtOrBelow( (double)plane->dist + PLANESIDE_EPSILON ) );
+			m_Back = ReplicateX4( FloatAtOrAbove( (double)plane->dist - PLANESIDE_EPSILON ) );
+			return;
+		}
+
+		for ( int i=0; i < 3; i++ )
+		{
+			m_Normal[i] = ReplicateX4( plane->normal[i] );
+			m_pLeading[i] = pScratch->bounds[plane->normal[i] < 0 ? i : 3+i].Base();
+			m_pTrailing[i] = pScratch->bounds[plane->normal[i] < 0 ? 3+i : i].Base();
+		}
+		m_Dist = ReplicateX4( plane->dist );
+		m_Front = m_Back = ReplicateX4( FloatAtOrAbove( PLANESIDE_EPSILON ) );
+	}
+
+	void Test( int iFirst, int *pFrontMask, int *pBackMask ) const
+	{
+		if ( m_Type < 3 )
+		{
+			fltx4 maxs = LoadUnalignedSIMD( &m_pScratch->bounds[3+m_Type][iFirst] );
+			fltx4 mins = LoadUnalignedSIMD( &m_pScratch->bounds[m_Type][iFirst] );
+			*pFrontMask = TestSignSIMD( CmpGtSIMD( maxs, m_Front ) );
+			*pBackMask = TestSignSIMD( CmpLtSIMD( mins, m_Back ) );
+			return;
+		}
+
+		// Same operation order as DotProduct, so the distances match the scalar code exactly.
+		fltx4 dist1 = MulSIMD( m_Normal[0], LoadUnalignedSIMD( m_pLeading[0] + iFirst ) );
+		dist1 = AddSIMD( dist1, MulSIMD( m_Normal[1], LoadUnalignedSIMD( m_pLeading[1] + iFirst ) ) );
+		dist1 = AddSIMD( dist1, MulSIMD( m_Normal[2], LoadUnalignedSIMD( m_pLeading[2] + iFirst ) ) );
+		dist1 = SubSIMD( dist1, m_Dist );
+
+		fltx4 dist2 = MulSIMD( m_Normal[0], LoadUnalignedSIMD( m_pTrailing[0] + iFirst ) );
+		dist2 = AddSIMD( dist2, MulSIMD( m_Normal[1], LoadUnalignedSIMD( m_pTrailing[1] + iFirst ) ) );
+		dist2 = AddSIMD( dist2, MulSIMD( m_Normal[2], LoadUnalignedSIMD( m_pTrailing[2] + iFirst ) ) );
+		dist2 = SubSIMD( dist2, m_Dist );
+
+		*pFrontMask = TestSignSIMD( CmpGeSIMD( dist1, m_Front ) );
+		*pBackMask = TestSignSIMD( CmpLtSIMD( dist2, m_Back ) );
+	}
+
+private:
+	const splitscratch_t *m_pScratch;
+	int			m_Type;
+	fltx4		m_Normal[3];
+	fltx4		m_Dist;
+	fltx4		m_Front, m_Back;
+	const float	*m_pLeading[3];
+	const float	*m_pTrailing[3];
+};
+
+// Gives the value SelectSplitSide has always given a plane.
+static void ScoreSplitCandidate( const splitscratch_t *pScratch, node_t *node, splitcandidate_t *pCandidate )
+{
+	int		pnum = pCandidate->pnum;
+	side_t	*side = pCandidate->side;
+
+	pCandidate->valid = CheckPlaneAgainstVolume (pnum, node);
+	if (!pCandidate->valid)
+		return;
+
+	int front = 0, back = 0, facing = 0, splits = 0, epsilonbrush = 0;
+	qboolean hintsplit = false;
+
+	const plane_t *plane = &g_MainMap->mapplanes[pnum];
+	CBoxPlaneTest boxTest( pScratch, plane );
+
+	int nBrushes = pScratch->brushes.Count();
+	int iFacing = FindBrushFacing( pScratch, pnum );
+	for ( int i=0; i < nBrushes; i += 4 )
+	{
+		int frontMask, backMask;
+		boxTest.Test( i, &frontMask, &backMask );
+
+		int validMask = ( nBrushes - i >= 4 ) ? 0xf : ( 1 << (nBrushes - i) ) - 1;
+		frontMask &= validMask;
+		backMask &= validMask;
+
+		// brushes with a side on the plane are facing it whatever their bounds say
+		int facingMask = 0;
+		while ( iFacing < pScratch->facing.Count() && pScratch->facing[iFacing].pnum == pnum && pScratch->facing[iFacing].brush < i + 4 )
+		{
+			const brushfacing_t &f = pScratch->facing[iFacing++];
+			facingMask |= 1 << (f.brush - i);
+			facing++;
+			if ( f.side & PSIDE_FRONT )
+				front++;
+			else
+				back++;
+		}
+
+		frontMask &= ~facingMask;
+		backMask &= ~facingMask;
+		front += s_BitCount[frontMask];
+		back += s_BitCount[backMask];
+
+		int bothMask = frontMask & backMask;
+		for ( int j=0; bothMask; j++, bothMask >>= 1 )
+		{
+			if ( !(bothMask & 1) )
+				continue;
+
+			int bsplits;
+			qboolean bhint;
+			VerifyEquals( TestBrushToPlanenum (pScratch->brushes[i+j], pnum, &bsplits, &bhint, &epsilonbrush), PSIDE_BOTH );
+			splits += bsplits;
+
+			// TestBrushToPlanenum clears this on every call, so only the last brush ever counted
+			if ( i + j == nBrushes - 1 )
+				hintsplit = bhint;
+		}
+	}
+
+	// give a value estimate for using this plane
+	int value =  5*facing - 5*splits - abs(front-back);
+//		value =  -5*splits;
+//		value =  5*facing - 5*splits;
+	if (plane->type < 3)
+		value+=5;		// axial is better
+	value -= epsilonbrush*1000;	// avoid!
+
+	// trans should split last
+	if ( side->surf & SURF_TRANS )
+	{
+		value -= 500;
+	}
+
+	// never split a hint side except with another hint
+	if (hintsplit && !(side->surf & SURF_HINT) )
+		value = -9999999;
+
+	// water should split first
+	if (side->contents & (CONTENTS_WATER | CONTENTS_SLIME))
+		value = 9999999;
+
+	pCandidate->value = value;
+}
+
+static void ScoreSplitCandidate_Thread( int iThread, int iCandidate )
+{
+	ScoreSplitCandidate( s_pScoringScratch, s_pScoringNode, &s_pScoringScratch->candidates[iCandidate] );
+}
+
+// Flags every side on the plane so it won't be picked up as a candidate again.
+static void MarkPlaneTested( splitscratch_t *pScratch, int pnum )
+{
+	for ( int i=FindBrushFacing( pScratch, pnum ); i < pScratch->facing.Count() && pScratch->facing[i].pnum == pnum; i++ )
+	{
+		bspbrush_t *brush = pScratch->brushes[pScratch->facing[i].brush];
+		for ( int j=0; j < brush->numsides; j++ )
+		{
+			if ( (brush->sides[j].planenum & ~1) == pnum )
+				brush->sides[j].tested = true;
+		}
+	}
+}
+
+// Save off the side test so we don't need to recalculate it when we actually seperate the brushes.
+static void SetBrushSides( splitscratch_t *pScratch, int pnum )
+{
+	CBoxPlaneTest boxTest( pScratch, &g_MainMap->mapplanes[pnum] );
+
+	int nBrushes = pScratch->brushes.Count();
+	for ( int i=0; i < nBrushes; i += 4 )
+	{
+		int frontMask, backMask;
+		boxTest.Test( i, &frontMask, &backMask );
+
+		for ( int j=0; j < 4 && i + j < nBrushes; j++ )
+		{
+			pScratch->brushes[i+j]->side = ( (frontMask >> j) & 1 ) ? PSIDE_FRONT : 0;
+			if ( (backMask >> j) & 1 )
+				pScratch->brushes[i+j]->side |= PSIDE_BACK;
+		}
+	}
+
+	for ( int i=FindBrushFacing( pScratch, pnum ); i < pScratch->facing.Count() && pScratch->facing[i].pnum == pnum; i++ )
+	{
+		pScratch->brushes[pScratch->facing[i].brush]->side = pScratch->facing[i].side;
+	}
+}
+
 /*
 ================
 SelectSplitSide
@@ -846,26 +1284,27 @@ SelectSplitSide
 Using a hueristic, choses one of the sides out of the brushlist
 to partition the brushes with.
 Returns NULL if there are no valid planes to split with..
+
+Each plane is scored once, by the first side that uses it, and on a
+tie the earliest one wins - the same choice the one-at-a-time search made.
 ================
 */
 
 side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 {
-	int			value, bestvalue;
-	bspbrush_t	*brush, *test;
+	int			bestvalue;
+	bspbrush_t	*brush;
 	side_t		*side, *bestside;
-	int			i, j, pass, numpasses;
+	int			bestpnum;
+	int			i, pass, numpasses;
 	int			pnum;
-	int			s;
-	int			front, back, both, facing, splits;
-	int			bsplits;
-	int			bestsplits;
-	int			epsilonbrush;
-	qboolean	hintsplit = false;
+
+	splitscratch_t *pScratch = GetSplitScratch();
+	SetupSplitScratch( pScratch, brushes );
 
 	bestside = NULL;
 	bestvalue = -99999;
-	bestsplits = 0;
+	bestpnum = -1;
 
 	// the search order goes: visible-structural, nonvisible-structural
 	// If any valid plane is available in a pass, no further
@@ -873,6 +1312,7 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 	numpasses = 2;
 	for (pass = 0 ; pass < numpasses ; pass++)
 	{
+		pScratch->candidates.RemoveAll();
 		for (brush = brushes ; brush ; brush=brush->next)
 		{
 			for (i=0 ; i<brush->numsides ; i++)
@@ -897,77 +1337,34 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 
 				CheckPlaneAgainstParents (pnum, node);
 
-				if (!CheckPlaneAgainstVolume (pnum, node))
-					continue;	// would produce a tiny volume
-
-				front = 0;
-				back = 0;
-				both = 0;
-				facing = 0;
-				splits = 0;
-				epsilonbrush = 0;
-
-				for (test = brushes ; test ; test=test->next)
-				{
-					s = TestBrushToPlanenum (test, pnum, &bsplits, &hintsplit, &epsilonbrush);
-
-					splits += bsplits;
-					if (bsplits && (s&PSIDE_FACING) )
-						Error ("PSIDE_FACING with splits");
-
-					test->testside = s;
-					// if the brush shares this face, don't bother
-					// testing that facenum as a splitter again
-					if (s & PSIDE_FACING)
-					{
-						facing++;
-						for (j=0 ; j<test->numsides ; j++)
-						{
-							if ( (test->sides[j].planenum&~1) == pnum)
-								test->sides[j].tested = true;
-						}
-					}
-					if (s & PSIDE_FRONT)
-						front++;
-					if (s & PSIDE_BACK)
-						back++;
-					if (s == PSIDE_BOTH)
-						both++;
-				}
-
-				// give a value estimate for using this plane
-				value =  5*facing - 5*splits - abs(front-back);
-//					value =  -5*splits;
-//					value =  5*facing - 5*splits;
-				if (g_MainMap->mapplanes[pnum].type < 3)
-					value+=5;		// axial is better
-				value -= epsilonbrush*1000;	// avoid!
-
-				// trans should split last
-				if ( side->surf & SURF_TRANS )
-				{
-					value -= 500;
-				}
-
-				// never split a hint side except with another hint
-				if (hintsplit && !(side->surf & SURF_HINT) )
-					value = -9999999;
-
-				// water should split first
-				if (side->contents & (CONTENTS_WATER | CONTENTS_SLIME))
-					value = 9999999;
-
-				// save off the side test so we don't need
-				// to recalculate it when we actually seperate
-				// the brushes
-				if (value > bestvalue)
-				{
-					bestvalue = value;
-					bestside = side;
-					bestsplits = splits;
-					for (test = brushes ; test ; test=test->next)
-						test->side = test->testside;
-				}
+				splitcandidate_t &candidate = pScratch->candidates[pScratch->candidates.AddToTail()];
+				candidate.side = side;
+				candidate.pnum = pnum;
+				MarkPlaneTested( pScratch, pnum );
+			}
+		}
+
+		int nCandidates = pScratch->candidates.Count();
+		if ( s_bThreadedBSPTop && nCandidates > 1 && nCandidates * pScratch->brushes.Count() >= MIN_THREADED_SPLIT_TESTS )
+		{
+			s_pScoringScratch = pScratch;
+			s_pScoringNode = node;
+			RunThreadsOnIndividual (nCandidates, false, ScoreSplitCandidate_Thread);
+		}
+		else
+		{
+			for (i=0 ; i<nCandidates ; i++)
+				ScoreSplitCandidate( pScratch, node, &pScratch->candidates[i] );
+		}
+
+		for (i=0 ; i<nCandidates ; i++)
+		{
+			const splitcandidate_t &candidate = pScratch->candidates[i];
+			if (candidate.valid && candidate.value > bestvalue)
+			{
+				bestvalue = candidate.value;
+				bestside = candidate.side;
+				bestpnum = candidate.pnum;
 			}
 		}
 
@@ -975,10 +1372,10 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 		// other passes
 		if (bestside)
 		{
+			SetBrushSides( pScratch, bestpnum );
 			if (pass > 0)
 			{
-				if (numthreads == 1)
-					c_nonvis++;
+				ThreadInterlockedIncrement( &c_nonvis );
 			}
 			break;
 		}
@@ -1324,6 +1721,41 @@ void SplitBrushList (bspbrush_t *brushes,
 }
 
 
+//-----------------------------------------------------------------------------
+// Threaded tree building. The main thread splits the top of the tree on its own
+// (scoring each node's candidates on all threads), and every subtree that gets
+// down to s_nMaxTaskBrushes brushes is set aside whole. The subtrees are then
+// built in parallel. A subtree only depends on its own brush list and volume,
+// so the tree comes out exactly the same as a single threaded build.
+//-----------------------------------------------------------------------------
+
+// Subtrees are sized so there are about this many per thread, to even out the load.
+#define	BSP_TASKS_PER_THREAD	8
+#define	MIN_BSP_TASK_BRUSHES	32
+
+struct bsptask_t
+{
+	node_t		*node;
+	bspbrush_t	*brushes;
+	int			numbrushes;
+};
+
+static CUtlVector<bsptask_t> s_BSPTasks;
+static int s_nMaxTaskBrushes;
+
+static int CompareBSPTasks( const void *a, const void *b )
+{
+	// biggest first
+	return ((const bsptask_t*)b)->numbrushes - ((const bsptask_t*)a)->numbrushes;
+}
+
+node_t *BuildTree_r (node_t *node, bspbrush_t *brushes);
+
+static void BuildTreeTask_Thread( int iThread, int iTask )
+{
+	BuildTree_r (s_BSPTasks[iTask].node, s_BSPTasks[iTask].brushes);
+}
+
 /*
 ================
 BuildTree_r
@@ -1338,8 +1770,20 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 	int			i;
 	bspbrush_t	*children[2];
 
-	if (numthreads == 1)
-		c_nodes++;
+	if (s_bThreadedBSPTop)
+	{
+		int numbrushes = CountBrushList (brushes);
+		if (numbrushes <= s_nMaxTaskBrushes)
+		{
+			bsptask_t &task = s_BSPTasks[s_BSPTasks.AddToTail()];
+			task.node = node;
+			task.brushes = brushes;
+			task.numbrushes = numbrushes;
+			return node;
+		}
+	}
+
+	ThreadInterlockedIncrement( &c_nodes );
 
 	// find the best plane to use as a splitter
 	bestside = SelectSplitSide (brushes, node);
@@ -1379,6 +1823,35 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 
 	return node;
 }
+
+
+static void BuildTree (node_t *headnode, bspbrush_t *brushes)
+{
+	// can't start threads from a tool thread
+	if (g_nBrushBSPThreads <= 1 || GetCurrentToolThreadIndex() >= 0)
+	{
+		BuildTree_r (headnode, brushes);
+		return;
+	}
+
+	int oldnumthreads = numthreads;
+	numthreads = g_nBrushBSPThreads;
+
+	s_nMaxTaskBrushes = MAX( MIN_BSP_TASK_BRUSHES, CountBrushList (brushes) / (numthreads * BSP_TASKS_PER_THREAD) );
+	s_bThreadedBSPTop = true;
+	BuildTree_r (headnode, brushes);
+	s_bThreadedBSPTop = false;
+
+	qprintf ("%5i subtrees\n", s_BSPTasks.Count());
+	if (s_BSPTasks.Count())
+	{
+		qsort (s_BSPTasks.Base(), s_BSPTasks.Count(), sizeof(bsptask_t), CompareBSPTasks);
+		RunThreadsOnIndividual (s_BSPTasks.Count(), false, BuildTreeTask_Thread);
+	}
+	s_BSPTasks.Purge();
+
+	numthreads = oldnumthreads;
+}
 	  
 
 //===========================================================
@@ -1447,7 +1920,7 @@ tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
 
 	tree->headnode = node;
 
-	node = BuildTree_r (node, brushlist);
+	BuildTree (node, brushlist);
 	qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
 	qprintf ("%5i nonvis nodes\n", c_nonvis);
 	qprintf ("%5i leafs\n", (c_nodes+1)/2);
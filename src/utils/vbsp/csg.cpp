@@ -7,6 +7,8 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "tier1/utllinkedlist.h"
+#include "tier1/utlmultilist.h"
 
 /*
 
@@ -653,123 +655,403 @@ qboolean BrushGE (bspbrush_t *b1, bspbrush_t *b2)
 
 /*
 =================
-ChopBrushes
+ChopBrushPair
 
-Carves any intersecting solid brushes into the minimum number
-of non-intersecting brushes. 
+Tries to carve b1 and b2 apart. Returns 0 if they're left as they are, or 1 or 2
+if b1 or b2 should be replaced by *ppPieces, which is NULL when it's swallowed
+whole.
 =================
 */
-bspbrush_t *ChopBrushes (bspbrush_t *head)
+static int ChopBrushPair (bspbrush_t *b1, bspbrush_t *b2, bspbrush_t **ppPieces)
 {
-	bspbrush_t	*b1, *b2, *next;
-	bspbrush_t	*tail;
-	bspbrush_t	*keep;
 	bspbrush_t	*sub, *sub2;
 	int			c1, c2;
 
-	qprintf ("---- ChopBrushes ----\n");
-	qprintf ("original brushes: %i\n", CountBrushList (head));
+	*ppPieces = NULL;
+	if (BrushesDisjoint (b1, b2))
+		return 0;
 
-#if DEBUG_BRUSHMODEL
-	if (entity_num == DEBUG_BRUSHMODEL)
-		WriteBrushList ("before.gl", head, false);
-#endif
-	keep = NULL;
+	sub = NULL;
+	sub2 = NULL;
+	c1 = 999999;
+	c2 = 999999;
 
-newlist:
-	// find tail
-	if (!head)
-		return NULL;
-	for (tail=head ; tail->next ; tail=tail->next)
-	;
+	if ( BrushGE (b2, b1) )
+	{
+//		printf( "b2 bites b1\n" );
+		sub = SubtractBrush (b1, b2);
+		if (sub == b1)
+			return 0;		// didn't really intersect
+		if (!sub)
+		{	// b1 is swallowed by b2
+			return 1;
+		}
+		c1 = CountBrushList (sub);
+	}
+
+	if ( BrushGE (b1, b2) )
+	{
+//		printf( "b1 bites b2\n" );
+		sub2 = SubtractBrush (b2, b1);
+		if (sub2 == b2)
+			return 0;		// didn't really intersect
+		if (!sub2)
+		{	// b2 is swallowed by b1
+			FreeBrushList (sub);
+			return 2;
+		}
+		c2 = CountBrushList (sub2);
+	}
+
+	if (!sub && !sub2)
+		return 0;		// neither one can bite
 
-	for (b1=head ; b1 ; b1=next)
+	// only accept if it didn't fragment
+	// (commening this out allows full fragmentation)
+	if (c1 > 1 && c2 > 1)
 	{
-		next = b1->next;
-		for (b2=b1->next ; b2 ; b2 = b2->next)
+		const int contents1 = b1->original->contents;
+		const int contents2 = b2->original->contents;
+		// if both detail, allow fragmentation
+		if ( !((contents1&contents2) & CONTENTS_DETAIL) && !((contents1|contents2) & CONTENTS_AREAPORTAL) )
 		{
-			if (BrushesDisjoint (b1, b2))
-				continue;
+			if (sub2)
+				FreeBrushList (sub2);
+			if (sub)
+				FreeBrushList (sub);
+			return 0;
+		}
+	}
 
-			sub = NULL;
-			sub2 = NULL;
-			c1 = 999999;
-			c2 = 999999;
+	if (c1 < c2)
+	{
+		if (sub2)
+			FreeBrushList (sub2);
+		*ppPieces = sub;
+		return 1;
+	}
+	else
+	{
+		if (sub)
+			FreeBrushList (sub);
+		*ppPieces = sub2;
+		return 2;
+	}
+}
 
-			if ( BrushGE (b2, b1) )
-			{
-//				printf( "b2 bites b1\n" );
-				sub = SubtractBrush (b1, b2);
-				if (sub == b1)
-					continue;		// didn't really intersect
-				if (!sub)
-				{	// b1 is swallowed by b2
-					head = CullList (b1, b1);
-					goto newlist;
-				}
-				c1 = CountBrushList (sub);
-			}
 
-			if ( BrushGE (b1, b2) )
+//-----------------------------------------------------------------------------
+// Brushes only get carved by brushes whose bounds overlap theirs, and the pieces
+// never leave the bounds of the brush they came from. So ChopBrushes splits the
+// list into groups that can never reach each other - found with a uniform grid
+// over the brush bounds - and only tests a brush against its own group. That's
+// still all-pairs, but over a handful of brushes instead of every brush in the
+// list.
+//
+// The groups can't be chopped on their own, on threads, without changing the
+// result: every chop used to rebuild the list back to front (CullList), so which
+// brush of a group got tested first, and so which one bit which, depended on the
+// chops in every other group. ChopBrushes keeps that one list, with a flag for
+// which way round it is, and gets the same brushes out in the same order as
+// before.
+//-----------------------------------------------------------------------------
+
+// Bounds are grown by this much before they're compared, so brushes that only
+// touch still end up together.
+#define	CHOP_GROUP_EPSILON		1.0f
+
+// Cells are at least this big, and there are at most this many per brush.
+#define	MIN_CHOP_CELL_SIZE		64.0f
+#define	MAX_CHOP_CELLS_PER_BRUSH	4
+
+struct chopcellentry_t
+{
+	int		cell;
+	int		brush;
+};
+
+// A brush in the list being chopped
+struct chopentry_t
+{
+	bspbrush_t	*brush;
+	int			group;
+	int			groupentry;		// in s_ChopGroupLists
+};
+
+static CUtlLinkedList<chopentry_t, int> s_ChopList;
+static CUtlMultiList<int, int> s_ChopGroupLists;	// s_ChopList entries, one list per group, in list order
+static bool s_bChopListReversed;
+
+static int CompareChopCellEntries( const void *a, const void *b )
+{
+	const chopcellentry_t *pA = (const chopcellentry_t*)a;
+	const chopcellentry_t *pB = (const chopcellentry_t*)b;
+	if ( pA->cell != pB->cell )
+		return pA->cell - pB->cell;
+	return pA->brush - pB->brush;
+}
+
+static int FindChopGroupRoot( CUtlVector<int> &parents, int i )
+{
+	while ( parents[i] != i )
+	{
+		parents[i] = parents[parents[i]];
+		i = parents[i];
+	}
+	return i;
+}
+
+static bool ChopBoundsOverlap( const bspbrush_t *a, const bspbrush_t *b )
+{
+	for ( int i=0; i < 3; i++ )
+	{
+		if ( a->mins[i] - CHOP_GROUP_EPSILON >= b->maxs[i] + CHOP_GROUP_EPSILON ||
+			 a->maxs[i] + CHOP_GROUP_EPSILON <= b->mins[i] - CHOP_GROUP_EPSILON )
+			 return false;
+	}
+	return true;
+}
+
+// Adds a brush to the end of the list as it stands, and to the end of its group.
+static void AddChopEntry( bspbrush_t *b, int group )
+{
+	int entry = s_bChopListReversed ? s_ChopList.AddToHead() : s_ChopList.AddToTail();
+	s_ChopList[entry].brush = b;
+	s_ChopList[entry].group = group;
+	s_ChopList[entry].groupentry = s_bChopListReversed ? s_ChopGroupLists.AddToHead( group, entry ) : s_ChopGroupLists.AddToTail( group, entry );
+}
+
+static void RemoveChopEntry( int entry )
+{
+	s_ChopGroupLists.Remove( s_ChopList[entry].group, s_ChopList[entry].groupentry );
+	s_ChopList.Remove( entry );
+}
+
+// Builds s_ChopList from the brushes, in order, with a group for each set of
+// brushes that can reach each other.
+static void FindChopGroups( bspbrush_t *head )
+{
+	CUtlVector<bspbrush_t*> brushes;
+	Vector mins, maxs;
+	ClearBounds( mins, maxs );
+	float flTotalSize = 0;
+	for ( bspbrush_t *b = head; b; b = b->next )
+	{
+		brushes.AddToTail( b );
+		AddPointToBounds( b->mins, mins, maxs );
+		AddPointToBounds( b->maxs, mins, maxs );
+		flTotalSize += MAX( b->maxs[0] - b->mins[0], MAX( b->maxs[1] - b->mins[1], b->maxs[2] - b->mins[2] ) );
+	}
+
+	int nBrushes = brushes.Count();
+	mins -= Vector( CHOP_GROUP_EPSILON, CHOP_GROUP_EPSILON, CHOP_GROUP_EPSILON );
+	maxs += Vector( CHOP_GROUP_EPSILON, CHOP_GROUP_EPSILON, CHOP_GROUP_EPSILON );
+
+	// Cells about the size of an average brush, with the grid kept to a few cells per brush.
+	Vector size = maxs - mins;
+	float flCellSize = MAX( MIN_CHOP_CELL_SIZE, flTotalSize / nBrushes );
+	int dims[3];
+	for ( ;; )
+	{
+		int64 nCells = 1;
+		for ( int i=0; i < 3; i++ )
+		{
+			dims[i] = MAX( 1, (int)ceil( size[i] / flCellSize ) );
+			nCells *= dims[i];
+		}
+		if ( nCells <= (int64)nBrushes * MAX_CHOP_CELLS_PER_BRUSH )
+			break;
+		flCellSize *= 1.5f;
+	}
+
+	CUtlVector<chopcellentry_t> entries;
+	for ( int i=0; i < nBrushes; i++ )
+	{
+		int lo[3], hi[3];
+		for ( int j=0; j < 3; j++ )
+		{
+			lo[j] = clamp( (int)( ( brushes[i]->mins[j] - CHOP_GROUP_EPSILON - mins[j] ) / flCellSize ), 0, dims[j] - 1 );
+			hi[j] = clamp( (int)( ( brushes[i]->maxs[j] + CHOP_GROUP_EPSILON - mins[j] ) / flCellSize ), 0, dims[j] - 1 );
+		}
+
+		for ( int z=lo[2]; z <= hi[2]; z++ )
+		{
+			for ( int y=lo[1]; y <= hi[1]; y++ )
 			{
-//				printf( "b1 bites b2\n" );
-				sub2 = SubtractBrush (b2, b1);
-				if (sub2 == b2)
-					continue;		// didn't really intersect
-				if (!sub2)
-				{	// b2 is swallowed by b1
-					FreeBrushList (sub);
-					head = CullList (b1, b2);
-					goto newlist;
+				for ( int x=lo[0]; x <= hi[0]; x++ )
+				{
+					chopcellentry_t &entry = entries[entries.AddToTail()];
+					entry.cell = ( z * dims[1] + y ) * dims[0] + x;
+					entry.brush = i;
 				}
-				c2 = CountBrushList (sub2);
 			}
+		}
+	}
+	qsort( entries.Base(), entries.Count(), sizeof( chopcellentry_t ), CompareChopCellEntries );
 
-			if (!sub && !sub2)
-				continue;		// neither one can bite
+	// Join every pair that overlaps and where one can bite the other. A pair can share
+	// several cells, so only test it the first time.
+	CUtlVector<int> parents;
+	parents.SetCount( nBrushes );
+	for ( int i=0; i < nBrushes; i++ )
+		parents[i] = i;
 
-			// only accept if it didn't fragment
-			// (commening this out allows full fragmentation)
-			if (c1 > 1 && c2 > 1)
+	int nPairTests = 0;
+	for ( int iFirst=0; iFirst < entries.Count(); )
+	{
+		int iEnd = iFirst + 1;
+		while ( iEnd < entries.Count() && entries[iEnd].cell == entries[iFirst].cell )
+			iEnd++;
+
+		for ( int i=iFirst; i < iEnd; i++ )
+		{
+			bspbrush_t *b1 = brushes[entries[i].brush];
+			for ( int j=i+1; j < iEnd; j++ )
 			{
-				const int contents1 = b1->original->contents;
-				const int contents2 = b2->original->contents;
-				// if both detail, allow fragmentation
-				if ( !((contents1&contents2) & CONTENTS_DETAIL) && !((contents1|contents2) & CONTENTS_AREAPORTAL) )
+				bspbrush_t *b2 = brushes[entries[j].brush];
+
+				// the pair's first shared cell holds the max of their mins
+				int cell = 0;
+				for ( int k=2; k >= 0; k-- )
 				{
-					if (sub2)
-						FreeBrushList (sub2);
-					if (sub)
-						FreeBrushList (sub);
-					continue;
+					float flMin = MAX( b1->mins[k], b2->mins[k] ) - CHOP_GROUP_EPSILON;
+					cell = cell * dims[k] + clamp( (int)( ( flMin - mins[k] ) / flCellSize ), 0, dims[k] - 1 );
 				}
-			}
+				if ( cell != entries[i].cell )
+					continue;
 
-			if (c1 < c2)
-			{
-				if (sub2)
-					FreeBrushList (sub2);
-				tail = AddBrushListToTail (sub, tail);
-				head = CullList (b1, b1);
-				goto newlist;
-			}
-			else
-			{
-				if (sub)
-					FreeBrushList (sub);
-				tail = AddBrushListToTail (sub2, tail);
-				head = CullList (b1, b2);
-				goto newlist;
+				++nPairTests;
+				if ( !ChopBoundsOverlap( b1, b2 ) )
+					continue;
+				if ( !BrushGE( b1, b2 ) && !BrushGE( b2, b1 ) )
+					continue;
+
+				int r1 = FindChopGroupRoot( parents, entries[i].brush );
+				int r2 = FindChopGroupRoot( parents, entries[j].brush );
+				if ( r1 != r2 )
+					parents[MAX( r1, r2 )] = MIN( r1, r2 );
 			}
 		}
+		iFirst = iEnd;
+	}
+
+	// Make a list for each group and add the brushes in order.
+	CUtlVector<int> groupOfRoot;
+	groupOfRoot.SetCount( nBrushes );
+	s_ChopList.EnsureCapacity( nBrushes );
+	s_ChopGroupLists.EnsureCapacity( nBrushes );
+	s_bChopListReversed = false;
+	int numgroups = 0;
+	for ( int i=0; i < nBrushes; i++ )
+	{
+		int root = FindChopGroupRoot( parents, i );
+		if ( root == i )
+		{
+			groupOfRoot[i] = s_ChopGroupLists.CreateList();
+			numgroups++;
+		}
+		brushes[i]->next = NULL;
+		AddChopEntry( brushes[i], groupOfRoot[root] );
+	}
+
+	int largest = 0;
+	for ( int i=0; i < nBrushes; i++ )
+	{
+		if ( parents[i] == i )
+			largest = MAX( largest, s_ChopGroupLists.Count( groupOfRoot[i] ) );
+	}
+
+	qprintf ("%i cells of %.0f units, %i pair tests\n", dims[0]*dims[1]*dims[2], flCellSize, nPairTests);
+	qprintf ("%i groups, largest %i brushes\n", numgroups, largest);
+}
+
+/*
+=================
+ChopBrushes
+
+Carves any intersecting solid brushes into the minimum number
+of non-intersecting brushes. 
+=================
+*/
+bspbrush_t *ChopBrushes (bspbrush_t *head)
+{
+	bspbrush_t	*b1, *b2;
+	bspbrush_t	*keep;
+	bspbrush_t	*pieces, *next;
+	int			e1, e2, g2, chop;
+
+	qprintf ("---- ChopBrushes ----\n");
+	qprintf ("original brushes: %i\n", CountBrushList (head));
+
+#if DEBUG_BRUSHMODEL
+	if (entity_num == DEBUG_BRUSHMODEL)
+		WriteBrushList ("before.gl", head, false);
+#endif
+	if (!head)
+		return NULL;
+
+	double start = Plat_FloatTime();
+	FindChopGroups( head );
+	double grouped = Plat_FloatTime();
+
+	keep = NULL;
+	while (s_ChopList.Count())
+	{
+		// test the first brush against the rest of its group
+		e1 = s_bChopListReversed ? s_ChopList.Tail() : s_ChopList.Head();
+		b1 = s_ChopList[e1].brush;
+		int group = s_ChopList[e1].group;
+
+		chop = 0;
+		e2 = s_ChopList.InvalidIndex();
+		b2 = NULL;
+		pieces = NULL;
+		for (g2 = s_ChopList[e1].groupentry ; ; )
+		{
+			g2 = s_bChopListReversed ? s_ChopGroupLists.Previous (g2) : s_ChopGroupLists.Next (g2);
+			if (g2 == s_ChopGroupLists.InvalidIndex())
+				break;
+
+			e2 = s_ChopGroupLists[g2];
+			b2 = s_ChopList[e2].brush;
+			chop = ChopBrushPair (b1, b2, &pieces);
+			if (chop)
+				break;
+		}
 
-		if (!b2)
+		if (!chop)
 		{	// b1 is no longer intersecting anything, so keep it
+			RemoveChopEntry (e1);
 			b1->next = keep;
 			keep = b1;
+			continue;
+		}
+
+		// the pieces go on the end, the brush they replace goes away, and the
+		// list gets turned around, just as CullList used to do it
+		for ( ; pieces ; pieces = next)
+		{
+			next = pieces->next;
+			pieces->next = NULL;
+			AddChopEntry (pieces, group);
+		}
+		if (chop == 1)
+		{
+			RemoveChopEntry (e1);
+			FreeBrush (b1);
 		}
+		else
+		{
+			RemoveChopEntry (e2);
+			FreeBrush (b2);
+		}
+		s_bChopListReversed = !s_bChopListReversed;
 	}
 
+	s_ChopList.Purge();
+	s_ChopGroupLists.Purge();
+
+	qprintf ("grouping: %.2fs, chopping: %.2fs\n", grouped - start, Plat_FloatTime() - grouped);
 	qprintf ("output brushes: %i\n", CountBrushList (keep));
 #if DEBUG_BRUSHMODEL
 	if ( entity_num == DEBUG_BRUSHMODEL )
@@ -780,5 +1062,3 @@ newlist:
 #endif
 	return keep;
 }
-
-
@@ -19,6 +19,7 @@
 #include "loadcmdline.h"
 #include "byteswap.h"
 #include "worldvertextransitionfixup.h"
+#include "pacifier.h"
 
 extern float		g_maxLightmapDimension;
 
@@ -257,8 +258,27 @@ void ProcessWorldModel (void)
 	{
 		qprintf ("--------------------------------------------\n");
 
-		RunThreadsOnIndividual ((block_xh-block_xl+1)*(block_yh-block_yl+1),
-			!verbose, ProcessBlock_Thread);
+		// The blocks are done on this thread so BrushBSP can run its own threads.
+		{
+			int nBlocks = (block_xh-block_xl+1)*(block_yh-block_yl+1);
+			int blockstart = Plat_FloatTime();
+			if (!verbose)
+			{
+				printf ("%-20s ", "ProcessBlock_Thread:");
+				StartPacifier ("");
+			}
+			for (int iBlock = 0; iBlock < nBlocks; iBlock++)
+			{
+				ProcessBlock_Thread (0, iBlock);
+				if (!verbose)
+					UpdatePacifier ((float)(iBlock+1) / nBlocks);
+			}
+			if (!verbose)
+			{
+				EndPacifier (false);
+				printf (" (%i)\n", (int)(Plat_FloatTime() - blockstart));
+			}
+		}
 
 		//
 		// build the division tree
@@ -1277,6 +1297,7 @@ int RunVBSP( int argc, char **argv )
 	}
 
 	ThreadSetDefault ();
+	g_nBrushBSPThreads = numthreads;	// BrushBSP builds subtrees in parallel
 	numthreads = 1;		// multiple threads aren't helping...
 
 	// Setup the logfile.
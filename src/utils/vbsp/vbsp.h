@@ -462,6 +462,9 @@ enum detailscreen_e
 
 // brushbsp
 
+// Threads BrushBSP builds the tree with; the rest of vbsp runs single threaded.
+extern int g_nBrushBSPThreads;
+
 void WriteBrushList (char *name, bspbrush_t *brush, qboolean onlyvis);
 
 bspbrush_t *CopyBrush (bspbrush_t *brush);
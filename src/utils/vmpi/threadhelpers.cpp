@@ -5,35 +5,73 @@
 // $NoKeywords: $
 //=============================================================================//
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #include "threadhelpers.h"
 #include "tier0/dbg.h"
+#include "tier0/threadtools.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
+// -------------------------------------------------------------------------------- //
+// Platform critical sections. Both are recursive.
+// -------------------------------------------------------------------------------- //
+
+#ifdef _WIN32
+
+static inline void InitCS( char *pCS )		{ InitializeCriticalSection( (CRITICAL_SECTION*)pCS ); }
+static inline void DeleteCS( char *pCS )	{ DeleteCriticalSection( (CRITICAL_SECTION*)pCS ); }
+static inline void EnterCS( char *pCS )		{ EnterCriticalSection( (CRITICAL_SECTION*)pCS ); }
+static inline void LeaveCS( char *pCS )		{ LeaveCriticalSection( (CRITICAL_SECTION*)pCS ); }
+
+#else
+
+static inline void InitCS( char *pCS )
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+	pthread_mutex_init( (pthread_mutex_t*)pCS, &attr );
+	pthread_mutexattr_destroy( &attr );
+}
+
+static inline void DeleteCS( char *pCS )	{ pthread_mutex_destroy( (pthread_mutex_t*)pCS ); }
+static inline void EnterCS( char *pCS )		{ pthread_mutex_lock( (pthread_mutex_t*)pCS ); }
+static inline void LeaveCS( char *pCS )		{ pthread_mutex_unlock( (pthread_mutex_t*)pCS ); }
+
+#endif
+
+
 // -------------------------------------------------------------------------------- //
 // CVMPICriticalSection implementation.
 // -------------------------------------------------------------------------------- //
 
 CVMPICriticalSection::CVMPICriticalSection()
 {
+#ifdef _WIN32
 	Assert( sizeof( CRITICAL_SECTION ) == SIZEOF_CS );
+#else
+	COMPILE_TIME_ASSERT( sizeof( pthread_mutex_t ) <= SIZEOF_CS );
+#endif
 
 #if defined( _DEBUG )
-	InitializeCriticalSection( (CRITICAL_SECTION*)&m_DeadlockProtect );
+	InitCS( m_DeadlockProtect );
 #endif
 
-	InitializeCriticalSection( (CRITICAL_SECTION*)&m_CS );
+	InitCS( m_CS );
 }
 
 
 CVMPICriticalSection::~CVMPICriticalSection()
 {
-	DeleteCriticalSection( (CRITICAL_SECTION*)&m_CS );
+	DeleteCS( m_CS );
 
 #if defined( _DEBUG )
-	DeleteCriticalSection( (CRITICAL_SECTION*)&m_DeadlockProtect );
+	DeleteCS( m_DeadlockProtect );
 #endif
 }
 
@@ -43,14 +81,14 @@ void CVMPICriticalSection::Lock()
 {
 #if defined( _DEBUG )
 	// Check if this one is already locked.
-	DWORD id = GetCurrentThreadId();
-	EnterCriticalSection( (CRITICAL_SECTION*)&m_DeadlockProtect );
+	unsigned long id = ThreadGetCurrentId();
+	EnterCS( m_DeadlockProtect );
 		Assert( m_Locks.Find( id ) == m_Locks.InvalidIndex() );
 		m_Locks.AddToTail( id );
-	LeaveCriticalSection( (CRITICAL_SECTION*)&m_DeadlockProtect );
+	LeaveCS( m_DeadlockProtect );
 #endif
 
-	EnterCriticalSection( (CRITICAL_SECTION*)&m_CS );
+	EnterCS( m_CS );
 }
 
 
@@ -58,15 +96,15 @@ void CVMPICriticalSection::Unlock()
 {
 #if defined( _DEBUG )
 	// Check if this one is already locked.
-	DWORD id = GetCurrentThreadId();
-	EnterCriticalSection( (CRITICAL_SECTION*)&m_DeadlockProtect );
+	unsigned long id = ThreadGetCurrentId();
+	EnterCS( m_DeadlockProtect );
 		int index = m_Locks.Find( id );
 		Assert( index != m_Locks.InvalidIndex() );
 		m_Locks.Remove( index );
-	LeaveCriticalSection( (CRITICAL_SECTION*)&m_DeadlockProtect );
+	LeaveCS( m_DeadlockProtect );
 #endif
 	
-	LeaveCriticalSection( (CRITICAL_SECTION*)&m_CS );
+	LeaveCS( m_CS );
 }
 
 
@@ -107,6 +145,7 @@ void CVMPICriticalSectionLock::Unlock()
 
 // -------------------------------------------------------------------------------- //
 // CEvent implementation.
+// On POSIX, the handle is a CThreadEvent.
 // -------------------------------------------------------------------------------- //
 
 CEvent::CEvent()
@@ -123,7 +162,14 @@ bool CEvent::Init( bool bManualReset, bool bInitialState )
 {
 	Term();
 
+#ifdef _WIN32
 	m_hEvent = (void*)CreateEvent( NULL, bManualReset, bInitialState, NULL );
+#else
+	CThreadEvent *pEvent = new CThreadEvent( bManualReset );
+	if ( bInitialState )
+		pEvent->Set();
+	m_hEvent = pEvent;
+#endif
 	return (m_hEvent != NULL);
 }
 
@@ -131,7 +177,11 @@ void CEvent::Term()
 {
 	if ( m_hEvent )
 	{
+#ifdef _WIN32
 		CloseHandle( (HANDLE)m_hEvent );
+#else
+		delete (CThreadEvent*)m_hEvent;
+#endif
 		m_hEvent = NULL;
 	}
 }
@@ -145,13 +195,21 @@ void* CEvent::GetEventHandle() const
 bool CEvent::SetEvent()
 {
 	Assert( m_hEvent );
+#ifdef _WIN32
 	return ::SetEvent( (HANDLE)m_hEvent ) != 0;
+#else
+	return ((CThreadEvent*)m_hEvent)->Set();
+#endif
 }
 
 bool CEvent::ResetEvent()
 {
 	Assert( m_hEvent );
+#ifdef _WIN32
 	return ::ResetEvent( (HANDLE)m_hEvent ) != 0;
+#else
+	return ((CThreadEvent*)m_hEvent)->Reset();
+#endif
 }
 
 
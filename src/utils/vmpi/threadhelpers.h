@@ -16,6 +16,8 @@
 
 #if PLATFORM_WINDOWS_PC64
 	#define SIZEOF_CS	40	// sizeof( CRITICAL_SECTION )
+#elif defined( POSIX )
+	#define SIZEOF_CS	64	// room for a pthread_mutex_t
 #else
 	#define SIZEOF_CS	24	// sizeof( CRITICAL_SECTION )
 #endif
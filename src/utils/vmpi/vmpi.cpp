@@ -1799,11 +1799,23 @@ bool InitMaster( int argc, char **argv, const char *pDependencyFilename, VMPIRun
 		{
 			Msg( "%s found. Spawning a local worker automatically.\n", VMPI_GetParamString( mpi_AutoLocalWorker ) );
 			SpawnLocalWorker( 1, argv, g_MasterBroadcaster.GetListenPort(), true );
-		}		
+		}
 
 		bRet = true;
 	}
 
+	const char *pLocalWorkers = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_LocalWorkers ), "" );
+	if ( pLocalWorkers )
+	{
+		int nLocalWorkers = clamp( atoi( pLocalWorkers ), 0, nMaxWorkers );
+		Msg( "%s found. Spawning %d local workers.\n", VMPI_GetParamString( mpi_LocalWorkers ), nLocalWorkers );
+		for ( int i=0; i < nLocalWorkers; i++ )
+		{
+			if ( !SpawnLocalWorker( 1, argv, g_MasterBroadcaster.GetListenPort(), false ) )
+				break;
+		}
+	}
+
 	VMPI_HandleTimingWait_Master();	
 	return bRet;
 }
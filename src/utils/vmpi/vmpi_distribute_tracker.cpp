@@ -4,9 +4,11 @@
 //
 //=============================================================================//
 
+#ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
 #include <io.h>
+#endif
 #include "vmpi.h"
 #include "vmpi_distribute_work.h"
 #include "tier0/platform.h"
@@ -63,6 +65,8 @@ static int CountActiveWorkUnits()
 // Graphical functions.
 // ------------------------------------------------------------------------ //
 
+#ifdef _WIN32
+
 static bool g_bUseGraphics = false;
 static HWND g_hWnd = 0;
 
@@ -359,6 +363,18 @@ static void Graphical_End()
 }
 
 
+#else
+
+// The tracker window is Win32-only; -mpi_Graphics is ignored elsewhere.
+static void Graphical_Start() {}
+static void Graphical_WorkUnitSentToWorker( int iWorkUnit ) {}
+static void Graphical_WorkUnitStarted( int iWorkUnit ) {}
+static void Graphical_WorkUnitCompleted( int iWorkUnit ) {}
+static void Graphical_End() {}
+
+#endif
+
+
 // ------------------------------------------------------------------------ //
 // Interface functions.
 // ------------------------------------------------------------------------ //
@@ -502,6 +518,7 @@ void VMPITracker_HandleDebugKeypresses()
 	if ( !g_bTrackWorkUnitEvents )
 		return;
 	
+#ifdef _WIN32
 	if ( !kbhit() )
 		return;
 
@@ -574,6 +591,7 @@ void VMPITracker_HandleDebugKeypresses()
 			Warning( "\n\nExited menu.\n\n" );
 		}
 	}
+#endif
 }
 
 
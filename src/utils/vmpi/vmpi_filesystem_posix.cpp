@@ -0,0 +1,166 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: VMPI filesystem for POSIX builds.
+//
+// The master and workers are expected to see the same content (same machine, or a shared
+// mount), so there's no file transfer - everyone just uses the normal filesystem. Virtual
+// files are the exception: the master sends them out as persistent packets and each worker
+// writes them into a private temp directory that's searched under VMPI_VIRTUAL_FILES_PATH_ID.
+//
+//=============================================================================//
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include "vmpi.h"
+#include "vmpi_filesystem.h"
+#include "filesystem.h"
+#include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+#define VMPI_FSPACKETID_VIRTUAL_FILE	1
+
+
+IFileSystem *g_pOriginalPassThruFileSystem = NULL;
+
+// Where virtual files are written. Created the first time one shows up, which on a worker
+// that joins late can be before VMPI_FileSystem_Init.
+static char g_VirtualFilesDir[MAX_PATH];
+
+
+void *GetFullFileSystem()
+{
+	return (IFileSystem*)g_pOriginalPassThruFileSystem;
+}
+
+EXPOSE_INTERFACE_FN( GetFullFileSystem, IFileSystem, FILESYSTEM_INTERFACE_VERSION )
+
+void *GetVMPIFileSystem()
+{
+	return (IBaseFileSystem*)g_pOriginalPassThruFileSystem;
+}
+
+EXPOSE_INTERFACE_FN( GetVMPIFileSystem, IBaseFileSystem, BASEFILESYSTEM_INTERFACE_VERSION )
+
+
+static void WriteVirtualFile( const char *pFilename, const void *pData, unsigned long fileLength )
+{
+	if ( !g_VirtualFilesDir[0] )
+	{
+		V_strncpy( g_VirtualFilesDir, "/tmp/vmpi_XXXXXX", sizeof( g_VirtualFilesDir ) );
+		if ( !mkdtemp( g_VirtualFilesDir ) )
+			Error( "VMPI_FileSystem: couldn't create a directory for virtual files." );
+
+		if ( g_pOriginalPassThruFileSystem )
+			g_pOriginalPassThruFileSystem->AddSearchPath( g_VirtualFilesDir, VMPI_VIRTUAL_FILES_PATH_ID );
+	}
+
+	char fullFilename[MAX_PATH];
+	V_ComposeFileName( g_VirtualFilesDir, V_UnqualifiedFileName( pFilename ), fullFilename, sizeof( fullFilename ) );
+
+	FILE *fp = fopen( fullFilename, "wb" );
+	if ( !fp || fwrite( pData, 1, fileLength, fp ) != fileLength )
+		Error( "VMPI_FileSystem: couldn't write virtual file %s.", fullFilename );
+	fclose( fp );
+}
+
+
+static void RemoveVirtualFiles()
+{
+	if ( !g_VirtualFilesDir[0] )
+		return;
+
+	if ( g_pOriginalPassThruFileSystem )
+		g_pOriginalPassThruFileSystem->RemoveSearchPath( g_VirtualFilesDir, VMPI_VIRTUAL_FILES_PATH_ID );
+
+	DIR *pDir = opendir( g_VirtualFilesDir );
+	if ( pDir )
+	{
+		while ( dirent *pEntry = readdir( pDir ) )
+		{
+			if ( pEntry->d_name[0] == '.' )
+				continue;
+
+			char fullFilename[MAX_PATH];
+			V_ComposeFileName( g_VirtualFilesDir, pEntry->d_name, fullFilename, sizeof( fullFilename ) );
+			unlink( fullFilename );
+		}
+		closedir( pDir );
+	}
+
+	rmdir( g_VirtualFilesDir );
+	g_VirtualFilesDir[0] = 0;
+}
+
+
+IFileSystem* VMPI_FileSystem_Init( int maxMemoryUsage, IFileSystem *pPassThru )
+{
+	Assert( g_bUseMPI );
+	Assert( pPassThru );
+	g_pOriginalPassThruFileSystem = pPassThru;
+
+	if ( g_VirtualFilesDir[0] )
+		g_pOriginalPassThruFileSystem->AddSearchPath( g_VirtualFilesDir, VMPI_VIRTUAL_FILES_PATH_ID );
+
+	return pPassThru;
+}
+
+
+IFileSystem* VMPI_FileSystem_Term()
+{
+	RemoveVirtualFiles();
+
+	IFileSystem *pRet = g_pOriginalPassThruFileSystem;
+	g_pOriginalPassThruFileSystem = NULL;
+	return pRet;
+}
+
+
+void VMPI_FileSystem_DisableFileAccess()
+{
+	// Workers read straight from disk, so there's nothing to lock down.
+}
+
+
+CreateInterfaceFn VMPI_FileSystem_GetFactory()
+{
+	return Sys_GetFactoryThis();
+}
+
+
+void VMPI_FileSystem_CreateVirtualFile( const char *pFilename, const void *pData, unsigned long fileLength )
+{
+	Assert( g_bMPIMaster );
+
+	// The master opens it through the same search path as the workers.
+	WriteVirtualFile( pFilename, pData, fileLength );
+
+	char cPacketID[2] = { VMPI_PACKETID_FILESYSTEM, VMPI_FSPACKETID_VIRTUAL_FILE };
+	VMPI_Send3Chunks( cPacketID, sizeof( cPacketID ), pFilename, V_strlen( pFilename ) + 1, pData, fileLength, VMPI_PERSISTENT );
+}
+
+
+bool FileSystemRecv( MessageBuffer *pBuf, int iSource, int iPacketID )
+{
+	if ( pBuf->getLen() < 2 || pBuf->data[1] != VMPI_FSPACKETID_VIRTUAL_FILE )
+		return false;
+
+	pBuf->setOffset( 2 );
+
+	char filename[MAX_PATH];
+	if ( pBuf->ReadString( filename, sizeof( filename ) ) == -1 )
+		Error( "VMPI_FileSystem: invalid virtual file packet." );
+
+	WriteVirtualFile( filename, &pBuf->data[pBuf->getOffset()], pBuf->getLen() - pBuf->getOffset() );
+	return true;
+}
+
+
+CDispatchReg g_DispatchReg_FileSystem( VMPI_PACKETID_FILESYSTEM, FileSystemRecv );
+
+VMPI_REGISTER_PACKET_ID( VMPI_PACKETID_FILESYSTEM );
@@ -14,6 +14,7 @@ VMPI_PARAM( mpi_ShowDistributeWorkStats,	0,						"After finishing a stage in the
 VMPI_PARAM( mpi_TimingWait,					0,						"Causes the master to wait for a keypress to start so workers can connect before it starts. Used for performance measurements." )
 VMPI_PARAM( mpi_WorkerCount,				0,						"Set the maximum number of workers allowed in the job." )
 VMPI_PARAM( mpi_AutoLocalWorker,			0,						"Used on the master's machine. Automatically spawn a worker on the local machine. Used for testing." )
+VMPI_PARAM( mpi_LocalWorkers,				0,						"Used on the master's machine. Spawn this many workers on the local machine, with their output hidden. Example: -mpi_LocalWorkers 4" )
 VMPI_PARAM( mpi_FileTransmitRate,			0,						"VMPI file transmission rate in kB/sec." )
 VMPI_PARAM( mpi_Verbose,					0,						"Set to 0, 1, or 2 to control verbosity of debug output." )
 VMPI_PARAM( mpi_NoMasterWorkerThreads,		0,						"Don't process work units locally (in the master). Only used by the SDK work unit distributor." )
@@ -0,0 +1,1917 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: VMPI for POSIX builds.
+//
+// This implements the same master/worker protocol as vmpi.cpp on top of plain TCP sockets.
+// Each packet goes over the wire as a 4-byte length followed by the packet data, same as
+// ThreadedTCPSocket. There's no vmpi_service, registry or broadcast here: workers are either
+// started by hand with -mpi_worker <master address>[:port] or forked on the master's machine
+// with -mpi_Local, -mpi_AutoLocalWorker or -mpi_LocalWorkers <count>.
+//
+// Workers always run in SDK mode (they get their command line from the master), and no
+// files are transferred; see vmpi_filesystem_posix.cpp.
+//
+//=============================================================================//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "iphelpers.h"
+#include "utlvector.h"
+#include "utllinkedlist.h"
+#include "vmpi.h"
+#include "tier1/strtools.h"
+#include "vmpi_distribute_work.h"
+#include "tslist.h"
+#include "tier0/threadtools.h"
+#include "tier0/icommandline.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+#define DEFAULT_MAX_WORKERS	32	// Unless they specify -mpi_WorkerCount, it will stop accepting workers after it gets this many.
+int g_nMaxWorkerCount = DEFAULT_MAX_WORKERS;
+
+#define VMPI_INTERNAL_PACKET_ID	27
+	#define VMPI_INTERNAL_SUBPACKET_MACHINE_NAME				1
+	#define VMPI_INTERNAL_SUBPACKET_COMMAND_LINE				2
+	#define VMPI_INTERNAL_SUBPACKET_WAITING_FOR_COMMAND_LINE	3
+	#define VMPI_INTERNAL_SUBPACKET_GROUPED_PACKET				4
+	#define VMPI_INTERNAL_SUBPACKET_TIMING_WAIT_DONE			5
+	#define VMPI_INTERNAL_SUBPACKET_VERIFY_EXE_NAME				6
+	#define VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER				7
+
+VMPI_REGISTER_PACKET_ID( VMPI_INTERNAL_PACKET_ID );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_MACHINE_NAME );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_COMMAND_LINE );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_WAITING_FOR_COMMAND_LINE );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_GROUPED_PACKET );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_TIMING_WAIT_DONE );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_VERIFY_EXE_NAME );
+VMPI_REGISTER_SUBPACKET_ID( VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER );
+
+// Anything claiming to be bigger than this means the stream is garbage.
+#define VMPI_MAX_PACKET_LEN		( 1024 * 1024 * 1024 )
+
+// How much we try to recv() at a time.
+#define VMPI_RECV_CHUNK_SIZE	( 64 * 1024 )
+
+
+typedef CUtlVector<char> PersistentPacket;
+CUtlLinkedList<PersistentPacket*> g_PersistentPackets;	// Protected by g_ConnectionsMutex.
+
+// Command-line parameters list.
+#define VMPI_PARAM( paramName, paramFlags, helpText ) {paramName, paramFlags, "-"#paramName, helpText},
+class CVMPIParam
+{
+public:
+	EVMPICmdLineParam m_eParam;
+	int m_ParamFlags;
+	const char *m_pName;
+	const char *m_pHelpText;
+};
+static CVMPIParam g_VMPIParams[] =
+{
+	{k_eVMPICmdLineParam_FirstParam, 0, "k_eVMPICmdLineParam_FirstParam", "unused"},
+	{k_eVMPICmdLineParam_VMPIParam, 0, "mpi", "Enable VMPI."},
+#include "vmpi_parameters.h"
+};
+#undef VMPI_PARAM
+
+
+// ---------------------------------------------------------------------------------------- //
+// Globals.
+// ---------------------------------------------------------------------------------------- //
+
+class CVMPIConnection;
+
+//
+// WARNING: This should only ever be on for hardcore debugging!
+//
+bool g_bSuperSpewEnabled = false;
+
+
+// Used by -mpi_AutoRestart.
+CUtlVector<char*> g_OriginalCommandLineParameters;
+
+// Incoming packets, as queued by the IO thread.
+struct VMPIPacket_t
+{
+	int m_iSource;
+	int m_nLen;
+	char m_Data[1];
+};
+
+// The IO thread queues packets and disconnects here, and g_VMPIMessagesEvent is set whenever
+// either list gets something added to it.
+CThreadMutex g_VMPIMessagesMutex;
+CUtlLinkedList< VMPIPacket_t*, int > g_VMPIMessages;
+CUtlLinkedList< CVMPIConnection*, int > g_ErrorConnections;
+CThreadEvent g_VMPIMessagesEvent;
+
+bool g_bTimingWaitDone = false;
+bool g_bGroupPackets = false;
+
+// Slot 0 is the master. On the master, it's a placeholder with no socket. Slots are never reused,
+// and connections aren't deleted until VMPI_Finalize, so other threads can index this freely
+// below g_nConnections.
+#define MAX_VMPI_CONNECTIONS 4096
+CVMPIConnection *g_Connections[MAX_VMPI_CONNECTIONS];
+CInterlockedInt g_nConnections;
+CThreadMutex g_ConnectionsMutex;	// Held while adding connections and sending persistent packets.
+
+int g_ListenSocket = -1;
+int g_WakePipe[2] = { -1, -1 };		// Written to make the IO thread leave poll().
+ThreadHandle_t g_hIOThread = NULL;
+volatile bool g_bIOThreadExit = false;
+
+// Workers started by SpawnLocalWorker.
+CUtlVector<pid_t> g_LocalWorkerPIDs;
+
+// If true, then it will set certain thread priorities low.
+bool g_bSetThreadPriorities = true;
+
+VMPIDispatchFn g_VMPIDispatch[MAX_VMPI_PACKET_IDS];
+CTSList<MessageBuffer*> g_DispatchBuffers;
+
+VMPIRunMode g_VMPIRunMode = VMPI_RUN_NETWORKED;
+VMPIFileSystemMode g_VMPIFileSystemMode = VMPI_FILESYSTEM_TCP;
+
+static char g_GroupedPacketHeader[] = { VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_GROUPED_PACKET };
+static unsigned long g_LastFlushGroupedPacketsTime = 0;
+
+int g_nBytesSent = 0;
+int g_nMessagesSent = 0;
+int g_nBytesReceived = 0;
+int g_nMessagesReceived = 0;
+
+int g_nMulticastBytesSent = 0;
+int g_nMulticastBytesReceived = 0;
+
+
+CUtlLinkedList<VMPI_Disconnect_Handler,int> g_DisconnectHandlers;
+
+bool g_bUseMPI = false;
+int g_iVMPIVerboseLevel = 0;
+bool g_bMPIMaster = false;
+
+bool g_bMPI_Stats = false;
+bool g_bMPI_StatsTextOutput = false;
+
+char g_CurrentStageString[128] = "";
+CThreadMutex g_CurrentStageMutex;
+
+char g_MasterExeName[MAX_PATH];
+bool g_bReceivedMasterExeName = false;
+
+// Full path to our executable, for spawning local workers and -mpi_AutoRestart.
+char g_ExeFilename[MAX_PATH];
+
+
+static CVMPIPacketIDReg *g_pVMPIPacketIDRegHead = NULL;
+
+
+// ---------------------------------------------------------------------------------------- //
+// Classes.
+// ---------------------------------------------------------------------------------------- //
+
+class CVMPIConnection
+{
+public:
+	CVMPIConnection( int iConnection, int socket, const CIPAddr &remoteAddr )
+	{
+		m_iConnection = iConnection;
+		m_Socket = socket;
+		m_RemoteAddr = remoteAddr;
+
+		char str[512];
+		V_snprintf( str, sizeof( str ), "%d", iConnection );
+		SetMachineName( str );
+		m_bNameSet = false;
+		m_JobWorkerID = 0xFFFFFFFF;
+
+		m_nRecvBytes = 0;
+		m_bInErrorState = false;
+		m_ErrorString[0] = 0;
+	}
+
+	~CVMPIConnection()
+	{
+		if ( m_Socket != -1 )
+			close( m_Socket );
+	}
+
+	// Called by the main thread after the IO thread reports an error on the socket.
+	void HandleDisconnect()
+	{
+		if ( m_Socket == -1 )
+			return;
+
+		// Tell the app.
+		FOR_EACH_LL( g_DisconnectHandlers, i )
+			g_DisconnectHandlers[i]( m_iConnection, m_ErrorString );
+
+		// Free our socket.
+		AUTO_LOCK( m_SendMutex );
+		close( m_Socket );
+		m_Socket = -1;
+	}
+
+	void SetMachineName( const char *pName )
+	{
+		m_MachineName.CopyArray( pName, V_strlen( pName ) + 1 );
+		m_bNameSet = true;
+	}
+
+	const char* GetMachineName()
+	{
+		return m_MachineName.Base();
+	}
+
+	bool HasMachineNameBeenSet()
+	{
+		return m_bNameSet;
+	}
+
+
+public:
+
+	int m_iConnection;
+	int m_Socket;			// -1 for the master's own slot, and once a disconnect has been handled.
+	CIPAddr m_RemoteAddr;
+	unsigned long m_JobWorkerID;
+
+	// Held while writing to the socket. Also protects m_GroupedPacket.
+	CThreadMutex m_SendMutex;
+	CUtlVector<char> m_GroupedPacket;
+
+	// These are only touched by the IO thread (m_ErrorString is read by the main thread once
+	// the connection is in g_ErrorConnections).
+	CUtlVector<char> m_RecvBuffer;
+	int m_nRecvBytes;
+	bool m_bInErrorState;
+	char m_ErrorString[256];
+
+private:
+
+	CUtlVector<char> m_MachineName;
+	bool m_bNameSet;
+};
+
+
+
+CVMPIPacketIDReg::CVMPIPacketIDReg( int nPacketID, int nSubPacketID, const char *pName )
+{
+	m_nPacketID = nPacketID;
+	m_nSubPacketID = nSubPacketID;
+	m_pName = pName;
+	m_pNext = g_pVMPIPacketIDRegHead;
+	g_pVMPIPacketIDRegHead = this;
+}
+
+void CVMPIPacketIDReg::Lookup( int nPacketID, int nSubPacketID, char *pPacketIDString, int nPacketIDStringSize, char *pSubPacketIDString, int nSubPacketIDStringSize )
+{
+	// First find the packet ID.
+	CVMPIPacketIDReg *pCur;
+	for ( pCur = g_pVMPIPacketIDRegHead; pCur; pCur = pCur->m_pNext )
+	{
+		if ( pCur->m_nPacketID == nPacketID && pCur->m_nSubPacketID == -1 )
+		{
+			V_strncpy( pPacketIDString, pCur->m_pName, nPacketIDStringSize );
+			break;
+		}
+	}
+
+	// Didn't find it? Just print the number.
+	if ( !pCur )
+	{
+		V_snprintf( pPacketIDString, nPacketIDStringSize, "(%d)", nPacketID );
+	}
+
+	// Now find the subpacket ID.
+	for ( pCur = g_pVMPIPacketIDRegHead; pCur; pCur = pCur->m_pNext )
+	{
+		if ( pCur->m_nPacketID == nPacketID && pCur->m_nSubPacketID == nSubPacketID )
+		{
+			V_strncpy( pSubPacketIDString, pCur->m_pName, nSubPacketIDStringSize );
+			break;
+		}
+	}
+
+	// Didn't find it? Just print the number.
+	if ( !pCur )
+	{
+		V_snprintf( pSubPacketIDString, nSubPacketIDStringSize, "(%d)", nSubPacketID );
+	}
+}
+
+
+
+// ---------------------------------------------------------------------------------------- //
+// Helpers.
+// ---------------------------------------------------------------------------------------- //
+
+void VMPI_SuperSpew( const char *pMsg, ... )
+{
+	// This is usually used in conjunction with the log file to trace out protocol errors.
+	if ( g_bSuperSpewEnabled )
+	{
+		va_list marker;
+		va_start( marker, pMsg );
+		char str[2048];
+		V_vsnprintf( str, sizeof( str ), pMsg, marker );
+		va_end( marker );
+
+		Msg( "%s", str );
+	}
+}
+
+const char* VMPI_FindArg( int argc, char **argv, const char *pName, const char *pDefault )
+{
+	for ( int i=0; i < argc; i++ )
+	{
+		if ( stricmp( argv[i], pName ) == 0 )
+		{
+			if ( (i+1) < argc )
+				return argv[i+1];
+			else
+				return pDefault;
+		}
+	}
+	return NULL;
+}
+
+
+void ParseOptions( int argc, char **argv )
+{
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_DontSetThreadPriorities ) ) )
+	{
+		Msg( "%s found.\n", VMPI_GetParamString( mpi_DontSetThreadPriorities ) );
+		g_bSetThreadPriorities = false;
+	}
+
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_GroupPackets ) ) )
+	{
+		Msg( "%s found.\n", VMPI_GetParamString( mpi_GroupPackets ) );
+		g_bGroupPackets = true;
+	}
+
+	const char *pVerbose = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Verbose ), "1" );
+	if ( pVerbose )
+	{
+		if ( pVerbose[0] == '1' )
+			g_iVMPIVerboseLevel = 1;
+		else if ( pVerbose[0] == '2' )
+			g_iVMPIVerboseLevel = 2;
+	}
+
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Stats ) ) )
+		g_bMPI_Stats = true;
+
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Stats_TextOutput ) ) )
+		g_bMPI_StatsTextOutput = true;
+}
+
+
+void VMPI_SendMachineNameTo( int iProc )
+{
+	const char *pMyName = VMPI_GetLocalMachineName();
+
+	VMPI_SuperSpew( "Sent SUBPACKET_MACHINE_NAME (%s).\n", pMyName );
+
+	unsigned char packetData[VMPI_PACKET_SIZE];
+	packetData[0] = VMPI_INTERNAL_PACKET_ID;
+	packetData[1] = VMPI_INTERNAL_SUBPACKET_MACHINE_NAME;
+	V_strncpy( (char*)&packetData[2], pMyName, sizeof( packetData ) - 2 );
+	VMPI_SendData( packetData, 2 + V_strlen( pMyName ) + 1, iProc );
+}
+
+static char* CopyString( const char *pStr )
+{
+	int len = V_strlen( pStr ) + 1;
+	char *pArg = new char[len];
+	V_strncpy( pArg, pStr, len );
+	return pArg;
+}
+
+static void SetupSocket( int sock )
+{
+	// Nothing should hold on to our sockets across exec().
+	fcntl( sock, F_SETFD, FD_CLOEXEC );
+
+	// Work units are lots of small packets. Don't let Nagle sit on them.
+	int bNoDelay = 1;
+	setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, (char*)&bNoDelay, sizeof( bNoDelay ) );
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Internal VMPI dispatch..
+// ---------------------------------------------------------------------------------------- //
+
+void VMPI_SetMachineName( int iProc, const char *pName );
+
+CUtlVector<char*> g_WorkerCommandLine;
+bool g_bReceivedWorkerCommandLine = false;
+
+
+bool VMPI_InternalDispatchFn( MessageBuffer *pBuf, int iSource, int iPacketID )
+{
+	if ( pBuf->getLen() >= 2 )
+	{
+		if ( pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_MACHINE_NAME )
+		{
+			if ( pBuf->getLen() >= 3 )
+			{
+				VMPI_SuperSpew( "Received SUBPACKET_MACHINE_NAME (%s).\n", &pBuf->data[2] );
+				VMPI_SetMachineName( iSource, &pBuf->data[2] );
+				return true;
+			}
+			else
+			{
+				VMPI_SuperSpew( "Received invalid SUBPACKET_MACHINE_NAME packet (not long enough!)\n" );
+			}
+		}
+		else if ( pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_WAITING_FOR_COMMAND_LINE )
+		{
+			return true;
+		}
+		else if ( pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_COMMAND_LINE )
+		{
+			pBuf->setOffset( 2 );
+
+			int nArgs;
+			pBuf->read( &nArgs, sizeof( nArgs ) );
+			for ( int i=0; i < nArgs; i++ )
+			{
+				char str[4096];
+				if ( pBuf->ReadString( str, sizeof( str ) ) == -1 )
+					Error( "Error in ReadString() while reading command line." );
+
+				g_WorkerCommandLine.AddToTail( CopyString( str ) );
+			}
+
+			g_bReceivedWorkerCommandLine = true;
+			return true;
+		}
+		else if ( pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_VERIFY_EXE_NAME )
+		{
+			pBuf->setOffset( 2 );
+
+			if ( pBuf->ReadString( g_MasterExeName, sizeof( g_MasterExeName ) ) == -1 )
+				Error( "Error in ReadString() while reading VMPI_INTERNAL_SUBPACKET_VERIFY_EXE_NAME." );
+
+			VMPI_SuperSpew( "Received SUBPACKET_VERIFY_EXE_NAME (%s).\n", g_MasterExeName );
+			g_bReceivedMasterExeName = true;
+			return true;
+		}
+		else if ( pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER )
+		{
+			pBuf->setOffset( 2 );
+
+			char str[2048];
+			if ( pBuf->ReadString( str, sizeof( str ) ) == -1 )
+				Plat_FatalError( "Error in ReadString() while reading VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER." );
+
+			Msg( "\nWorker %d (%s) message: %s\n", iSource, VMPI_GetMachineName( iSource ), str );
+			return true;
+		}
+		else if ( pBuf->data[1] == VMPI_INTERNAL_SUBPACKET_TIMING_WAIT_DONE )
+		{
+			g_bTimingWaitDone = true;
+			return true;
+		}
+	}
+
+	return false;
+}
+CDispatchReg g_VMPIInternalDispatchReg( VMPI_INTERNAL_PACKET_ID, VMPI_InternalDispatchFn ); // register to handle the messages we want
+
+
+void VMPI_SendCommandLine( int argc, char **argv )
+{
+	MessageBuffer mb;
+
+	char cPacketHeader[2] = {VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_COMMAND_LINE};
+	mb.write( cPacketHeader, sizeof( cPacketHeader ) );
+	mb.write( &argc, sizeof( argc ) );
+	for ( int i=0; i < argc; i++ )
+		mb.WriteString( argv[i] );
+
+	VMPI_SendData( mb.data, mb.getLen(), VMPI_PERSISTENT );
+}
+
+void VMPI_ReceiveCommandLine()
+{
+	// For verification purposes, tell the master we're trying to get the command line.
+	unsigned char chData[2] = {VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_WAITING_FOR_COMMAND_LINE};
+	VMPI_SendData( chData, sizeof( chData ), VMPI_MASTER_ID );
+
+	double startTime = Plat_FloatTime();
+	while ( !g_bReceivedWorkerCommandLine )
+	{
+		if ( Plat_FloatTime() - startTime > 30 )
+			Error( "VMPI_ReceiveCommandLine: timeout." );
+
+		VMPI_DispatchNextMessage( 10 * 1000 );
+	}
+}
+
+
+void VMPI_SendExeName()
+{
+	MessageBuffer mb;
+
+	char cPacketHeader[2] = {VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_VERIFY_EXE_NAME};
+	mb.write( cPacketHeader, sizeof( cPacketHeader ) );
+
+	char fileBase[MAX_PATH];
+	V_FileBase( g_ExeFilename, fileBase, sizeof( fileBase ) );
+	mb.WriteString( fileBase );
+
+	VMPI_SuperSpew( "Sending SUBPACKET_VERIFY_EXE_NAME (%s).\n", fileBase );
+	VMPI_SendData( mb.data, mb.getLen(), VMPI_PERSISTENT );
+}
+
+void VMPI_ReceiveExeName()
+{
+	double startTime = Plat_FloatTime();
+	while ( !g_bReceivedMasterExeName )
+	{
+		if ( Plat_FloatTime() - startTime > 30 )
+			Error( "VMPI_ReceiveExeName: timeout." );
+
+		VMPI_DispatchNextMessage( 10 * 1000 );
+	}
+
+	// Now compare the exe name we got with our own.
+	char fileBase[MAX_PATH];
+	V_FileBase( g_ExeFilename, fileBase, sizeof( fileBase ) );
+	if ( V_stricmp( fileBase, g_MasterExeName ) != 0 )
+	{
+		Error( "VMPI_ReceiveExeName: mismatched exe names (master: %s, me: %s).\nThis usually just means the master finished"
+			" a job like vvis really fast and started a vrad immediately, and an old vvis worker connected to the new vrad job.",
+			g_MasterExeName, fileBase );
+	}
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Socket IO.
+// The IO thread does all the reading (and accepts new workers on the master), so a sender
+// never waits on a peer that's blocked sending to us. Sends happen on whatever thread calls
+// VMPI_SendChunks.
+// ---------------------------------------------------------------------------------------- //
+
+// Called on the IO thread.
+static void QueueConnectionError( CVMPIConnection *pConn, const char *pErrorString )
+{
+	if ( pConn->m_bInErrorState )
+		return;
+
+	pConn->m_bInErrorState = true;
+	V_strncpy( pConn->m_ErrorString, pErrorString, sizeof( pConn->m_ErrorString ) );
+
+	if ( !g_bMPIMaster )
+	{
+		Msg( "%s - CVMPIConnection::OnError( %s )\n", pConn->GetMachineName(), pErrorString );
+	}
+
+	AUTO_LOCK( g_VMPIMessagesMutex );
+	g_ErrorConnections.AddToTail( pConn );
+	g_VMPIMessagesEvent.Set();
+}
+
+
+// Called on the IO thread when poll() says there's something to read.
+static void ReadFromConnection( CVMPIConnection *pConn )
+{
+	// Make room for the rest of the packet we're in the middle of, if we know how big it is.
+	int nWanted = pConn->m_nRecvBytes + VMPI_RECV_CHUNK_SIZE;
+	if ( pConn->m_nRecvBytes >= 4 )
+	{
+		int nPacketLen = *((int*)pConn->m_RecvBuffer.Base());
+		if ( nPacketLen >= 0 && nPacketLen <= VMPI_MAX_PACKET_LEN )
+			nWanted = MAX( nWanted, nPacketLen + 4 );
+	}
+	if ( pConn->m_RecvBuffer.Count() < nWanted )
+		pConn->m_RecvBuffer.SetCount( nWanted );
+
+	ssize_t nBytes = recv( pConn->m_Socket, pConn->m_RecvBuffer.Base() + pConn->m_nRecvBytes, pConn->m_RecvBuffer.Count() - pConn->m_nRecvBytes, MSG_DONTWAIT );
+	if ( nBytes == 0 )
+	{
+		QueueConnectionError( pConn, "connection closed" );
+		return;
+	}
+	else if ( nBytes < 0 )
+	{
+		if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+			QueueConnectionError( pConn, strerror( errno ) );
+		return;
+	}
+
+	pConn->m_nRecvBytes += nBytes;
+
+	// Pull out all the complete packets.
+	const char *pBase = pConn->m_RecvBuffer.Base();
+	int iCurOffset = 0;
+	while ( pConn->m_nRecvBytes - iCurOffset >= 4 )
+	{
+		int nPacketLen = *((int*)&pBase[iCurOffset]);
+		if ( nPacketLen < 0 || nPacketLen > VMPI_MAX_PACKET_LEN )
+		{
+			QueueConnectionError( pConn, "invalid packet size" );
+			return;
+		}
+
+		if ( pConn->m_nRecvBytes - iCurOffset - 4 < nPacketLen )
+			break;
+
+		VMPIPacket_t *pPacket = (VMPIPacket_t*)malloc( sizeof( VMPIPacket_t ) + nPacketLen );
+		pPacket->m_iSource = pConn->m_iConnection;
+		pPacket->m_nLen = nPacketLen;
+		memcpy( pPacket->m_Data, &pBase[iCurOffset + 4], nPacketLen );
+		iCurOffset += nPacketLen + 4;
+
+		AUTO_LOCK( g_VMPIMessagesMutex );
+		g_VMPIMessages.AddToTail( pPacket );
+		g_VMPIMessagesEvent.Set();
+	}
+
+	if ( iCurOffset > 0 )
+	{
+		pConn->m_nRecvBytes -= iCurOffset;
+		memmove( pConn->m_RecvBuffer.Base(), &pBase[iCurOffset], pConn->m_nRecvBytes );
+
+		// Don't hang on to the memory from a big packet.
+		if ( pConn->m_nRecvBytes == 0 && pConn->m_RecvBuffer.Count() > 16 * VMPI_RECV_CHUNK_SIZE )
+			pConn->m_RecvBuffer.Purge();
+	}
+}
+
+
+// Writes one packet. The caller must hold pConn->m_SendMutex.
+static bool SendPacket( CVMPIConnection *pConn, void const * const *pChunks, const int *pChunkLengths, int nChunks )
+{
+	if ( pConn->m_Socket == -1 )
+		return false;
+
+	int nTotalLength = 0;
+	for ( int i=0; i < nChunks; i++ )
+		nTotalLength += pChunkLengths[i];
+
+	CUtlVectorFixedGrowable<iovec, 16> iovecs;
+	iovecs.SetCount( nChunks + 1 );
+	iovecs[0].iov_base = &nTotalLength;
+	iovecs[0].iov_len = sizeof( nTotalLength );
+	for ( int i=0; i < nChunks; i++ )
+	{
+		iovecs[i+1].iov_base = (void*)pChunks[i];
+		iovecs[i+1].iov_len = pChunkLengths[i];
+	}
+
+	int iFirst = 0;
+	while ( iFirst < iovecs.Count() )
+	{
+		msghdr msg;
+		memset( &msg, 0, sizeof( msg ) );
+		msg.msg_iov = &iovecs[iFirst];
+		msg.msg_iovlen = iovecs.Count() - iFirst;
+
+		ssize_t nSent = sendmsg( pConn->m_Socket, &msg, MSG_NOSIGNAL );
+		if ( nSent < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			// Make the IO thread notice, so the disconnect handlers get called from the main thread.
+			shutdown( pConn->m_Socket, SHUT_RDWR );
+			return false;
+		}
+
+		// Skip past whatever got written.
+		while ( iFirst < iovecs.Count() && nSent >= (ssize_t)iovecs[iFirst].iov_len )
+		{
+			nSent -= iovecs[iFirst].iov_len;
+			++iFirst;
+		}
+		if ( nSent > 0 )
+		{
+			iovecs[iFirst].iov_base = (char*)iovecs[iFirst].iov_base + nSent;
+			iovecs[iFirst].iov_len -= nSent;
+		}
+	}
+
+	return true;
+}
+
+
+// Called on the IO thread.
+static void AcceptWorker()
+{
+	sockaddr_in addr;
+	socklen_t addrLen = sizeof( addr );
+	int sock = accept( g_ListenSocket, (sockaddr*)&addr, &addrLen );
+	if ( sock == -1 )
+		return;
+
+	if ( g_nConnections - 1 >= g_nMaxWorkerCount || g_nConnections >= MAX_VMPI_CONNECTIONS )
+	{
+		close( sock );
+		return;
+	}
+
+	SetupSocket( sock );
+
+	CIPAddr remoteAddr;
+	SockAddrToIPAddr( &addr, &remoteAddr );
+
+	AUTO_LOCK( g_ConnectionsMutex );
+
+	int iConnection = g_nConnections;
+	CVMPIConnection *pConn = new CVMPIConnection( iConnection, sock, remoteAddr );
+	g_Connections[iConnection] = pConn;
+	g_nConnections = iConnection + 1;
+
+	// Catch it up on everything that's been sent with VMPI_PERSISTENT.
+	AUTO_LOCK( pConn->m_SendMutex );
+	FOR_EACH_LL( g_PersistentPackets, i )
+	{
+		PersistentPacket *pPacket = g_PersistentPackets[i];
+		const void *pData = pPacket->Base();
+		int len = pPacket->Count();
+		SendPacket( pConn, &pData, &len, 1 );
+	}
+
+	if ( g_iVMPIVerboseLevel >= 1 )
+		Msg( "VMPI: worker %d connected from %d.%d.%d.%d.\n", iConnection, remoteAddr.ip[0], remoteAddr.ip[1], remoteAddr.ip[2], remoteAddr.ip[3] );
+}
+
+
+static uintp VMPI_IOThreadFn( void *pParam )
+{
+	CUtlVector<pollfd> pollFDs;
+	CUtlVector<CVMPIConnection*> pollConnections;
+
+	while ( !g_bIOThreadExit )
+	{
+		pollFDs.RemoveAll();
+		pollConnections.RemoveAll();
+
+		pollfd fd;
+		fd.events = POLLIN;
+		fd.revents = 0;
+
+		fd.fd = g_WakePipe[0];
+		pollFDs.AddToTail( fd );
+		pollConnections.AddToTail( NULL );
+
+		if ( g_ListenSocket != -1 )
+		{
+			fd.fd = g_ListenSocket;
+			pollFDs.AddToTail( fd );
+			pollConnections.AddToTail( NULL );
+		}
+
+		int nConnections = g_nConnections;
+		for ( int i=0; i < nConnections; i++ )
+		{
+			CVMPIConnection *pConn = g_Connections[i];
+			if ( pConn->m_bInErrorState || pConn->m_Socket == -1 )
+				continue;
+
+			fd.fd = pConn->m_Socket;
+			pollFDs.AddToTail( fd );
+			pollConnections.AddToTail( pConn );
+		}
+
+		if ( poll( pollFDs.Base(), pollFDs.Count(), -1 ) < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			Warning( "VMPI: poll() failed (%s).\n", strerror( errno ) );
+			break;
+		}
+
+		for ( int i=0; i < pollFDs.Count(); i++ )
+		{
+			if ( !pollFDs[i].revents )
+				continue;
+
+			if ( pollConnections[i] )
+			{
+				ReadFromConnection( pollConnections[i] );
+			}
+			else if ( pollFDs[i].fd == g_WakePipe[0] )
+			{
+				char dummy[64];
+				read( g_WakePipe[0], dummy, sizeof( dummy ) );
+			}
+			else
+			{
+				AcceptWorker();
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+static void VMPI_StartIOThread()
+{
+	if ( pipe( g_WakePipe ) != 0 )
+		Error( "VMPI: pipe() failed (%s).", strerror( errno ) );
+
+	fcntl( g_WakePipe[0], F_SETFD, FD_CLOEXEC );
+	fcntl( g_WakePipe[1], F_SETFD, FD_CLOEXEC );
+
+	g_bIOThreadExit = false;
+	g_hIOThread = CreateSimpleThread( VMPI_IOThreadFn, NULL );
+	if ( !g_hIOThread )
+		Error( "VMPI: couldn't create the IO thread." );
+}
+
+
+static void VMPI_StopIOThread()
+{
+	if ( !g_hIOThread )
+		return;
+
+	g_bIOThreadExit = true;
+	char c = 0;
+	write( g_WakePipe[1], &c, 1 );
+
+	ThreadJoin( g_hIOThread );
+	ReleaseThreadHandle( g_hIOThread );
+	g_hIOThread = NULL;
+
+	close( g_WakePipe[0] );
+	close( g_WakePipe[1] );
+	g_WakePipe[0] = g_WakePipe[1] = -1;
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// CDispatchReg.
+// ---------------------------------------------------------------------------------------- //
+
+CDispatchReg::CDispatchReg( int iPacketID, VMPIDispatchFn fn )
+{
+	Assert( iPacketID >= 0 && iPacketID < MAX_VMPI_PACKET_IDS );
+	Assert( !g_VMPIDispatch[iPacketID] );
+	g_VMPIDispatch[iPacketID] = fn;
+}
+
+
+void VMPI_HandleTimingWait_Worker()
+{
+	if ( VMPI_IsParamUsed( mpi_TimingWait ) )
+	{
+		Msg( "-mpi_TimingWait specified. Waiting for master to start..." );
+
+		// Wait for the signal to go.
+		while ( !g_bTimingWaitDone )
+		{
+			VMPI_DispatchNextMessage( 50 );
+		}
+
+		Msg( "\n ");
+	}
+}
+
+
+void VMPI_HandleTimingWait_Master()
+{
+	if ( VMPI_IsParamUsed( mpi_TimingWait ) )
+	{
+		Msg( "-mpi_TimingWait specified. Press enter to continue... " );
+		getchar();
+		Msg( "\n" );
+
+		unsigned char cPacket[2] = { VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_TIMING_WAIT_DONE };
+		VMPI_SendData( cPacket, sizeof( cPacket ), VMPI_PERSISTENT );
+	}
+}
+
+
+// ---------------------------------------------------------------------------------------- //
+// Helpers.
+// ---------------------------------------------------------------------------------------- //
+
+static int ConnectToMaster( const CIPAddr &masterAddr )
+{
+	sockaddr_in addr;
+	IPAddrToSockAddr( &masterAddr, &addr );
+
+	CWaitTimer wait( 3 );
+	while ( 1 )
+	{
+		int sock = socket( AF_INET, SOCK_STREAM, 0 );
+		if ( sock == -1 )
+			Error( "VMPI: socket() failed (%s).", strerror( errno ) );
+
+		if ( connect( sock, (sockaddr*)&addr, sizeof( addr ) ) == 0 )
+			return sock;
+
+		close( sock );
+
+		if( wait.ShouldKeepWaiting() )
+			ThreadSleep( 100 );
+		else
+			return -1;
+	}
+}
+
+
+bool MPI_Init_Worker( int &argc, char **&argv, const CIPAddr &masterAddr )
+{
+	g_bMPIMaster = false;
+
+	int nAttempts = 1;
+	int sock;
+	while ( ( sock = ConnectToMaster( masterAddr ) ) == -1 )
+	{
+		if ( !VMPI_IsParamUsed( mpi_Retry ) )
+		{
+			Warning( "MPI_Init_Worker() failed\n" );
+			return false;
+		}
+
+		Msg( "%s found. Retrying connection to %d.%d.%d.%d:%d (attempt %d).\n", VMPI_GetParamString( mpi_Retry ), masterAddr.ip[0], masterAddr.ip[1], masterAddr.ip[2], masterAddr.ip[3], masterAddr.port, nAttempts++ );
+	}
+
+	SetupSocket( sock );
+	g_Connections[VMPI_MASTER_ID] = new CVMPIConnection( VMPI_MASTER_ID, sock, masterAddr );
+	g_nConnections = 1;
+	VMPI_StartIOThread();
+
+	// Send the master our machine name.
+	VMPI_SendMachineNameTo( VMPI_MASTER_ID );
+
+	// Verify that the exe is correct.
+	VMPI_ReceiveExeName();
+
+	VMPI_ReceiveCommandLine();
+
+	CommandLine()->CreateCmdLine( g_WorkerCommandLine.Count(), g_WorkerCommandLine.Base() );
+	argc = g_WorkerCommandLine.Count();
+	argv = g_WorkerCommandLine.Base();
+
+	ParseOptions( g_WorkerCommandLine.Count(), g_WorkerCommandLine.Base() );
+	for ( int i=0; i < g_WorkerCommandLine.Count(); i++ )
+	{
+		Msg( "arg %d: %s\n", i, g_WorkerCommandLine[i] );
+	}
+
+	VMPI_HandleTimingWait_Worker();
+	return true;
+}
+
+
+bool SpawnLocalWorker( int argc, char **argv, int iListenPort, bool bShowOutput )
+{
+	// Same command line, with -mpi_worker pointing back at us after the exe name.
+	char masterAddr[64];
+	V_snprintf( masterAddr, sizeof( masterAddr ), "127.0.0.1:%d", iListenPort );
+
+	CUtlVector<char*> args;
+	args.AddToTail( g_ExeFilename );
+	args.AddToTail( (char*)"-mpi_worker" );
+	args.AddToTail( masterAddr );
+	args.AddToTail( (char*)"-allowdebug" );
+	for ( int i=1; i < argc; i++ )
+		args.AddToTail( argv[i] );
+	args.AddToTail( NULL );
+
+	pid_t pid = fork();
+	if ( pid == 0 )
+	{
+		// Only async-signal-safe calls from here to exec; the parent has other threads running.
+		if ( !bShowOutput )
+		{
+			int nullFD = open( "/dev/null", O_WRONLY );
+			if ( nullFD != -1 )
+			{
+				dup2( nullFD, STDOUT_FILENO );
+				dup2( nullFD, STDERR_FILENO );
+			}
+		}
+
+		if ( g_bSetThreadPriorities )
+			setpriority( PRIO_PROCESS, 0, 19 );
+
+		execv( g_ExeFilename, args.Base() );
+		_exit( 127 );
+	}
+	else if ( pid == -1 )
+	{
+		Warning( " - ERROR in fork (%s)!\n", strerror( errno ) );
+		return false;
+	}
+
+	g_LocalWorkerPIDs.AddToTail( pid );
+	return true;
+}
+
+
+static int CreateListenSocket( int argc, char **argv )
+{
+	int iFirstPort = VMPI_MASTER_FIRST_PORT;
+	int iLastPort = VMPI_MASTER_LAST_PORT;
+	const char *pPort = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Port ), "" );
+	if ( pPort && pPort[0] )
+	{
+		iFirstPort = iLastPort = atoi( pPort );
+	}
+
+	for ( int iPort=iFirstPort; iPort <= iLastPort; iPort++ )
+	{
+		int sock = socket( AF_INET, SOCK_STREAM, 0 );
+		if ( sock == -1 )
+			Error( "VMPI: socket() failed (%s).", strerror( errno ) );
+
+		fcntl( sock, F_SETFD, FD_CLOEXEC );
+
+		int bReuseAddr = 1;
+		setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, (char*)&bReuseAddr, sizeof( bReuseAddr ) );
+
+		sockaddr_in addr;
+		memset( &addr, 0, sizeof( addr ) );
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl( INADDR_ANY );
+		addr.sin_port = htons( iPort );
+
+		if ( bind( sock, (sockaddr*)&addr, sizeof( addr ) ) == 0 && listen( sock, SOMAXCONN ) == 0 )
+		{
+			g_ListenSocket = sock;
+			return iPort;
+		}
+
+		close( sock );
+	}
+
+	Error( "Can't bind a port in range [%d, %d].", iFirstPort, iLastPort );
+	return -1;
+}
+
+
+bool InitMaster( int argc, char **argv, VMPIRunMode runMode )
+{
+	int nMaxWorkers = -1;
+	const char *pProcCount = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_WorkerCount ) );
+	if ( pProcCount )
+	{
+		nMaxWorkers = atoi( pProcCount );
+		Warning( "%s: waiting for %d processes to join.\n", VMPI_GetParamString( mpi_WorkerCount ), nMaxWorkers );
+	}
+	else
+	{
+		nMaxWorkers = DEFAULT_MAX_WORKERS;
+	}
+	nMaxWorkers = clamp( nMaxWorkers, 2, MAX_VMPI_CONNECTIONS );
+
+
+	g_bMPIMaster = true;
+	g_nMaxWorkerCount = nMaxWorkers;
+
+	if ( argc <= 0 )
+		Error( "MPI_Init_Master: argc <= 0!" );
+
+	ParseOptions( argc, argv );
+
+	g_Connections[VMPI_MASTER_ID] = new CVMPIConnection( VMPI_MASTER_ID, -1, CIPAddr( 127, 0, 0, 1, 0 ) );
+	g_nConnections = 1;
+
+	// Send the base filename of the exe we're running. Sometimes if we run vvis followed by vrad
+	// really quickly, the old vvis workers can connect to the vrad process and mess with it.
+	VMPI_SendExeName();
+
+	// The workers get their command line from us.
+	VMPI_SendCommandLine( argc, argv );
+
+	int iListenPort = CreateListenSocket( argc, argv );
+	Msg( "VMPI master listening on port %d.\n", iListenPort );
+
+	VMPI_StartIOThread();
+
+	bool bRet = true;
+	if ( runMode == VMPI_RUN_LOCAL )
+	{
+		bRet = SpawnLocalWorker( argc, argv, iListenPort, false );
+	}
+	else if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_AutoLocalWorker ), "" ) )
+	{
+		Msg( "%s found. Spawning a local worker automatically.\n", VMPI_GetParamString( mpi_AutoLocalWorker ) );
+		SpawnLocalWorker( 1, argv, iListenPort, true );
+	}
+
+	const char *pLocalWorkers = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_LocalWorkers ), "" );
+	if ( pLocalWorkers )
+	{
+		int nLocalWorkers = clamp( atoi( pLocalWorkers ), 0, g_nMaxWorkerCount );
+		Msg( "%s found. Spawning %d local workers.\n", VMPI_GetParamString( mpi_LocalWorkers ), nLocalWorkers );
+		for ( int i=0; i < nLocalWorkers; i++ )
+		{
+			if ( !SpawnLocalWorker( 1, argv, iListenPort, false ) )
+				break;
+		}
+	}
+
+	VMPI_HandleTimingWait_Master();
+	return bRet;
+}
+
+
+void VMPI_InitGlobals( int argc, char **argv, VMPIRunMode runMode )
+{
+	g_bUseMPI = true;
+	g_VMPIRunMode = runMode;
+
+	int len = readlink( "/proc/self/exe", g_ExeFilename, sizeof( g_ExeFilename ) - 1 );
+	if ( len > 0 )
+		g_ExeFilename[len] = 0;
+	else
+		V_strncpy( g_ExeFilename, argc > 0 ? argv[0] : "", sizeof( g_ExeFilename ) );
+
+	#if defined( _DEBUG )
+
+		for ( int iArg=0; iArg < argc; iArg++ )
+		{
+			Warning( "%s\n", argv[iArg] );
+		}
+
+		Warning( "\n" );
+
+	#endif
+}
+
+
+void VMPI_SetupAutoRestartParameters( int argc, char **argv )
+{
+	if ( VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_AutoRestart ) ) )
+	{
+		g_OriginalCommandLineParameters.SetCount( argc );
+		for ( int i=0; i < argc; i++ )
+		{
+			g_OriginalCommandLineParameters[i] = CopyString( argv[i] );
+		}
+	}
+}
+
+
+bool VMPI_HandleAutoRestart()
+{
+	if ( g_OriginalCommandLineParameters.Count() == 0 )
+		return true;
+
+	Msg( "%s found. Auto-restarting.\n", VMPI_GetParamString( mpi_AutoRestart ) );
+
+	CUtlVector<char*> args;
+	args.AddVectorToTail( g_OriginalCommandLineParameters );
+	args.AddToTail( NULL );
+
+	pid_t pid = fork();
+	if ( pid == 0 )
+	{
+		setsid();
+		execv( g_ExeFilename, args.Base() );
+		_exit( 127 );
+	}
+	else if ( pid == -1 )
+	{
+		Warning( " - ERROR in fork (%s)!\n", strerror( errno ) );
+		return false;
+	}
+
+	g_OriginalCommandLineParameters.PurgeAndDeleteElements();
+	return true;
+}
+
+
+bool VMPI_Init(
+	int &argc,
+	char **&argv,
+	const char *pDependencyFilename,
+	VMPI_Disconnect_Handler handler,
+	VMPIRunMode runMode,
+	bool bConnectingAsService
+	)
+{
+	if ( handler )
+		VMPI_AddDisconnectHandler( handler );
+
+	VMPI_SetupAutoRestartParameters( argc, argv );
+	VMPI_InitGlobals( argc, argv, runMode );
+
+	// Were we launched as a worker?
+	const char *pMasterIP = VMPI_FindArg( argc, argv, VMPI_GetParamString( mpi_Worker ), NULL );
+	if ( pMasterIP )
+	{
+		CIPAddr addr;
+		addr.port = VMPI_MASTER_FIRST_PORT;
+		if ( !ConvertStringToIPAddr( pMasterIP, &addr ) )
+			Error( "Unable to parse or resolve master IP (%s).\n", pMasterIP );
+
+		return MPI_Init_Worker( argc, argv, addr );
+	}
+	else
+	{
+		// There's no file transfer, so the dependency list isn't needed.
+		return InitMaster( argc, argv, runMode );
+	}
+}
+
+
+void VMPI_Init_PatchMaster( int argc, char **argv )
+{
+	Error( "Patching VMPI workers isn't supported on this platform." );
+}
+
+
+void VMPI_Finalize()
+{
+	DistributeWork_Cancel();
+
+	VMPI_StopIOThread();
+
+	// Get rid of all the sockets.
+	for ( int iConn=0; iConn < g_nConnections; iConn++ )
+	{
+		delete g_Connections[iConn];
+		g_Connections[iConn] = NULL;
+	}
+
+	g_nConnections = 0;
+
+	if ( g_ListenSocket != -1 )
+	{
+		close( g_ListenSocket );
+		g_ListenSocket = -1;
+	}
+
+	// Get rid of all the packets.
+	FOR_EACH_LL( g_VMPIMessages, i )
+	{
+		free( g_VMPIMessages[i] );
+	}
+	g_VMPIMessages.Purge();
+	g_ErrorConnections.Purge();
+
+	g_PersistentPackets.PurgeAndDeleteElements();
+
+	// Get rid of the message buffers
+	g_DispatchBuffers.Purge();
+
+	// Our sockets are closed, so local workers should be on their way out. Give them a moment
+	// so they don't get left behind as zombies.
+	double flStartTime = Plat_FloatTime();
+	while ( g_LocalWorkerPIDs.Count() && Plat_FloatTime() - flStartTime < 5 )
+	{
+		for ( int i=g_LocalWorkerPIDs.Count()-1; i >= 0; i-- )
+		{
+			if ( waitpid( g_LocalWorkerPIDs[i], NULL, WNOHANG ) != 0 )
+				g_LocalWorkerPIDs.Remove( i );
+		}
+
+		if ( g_LocalWorkerPIDs.Count() )
+			ThreadSleep( 50 );
+	}
+	g_LocalWorkerPIDs.Purge();
+
+	g_WorkerCommandLine.PurgeAndDeleteElements();
+
+	VMPI_HandleAutoRestart();
+}
+
+
+VMPIRunMode VMPI_GetRunMode()
+{
+	return g_VMPIRunMode;
+}
+
+
+VMPIFileSystemMode VMPI_GetFileSystemMode()
+{
+	return g_VMPIFileSystemMode;
+}
+
+
+int VMPI_GetCurrentNumberOfConnections()
+{
+	return g_nConnections;
+}
+
+
+// Returns true if there were any errors to handle.
+bool InternalHandleSocketErrors()
+{
+	// Copy the list of connections with errors into a local array so we can handle all the errors outside
+	// the mutex, thus avoiding potential deadlock if any error handlers call Error().
+	CUtlVector<CVMPIConnection*> errorConnections;
+
+	g_VMPIMessagesMutex.Lock();
+		FOR_EACH_LL( g_ErrorConnections, i )
+		{
+			errorConnections.AddToTail( g_ErrorConnections[i] );
+		}
+		g_ErrorConnections.Purge();
+	g_VMPIMessagesMutex.Unlock();
+
+	for ( int i=0; i < errorConnections.Count(); i++ )
+	{
+		errorConnections[i]->HandleDisconnect();
+	}
+
+	return errorConnections.Count() > 0;
+}
+
+
+void VMPI_HandleSocketErrors( unsigned long timeout )
+{
+	if ( !InternalHandleSocketErrors() && timeout != 0 )
+	{
+		g_VMPIMessagesEvent.Wait( timeout );
+		InternalHandleSocketErrors();
+	}
+}
+
+
+// If bWait is false, then this function returns false immediately if there are no messages waiting.
+bool VMPI_GetNextMessage( MessageBuffer *pBuf, int *pSource, unsigned long startTimeout )
+{
+	unsigned long startTime = Plat_MSTime();
+
+	while ( 1 )
+	{
+		VMPIPacket_t *pPacket = NULL;
+		bool bHasErrors;
+
+		g_VMPIMessagesMutex.Lock();
+
+GrabNextMessage:;
+			if ( g_VMPIMessages.Count() > 0 )
+			{
+				int iHead = g_VMPIMessages.Head();
+				pPacket = g_VMPIMessages[iHead];
+				g_VMPIMessages.Remove( iHead );
+
+				const char *pBase = pPacket->m_Data;
+				if ( pPacket->m_nLen >= 6 && (unsigned char)pBase[0] == VMPI_INTERNAL_PACKET_ID && (unsigned char)pBase[1] == VMPI_INTERNAL_SUBPACKET_GROUPED_PACKET )
+				{
+					// Ok, this is a grouped packet. Split it out into a bunch of separate packets.
+					CUtlVector<VMPIPacket_t*> groupedPackets;
+					int iCurOffset = 2;
+					while ( (iCurOffset+4) <= pPacket->m_nLen )
+					{
+						int curPacketLen = *((int*)&pBase[iCurOffset]);
+						iCurOffset += 4;
+
+						if ( curPacketLen < 0 || iCurOffset + curPacketLen > pPacket->m_nLen )
+							Error( "Invalid chunked packet\n" );
+
+						VMPIPacket_t *pChunkPacket = (VMPIPacket_t*)malloc( sizeof( VMPIPacket_t ) + curPacketLen );
+						pChunkPacket->m_iSource = pPacket->m_iSource;
+						pChunkPacket->m_nLen = curPacketLen;
+						memcpy( pChunkPacket->m_Data, &pBase[iCurOffset], curPacketLen );
+						groupedPackets.AddToTail( pChunkPacket );
+
+						iCurOffset += curPacketLen;
+					}
+
+					for ( int i=0; i < groupedPackets.Count(); i++ )
+					{
+						g_VMPIMessages.AddToHead( groupedPackets[groupedPackets.Count() - i - 1] );
+					}
+					free( pPacket );
+					pPacket = NULL;
+					goto GrabNextMessage;
+				}
+			}
+
+			// Messages that came in before a disconnect get delivered before the disconnect is handled.
+			bHasErrors = ( pPacket == NULL && g_ErrorConnections.Count() > 0 );
+
+		g_VMPIMessagesMutex.Unlock();
+
+		if ( pPacket )
+		{
+			// Copy it into their message buffer.
+			pBuf->setLen( pPacket->m_nLen );
+			memcpy( pBuf->data, pPacket->m_Data, pPacket->m_nLen );
+
+			if ( g_bSuperSpewEnabled )
+			{
+				char szPacketID[64], szSubPacketID[64];
+				CVMPIPacketIDReg::Lookup(
+					(pPacket->m_nLen >= 1) ? pBuf->data[0] : -1,
+					(pPacket->m_nLen >= 2) ? pBuf->data[1] : -1,
+					szPacketID, sizeof( szPacketID ), szSubPacketID, sizeof( szSubPacketID ) );
+
+				VMPI_SuperSpew( "Received a packet (packetID %s, subPacketID %s)\n",
+					szPacketID, szSubPacketID );
+			}
+
+			*pSource = pPacket->m_iSource;
+			Assert( *pSource >= 0 && *pSource < g_nConnections );
+
+			// Update global stats about how much data we've received.
+			++g_nMessagesReceived;
+			g_nBytesReceived += pPacket->m_nLen + 4;	// (4 bytes extra for the packet length)
+
+			free( pPacket );
+			return true;
+		}
+
+		if ( bHasErrors )
+		{
+			InternalHandleSocketErrors();
+		}
+
+		// Wait for the IO thread to give us something.
+		unsigned long timeout = VMPI_TIMEOUT_INFINITE;
+		if ( startTimeout != VMPI_TIMEOUT_INFINITE )
+		{
+			unsigned long delta = Plat_MSTime() - startTime;
+			if ( delta >= startTimeout )
+				return false;
+
+			timeout = startTimeout - delta;
+		}
+
+		if ( !bHasErrors )
+			g_VMPIMessagesEvent.Wait( timeout == VMPI_TIMEOUT_INFINITE ? TT_INFINITE : timeout );
+	}
+}
+
+
+bool VMPI_InternalDispatch( MessageBuffer *pBuf, int iSource )
+{
+	unsigned char iPacketID = ( pBuf->getLen() >= 1 ) ? (unsigned char)pBuf->data[0] : MAX_VMPI_PACKET_IDS;
+	if ( iPacketID < MAX_VMPI_PACKET_IDS && g_VMPIDispatch[iPacketID] )
+	{
+		return g_VMPIDispatch[iPacketID]( pBuf, iSource, iPacketID );
+
+	}
+	else
+	{
+		return false;
+	}
+}
+
+bool VMPI_DispatchNextMessage( unsigned long timeout )
+{
+	MessageBuffer *pBuf = NULL;
+	if ( !g_DispatchBuffers.PopItem( &pBuf ) )
+	{
+		pBuf = new MessageBuffer();
+	}
+
+	bool bRetval = true;
+	while ( 1 )
+	{
+		int iSource;
+		if ( VMPI_GetNextMessage( pBuf, &iSource, timeout ) )
+		{
+			if ( VMPI_InternalDispatch( pBuf, iSource ) )
+			{
+				break;
+			}
+			else
+			{
+				// Oops! What is this packet?
+				Assert( false );
+			}
+		}
+		else
+		{
+			bRetval = false;
+			break;
+		}
+	}
+
+	g_DispatchBuffers.PushItem( pBuf );
+	return bRetval;
+}
+
+
+bool VMPI_DispatchUntil( MessageBuffer *pBuf, int *pSource, int packetID, int subPacketID, bool bWait )
+{
+	while ( 1 )
+	{
+		if ( !VMPI_GetNextMessage( pBuf, pSource, bWait ? VMPI_TIMEOUT_INFINITE : 0 ) )
+			return false;
+
+		if ( !VMPI_InternalDispatch( pBuf, *pSource ) )
+		{
+			if ( pBuf->getLen() >= 1 && (unsigned char)pBuf->data[0] == packetID )
+			{
+				if ( subPacketID == -1 )
+					return true;
+
+				if ( pBuf->getLen() >= 2 && (unsigned char)pBuf->data[1] == subPacketID )
+					return true;
+			}
+
+			// See the note in vmpi.cpp - stray packets here are discarded.
+		}
+	}
+}
+
+
+bool VMPI_SendData( void *pData, int nBytes, int iDest, int fVMPISendFlags )
+{
+	return VMPI_SendChunks( &pData, &nBytes, 1, iDest, fVMPISendFlags );
+}
+
+
+// The caller must hold pConn->m_SendMutex.
+void VMPI_GroupPackets( CVMPIConnection *pConn, void const * const *pChunks, const int *pChunkLengths, int nChunks )
+{
+	// First add the header.
+	if ( pConn->m_GroupedPacket.Count() == 0 )
+	{
+		pConn->m_GroupedPacket.AddMultipleToTail( sizeof( g_GroupedPacketHeader ), g_GroupedPacketHeader );
+	}
+
+	// Collate the chunks.
+	int nTotalLength = 0;
+	for ( int i=0; i < nChunks; i++ )
+		nTotalLength += pChunkLengths[i];
+
+	pConn->m_GroupedPacket.AddMultipleToTail( sizeof( nTotalLength ), (const char*)&nTotalLength );
+	for ( int i=0; i < nChunks; i++ )
+	{
+		pConn->m_GroupedPacket.AddMultipleToTail( pChunkLengths[i], (const char*)pChunks[i] );
+	}
+}
+
+
+void VMPI_FlushGroupedPackets( unsigned long msInterval )
+{
+	if ( msInterval != 0 )
+	{
+		unsigned long curTime = Plat_MSTime();
+		if ( curTime - g_LastFlushGroupedPacketsTime < msInterval )
+			return;
+		g_LastFlushGroupedPacketsTime = curTime;
+	}
+
+	int nConnections = g_nConnections;
+	for ( int i=0; i < nConnections; i++ )
+	{
+		CVMPIConnection *pConn = g_Connections[i];
+
+		AUTO_LOCK( pConn->m_SendMutex );
+		if ( pConn->m_GroupedPacket.Count() == 0 )
+			continue;
+
+		const void *pData = pConn->m_GroupedPacket.Base();
+		int len = pConn->m_GroupedPacket.Count();
+		SendPacket( pConn, &pData, &len, 1 );
+		pConn->m_GroupedPacket.RemoveAll();
+	}
+}
+
+
+bool VMPI_SendChunks( void const * const *pChunks, const int *pChunkLengths, int nChunks, int iDest, int fVMPISendFlags )
+{
+	if ( iDest == VMPI_SEND_TO_ALL )
+	{
+		// Don't want new connections while in here!
+		AUTO_LOCK( g_ConnectionsMutex );
+
+		for ( int i=0; i < g_nConnections; i++ )
+			VMPI_SendChunks( pChunks, pChunkLengths, nChunks, i );
+
+		return true;
+	}
+	else if ( iDest == VMPI_PERSISTENT )
+	{
+		// Don't want new connections while in here!
+		AUTO_LOCK( g_ConnectionsMutex );
+
+		// Send the packet to everyone.
+		for ( int i=0; i < g_nConnections; i++ )
+			VMPI_SendChunks( pChunks, pChunkLengths, nChunks, i );
+
+		// Remember to send it to the new workers.
+		PersistentPacket *pNew = new PersistentPacket;
+		for ( int i=0; i < nChunks; i++ )
+			pNew->AddMultipleToTail( pChunkLengths[i], (const char*)pChunks[i] );
+
+		g_PersistentPackets.AddToTail( pNew );
+		return true;
+	}
+	else
+	{
+		if ( iDest < 0 || iDest >= g_nConnections )
+			return false;
+
+		g_nMessagesSent++;
+		g_nBytesSent += 4; // for message tag.
+		for ( int i=0; i < nChunks; i++ )
+			g_nBytesSent += pChunkLengths[i];
+
+		CVMPIConnection *pConnection = g_Connections[iDest];
+		AUTO_LOCK( pConnection->m_SendMutex );
+
+		if ( pConnection->m_Socket == -1 )
+			return false;
+
+		if ( g_bGroupPackets && (fVMPISendFlags & k_eVMPISendFlags_GroupPackets) )
+		{
+			VMPI_GroupPackets( pConnection, pChunks, pChunkLengths, nChunks );
+			return true;
+		}
+		else
+		{
+			return SendPacket( pConnection, pChunks, pChunkLengths, nChunks );
+		}
+	}
+}
+
+
+bool VMPI_Send2Chunks( const void *pChunk1, int chunk1Len, const void *pChunk2, int chunk2Len, int iDest, int fVMPISendFlags )
+{
+	const void *pChunks[2] = { pChunk1, pChunk2 };
+	int len[2] = { chunk1Len, chunk2Len };
+	return VMPI_SendChunks( pChunks, len, ARRAYSIZE( pChunks ), iDest, fVMPISendFlags );
+}
+
+
+bool VMPI_Send3Chunks( const void *pChunk1, int chunk1Len, const void *pChunk2, int chunk2Len, const void *pChunk3, int chunk3Len, int iDest, int fVMPISendFlags )
+{
+	const void *pChunks[3] = { pChunk1, pChunk2, pChunk3 };
+	int len[3] = { chunk1Len, chunk2Len, chunk3Len };
+	return VMPI_SendChunks( pChunks, len, ARRAYSIZE( pChunks ), iDest, fVMPISendFlags );
+}
+
+
+void VMPI_AddDisconnectHandler( VMPI_Disconnect_Handler handler )
+{
+	g_DisconnectHandlers.AddToTail( handler );
+}
+
+
+CVMPIConnection* GetConnection( int procID )
+{
+	Assert( procID >= 0 && procID < g_nConnections );
+	return g_Connections[procID];
+}
+
+
+bool VMPI_IsProcValid( int procID )
+{
+	return procID >= 0 && procID < g_nConnections;
+}
+
+
+bool VMPI_IsProcConnected( int procID )
+{
+	if ( procID < 0 || procID >= g_nConnections )
+	{
+		Assert( false );
+		return false;
+	}
+
+	return g_Connections[procID]->m_Socket != -1;
+}
+
+bool VMPI_IsProcAService( int procID )
+{
+	// There's no vmpi_service here.
+	return false;
+}
+
+void VMPI_Sleep( unsigned long ms )
+{
+	ThreadSleep( ms );
+}
+
+
+const char* VMPI_GetMachineName( int iProc )
+{
+	if ( g_bMPIMaster && iProc == VMPI_MASTER_ID )
+		return VMPI_GetLocalMachineName();
+
+	if ( iProc < 0 || iProc >= g_nConnections )
+	{
+		Assert( false );
+		return "invalid index";
+	}
+
+	return g_Connections[iProc]->GetMachineName();
+}
+
+
+void VMPI_SetMachineName( int iProc, const char *pName )
+{
+	if ( iProc < 0 || iProc >= g_nConnections )
+	{
+		Assert( false );
+		return;
+	}
+
+	g_Connections[iProc]->SetMachineName( pName );
+}
+
+
+bool VMPI_HasMachineNameBeenSet( int iProc )
+{
+	if ( iProc < 0 || iProc >= g_nConnections )
+	{
+		Assert( false );
+		return false;
+	}
+
+	return g_Connections[iProc]->HasMachineNameBeenSet();
+}
+
+
+const char* VMPI_GetLocalMachineName()
+{
+	static char cName[256];
+	if ( gethostname( cName, sizeof( cName ) ) == 0 )
+	{
+		cName[sizeof( cName ) - 1] = 0;
+		return cName;
+	}
+	else
+	{
+		return "(error in gethostname)";
+	}
+}
+
+
+unsigned long VMPI_GetJobWorkerID( int iProc )
+{
+	return GetConnection( iProc )->m_JobWorkerID;
+}
+
+
+void VMPI_SetJobWorkerID( int iProc, unsigned long jobWorkerID )
+{
+	GetConnection( iProc )->m_JobWorkerID = jobWorkerID;
+}
+
+
+void VMPI_GetCurrentStage( char *pOut, int strLen )
+{
+	AUTO_LOCK( g_CurrentStageMutex );
+	V_strncpy( pOut, g_CurrentStageString, strLen );
+}
+
+
+void VMPI_SetCurrentStage( const char *pCurStage )
+{
+	AUTO_LOCK( g_CurrentStageMutex );
+	V_strncpy( g_CurrentStageString, pCurStage, sizeof( g_CurrentStageString ) );
+}
+
+
+void VMPI_InviteDebugWorkers()
+{
+	// There's no job broadcast or password to change; just let in some more workers.
+	g_nMaxWorkerCount += 25;
+}
+
+
+bool VMPI_IsSDKMode()
+{
+	// Workers always get the command line from the master.
+	return true;
+}
+
+
+const char* VMPI_GetParamString( EVMPICmdLineParam eParam )
+{
+	if ( eParam <= k_eVMPICmdLineParam_FirstParam || eParam >= k_eVMPICmdLineParam_LastParam )
+	{
+		Assert( false );
+		Warning( "Invalid call: VMPI_GetParamString( %d )\n", eParam );
+		return "unknown";
+	}
+	else
+	{
+		return g_VMPIParams[eParam].m_pName;
+	}
+}
+
+int VMPI_GetParamFlags( EVMPICmdLineParam eParam )
+{
+	if ( eParam <= k_eVMPICmdLineParam_FirstParam || eParam >= k_eVMPICmdLineParam_LastParam )
+	{
+		Assert( false );
+		Warning( "Invalid call: VMPI_GetParamString( %d )\n", eParam );
+		return 0;
+	}
+	else
+	{
+		return g_VMPIParams[eParam].m_ParamFlags;
+	}
+}
+
+bool VMPI_IsParamUsed( EVMPICmdLineParam eParam )
+{
+	int iParam = CommandLine()->FindParm( VMPI_GetParamString( eParam ) );
+	return iParam != 0;
+}
+
+const char* VMPI_GetParamHelpString( EVMPICmdLineParam eParam )
+{
+	if ( eParam <= k_eVMPICmdLineParam_FirstParam || eParam >= k_eVMPICmdLineParam_LastParam )
+	{
+		Assert( false );
+		Warning( "Invalid call: VMPI_GetParamHelpString( %d )\n", eParam );
+		return "unknown vmpi param";
+	}
+	else
+	{
+		return g_VMPIParams[eParam].m_pHelpText;
+	}
+}
+
+void VMPI_PrintMsgOnMaster( const char *pMessage, ... )
+{
+	char formatted[2048];
+	va_list marker;
+	va_start( marker, pMessage );
+	V_vsnprintf( formatted, sizeof( formatted ), pMessage, marker );
+	va_end( marker );
+
+	if ( VMPI_IsMaster() )
+	{
+		Msg( "%s\n", formatted );
+	}
+	else
+	{
+		MessageBuffer mb;
+
+		char cPacketHeader[2] = {VMPI_INTERNAL_PACKET_ID, VMPI_INTERNAL_SUBPACKET_PRINT_ON_MASTER};
+		mb.write( cPacketHeader, sizeof( cPacketHeader ) );
+		mb.WriteString( formatted );
+
+		VMPI_SendData( mb.data, mb.getLen(), VMPI_MASTER_ID );
+	}
+}
+
+
+bool VMPI_IsThisMyIP( CIPAddr testIP )
+{
+	if ( testIP.ip[0] == 127 )
+		return true;
+
+	struct ifaddrs *pAddrs = NULL;
+	if ( getifaddrs( &pAddrs ) != 0 )
+		return false;
+
+	bool bFound = false;
+	for ( struct ifaddrs *pCur = pAddrs; pCur && !bFound; pCur = pCur->ifa_next )
+	{
+		if ( pCur->ifa_addr && pCur->ifa_addr->sa_family == AF_INET )
+		{
+			CIPAddr addr;
+			SockAddrToIPAddr( (const sockaddr_in*)pCur->ifa_addr, &addr );
+			bFound = ( memcmp( addr.ip, testIP.ip, sizeof( addr.ip ) ) == 0 );
+		}
+	}
+
+	freeifaddrs( pAddrs );
+	return bFound;
+}
+
+bool VMPI_IsThisWorkerRunningOnMasterMachine()
+{
+	if ( VMPI_IsMaster() )
+	{
+		return false;
+	}
+
+	if ( VMPI_IsProcValid( VMPI_MASTER_ID ) && VMPI_IsProcConnected( VMPI_MASTER_ID ) )
+	{
+		return VMPI_IsThisMyIP( GetConnection( VMPI_MASTER_ID )->m_RemoteAddr );
+	}
+
+	return false;
+}
+
+
+void VMPI_QueryRegistryForWorkers( CUtlVector<VMPIWorkerInfo_t> &registeredWorkers )
+{
+	// There's no VMPI registry here.
+	registeredWorkers.RemoveAll();
+}
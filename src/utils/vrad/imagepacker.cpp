@@ -14,12 +14,12 @@
 
 #include "vrad.h"
 #include "imagepacker.h"
+#include "threads.h"
+#include "pacifier.h"
 
 
 bool CImagePacker::Reset( int maxLightmapWidth, int maxLightmapHeight )
 {
-	int i;
-	
 	Assert( maxLightmapWidth <= MAX_MAX_LIGHTMAP_WIDTH );
 	
 	m_MaxLightmapWidth = maxLightmapWidth;
@@ -29,30 +29,51 @@ bool CImagePacker::Reset( int maxLightmapWidth, int maxLightmapHeight )
 	m_MaxBlockHeight = maxLightmapHeight + 1;
 
 	m_AreaUsed = 0;
-	m_MinimumHeight = -1;
-	for( i = 0; i < m_MaxLightmapWidth; i++ )
-    {
-		m_pLightmapWavefront[i] = -1;
-    }
+	m_AreaWasted = 0;
+	m_MinimumHeight = 0;
+
+	m_Skyline.RemoveAll();
+	SkylineSegment_t &floor = m_Skyline[m_Skyline.AddToTail()];
+	floor.m_X = 0;
+	floor.m_Y = 0;
+	floor.m_Width = maxLightmapWidth;
 	return true;
 }
 
 
-inline int CImagePacker::GetMaxYIndex( int firstX, int width )
+//-----------------------------------------------------------------------------
+// Returns the y a block would sit at with its left edge on the start of the
+// segment, or -1 if it doesn't fit there. pWaste gets the area it would leave
+// unusable underneath it.
+//-----------------------------------------------------------------------------
+int CImagePacker::FitBlock( int iSegment, int width, int height, int *pWaste ) const
 {
-	int maxY = -1;
-	int maxYIndex = 0;
-	for( int x = firstX; x < firstX + width; ++x )
+	int x = m_Skyline[iSegment].m_X;
+	if ( x + width > m_MaxLightmapWidth )
+		return -1;
+
+	int y = 0;
+	int widthLeft = width;
+	int i;
+	for ( i = iSegment; widthLeft > 0; i++ )
 	{
-		// NOTE: Want the equals here since we'll never be able to fit
-		// in between the multiple instances of maxY
-		if( m_pLightmapWavefront[x] >= maxY )
-		{
-			maxY = m_pLightmapWavefront[x];
-			maxYIndex = x;
-		}
+		y = max( y, m_Skyline[i].m_Y );
+		if ( y + height > m_MaxLightmapHeight )
+			return -1;
+		widthLeft -= m_Skyline[i].m_Width;
 	}
-	return maxYIndex;
+
+	int waste = 0;
+	widthLeft = width;
+	for ( i = iSegment; widthLeft > 0; i++ )
+	{
+		int covered = min( widthLeft, m_Skyline[i].m_Width );
+		waste += ( y - m_Skyline[i].m_Y ) * covered;
+		widthLeft -= covered;
+	}
+
+	*pWaste = waste;
+	return y;
 }
 
 
@@ -63,33 +84,28 @@ bool CImagePacker::AddBlock( int width, int height, int *returnX, int *returnY )
 	if ( ( width >= m_MaxBlockWidth ) && ( height >= m_MaxBlockHeight ) )
 		return false;
 
-	int bestX = -1;	
-	int maxYIdx;
-	int outerX = 0;
-	int outerMinY = m_MaxLightmapHeight;
-	int lastX = m_MaxLightmapWidth - width;
-	int lastMaxYVal = -2;
-	while (outerX <= lastX)
-	{
-		// Skip all tiles that have the last Y value, these
-		// aren't going to change our min Y value
-		if (m_pLightmapWavefront[outerX] == lastMaxYVal)
-		{
-			++outerX;
+	// Bottom-left: the spot that leaves the lowest top edge, then the one that wastes the least
+	int bestSegment = -1;
+	int bestY = 0;
+	int bestTop = INT_MAX;
+	int bestWaste = INT_MAX;
+	for ( int i = 0; i < m_Skyline.Count(); i++ )
+	{
+		int waste;
+		int y = FitBlock( i, width, height, &waste );
+		if ( y < 0 )
 			continue;
-		}
 
-		maxYIdx = GetMaxYIndex( outerX, width );
-		lastMaxYVal = m_pLightmapWavefront[maxYIdx];
-		if (outerMinY > lastMaxYVal)
+		if ( ( y + height < bestTop ) || ( y + height == bestTop && waste < bestWaste ) )
 		{
-			outerMinY = lastMaxYVal;
-			bestX = outerX;
+			bestSegment = i;
+			bestY = y;
+			bestTop = y + height;
+			bestWaste = waste;
 		}
-		outerX = maxYIdx + 1;
 	}
-	
-	if( bestX == -1 )
+
+	if( bestSegment == -1 )
 	{
 		// If we failed to add it, remember the block size that failed
 		// *only if both dimensions are smaller*!!
@@ -102,40 +118,237 @@ bool CImagePacker::AddBlock( int width, int height, int *returnX, int *returnY )
 
 		return false;
 	}
-	
+
 	// Set the return positions for the block.
-	*returnX = bestX;
-	*returnY = outerMinY + 1;
-	
-	// Check if it actually fit height-wise.
-	// hack
-	//  if( *returnY + height > maxLightmapHeight )
-	if( *returnY + height >= m_MaxLightmapHeight - 1 )
+	*returnX = m_Skyline[bestSegment].m_X;
+	*returnY = bestY;
+
+	// Raise the skyline over the block
+	SkylineSegment_t top;
+	top.m_X = *returnX;
+	top.m_Y = bestTop;
+	top.m_Width = width;
+	m_Skyline.InsertBefore( bestSegment, top );
+
+	int right = top.m_X + width;
+	int i = bestSegment + 1;
+	while ( i < m_Skyline.Count() && m_Skyline[i].m_X < right )
 	{
-		if ( ( width <= m_MaxBlockWidth ) && ( height <= m_MaxBlockHeight )	)
+		SkylineSegment_t &segment = m_Skyline[i];
+		int segmentRight = segment.m_X + segment.m_Width;
+		if ( segmentRight > right )
 		{
-			m_MaxBlockWidth = width;
-			m_MaxBlockHeight = height;
+			segment.m_Width = segmentRight - right;
+			segment.m_X = right;
+			break;
 		}
+		m_Skyline.Remove( i );
+	}
 
-		return false;
+	// Merge runs that ended up at the same height
+	for ( i = 0; i < m_Skyline.Count() - 1; )
+	{
+		if ( m_Skyline[i].m_Y == m_Skyline[i+1].m_Y )
+		{
+			m_Skyline[i].m_Width += m_Skyline[i+1].m_Width;
+			m_Skyline.Remove( i + 1 );
+		}
+		else
+		{
+			++i;
+		}
 	}
-						   
+
 	// It fit!
 	// Keep up with the smallest possible size for the image so far.
-	if( *returnY + height > m_MinimumHeight )
-		m_MinimumHeight = *returnY + height;
-	
-	// Update the wavefront info.
-	int x;
-	for( x = bestX; x < bestX + width; x++ )
-    {
-		m_pLightmapWavefront[x] = outerMinY + height;
-    }
-	
-	//  AddBlockToLightmapImage( *returnX, *returnY, width, height );
+	if( bestTop > m_MinimumHeight )
+		m_MinimumHeight = bestTop;
+
 	m_AreaUsed += width * height;
+	m_AreaWasted += bestWaste;
+
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Packing several pages
+//-----------------------------------------------------------------------------
+static CUtlVector<PackedBlock_t> *s_pPackBlocks;
+static CUtlVector< CUtlVector<int> > s_PageShares;
+static CUtlVector<CImagePacker> s_PagePackers;
 
+static int __cdecl ComparePackedBlocks( const void *a, const void *b )
+{
+	PackedBlock_t const &blockA = s_pPackBlocks->Element( *(int const *)a );
+	PackedBlock_t const &blockB = s_pPackBlocks->Element( *(int const *)b );
+
+	// largest first, then tallest, then in order
+	int areaA = blockA.m_nWidth * blockA.m_nHeight;
+	int areaB = blockB.m_nWidth * blockB.m_nHeight;
+	if ( areaA != areaB )
+		return ( areaA > areaB ) ? -1 : 1;
+	if ( blockA.m_nHeight != blockB.m_nHeight )
+		return ( blockA.m_nHeight > blockB.m_nHeight ) ? -1 : 1;
+	return *(int const *)a - *(int const *)b;
+}
+
+static bool AddBlockToPage( int iPage, int iBlock )
+{
+	PackedBlock_t &block = s_pPackBlocks->Element( iBlock );
+	if ( !s_PagePackers[iPage].AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+		return false;
+
+	block.m_nPage = iPage;
 	return true;
 }
 
+static void ThreadPackPage( int iThread, int iPage )
+{
+	CUtlVector<int> &share = s_PageShares[iPage];
+	for ( int i = 0; i < share.Count(); i++ )
+	{
+		AddBlockToPage( iPage, share[i] );
+	}
+}
+
+void PackImagePages( CUtlVector<PackedBlock_t> &blocks, int nPageWidth, int nPageHeight, ImagePackStats_t *pStats )
+{
+	memset( pStats, 0, sizeof( *pStats ) );
+	s_pPackBlocks = &blocks;
+
+	CUtlVector<int> sorted;
+	sorted.EnsureCapacity( blocks.Count() );
+	int64 nTotalArea = 0;
+	for ( int i = 0; i < blocks.Count(); i++ )
+	{
+		PackedBlock_t &block = blocks[i];
+		block.m_nPage = -1;
+		block.m_nX = block.m_nY = 0;
+		if ( block.m_nWidth > nPageWidth || block.m_nHeight > nPageHeight )
+		{
+			++pStats->m_nOversizedBlocks;
+			continue;
+		}
+
+		sorted.AddToTail( i );
+		nTotalArea += block.m_nWidth * block.m_nHeight;
+	}
+	qsort( sorted.Base(), sorted.Count(), sizeof( int ), ComparePackedBlocks );
+
+	// Deal the blocks out to the pages they'll need at least, keeping the area even,
+	// and pack each of those pages on its own thread
+	int64 nPageArea = (int64)nPageWidth * nPageHeight;
+	int nPages = (int)( ( nTotalArea + nPageArea - 1 ) / nPageArea );
+	s_PageShares.SetCount( nPages );
+	s_PagePackers.SetCount( nPages );
+
+	CUtlVector<int64> shareArea;
+	shareArea.SetCount( nPages );
+	for ( int i = 0; i < nPages; i++ )
+	{
+		s_PageShares[i].RemoveAll();
+		s_PagePackers[i].Reset( nPageWidth, nPageHeight );
+		shareArea[i] = 0;
+	}
+
+	for ( int i = 0; i < sorted.Count(); i++ )
+	{
+		int iSmallest = 0;
+		for ( int j = 1; j < nPages; j++ )
+		{
+			if ( shareArea[j] < shareArea[iSmallest] )
+				iSmallest = j;
+		}
+
+		PackedBlock_t &block = blocks[sorted[i]];
+		s_PageShares[iSmallest].AddToTail( sorted[i] );
+		shareArea[iSmallest] += block.m_nWidth * block.m_nHeight;
+	}
+
+	if ( nPages > 1 )
+	{
+		SuppressPacifier( true );
+		RunThreadsOnIndividual( nPages, false, ThreadPackPage );
+		SuppressPacifier( false );
+	}
+	else if ( nPages == 1 )
+	{
+		ThreadPackPage( 0, 0 );
+	}
+
+	// Anything that didn't fit in its page goes in the first page with room
+	for ( int i = 0; i < sorted.Count(); i++ )
+	{
+		if ( blocks[sorted[i]].m_nPage != -1 )
+			continue;
+
+		int iPage;
+		for ( iPage = 0; iPage < s_PagePackers.Count(); iPage++ )
+		{
+			if ( AddBlockToPage( iPage, sorted[i] ) )
+				break;
+		}
+
+		if ( iPage == s_PagePackers.Count() )
+		{
+			s_PagePackers[s_PagePackers.AddToTail()].Reset( nPageWidth, nPageHeight );
+			bool bAdded = AddBlockToPage( iPage, sorted[i] );
+			Assert( bAdded );
+			NOTE_UNUSED( bAdded );
+		}
+	}
+
+	pStats->m_nPages = s_PagePackers.Count();
+	for ( int i = 0; i < s_PagePackers.Count(); i++ )
+	{
+		pStats->m_nAreaUsed += s_PagePackers[i].GetAreaUsed();
+		pStats->m_nAreaWasted += s_PagePackers[i].GetAreaWasted();
+	}
+
+	s_PageShares.Purge();
+	s_PagePackers.Purge();
+	s_pPackBlocks = NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Lightmap page statistics
+//-----------------------------------------------------------------------------
+void PrintLightmapPageStats()
+{
+	CUtlVector<PackedBlock_t> blocks;
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		if ( f->lightofs == -1 || f->styles[0] == 255 )
+			continue;
+
+		// Bumped faces lay their lightmaps out side by side
+		PackedBlock_t &block = blocks[blocks.AddToTail()];
+		block.m_nWidth = f->m_LightmapTextureSizeInLuxels[0] + 1;
+		block.m_nHeight = f->m_LightmapTextureSizeInLuxels[1] + 1;
+		if ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT )
+		{
+			block.m_nWidth *= NUM_BUMP_VECTS + 1;
+		}
+	}
+
+	if ( !blocks.Count() )
+		return;
+
+	ImagePackStats_t stats;
+	PackImagePages( blocks, LIGHTMAP_PAGE_WIDTH, LIGHTMAP_PAGE_HEIGHT, &stats );
+
+	int64 nPageArea = (int64)LIGHTMAP_PAGE_WIDTH * LIGHTMAP_PAGE_HEIGHT;
+	int64 nUnderSkyline = stats.m_nAreaUsed + stats.m_nAreaWasted;
+	Msg( "Lightmap pages: %d lightmaps in %d %dx%d pages, %.1f%% occupancy, %.1f%% fragmentation",
+		blocks.Count(), stats.m_nPages, LIGHTMAP_PAGE_WIDTH, LIGHTMAP_PAGE_HEIGHT,
+		stats.m_nPages ? 100.0 * stats.m_nAreaUsed / ( stats.m_nPages * nPageArea ) : 0.0,
+		nUnderSkyline ? 100.0 * stats.m_nAreaWasted / nUnderSkyline : 0.0 );
+	if ( stats.m_nOversizedBlocks )
+	{
+		Msg( ", %d too big for a page", stats.m_nOversizedBlocks );
+	}
+	Msg( "\n" );
+}
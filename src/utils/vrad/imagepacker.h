@@ -19,8 +19,14 @@
 #pragma once
 #endif
 
+#include "tier1/utlvector.h"
+
 #define MAX_MAX_LIGHTMAP_WIDTH 2048
 
+// The engine's lightmap page size
+#define LIGHTMAP_PAGE_WIDTH		512
+#define LIGHTMAP_PAGE_HEIGHT	256
+
 
 //-----------------------------------------------------------------------------
 // This packs a single lightmap
@@ -31,13 +37,27 @@ public:
 	bool Reset( int maxLightmapWidth, int maxLightmapHeight );
 	bool AddBlock( int width, int height, int *returnX, int *returnY );
 
+	// Area covered by blocks, and area under the skyline that no block can use anymore
+	int GetAreaUsed() const { return m_AreaUsed; }
+	int GetAreaWasted() const { return m_AreaWasted; }
+	int GetMinimumHeight() const { return m_MinimumHeight; }
+
 protected:
-	int GetMaxYIndex( int firstX, int width );
+	// The top edge of the blocks packed so far, as runs of equal height from left to right
+	struct SkylineSegment_t
+	{
+		int m_X;
+		int m_Y;
+		int m_Width;
+	};
+
+	int FitBlock( int iSegment, int width, int height, int *pWaste ) const;
 
 	int m_MaxLightmapWidth;
 	int m_MaxLightmapHeight;
-	int m_pLightmapWavefront[MAX_MAX_LIGHTMAP_WIDTH];
+	CUtlVector<SkylineSegment_t> m_Skyline;
 	int m_AreaUsed;
+	int m_AreaWasted;
 	int m_MinimumHeight;
 
 	// For optimization purposes:
@@ -48,4 +68,34 @@ protected:
 };
 
 
+//-----------------------------------------------------------------------------
+// Packs a set of blocks into as few pages as possible. Blocks are placed largest
+// first; the first pages are filled in parallel, each from its own share of the
+// blocks, and whatever didn't fit goes into the pages one block at a time.
+//-----------------------------------------------------------------------------
+struct PackedBlock_t
+{
+	int m_nWidth;
+	int m_nHeight;
+
+	// Filled in by PackImagePages. m_nPage is -1 if the block is bigger than a page.
+	int m_nPage;
+	int m_nX;
+	int m_nY;
+};
+
+struct ImagePackStats_t
+{
+	int m_nPages;
+	int m_nOversizedBlocks;
+	int64 m_nAreaUsed;
+	int64 m_nAreaWasted;
+};
+
+void PackImagePages( CUtlVector<PackedBlock_t> &blocks, int nPageWidth, int nPageHeight, ImagePackStats_t *pStats );
+
+// Reports how the face lightmaps pack into engine lightmap pages
+void PrintLightmapPageStats();
+
+
 #endif // IMAGEPACKER_H
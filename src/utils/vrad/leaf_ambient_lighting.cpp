@@ -89,29 +89,38 @@ float Engine_WorldLightDistanceFalloff( const dworldlight_t *wl, const Vector& d
 }
 
 
-void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
+// Adds up to 8 emit_surface lights, testing the visibility of all of them with one ray packet.
+static void AddEmitSurfaceLightBatch( const Vector &vStart, int const *pLights, int nLights, Vector lightBoxColor[6] )
 {
-	fltx4 fractionVisible;
-
-	FourVectors vStart4, wlOrigin4;
-	vStart4.DuplicateVector ( vStart );
+	Assert( nLights > 0 && nLights <= 8 );
 
-	for ( int iLight=0; iLight < *pNumworldlights; iLight++ )
+	// Pad out the packet with copies of the first light
+	FourVectors vStart4[2], wlOrigin4[2];
+	for ( int h=0; h < 2; h++ )
 	{
-		dworldlight_t *wl = &dworldlights[iLight];
-
-		// Should this light even go in the ambient cubes?
-		if ( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
-			continue;
+		vStart4[h].DuplicateVector( vStart );
+		for ( int i=0; i < 4; i++ )
+		{
+			int iSlot = 4*h + i;
+			const Vector &vOrigin = dworldlights[ pLights[ iSlot < nLights ? iSlot : 0 ] ].origin;
+			wlOrigin4[h].X( i ) = vOrigin.x;
+			wlOrigin4[h].Y( i ) = vOrigin.y;
+			wlOrigin4[h].Z( i ) = vOrigin.z;
+		}
+	}
 
-		Assert( wl->type == emit_surface );
+	// Can these lights see the point?
+	fltx4 fractionVisible[2];
+	TestLine8( vStart4, wlOrigin4, fractionVisible );
 
-		// Can this light see the point?
-		wlOrigin4.DuplicateVector ( wl->origin );
-		TestLine ( vStart4, wlOrigin4, &fractionVisible );
-		if ( !TestSignSIMD ( CmpGtSIMD ( fractionVisible, Four_Zeros ) ) )
+	for ( int iSlot=0; iSlot < nLights; iSlot++ )
+	{
+		float flFractionVisible = SubFloat( fractionVisible[iSlot / 4], iSlot % 4 );
+		if ( flFractionVisible <= 0 )
 			continue;
 
+		dworldlight_t *wl = &dworldlights[ pLights[iSlot] ];
+
 		// Add this light's contribution.
 		Vector vDelta = wl->origin - vStart;
 		float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
@@ -120,7 +129,7 @@ void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
 		VectorNormalize( vDeltaNorm );
 		float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
 
-		float ratio = flDistanceScale * flAngleScale * SubFloat ( fractionVisible, 0 );
+		float ratio = flDistanceScale * flAngleScale * flFractionVisible;
 		if ( ratio == 0 )
 			continue;
 
@@ -132,7 +141,37 @@ void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
 				lightBoxColor[i] += wl->intensity * (t * ratio);
 			}
 		}
-	}	
+	}
+}
+
+
+void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
+{
+	int iBatch[8];
+	int nBatch = 0;
+
+	for ( int iLight=0; iLight < *pNumworldlights; iLight++ )
+	{
+		dworldlight_t *wl = &dworldlights[iLight];
+
+		// Should this light even go in the ambient cubes?
+		if ( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
+			continue;
+
+		Assert( wl->type == emit_surface );
+
+		iBatch[nBatch++] = iLight;
+		if ( nBatch == ARRAYSIZE( iBatch ) )
+		{
+			AddEmitSurfaceLightBatch( vStart, iBatch, nBatch, lightBoxColor );
+			nBatch = 0;
+		}
+	}
+
+	if ( nBatch )
+	{
+		AddEmitSurfaceLightBatch( vStart, iBatch, nBatch, lightBoxColor );
+	}
 }
 
 
@@ -203,69 +242,75 @@ class CLeafSampler
 public:
 	CLeafSampler( int iThread ) : m_iThread(iThread) {}
 
-	// Generate a random point in the leaf's bounding volume
 	// reject any points that aren't actually in the leaf
 	// do a couple of tracing heuristics to eliminate points that are inside detail brushes 
 	// or underneath displacement surfaces in the leaf
-	// return once we have a valid point, use the center if one can't be computed quickly
-	void GenerateLeafSamplePosition( int leafIndex, const CUtlVector<dplane_t> &leafPlanes, Vector &samplePosition )
+	bool IsValidLeafSamplePosition( int leafIndex, const CUtlVector<dplane_t> &leafPlanes, const Vector &samplePosition )
 	{
 		dleaf_t *pLeaf = dleafs + leafIndex;
 
-		float dx = pLeaf->maxs[0] - pLeaf->mins[0];
-		float dy = pLeaf->maxs[1] - pLeaf->mins[1];
-		float dz = pLeaf->maxs[2] - pLeaf->mins[2];
-		bool bValid = false;
-		for ( int i = 0; i < 1000 && !bValid; i++ )
+		for ( int j = leafPlanes.Count(); --j >= 0; )
 		{
-			samplePosition.x = pLeaf->mins[0] + m_random.RandomFloat(0, dx);
-			samplePosition.y = pLeaf->mins[1] + m_random.RandomFloat(0, dy);
-			samplePosition.z = pLeaf->mins[2] + m_random.RandomFloat(0, dz);
-			bValid = true;
-
-			for ( int j = leafPlanes.Count(); --j >= 0 && bValid; )
+			float d = DotProduct(leafPlanes[j].normal, samplePosition) - leafPlanes[j].dist;
+			if ( d < DIST_EPSILON )
 			{
-				float d = DotProduct(leafPlanes[j].normal, samplePosition) - leafPlanes[j].dist;
-				if ( d < DIST_EPSILON )
-				{
-					// not inside the leaf, try again 
-					bValid = false;
-					break;
-				}
+				// not inside the leaf
+				return false;
 			}
-			if ( !bValid )
-				continue;
+		}
 
-			for ( int j = 0; j < 6; j++ )
+		for ( int j = 0; j < 6; j++ )
+		{
+			Vector start = samplePosition;
+			int axis = j%3;
+			start[axis] = (j<3) ? pLeaf->mins[axis] : pLeaf->maxs[axis];
+			float t;
+			Vector normal;
+			CastRayInLeaf( m_iThread, samplePosition, start, leafIndex, &t, &normal );
+			if ( t == 0.0f )
 			{
-				Vector start = samplePosition;
-				int axis = j%3;
-				start[axis] = (j<3) ? pLeaf->mins[axis] : pLeaf->maxs[axis];
-				float t;
-				Vector normal;
-				CastRayInLeaf( m_iThread, samplePosition, start, leafIndex, &t, &normal );
-				if ( t == 0.0f )
-				{
-					// inside a func_detail, try again.
-					bValid = false;
-					break;
-				}
-				if ( t != 1.0f )
+				// inside a func_detail
+				return false;
+			}
+			if ( t != 1.0f )
+			{
+				Vector delta = start - samplePosition;
+				if ( DotProduct(delta, normal) > 0 )
 				{
-					Vector delta = start - samplePosition;
-					if ( DotProduct(delta, normal) > 0 )
-					{
-						// hit backside of displacement, try again.
-						bValid = false;
-						break;
-					}
+					// hit backside of displacement
+					return false;
 				}
 			}
 		}
-		if ( !bValid )
+		return true;
+	}
+
+	// Generate a random point in the box, rejecting points that aren't valid sample positions.
+	// Returns false if none turned up in nTries.
+	bool GenerateSamplePositionInBox( int leafIndex, const CUtlVector<dplane_t> &leafPlanes, const Vector &mins, const Vector &maxs, int nTries, Vector &samplePosition )
+	{
+		for ( int i = 0; i < nTries; i++ )
+		{
+			samplePosition.x = mins.x + m_random.RandomFloat(0, maxs.x - mins.x);
+			samplePosition.y = mins.y + m_random.RandomFloat(0, maxs.y - mins.y);
+			samplePosition.z = mins.z + m_random.RandomFloat(0, maxs.z - mins.z);
+			if ( IsValidLeafSamplePosition( leafIndex, leafPlanes, samplePosition ) )
+				return true;
+		}
+		return false;
+	}
+
+	// Generate a random point in the leaf's bounding volume
+	// return once we have a valid point, use the center if one can't be computed quickly
+	void GenerateLeafSamplePosition( int leafIndex, const CUtlVector<dplane_t> &leafPlanes, Vector &samplePosition )
+	{
+		dleaf_t *pLeaf = dleafs + leafIndex;
+		Vector mins( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] );
+		Vector maxs( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] );
+		if ( !GenerateSamplePositionInBox( leafIndex, leafPlanes, mins, maxs, 1000, samplePosition ) )
 		{
 			// didn't generate a valid sample point, just use the center of the leaf bbox
-			samplePosition = ( Vector( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] ) + Vector( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] ) ) * 0.5f;
+			samplePosition = ( mins + maxs ) * 0.5f;
 		}
 	}
 
@@ -381,6 +426,9 @@ void AddSampleToList( CUtlVector<ambientsample_t> &list, const Vector &samplePos
 	list.FastRemove( nearestNeighborIndex );
 }
 
+// cubes closer than this in gamma space (see CubeDeltaGammaSpace) are considered the same
+#define AMBIENT_GAMMA_TOLERANCE 3
+
 // max number of units in gamma space of per-side delta
 int CubeDeltaGammaSpace( Vector *pCube0, Vector *pCube1 )
 {
@@ -437,7 +485,7 @@ void CompressAmbientSampleList( CUtlVector<ambientsample_t> &list )
 		if ( list.Count() > 1 )
 		{
 			Mod_LeafAmbientColorAtPos( testCube, list[i].pos, list, i );
-			if ( CubeDeltaGammaSpace(testCube, list[i].cube) < 3 )
+			if ( CubeDeltaGammaSpace(testCube, list[i].cube) < AMBIENT_GAMMA_TOLERANCE )
 			{
 				list.FastRemove(i);
 				i--;
@@ -522,6 +570,173 @@ static byte Fixed8Fraction( float t, float tMin, float tMax )
 
 CUtlVector< CUtlVector<ambientsample_t> > g_LeafAmbientSamples;
 
+// at most this many candidate samples per leaf
+#define MAX_LEAF_AMBIENT_CANDIDATES 128
+
+//-----------------------------------------------------------------------------
+// A grid of candidate sample points over a leaf's bounds. The points are placed
+// up front, but only lit as the refinement reaches them: a box of the grid is
+// lit at its corners and only split when those disagree, so leaves with smooth
+// lighting are done with a handful of samples instead of all of them.
+//-----------------------------------------------------------------------------
+class CLeafAmbientGrid
+{
+public:
+	CLeafAmbientGrid( int iThread, int leafID, const CUtlVector<dplane_t> &leafPlanes, CLeafSampler &sampler, const int nSize[3] ) : 
+		m_iThread( iThread )
+	{
+		dleaf_t *pLeaf = dleafs + leafID;
+		Vector mins( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] );
+		Vector maxs( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] );
+		Vector cellSize;
+		for ( int i = 0; i < 3; i++ )
+		{
+			m_nSize[i] = nSize[i];
+			cellSize[i] = ( maxs[i] - mins[i] ) / nSize[i];
+		}
+
+		m_Points.SetCount( nSize[0] * nSize[1] * nSize[2] );
+		for ( int z = 0; z < nSize[2]; z++ )
+		{
+			for ( int y = 0; y < nSize[1]; y++ )
+			{
+				for ( int x = 0; x < nSize[0]; x++ )
+				{
+					gridpoint_t &point = Point( x, y, z );
+					point.bLit = false;
+
+					// Use the center of the cell, or somewhere else in it if that's in a detail brush
+					Vector cellMins = mins + Vector( x * cellSize.x, y * cellSize.y, z * cellSize.z );
+					Vector cellMaxs = cellMins + cellSize;
+					point.pos = ( cellMins + cellMaxs ) * 0.5f;
+					point.bValid = sampler.IsValidLeafSamplePosition( leafID, leafPlanes, point.pos ) ||
+						sampler.GenerateSamplePositionInBox( leafID, leafPlanes, cellMins, cellMaxs, 16, point.pos );
+				}
+			}
+		}
+	}
+
+	// Lights the corners of the box (inclusive grid coordinates) and recurses into
+	// its halves if they don't all match
+	void Refine( const int lo[3], const int hi[3] )
+	{
+		gridpoint_t *pCorners[8];
+		int nCorners = 0;
+		bool bSplit = false;
+		for ( int i = 0; i < 8; i++ )
+		{
+			gridpoint_t *pPoint = LightPoint( (i & 1) ? hi[0] : lo[0], (i & 2) ? hi[1] : lo[1], (i & 4) ? hi[2] : lo[2] );
+			if ( !pPoint )
+			{
+				// can't tell what the lighting is doing here without more samples
+				bSplit = true;
+				continue;
+			}
+
+			for ( int j = 0; j < nCorners && !bSplit; j++ )
+			{
+				if ( pCorners[j] != pPoint && CubeDeltaGammaSpace( pCorners[j]->cube, pPoint->cube ) >= AMBIENT_GAMMA_TOLERANCE )
+				{
+					bSplit = true;
+				}
+			}
+			pCorners[nCorners++] = pPoint;
+		}
+
+		if ( !bSplit )
+			return;
+
+		// Split every axis that still has grid points between the corners
+		int split[3][3];
+		int nHalves[3];
+		for ( int i = 0; i < 3; i++ )
+		{
+			if ( hi[i] - lo[i] > 1 )
+			{
+				int mid = ( lo[i] + hi[i] ) / 2;
+				split[i][0] = lo[i];
+				split[i][1] = mid;
+				split[i][2] = hi[i];
+				nHalves[i] = 2;
+			}
+			else
+			{
+				split[i][0] = lo[i];
+				split[i][1] = hi[i];
+				nHalves[i] = 1;
+			}
+		}
+
+		if ( nHalves[0] * nHalves[1] * nHalves[2] == 1 )
+			return;
+
+		for ( int z = 0; z < nHalves[2]; z++ )
+		{
+			for ( int y = 0; y < nHalves[1]; y++ )
+			{
+				for ( int x = 0; x < nHalves[0]; x++ )
+				{
+					int childLo[3] = { split[0][x], split[1][y], split[2][z] };
+					int childHi[3] = { split[0][x+1], split[1][y+1], split[2][z+1] };
+					Refine( childLo, childHi );
+				}
+			}
+		}
+	}
+
+	void RefineAll()
+	{
+		int lo[3] = { 0, 0, 0 };
+		int hi[3] = { m_nSize[0] - 1, m_nSize[1] - 1, m_nSize[2] - 1 };
+		Refine( lo, hi );
+	}
+
+	// add every sample that got lit to the list
+	void AddSamplesToList( CUtlVector<ambientsample_t> &list )
+	{
+		for ( int i = 0; i < m_Points.Count(); i++ )
+		{
+			if ( m_Points[i].bLit )
+			{
+				AddSampleToList( list, m_Points[i].pos, m_Points[i].cube );
+			}
+		}
+	}
+
+private:
+	struct gridpoint_t
+	{
+		Vector pos;
+		Vector cube[6];
+		bool bValid;
+		bool bLit;
+	};
+
+	gridpoint_t &Point( int x, int y, int z )
+	{
+		return m_Points[ ( z * m_nSize[1] + y ) * m_nSize[0] + x ];
+	}
+
+	// returns NULL if there's no valid sample position in this cell
+	gridpoint_t *LightPoint( int x, int y, int z )
+	{
+		gridpoint_t &point = Point( x, y, z );
+		if ( !point.bValid )
+			return NULL;
+
+		if ( !point.bLit )
+		{
+			ComputeAmbientFromSphericalSamples( m_iThread, point.pos, point.cube );
+			point.bLit = true;
+		}
+		return &point;
+	}
+
+	int m_iThread;
+	int m_nSize[3];
+	CUtlVector<gridpoint_t> m_Points;
+};
+
 void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t> &list )
 {
 	CUtlVector<dplane_t> leafPlanes;
@@ -529,35 +744,49 @@ void ComputeAmbientForLeaf( int iThread, int leafID, CUtlVector<ambientsample_t>
 
 	GetLeafBoundaryPlanes( leafPlanes, leafID );
 	list.RemoveAll();
-	// this heuristic tries to generate at least one sample per volume (chosen to be similar to the size of a player) in the space
-	int xSize = (dleafs[leafID].maxs[0] - dleafs[leafID].mins[0]) / 32;
-	int ySize = (dleafs[leafID].maxs[1] - dleafs[leafID].mins[1]) / 32;
-	int zSize = (dleafs[leafID].maxs[2] - dleafs[leafID].mins[2]) / 64;
-	xSize = max(xSize,1);
-	ySize = max(xSize,1);
-	zSize = max(xSize,1);
-	// generate update 128 candidate samples, always at least one sample
-	int volumeCount = xSize * ySize * zSize;
-	if ( g_bFastAmbient )
-	{
-		// save compute time, only do one sample
-		volumeCount = 1;
-	}
-	int sampleCount = clamp( volumeCount, 1, 128 );
 	if ( dleafs[leafID].contents & CONTENTS_SOLID )
 	{
 		// don't generate any samples in solid leaves
 		// NOTE: We copy the nearest non-solid leaf sample pointers into this leaf at the end
 		return;
 	}
+
+	// this heuristic tries to generate at least one candidate per volume (chosen to be similar to the size of a player) in the space
+	int nSize[3];
+	nSize[0] = max( (dleafs[leafID].maxs[0] - dleafs[leafID].mins[0]) / 32, 1 );
+	nSize[1] = max( (dleafs[leafID].maxs[1] - dleafs[leafID].mins[1]) / 32, 1 );
+	nSize[2] = max( (dleafs[leafID].maxs[2] - dleafs[leafID].mins[2]) / 64, 1 );
+	while ( nSize[0] * nSize[1] * nSize[2] > MAX_LEAF_AMBIENT_CANDIDATES )
+	{
+		int axis = ( nSize[0] >= nSize[1] ) ? 0 : 1;
+		if ( nSize[2] > nSize[axis] )
+			axis = 2;
+		nSize[axis] = ( nSize[axis] + 1 ) / 2;
+	}
+
 	Vector cube[6];
-	for ( int i = 0; i < sampleCount; i++ )
+	if ( g_bFastAmbient || nSize[0] * nSize[1] * nSize[2] == 1 )
+	{
+		// save compute time, only do one sample
+		Vector samplePosition;
+		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
+		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
+		AddSampleToList( list, samplePosition, cube );
+		return;
+	}
+
+	// start with the corners of the grid and only light the rest where they disagree
+	// note adding to the list will remove the least valuable sample once the limit is reached
+	CLeafAmbientGrid grid( iThread, leafID, leafPlanes, sampler, nSize );
+	grid.RefineAll();
+	grid.AddSamplesToList( list );
+
+	if ( !list.Count() )
 	{
-		// compute each candidate sample and add to the list
+		// no valid position on the grid, fall back to anywhere in the leaf
 		Vector samplePosition;
 		sampler.GenerateLeafSamplePosition( leafID, leafPlanes, samplePosition );
 		ComputeAmbientFromSphericalSamples( iThread, samplePosition, cube );
-		// note this will remove the least valuable sample once the limit is reached
 		AddSampleToList( list, samplePosition, cube );
 	}
 
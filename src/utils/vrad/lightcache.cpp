@@ -0,0 +1,452 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-face direct lighting cache for -incremental
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "lightcache.h"
+#include "gamebspfile.h"
+#include "filesystem.h"
+
+
+#define LIGHTCACHE_ID			( ( 'C' << 24 ) + ( 'L' << 16 ) + ( 'V' << 8 ) + 'V' )
+#define LIGHTCACHE_VERSION		1
+
+struct LightCacheHeader_t
+{
+	int32 m_nId;
+	int32 m_nVersion;
+	uint8 m_Key[MD5_DIGEST_LENGTH];
+	int32 m_nFaces;
+	int32 m_nLights;
+	int32 m_nPVSBytes;
+	int32 m_nLightValues;
+};
+
+CLightCache g_LightCache;
+bool g_bIncrementalLighting = false;
+
+
+CLightCache::CLightCache()
+{
+	m_nPVSBytes = 0;
+	m_bLoaded = false;
+	m_bLightsChanged = true;
+	memset( m_Key, 0, sizeof( m_Key ) );
+}
+
+
+static void MD5UpdateData( MD5Context_t *pCtx, void const *pData, int nBytes )
+{
+	if ( nBytes > 0 )
+		MD5Update( pCtx, (unsigned char const *)pData, nBytes );
+}
+
+
+//-----------------------------------------------------------------------------
+// Everything other than the lights that goes into a face's direct lighting.
+//-----------------------------------------------------------------------------
+void CLightCache::ComputeKey( uint8 key[MD5_DIGEST_LENGTH] )
+{
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+
+	int32 nSettings[] = 
+	{
+		LIGHTCACHE_VERSION, numfaces, do_fast, do_extra, extrapasses, do_centersamples, g_bHDR,
+		g_bTextureShadows, g_bStaticPropPolys, g_bDisablePropSelfShadowing, g_bLargeDispSampleRadius, dlight_map
+	};
+	MD5UpdateData( &ctx, nSettings, sizeof( nSettings ) );
+
+	float flSettings[] = 
+	{
+		g_flSkySampleScale, g_SunAngularExtent, smoothing_threshold, dlight_threshold, g_flMaxDispSampleSize
+	};
+	MD5UpdateData( &ctx, flSettings, sizeof( flSettings ) );
+
+	MD5UpdateData( &ctx, dplanes, numplanes * sizeof( dplane_t ) );
+	MD5UpdateData( &ctx, dvertexes, numvertexes * sizeof( dvertex_t ) );
+	MD5UpdateData( &ctx, dedges, numedges * sizeof( dedge_t ) );
+	MD5UpdateData( &ctx, dsurfedges, numsurfedges * sizeof( int ) );
+	MD5UpdateData( &ctx, texinfo.Base(), texinfo.Count() * sizeof( texinfo_t ) );
+	MD5UpdateData( &ctx, dtexdata, numtexdata * sizeof( dtexdata_t ) );
+	MD5UpdateData( &ctx, g_dispinfo.Base(), g_dispinfo.Count() * sizeof( ddispinfo_t ) );
+	MD5UpdateData( &ctx, g_DispVerts.Base(), g_DispVerts.Count() * sizeof( CDispVert ) );
+	MD5UpdateData( &ctx, g_DispTris.Base(), g_DispTris.Count() * sizeof( CDispTri ) );
+
+	// The lighting outputs live in the faces, leave them out
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t face = g_pFaces[i];
+		memset( face.styles, 0, sizeof( face.styles ) );
+		face.lightofs = 0;
+		MD5UpdateData( &ctx, &face, sizeof( face ) );
+	}
+
+	// Static props shadow the world
+	GameLumpHandle_t hLump = g_GameLumps.GetGameLumpHandle( GAMELUMP_STATIC_PROPS );
+	if ( hLump != g_GameLumps.InvalidGameLump() )
+	{
+		MD5UpdateData( &ctx, g_GameLumps.GetGameLump( hLump ), g_GameLumps.GameLumpSize( hLump ) );
+	}
+
+	MD5Final( key, &ctx );
+}
+
+
+void CLightCache::MakeCachedLight( directlight_t const *dl, CachedLight_t *pOut )
+{
+	// Zero the padding so the records can be compared with memcmp
+	memset( pOut, 0, sizeof( *pOut ) );
+	pOut->m_Light = dl->light;
+	pOut->m_nFaceNum = dl->facenum;
+	pOut->m_nTexData = dl->texdata;
+	pOut->m_flStartFadeDistance = dl->m_flStartFadeDistance;
+	pOut->m_flEndFadeDistance = dl->m_flEndFadeDistance;
+	pOut->m_flCapDist = dl->m_flCapDist;
+}
+
+
+bool CLightCache::Load( char const *pFilename )
+{
+	if ( !g_pFileSystem->FileExists( pFilename ) )
+		return false;
+
+	FileHandle_t fp = g_pFileSystem->Open( pFilename, "rb" );
+	if ( !fp )
+		return false;
+
+	LightCacheHeader_t header;
+	unsigned int nFileSize = g_pFileSystem->Size( fp );
+	if ( nFileSize < sizeof( header ) ||
+		 g_pFileSystem->Read( &header, sizeof( header ), fp ) != sizeof( header ) ||
+		 header.m_nId != LIGHTCACHE_ID ||
+		 header.m_nVersion != LIGHTCACHE_VERSION ||
+		 memcmp( header.m_Key, m_Key, MD5_DIGEST_LENGTH ) ||
+		 header.m_nFaces != numfaces ||
+		 header.m_nPVSBytes != m_nPVSBytes ||
+		 header.m_nLights < 0 || header.m_nLightValues < 0 ||
+		 nFileSize != sizeof( header ) + (uint64)header.m_nFaces * sizeof( CachedFace_t ) + 
+			(uint64)header.m_nLights * ( sizeof( CachedLight_t ) + header.m_nPVSBytes ) + 
+			(uint64)header.m_nLightValues * sizeof( LightingValue_t ) )
+	{
+		g_pFileSystem->Close( fp );
+		return false;
+	}
+
+	m_Faces.SetCount( header.m_nFaces );
+	m_Lights.SetCount( header.m_nLights );
+	m_LightPVS.SetCount( header.m_nLights * header.m_nPVSBytes );
+	m_LightValues.SetCount( header.m_nLightValues );
+
+	int nFaceBytes = m_Faces.Count() * sizeof( CachedFace_t );
+	int nLightBytes = m_Lights.Count() * sizeof( CachedLight_t );
+	int nValueBytes = m_LightValues.Count() * sizeof( LightingValue_t );
+	bool bOk = g_pFileSystem->Read( m_Faces.Base(), nFaceBytes, fp ) == nFaceBytes &&
+		g_pFileSystem->Read( m_Lights.Base(), nLightBytes, fp ) == nLightBytes &&
+		g_pFileSystem->Read( m_LightPVS.Base(), m_LightPVS.Count(), fp ) == m_LightPVS.Count() &&
+		g_pFileSystem->Read( m_LightValues.Base(), nValueBytes, fp ) == nValueBytes;
+	g_pFileSystem->Close( fp );
+
+	// Make sure every face's values are in the file
+	for ( int i = 0; bOk && i < m_Faces.Count(); i++ )
+	{
+		CachedFace_t const &face = m_Faces[i];
+		int nStyles = 0;
+		while ( nStyles < MAXLIGHTMAPS && face.m_Styles[nStyles] != 255 )
+			++nStyles;
+
+		bOk = face.m_nSamples >= 0 && face.m_nNormals >= 1 && face.m_nNormals <= NUM_BUMP_VECTS + 1 &&
+			face.m_nFirstValue >= 0 &&
+			(int64)face.m_nFirstValue + (int64)nStyles * face.m_nNormals * face.m_nSamples <= m_LightValues.Count();
+	}
+
+	if ( !bOk )
+	{
+		m_Faces.Purge();
+		m_Lights.Purge();
+		m_LightPVS.Purge();
+		m_LightValues.Purge();
+	}
+	return bOk;
+}
+
+
+//-----------------------------------------------------------------------------
+// Matches the active lights against the cached ones. Lights sort by their bytes
+// so identical ones line up, and whatever's left over on either side changed.
+//-----------------------------------------------------------------------------
+struct LightCacheRef_t
+{
+	void const *m_pLight;
+	byte const *m_pPVS;
+};
+
+static int s_nCachedLightSize;
+
+static int __cdecl CompareLightCacheRefs( const void *a, const void *b )
+{
+	return memcmp( ((LightCacheRef_t const *)a)->m_pLight, ((LightCacheRef_t const *)b)->m_pLight, s_nCachedLightSize );
+}
+
+void CLightCache::MarkChangedFaces()
+{
+	CUtlVector<CachedLight_t> newLights;
+	CUtlVector<LightCacheRef_t> newRefs;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		MakeCachedLight( dl, &newLights[newLights.AddToTail()] );
+	}
+
+	int i = 0;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next, i++ )
+	{
+		LightCacheRef_t &ref = newRefs[newRefs.AddToTail()];
+		ref.m_pLight = &newLights[i];
+		ref.m_pPVS = dl->pvs;
+	}
+
+	CUtlVector<LightCacheRef_t> oldRefs;
+	oldRefs.SetCount( m_Lights.Count() );
+	for ( i = 0; i < m_Lights.Count(); i++ )
+	{
+		oldRefs[i].m_pLight = &m_Lights[i];
+		oldRefs[i].m_pPVS = &m_LightPVS[i * m_nPVSBytes];
+	}
+
+	s_nCachedLightSize = sizeof( CachedLight_t );
+	qsort( newRefs.Base(), newRefs.Count(), sizeof( LightCacheRef_t ), CompareLightCacheRefs );
+	qsort( oldRefs.Base(), oldRefs.Count(), sizeof( LightCacheRef_t ), CompareLightCacheRefs );
+
+	// Merge the PVS of every light that's only in one of the lists
+	CUtlVector<byte> changedPVS;
+	changedPVS.SetCount( m_nPVSBytes );
+	memset( changedPVS.Base(), 0, m_nPVSBytes );
+
+	int nChanged = 0;
+	bool bChangedEverywhere = false;
+	int iNew = 0, iOld = 0;
+	while ( iNew < newRefs.Count() || iOld < oldRefs.Count() )
+	{
+		LightCacheRef_t const *pChanged;
+		if ( iNew == newRefs.Count() )
+		{
+			pChanged = &oldRefs[iOld++];
+		}
+		else if ( iOld == oldRefs.Count() )
+		{
+			pChanged = &newRefs[iNew++];
+		}
+		else
+		{
+			int nCmp = CompareLightCacheRefs( &newRefs[iNew], &oldRefs[iOld] );
+			if ( nCmp == 0 )
+			{
+				++iNew;
+				++iOld;
+				continue;
+			}
+			pChanged = ( nCmp < 0 ) ? &newRefs[iNew++] : &oldRefs[iOld++];
+		}
+
+		++nChanged;
+		if ( !pChanged->m_pPVS )
+		{
+			bChangedEverywhere = true;
+			continue;
+		}
+
+		for ( i = 0; i < m_nPVSBytes; i++ )
+		{
+			changedPVS[i] |= pChanged->m_pPVS[i];
+		}
+	}
+
+	m_bLightsChanged = ( nChanged != 0 );
+	m_FacesToLight.SetCount( ( numfaces + 7 ) / 8 );
+	memset( m_FacesToLight.Base(), 0, m_FacesToLight.Count() );
+
+	if ( m_bLightsChanged )
+	{
+		if ( bChangedEverywhere || dvis->numclusters == 0 )
+		{
+			memset( m_FacesToLight.Base(), 0xFF, m_FacesToLight.Count() );
+		}
+		else
+		{
+			MarkFacesInClusters( changedPVS.Base(), m_FacesToLight.Base() );
+
+			// Faces that aren't in any leaf (brush entities) can't be culled by PVS
+			CUtlVector<byte> allClusters, facesInLeaves;
+			allClusters.SetCount( m_nPVSBytes );
+			memset( allClusters.Base(), 0xFF, m_nPVSBytes );
+			facesInLeaves.SetCount( m_FacesToLight.Count() );
+			memset( facesInLeaves.Base(), 0, facesInLeaves.Count() );
+			MarkFacesInClusters( allClusters.Base(), facesInLeaves.Base() );
+
+			for ( i = 0; i < m_FacesToLight.Count(); i++ )
+			{
+				m_FacesToLight[i] |= ~facesInLeaves[i];
+			}
+		}
+	}
+
+	int nFacesToLight = 0;
+	for ( i = 0; i < numfaces; i++ )
+	{
+		if ( m_FacesToLight[i >> 3] & ( 1 << ( i & 7 ) ) )
+			++nFacesToLight;
+	}
+
+	Msg( "Incremental lighting: %d of %d lights changed, relighting %d of %d faces\n", 
+		nChanged, newRefs.Count(), nFacesToLight, numfaces );
+}
+
+
+void CLightCache::PrepareForLighting( char const *pFilename )
+{
+	m_nPVSBytes = ( dvis->numclusters / 8 ) + 1;
+	ComputeKey( m_Key );
+
+	m_bLoaded = Load( pFilename );
+	if ( !m_bLoaded )
+	{
+		Msg( "Incremental lighting: no usable light cache in %s, lighting all faces\n", pFilename );
+		m_bLightsChanged = true;
+		return;
+	}
+
+	MarkChangedFaces();
+
+	// The lights get written back out from activelights
+	m_Lights.Purge();
+	m_LightPVS.Purge();
+}
+
+
+bool CLightCache::IsFaceCached( int iFace, int nSamples, int nNormals ) const
+{
+	if ( !m_bLoaded || ( m_FacesToLight[iFace >> 3] & ( 1 << ( iFace & 7 ) ) ) )
+		return false;
+
+	CachedFace_t const &face = m_Faces[iFace];
+	return face.m_nSamples == nSamples && ( face.m_Styles[0] == 255 || face.m_nNormals == nNormals );
+}
+
+
+void CLightCache::RestoreFace( int iFace, dface_t *f, facelight_t *fl ) const
+{
+	CachedFace_t const &face = m_Faces[iFace];
+	LightingValue_t const *pValues = m_LightValues.Base() + face.m_nFirstValue;
+	for ( int k = 0; k < MAXLIGHTMAPS && face.m_Styles[k] != 255; k++ )
+	{
+		f->styles[k] = face.m_Styles[k];
+		for ( int n = 0; n < face.m_nNormals; n++ )
+		{
+			fl->light[k][n] = ( LightingValue_t* )FaceLightAlloc( fl->numsamples * sizeof( LightingValue_t ) );
+			memcpy( fl->light[k][n], pValues, fl->numsamples * sizeof( LightingValue_t ) );
+			pValues += fl->numsamples;
+		}
+	}
+}
+
+
+void CLightCache::Save( char const *pFilename )
+{
+	// Written to the side and renamed into place, so a failed write never leaves a
+	// truncated cache behind for the next -incremental run to trust
+	char szTempName[MAX_PATH];
+	V_snprintf( szTempName, sizeof( szTempName ), "%s.tmp", pFilename );
+
+	FILE *fp = fopen( szTempName, "wb" );
+	if ( !fp )
+	{
+		Warning( "Unable to write light cache %s\n", szTempName );
+		return;
+	}
+
+	LightCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = LIGHTCACHE_ID;
+	header.m_nVersion = LIGHTCACHE_VERSION;
+	memcpy( header.m_Key, m_Key, MD5_DIGEST_LENGTH );
+	header.m_nFaces = numfaces;
+	header.m_nPVSBytes = m_nPVSBytes;
+
+	CUtlVector<CachedFace_t> faces;
+	faces.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		facelight_t *fl = &facelight[i];
+
+		CachedFace_t &face = faces[i];
+		memset( &face, 0, sizeof( face ) );
+		face.m_nSamples = fl->numsamples;
+		face.m_nNormals = ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT ) ? NUM_BUMP_VECTS + 1 : 1;
+		face.m_nFirstValue = header.m_nLightValues;
+		memset( face.m_Styles, 255, sizeof( face.m_Styles ) );
+		for ( int k = 0; k < MAXLIGHTMAPS && fl->numsamples && f->styles[k] != 255 && fl->light[k][0]; k++ )
+		{
+			face.m_Styles[k] = f->styles[k];
+			header.m_nLightValues += face.m_nNormals * fl->numsamples;
+		}
+	}
+
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		++header.m_nLights;
+	}
+
+	bool bOK = ( fwrite( &header, sizeof( header ), 1, fp ) == 1 ) &&
+		( !numfaces || fwrite( faces.Base(), faces.Count() * sizeof( CachedFace_t ), 1, fp ) == 1 );
+
+	for ( directlight_t *dl = activelights; bOK && dl != NULL; dl = dl->next )
+	{
+		CachedLight_t light;
+		MakeCachedLight( dl, &light );
+		bOK = ( fwrite( &light, sizeof( light ), 1, fp ) == 1 );
+	}
+
+	// A light without a PVS reaches every cluster
+	CUtlVector<byte> allClusters;
+	allClusters.SetCount( m_nPVSBytes );
+	memset( allClusters.Base(), 0xFF, m_nPVSBytes );
+	for ( directlight_t *dl = activelights; bOK && m_nPVSBytes && dl != NULL; dl = dl->next )
+	{
+		bOK = ( fwrite( dl->pvs ? dl->pvs : allClusters.Base(), m_nPVSBytes, 1, fp ) == 1 );
+	}
+
+	for ( int i = 0; bOK && i < numfaces; i++ )
+	{
+		facelight_t *fl = &facelight[i];
+		for ( int k = 0; bOK && k < MAXLIGHTMAPS && faces[i].m_Styles[k] != 255; k++ )
+		{
+			for ( int n = 0; bOK && n < faces[i].m_nNormals; n++ )
+			{
+				bOK = ( fwrite( fl->light[k][n], fl->numsamples * sizeof( LightingValue_t ), 1, fp ) == 1 );
+			}
+		}
+	}
+
+	if ( fclose( fp ) != 0 )
+	{
+		bOK = false;
+	}
+
+	if ( bOK )
+	{
+#ifdef _WIN32
+		// rename won't replace an existing file here
+		remove( pFilename );
+#endif
+		bOK = ( rename( szTempName, pFilename ) == 0 );
+	}
+
+	if ( !bOK )
+	{
+		Warning( "Unable to write light cache %s\n", pFilename );
+		remove( szTempName );
+	}
+}
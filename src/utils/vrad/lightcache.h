@@ -0,0 +1,95 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per-face direct lighting cache for -incremental
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+#include "utlvector.h"
+#include "vrad.h"
+#include "lightmap.h"
+#include "tier1/checksum_md5.h"
+
+
+//-----------------------------------------------------------------------------
+// Command line incremental lighting (-incremental).
+//
+// After the direct lighting pass, every face's facelight values are saved next
+// to the map along with the lights that made them. On the next run the light
+// entities are diffed against that list; faces that an added, removed or
+// changed light can see (by PVS) are relit, the rest are restored from the
+// cache. Bounces and FinalLightFace always run, so the lighting lump comes
+// out as if the whole map had been lit.
+//-----------------------------------------------------------------------------
+class CLightCache
+{
+public:
+						CLightCache();
+
+	// Loads the cache and works out which faces need relighting. Call after the
+	// direct lights are created. With no usable cache every face gets lit.
+	void				PrepareForLighting( char const *pFilename );
+
+	// True if BuildFacelights can skip the light gather for this face.
+	bool				IsFaceCached( int iFace, int nSamples, int nNormals ) const;
+
+	// True if any light was added, removed or changed since the cache was saved.
+	bool				HasLightChanges() const	{ return m_bLightsChanged; }
+
+	// Fills in a cached face's lightstyles and direct lighting.
+	void				RestoreFace( int iFace, dface_t *f, facelight_t *fl ) const;
+
+	// Saves the direct lighting of every face and the lights that made it.
+	void				Save( char const *pFilename );
+
+private:
+	// Identifies a light between runs. Everything in here is compared exactly.
+	struct CachedLight_t
+	{
+		dworldlight_t	m_Light;
+		int				m_nFaceNum;
+		int				m_nTexData;
+		float			m_flStartFadeDistance;
+		float			m_flEndFadeDistance;
+		float			m_flCapDist;
+	};
+
+	struct CachedFace_t
+	{
+		byte			m_Styles[MAXLIGHTMAPS];
+		int				m_nSamples;
+		int				m_nNormals;
+		int				m_nFirstValue;	// index into m_LightValues
+	};
+
+	static void			ComputeKey( uint8 key[MD5_DIGEST_LENGTH] );
+	bool				Load( char const *pFilename );
+	void				MarkChangedFaces();
+
+	static void			MakeCachedLight( directlight_t const *dl, CachedLight_t *pOut );
+
+	CUtlVector<CachedFace_t>		m_Faces;
+	CUtlVector<LightingValue_t>		m_LightValues;
+	CUtlVector<CachedLight_t>		m_Lights;
+	CUtlVector<byte>				m_LightPVS;		// m_nPVSBytes for each of m_Lights
+	int								m_nPVSBytes;
+
+	// A bit per face, set if the face must be relit.
+	CUtlVector<byte>				m_FacesToLight;
+	bool							m_bLoaded;
+	bool							m_bLightsChanged;
+	uint8							m_Key[MD5_DIGEST_LENGTH];
+};
+
+extern CLightCache g_LightCache;
+extern bool g_bIncrementalLighting;
+
+
+#endif // LIGHTCACHE_H
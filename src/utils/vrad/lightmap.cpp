@@ -16,6 +16,7 @@
 #include "map_utils.h"
 #include "mathlib/halton.h"
 #include "imagepacker.h"
+#include "lightcache.h"
 #include "tier1/utlrbtree.h"
 #include "tier1/utlbuffer.h"
 #include "bitmap/tgawriter.h"
@@ -590,12 +591,12 @@ bool BuildFacesamplesAndLuxels_DoFast( lightinfo_t *pLightInfo, facelight_t *pFa
 	// quickly create samples and luxels (copy over samples)
 	//
 	pFaceLight->numsamples = width * height;
-	pFaceLight->sample = ( sample_t* )calloc( pFaceLight->numsamples, sizeof( *pFaceLight->sample ) );
+	pFaceLight->sample = ( sample_t* )FaceLightAlloc( pFaceLight->numsamples * sizeof( *pFaceLight->sample ) );
 	if( !pFaceLight->sample )
 		return false;
 
 	pFaceLight->numluxels = width * height;
-	pFaceLight->luxel = ( Vector* )calloc( pFaceLight->numluxels, sizeof( *pFaceLight->luxel ) );
+	pFaceLight->luxel = ( Vector* )FaceLightAlloc( pFaceLight->numluxels * sizeof( *pFaceLight->luxel ) );
 	if( !pFaceLight->luxel )
 		return false;
 
@@ -783,7 +784,7 @@ bool BuildFacesamples( lightinfo_t *pLightInfo, facelight_t *pFaceLight )
 	// copy over samples
 	//
 	pFaceLight->numsamples = pSamples - samples;
-	pFaceLight->sample = ( sample_t* )calloc( pFaceLight->numsamples, sizeof( *pFaceLight->sample ) );
+	pFaceLight->sample = ( sample_t* )FaceLightAlloc( pFaceLight->numsamples * sizeof( *pFaceLight->sample ) );
 	if( !pFaceLight->sample )
 		return false;
 
@@ -852,7 +853,7 @@ bool BuildFaceLuxels( lightinfo_t *pLightInfo, facelight_t *pFaceLight )
 
 	// calcuate actual luxel points
 	pFaceLight->numluxels = width * height;
-	pFaceLight->luxel = ( Vector* )calloc( pFaceLight->numluxels, sizeof( *pFaceLight->luxel ) );
+	pFaceLight->luxel = ( Vector* )FaceLightAlloc( pFaceLight->numluxels * sizeof( *pFaceLight->luxel ) );
 	if( !pFaceLight->luxel )
 		return false;
 
@@ -887,6 +888,64 @@ bool BuildLuxels( lightinfo_t *pLightInfo, facelight_t *pFaceLight, int ndxFace
 }
 
 
+//-----------------------------------------------------------------------------
+// Per-thread facelight arenas
+//-----------------------------------------------------------------------------
+#define FACELIGHT_ARENA_CHUNK_SIZE	( 1024 * 1024 )
+
+class CFaceLightArena
+{
+public:
+	CFaceLightArena() : m_pNext( NULL ), m_pEnd( NULL ) {}
+
+	void *Alloc( size_t nBytes )
+	{
+		nBytes = AlignValue( nBytes ? nBytes : 1, 16 );
+
+		void *pResult;
+		if ( nBytes > FACELIGHT_ARENA_CHUNK_SIZE / 4 )
+		{
+			// big ones get their own block so they don't waste the rest of the chunk
+			pResult = MemAlloc_AllocAligned( nBytes, 16 );
+		}
+		else
+		{
+			if ( (size_t)( m_pEnd - m_pNext ) < nBytes )
+			{
+				m_pNext = (byte *)MemAlloc_AllocAligned( FACELIGHT_ARENA_CHUNK_SIZE, 16 );
+				if ( !m_pNext )
+				{
+					m_pEnd = NULL;
+					return NULL;
+				}
+				m_pEnd = m_pNext + FACELIGHT_ARENA_CHUNK_SIZE;
+			}
+			pResult = m_pNext;
+			m_pNext += nBytes;
+		}
+
+		if ( pResult )
+		{
+			memset( pResult, 0, nBytes );
+		}
+		return pResult;
+	}
+
+private:
+	byte *m_pNext;
+	byte *m_pEnd;
+};
+
+static CFaceLightArena s_FaceLightArenas[MAX_TOOL_THREADS+1];
+
+void *FaceLightAlloc( size_t nBytes )
+{
+	// Anything outside the tool threads allocates from the main thread's arena
+	int iThread = GetCurrentToolThreadIndex();
+	return s_FaceLightArenas[ ( iThread >= 0 ) ? iThread : THREADINDEX_MAIN ].Alloc( nBytes );
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: for each face, find the center of each luxel; for each texture
 //          aligned grid point, back project onto the plane and get the world
@@ -908,19 +967,20 @@ void CalcPoints( lightinfo_t *pLightInfo, facelight_t *pFaceLight, int ndxFace )
 		{
 			Msg( "Face %d: (Fast)Error Building Samples and Luxels\n", ndxFace );
 		}
-		return;
 	}
-
-	// build the samples
-	if( !BuildSamples( pLightInfo, pFaceLight, ndxFace ) )
+	else
 	{
-		Msg( "Face %d: Error Building Samples\n", ndxFace );
-	}
+		// build the samples
+		if( !BuildSamples( pLightInfo, pFaceLight, ndxFace ) )
+		{
+			Msg( "Face %d: Error Building Samples\n", ndxFace );
+		}
 
-	// build the luxels
-	if( !BuildLuxels( pLightInfo, pFaceLight, ndxFace ) )
-	{
-		Msg( "Face %d: Error Building Luxels\n", ndxFace );
+		// build the luxels
+		if( !BuildLuxels( pLightInfo, pFaceLight, ndxFace ) )
+		{
+			Msg( "Face %d: Error Building Luxels\n", ndxFace );
+		}
 	}
 }
 
@@ -1832,11 +1892,11 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 
 }
 
-// Helper function - gathers light from area lights, spot lights, and point lights
-void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
-								  FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
-								  int nLFlags, int static_prop_index_to_ignore,
-								  float flEpsilon )
+// Helper function - everything GatherSampleStandardLightSSE does except the visibility trace.
+// Returns false if none of the samples can be lit, otherwise *pSrc is where the shadow rays end.
+static bool ComputeStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
+									 FourVectors const& pos, FourVectors *pNormals, int normalCount,
+									 int nLFlags, FourVectors *pSrc )
 {
 	bool bIgnoreNormals = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) != 0;
 
@@ -1870,7 +1930,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 		fltx4 notPastFadeDist = CmpLeSIMD ( dist, ReplicateX4 ( dl->m_flEndFadeDistance ) );
 		dot = AndSIMD( dot, notPastFadeDist );  // dot = 0 if past fade distance
 		if ( !TestSignSIMD ( notPastFadeDist ) )
-			return;
+			return false;
 	}
 
 	dist = MaxSIMD( dist, Four_Ones );
@@ -1901,7 +1961,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 		// Light behind surface yields zero dot
 		dot2 = MaxSIMD( Four_Zeros, dot2 );
 		if ( TestSignSIMD( CmpEqSIMD( Four_Zeros, dot ) ) == 0xF )
-			return;
+			return false;
 
 		out.m_flFalloff = ReciprocalSIMD ( dist2 );
 		out.m_flFalloff = MulSIMD( out.m_flFalloff, dot2 );
@@ -1919,7 +1979,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 		// Affix dot2 to zero if outside light cone
 		inCone = CmpGtSIMD( dot2, ReplicateX4( dl->light.stopdot2 ) );
 		if ( !TestSignSIMD ( inCone ) )
-			return;
+			return false;
 		dot = AndSIMD( inCone, dot );
 
 		constant  = ReplicateX4( dl->light.constant_attn );
@@ -1976,10 +2036,7 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 		out.m_flFalloff = MulSIMD( mult, out.m_flFalloff );
 	}
 
-	// Raytrace for visibility function
-	fltx4 fractionVisible = Four_Ones;
-	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
-	dot = MulSIMD( fractionVisible, dot );
+	// The caller still has to multiply in the visibility
 	out.m_flDot[0] = dot;
 
 	for ( int i = 1; i < normalCount; i++ )
@@ -1992,6 +2049,49 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 			out.m_flDot[i] = MaxSIMD( Four_Zeros, out.m_flDot[i] );
 		}
 	}
+
+	*pSrc = src;
+	return true;
+}
+
+// Helper function - gathers light from area lights, spot lights, and point lights
+void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
+								  FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
+								  int nLFlags, int static_prop_index_to_ignore,
+								  float flEpsilon )
+{
+	FourVectors src;
+	if ( !ComputeStandardLightSSE( out, dl, pos, pNormals, normalCount, nLFlags, &src ) )
+		return;
+
+	// Raytrace for visibility function
+	fltx4 fractionVisible = Four_Ones;
+	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
+	out.m_flDot[0] = MulSIMD( fractionVisible, out.m_flDot[0] );
+}
+
+static void ClearSampleLightOutputSSE( SSE_sampleLightOutput_t &out, int normalCount )
+{
+	for ( int b = 0; b < normalCount; b++ )
+		out.m_flDot[b] = Four_Zeros;
+	out.m_flFalloff = Four_Zeros;
+	out.m_flSunAmount = Four_Zeros;
+	Assert( normalCount <= (NUM_BUMP_VECTS+1) );
+}
+
+static void ClampBumpedDotsSSE( SSE_sampleLightOutput_t &out, int normalCount )
+{
+	// NOTE: Notice here that if the light is on the back side of the face
+	// (tested by checking the dot product of the face normal and the light position)
+	// we don't want it to contribute to *any* of the bumped lightmaps. It glows
+	// in disturbing ways if we don't do this.
+	out.m_flDot[0] = MaxSIMD ( out.m_flDot[0], Four_Zeros );
+	fltx4 notZero = CmpGtSIMD( out.m_flDot[0], Four_Zeros );
+	for ( int n = 1; n < normalCount; n++ )
+	{
+		out.m_flDot[n] = MaxSIMD( out.m_flDot[n], Four_Zeros );
+		out.m_flDot[n] = AndSIMD( out.m_flDot[n], notZero );
+	}
 }
 
 // returns dot product with normal and delta
@@ -2006,11 +2106,7 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 					   int static_prop_index_to_ignore,
 					   float flEpsilon )
 {
-	for ( int b = 0; b < normalCount; b++ )
-		out.m_flDot[b] = Four_Zeros;
-	out.m_flFalloff = Four_Zeros;
-	out.m_flSunAmount = Four_Zeros;
-	Assert( normalCount <= (NUM_BUMP_VECTS+1) );
+	ClearSampleLightOutputSSE( out, normalCount );
 
 	// skylights work fundamentally differently than normal lights
 	switch( dl->light.type )
@@ -2034,18 +2130,7 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 		return;
 	}
 
-	// NOTE: Notice here that if the light is on the back side of the face
-	// (tested by checking the dot product of the face normal and the light position)
-	// we don't want it to contribute to *any* of the bumped lightmaps. It glows
-	// in disturbing ways if we don't do this.
-	out.m_flDot[0] = MaxSIMD ( out.m_flDot[0], Four_Zeros );
-	fltx4 notZero = CmpGtSIMD( out.m_flDot[0], Four_Zeros );
-	for ( int n = 1; n < normalCount; n++ )
-	{
-		out.m_flDot[n] = MaxSIMD( out.m_flDot[n], Four_Zeros );
-		out.m_flDot[n] = AndSIMD( out.m_flDot[n], notZero );
-	}
-
+	ClampBumpedDotsSSE( out, normalCount );
 }
 
 /*
@@ -2386,7 +2471,7 @@ static inline void AllocateLightstyleSamples( facelight_t* fl, int styleIndex, i
 {
 	for (int n = 0; n < numnormals; ++n)
 	{
-		fl->light[styleIndex][n] = ( LightingValue_t* )calloc( fl->numsamples, sizeof(LightingValue_t ) );
+		fl->light[styleIndex][n] = ( LightingValue_t* )FaceLightAlloc( fl->numsamples * sizeof(LightingValue_t ) );
 	}
 }
 
@@ -2486,82 +2571,523 @@ static void ComputeIlluminationPointAndNormalsSSE( lightinfo_t const& l, FourVec
 }
 
 //-----------------------------------------------------------------------------
-// Iterates over all lights and computes lighting at up to 4 sample points
+// Per-cluster light lists. Rather than walking every active light for every
+// group of samples and rejecting them one at a time, each cluster gets the list
+// of lights that can reach it: the light's pvs has to include the cluster, and a
+// light with a hard falloff has to get within its end fade distance of the
+// cluster's bounds. With -lightcullthreshold, lights without a hard falloff are
+// also dropped past the distance where they fall below the threshold.
+//
+// The lists hold indices into s_ClusterLightList, which is activelights in list
+// order, so walking a merged set of lists adds the lights in the same order as
+// walking activelights does.
 //-----------------------------------------------------------------------------
-static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+
+bool g_bLightCulling = true;
+float g_flLightCullThreshold = 0.0f;
+
+// sample points are moved off the surface by the face normal, and the distance
+// the fade is tested against is an estimate
+#define LIGHT_CULL_BOUNDS_EPSILON	2.0f
+#define LIGHT_CULL_FADE_TOLERANCE	1.01f
+
+static CUtlVector<directlight_t *> s_ClusterLightList;
+static CUtlVector<int> s_ClusterLightStart;				// numclusters+1 offsets into s_ClusterLights
+static CUtlVector<int> s_ClusterLights;
+
+struct LightCullStats_t
 {
-	SSE_sampleLightOutput_t out;
+	int64 m_nSampleGroups;
+	int64 m_nLightsTested;
+	int64 m_nLightsContributing;
+	int64 m_nPad[5];										// keep threads off each other's cache line
+};
 
-	// Iterate over all direct lights and add them to the particular sample
-	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
-	{	    
-		// is this lights cluster visible?
-		fltx4 dotMask = Four_Zeros;
-		bool skipLight = true;
-		for( int s = 0; s < numSamples; s++ )
+static LightCullStats_t s_LightCullStats[MAX_TOOL_THREADS+1];
+
+
+//-----------------------------------------------------------------------------
+// How far away can this light still light something? FLT_MAX if it isn't culled by distance.
+//-----------------------------------------------------------------------------
+static float LightCullDistance( directlight_t *dl )
+{
+	if ( dl->facenum != -1 )
+		return FLT_MAX;
+
+	float flDist = FLT_MAX;
+	bool bHasHardFalloff = ( dl->m_flEndFadeDistance > dl->m_flStartFadeDistance );
+	if ( bHasHardFalloff )
+	{
+		flDist = dl->m_flEndFadeDistance * LIGHT_CULL_FADE_TOLERANCE;
+	}
+
+	if ( g_flLightCullThreshold <= 0.0f )
+		return flDist;
+
+	// distance where the brightest component of the light falls to the threshold
+	float flIntensity = max( dl->light.intensity.x, max( dl->light.intensity.y, dl->light.intensity.z ) );
+	float flFalloffAtCutoff = g_flLightCullThreshold / max( flIntensity, 1.0e-6f );
+	float flCutoff = FLT_MAX;
+	switch ( dl->light.type )
+	{
+	case emit_point:
+	case emit_spotlight:
 		{
-			if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
+			// 1 / ( c + b d + a d^2 ) = falloff
+			float a = dl->light.quadratic_attn;
+			float b = dl->light.linear_attn;
+			float c = dl->light.constant_attn - 1.0f / flFalloffAtCutoff;
+			if ( a < 0.0f || b < 0.0f )
+				break;
+			if ( a > 0.0f )
+				flCutoff = ( -b + sqrt( max( b * b - 4.0f * a * c, 0.0f ) ) ) / ( 2.0f * a );
+			else if ( b > 0.0f )
+				flCutoff = -c / b;
+		}
+		break;
+
+	case emit_surface:
+		// 1 / d^2 = falloff
+		flCutoff = sqrt( 1.0f / flFalloffAtCutoff );
+		break;
+	}
+
+	return min( flDist, max( flCutoff, 1.0f ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Builds the light lists for all clusters from the current activelights
+//-----------------------------------------------------------------------------
+void BuildClusterLightLists( void )
+{
+	s_ClusterLightList.RemoveAll();
+	s_ClusterLightStart.RemoveAll();
+	s_ClusterLights.RemoveAll();
+	memset( s_LightCullStats, 0, sizeof( s_LightCullStats ) );
+
+	if ( !g_bLightCulling || !dvis->numclusters )
+		return;
+
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		s_ClusterLightList.AddToTail( dl );
+	}
+
+	CUtlVector<float> cullDist;
+	cullDist.SetCount( s_ClusterLightList.Count() );
+	for ( int i = 0; i < s_ClusterLightList.Count(); i++ )
+	{
+		cullDist[i] = LightCullDistance( s_ClusterLightList[i] );
+	}
+
+	s_ClusterLightStart.SetCount( dvis->numclusters + 1 );
+	for ( int iCluster = 0; iCluster < dvis->numclusters; iCluster++ )
+	{
+		s_ClusterLightStart[iCluster] = s_ClusterLights.Count();
+
+		Vector mins, maxs;
+		ClearBounds( mins, maxs );
+		for ( int i = 0; i < g_ClusterLeaves[iCluster].leafCount; i++ )
+		{
+			dleaf_t *pLeaf = &dleafs[ g_ClusterLeaves[iCluster].leafs[i] ];
+			AddPointToBounds( Vector( pLeaf->mins[0], pLeaf->mins[1], pLeaf->mins[2] ), mins, maxs );
+			AddPointToBounds( Vector( pLeaf->maxs[0], pLeaf->maxs[1], pLeaf->maxs[2] ), mins, maxs );
+		}
+		mins -= Vector( LIGHT_CULL_BOUNDS_EPSILON, LIGHT_CULL_BOUNDS_EPSILON, LIGHT_CULL_BOUNDS_EPSILON );
+		maxs += Vector( LIGHT_CULL_BOUNDS_EPSILON, LIGHT_CULL_BOUNDS_EPSILON, LIGHT_CULL_BOUNDS_EPSILON );
+
+		for ( int i = 0; i < s_ClusterLightList.Count(); i++ )
+		{
+			directlight_t *dl = s_ClusterLightList[i];
+			if ( !PVSCheck( dl->pvs, iCluster ) )
+				continue;
+
+			// an empty cluster (no leaves) gets inverted bounds, so skip the distance test for it
+			if ( cullDist[i] != FLT_MAX && mins.x <= maxs.x )
 			{
-				dotMask = SetComponentSIMD( dotMask, s, 1.0f );
-				skipLight = false;
+				float flDistSqr = CalcSqrDistanceToAABB( mins, maxs, dl->light.origin );
+				if ( flDistSqr > cullDist[i] * cullDist[i] )
+					continue;
 			}
+
+			s_ClusterLights.AddToTail( i );
 		}
-		if ( skipLight )
-			continue;
+	}
+	s_ClusterLightStart[dvis->numclusters] = s_ClusterLights.Count();
 
-		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
-		
-		// Apply the PVS check filter and compute falloff x dot
-		fltx4 fxdot[NUM_BUMP_VECTS + 1];
-		skipLight = true;
-		for ( int b = 0; b < info.m_NormalCount; b++ )
+	qprintf( "%d lights, %.1f per cluster after culling\n", s_ClusterLightList.Count(),
+		(float)s_ClusterLights.Count() / dvis->numclusters );
+}
+
+
+//-----------------------------------------------------------------------------
+// Reports how many lights were tested against sample groups, and how many of
+// those actually added light
+//-----------------------------------------------------------------------------
+void PrintLightCullingStats( void )
+{
+	LightCullStats_t total;
+	memset( &total, 0, sizeof( total ) );
+	for ( int i = 0; i < ARRAYSIZE( s_LightCullStats ); i++ )
+	{
+		total.m_nSampleGroups += s_LightCullStats[i].m_nSampleGroups;
+		total.m_nLightsTested += s_LightCullStats[i].m_nLightsTested;
+		total.m_nLightsContributing += s_LightCullStats[i].m_nLightsContributing;
+	}
+
+	if ( !total.m_nSampleGroups )
+		return;
+
+	int nLights = 0;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		++nLights;
+	}
+
+	Msg( "Direct lighting: %d lights, %.1f tested and %.1f contributing per sample group (%.1f%% of tested)\n",
+		nLights, (double)total.m_nLightsTested / total.m_nSampleGroups,
+		(double)total.m_nLightsContributing / total.m_nSampleGroups,
+		total.m_nLightsTested ? 100.0 * total.m_nLightsContributing / total.m_nLightsTested : 0.0 );
+}
+
+
+//-----------------------------------------------------------------------------
+// Walks the lights that can reach any of the samples in a group, in activelights
+// order. Falls back to all of activelights if there are no cluster light lists or
+// one of the samples isn't in a cluster.
+//-----------------------------------------------------------------------------
+class CSampleLightIterator
+{
+public:
+	CSampleLightIterator( SSE_SampleInfo_t const &info, int numSamples )
+	{
+		m_nLists = 0;
+		m_pNextLight = NULL;
+		if ( !s_ClusterLightStart.Count() )
+		{
+			m_pNextLight = activelights;
+			return;
+		}
+
+		for ( int s = 0; s < numSamples; s++ )
 		{
-			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
-			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
-			if ( !IsAllZeros( fxdot[b] ) )
+			int iCluster = info.m_Clusters[s];
+			if ( iCluster < 0 )
 			{
-				skipLight = false;
+				m_nLists = 0;
+				m_pNextLight = activelights;
+				return;
+			}
+
+			bool bDuplicate = false;
+			for ( int l = 0; l < m_nLists; l++ )
+			{
+				if ( m_iCluster[l] == iCluster )
+				{
+					bDuplicate = true;
+					break;
+				}
 			}
+			if ( bDuplicate )
+				continue;
+
+			m_iCluster[m_nLists] = iCluster;
+			m_pCur[m_nLists] = s_ClusterLights.Base() + s_ClusterLightStart[iCluster];
+			m_pEnd[m_nLists] = s_ClusterLights.Base() + s_ClusterLightStart[iCluster + 1];
+			++m_nLists;
 		}
-		if ( skipLight )
+	}
+
+	directlight_t *Next()
+	{
+		if ( !m_nLists )
+		{
+			directlight_t *dl = m_pNextLight;
+			if ( dl )
+				m_pNextLight = dl->next;
+			return dl;
+		}
+
+		// lowest index at the head of any list
+		int nBest = INT_MAX;
+		for ( int l = 0; l < m_nLists; l++ )
+		{
+			if ( m_pCur[l] < m_pEnd[l] && *m_pCur[l] < nBest )
+				nBest = *m_pCur[l];
+		}
+		if ( nBest == INT_MAX )
+			return NULL;
+
+		for ( int l = 0; l < m_nLists; l++ )
+		{
+			if ( m_pCur[l] < m_pEnd[l] && *m_pCur[l] == nBest )
+				++m_pCur[l];
+		}
+		return s_ClusterLightList[nBest];
+	}
+
+private:
+	int m_nLists;
+	int m_iCluster[4];
+	int const *m_pCur[4];
+	int const *m_pEnd[4];
+	directlight_t *m_pNextLight;
+};
+
+
+//-----------------------------------------------------------------------------
+// Is this light's cluster visible from any of the samples? dotMask gets 1 for
+// each sample that can see it.
+//-----------------------------------------------------------------------------
+static bool ComputeLightPVSMask( SSE_SampleInfo_t& info, directlight_t *dl, int numSamples, fltx4 *pDotMask )
+{
+	fltx4 dotMask = Four_Zeros;
+	bool bVisible = false;
+	for( int s = 0; s < numSamples; s++ )
+	{
+		if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
+		{
+			dotMask = SetComponentSIMD( dotMask, s, 1.0f );
+			bVisible = true;
+		}
+	}
+	*pDotMask = dotMask;
+	return bVisible;
+}
+
+
+//-----------------------------------------------------------------------------
+// Adds one light's gathered contribution to up to 4 samples. Returns false if
+// it didn't add anything.
+//-----------------------------------------------------------------------------
+static bool AddLightToSamples( SSE_SampleInfo_t& info, directlight_t *dl, SSE_sampleLightOutput_t const &out,
+							   fltx4 dotMask, int sampleIdx, int numSamples )
+{
+	// Apply the PVS check filter and compute falloff x dot
+	fltx4 fxdot[NUM_BUMP_VECTS + 1];
+	bool skipLight = true;
+	for ( int b = 0; b < info.m_NormalCount; b++ )
+	{
+		fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
+		fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+		if ( !IsAllZeros( fxdot[b] ) )
+		{
+			skipLight = false;
+		}
+	}
+	if ( skipLight )
+		return false;
+
+	// Figure out the lightstyle for this particular sample
+	int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight, 
+		dl->light.style, info.m_NormalCount );
+	if (lightStyleIndex < 0)
+	{
+		if (info.m_WarnFace != info.m_FaceNum)
+		{
+			Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
+				info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
+			info.m_WarnFace = info.m_FaceNum;
+		}
+		return false;
+	}
+
+	// pLightmaps is an array of the lightmaps for each normal direction,
+	// here's where the result of the sample gathering goes
+	LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
+
+	// Incremental lighting only cares about lightstyle zero
+	if( g_pIncremental && (dl->light.style == 0) )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i, 
+				info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
+		}
+	}
+
+	for( int n = 0; n < info.m_NormalCount; ++n )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
+		}
+	}
+
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Iterates over all lights and computes lighting at up to 4 sample points
+//-----------------------------------------------------------------------------
+static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+{
+	SSE_sampleLightOutput_t out;
+	LightCullStats_t &stats = s_LightCullStats[info.m_iThread];
+	++stats.m_nSampleGroups;
+
+	// Iterate over the direct lights that can reach these samples and add them to the particular sample
+	CSampleLightIterator lights( info, numSamples );
+	for (directlight_t *dl = lights.Next(); dl != NULL; dl = lights.Next())
+	{	    
+		// is this lights cluster visible?
+		fltx4 dotMask;
+		if ( !ComputeLightPVSMask( info, dl, numSamples, &dotMask ) )
 			continue;
 
-		// Figure out the lightstyle for this particular sample
-		int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight, 
-			dl->light.style, info.m_NormalCount );
-		if (lightStyleIndex < 0)
+		++stats.m_nLightsTested;
+		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+		if ( AddLightToSamples( info, dl, out, dotMask, sampleIdx, numSamples ) )
+			++stats.m_nLightsContributing;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Deferred version of GatherSampleLightAt4Points for a whole face. The lights are
+// gathered for each group of samples as it is added, but the shadow rays of point,
+// spot and surface lights go into a RayQueue instead of being traced one packet
+// at a time. Flushing the queue sorts the rays into coherent packets, traces them,
+// and then adds the lighting in the same order GatherSampleLightAt4Points would.
+//
+// This replaces GatherSampleLightAt8Points, which paired up neighbouring groups
+// to trace their shadow rays as one Trace8Rays packet. The queue builds the same
+// 8 ray packets, but from every group on the face and sorted for coherence, and
+// it doesn't need two groups to have the same lights, which per-cluster light
+// lists no longer guarantee.
+//-----------------------------------------------------------------------------
+
+// how many shadow rays to queue up before flushing, to bound the memory used per face
+#define DEFERRED_SHADOW_RAYS_PER_FLUSH	8192
+
+class CShadowRayVisibility : public IRayQueueCallback
+{
+public:
+	virtual void RayQueueResult( int nUserData, const RayTracingSingleResult &result )
+	{
+		// Assume we can see the target unless we get a hit (same test as TestLine)
+		m_Visibility[nUserData] = ( ( result.HitID != -1 ) && ( result.HitDistance < result.ray_length ) ) ? 0.0f : 1.0f;
+	}
+
+	CUtlVector<float> m_Visibility;
+};
+
+class CDeferredFaceLighting
+{
+public:
+	CDeferredFaceLighting( SSE_SampleInfo_t &info ) : m_Info( info ) {}
+
+	void GatherGroup( int sampleIdx, int numSamples );
+	void Flush();
+
+private:
+	struct SampleGroup_t
+	{
+		SSE_SampleInfo_t m_Info;
+		int m_nSampleIdx;
+		int m_nSamples;
+	};
+
+	struct GatheredLight_t
+	{
+		SSE_sampleLightOutput_t m_Out;
+		fltx4 m_DotMask;
+		directlight_t *m_pLight;
+		int m_nGroup;
+		int m_nFirstRay;							// in m_Visibility, or -1 if visibility is already in m_Out
+	};
+
+	SSE_SampleInfo_t &m_Info;
+	CUtlVector< SampleGroup_t, CUtlMemoryAligned< SampleGroup_t, 16 > > m_Groups;
+	CUtlVector< GatheredLight_t, CUtlMemoryAligned< GatheredLight_t, 16 > > m_Lights;
+	RayQueue m_ShadowRays;
+	CShadowRayVisibility m_Visibility;
+};
+
+// Gathers all lights at the points currently in m_Info
+void CDeferredFaceLighting::GatherGroup( int sampleIdx, int numSamples )
+{
+	int nGroup = m_Groups.AddToTail();
+	m_Groups[nGroup].m_Info = m_Info;
+	m_Groups[nGroup].m_nSampleIdx = sampleIdx;
+	m_Groups[nGroup].m_nSamples = numSamples;
+	SSE_SampleInfo_t &info = m_Groups[nGroup].m_Info;
+	LightCullStats_t &stats = s_LightCullStats[info.m_iThread];
+	++stats.m_nSampleGroups;
+
+	CSampleLightIterator lights( info, numSamples );
+	for (directlight_t *dl = lights.Next(); dl != NULL; dl = lights.Next())
+	{
+		// is this lights cluster visible?
+		fltx4 dotMask;
+		if ( !ComputeLightPVSMask( info, dl, numSamples, &dotMask ) )
+			continue;
+
+		++stats.m_nLightsTested;
+		int i = m_Lights.AddToTail();
+		GatheredLight_t &light = m_Lights[i];
+		light.m_DotMask = dotMask;
+		light.m_pLight = dl;
+		light.m_nGroup = nGroup;
+		light.m_nFirstRay = -1;
+
+		if ( dl->light.type != emit_point && dl->light.type != emit_surface && dl->light.type != emit_spotlight )
 		{
-			if (info.m_WarnFace != info.m_FaceNum)
-			{
-				Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
-					info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
-				info.m_WarnFace = info.m_FaceNum;
-			}
+			// sky lights trace their own rays
+			GatherSampleLightSSE( light.m_Out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
 			continue;
 		}
 
-		// pLightmaps is an array of the lightmaps for each normal direction,
-		// here's where the result of the sample gathering goes
-		LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
+		ClearSampleLightOutputSSE( light.m_Out, info.m_NormalCount );
+		FourVectors src;
+		if ( !ComputeStandardLightSSE( light.m_Out, dl, info.m_Points, info.m_PointNormals, info.m_NormalCount, 0, &src ) )
+		{
+			// can't light any of the samples
+			m_Lights.Remove( i );
+			continue;
+		}
 
-		// Incremental lighting only cares about lightstyle zero
-		if( g_pIncremental && (dl->light.style == 0) )
+		light.m_nFirstRay = m_Visibility.m_Visibility.AddMultipleToTail( 4 );
+		for ( int s = 0; s < 4; s++ )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-			{
-				g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i, 
-					info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
-			}
+			if ( s < numSamples )
+				m_ShadowRays.AddRay( info.m_Points.Vec( s ), src.Vec( s ), &m_Visibility, light.m_nFirstRay + s );
+			else
+				m_Visibility.m_Visibility[light.m_nFirstRay + s] = 1.0f;
 		}
+	}
+
+	if ( m_ShadowRays.Count() >= DEFERRED_SHADOW_RAYS_PER_FLUSH )
+		Flush();
+}
+
+void CDeferredFaceLighting::Flush()
+{
+	// this runs inside a BuildFacelights worker, so trace on this thread
+	g_RtEnv.FlushRayQueue( m_ShadowRays );
 
-		for( int n = 0; n < info.m_NormalCount; ++n )
+	for ( int i = 0; i < m_Lights.Count(); i++ )
+	{
+		GatheredLight_t &light = m_Lights[i];
+		SampleGroup_t &group = m_Groups[light.m_nGroup];
+		if ( light.m_nFirstRay >= 0 )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-			{
-				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
-			}
+			fltx4 fractionVisible = LoadUnalignedSIMD( &m_Visibility.m_Visibility[light.m_nFirstRay] );
+			light.m_Out.m_flDot[0] = MulSIMD( fractionVisible, light.m_Out.m_flDot[0] );
+			ClampBumpedDotsSSE( light.m_Out, group.m_Info.m_NormalCount );
 		}
+
+		group.m_Info.m_WarnFace = m_Info.m_WarnFace;
+		if ( AddLightToSamples( group.m_Info, light.m_pLight, light.m_Out, light.m_DotMask, group.m_nSampleIdx, group.m_nSamples ) )
+			++s_LightCullStats[group.m_Info.m_iThread].m_nLightsContributing;
+		m_Info.m_WarnFace = group.m_Info.m_WarnFace;
 	}
+
+	m_Groups.RemoveAll();
+	m_Lights.RemoveAll();
+	m_Visibility.m_Visibility.RemoveAll();
 }
 
 
@@ -2582,8 +3108,9 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 		}
 	}
 
-	// Iterate over all direct lights and add them to the particular sample
-	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
+	// Iterate over the direct lights that can reach these samples and add them to the particular sample
+	CSampleLightIterator lights( info, 4 );
+	for (directlight_t *dl = lights.Next(); dl != NULL; dl = lights.Next())
 	{
 		if ((flags & AMBIENT_ONLY) && (dl->light.type != emit_skyambient))
 			continue;
@@ -3109,11 +3636,20 @@ void BuildFacelights (int iThread, int facenum)
 	// Allocate sample positions/normals to SSE
 	int numGroups = ( fl->numsamples & 0x3) ? ( fl->numsamples / 4 ) + 1 : ( fl->numsamples / 4 );
 
+	// -incremental: no light that changed can see this face, reuse the last run's lighting
+	bool bCached = g_bIncrementalLighting && g_LightCache.IsFaceCached( facenum, fl->numsamples, sampleInfo.m_NormalCount );
+
 	// always allocate style 0 lightmap
-	f->styles[0] = 0;
-	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	if ( !bCached )
+	{
+		f->styles[0] = 0;
+		AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	}
 
-	// sample the lights at each sample location
+	// sample the lights at each sample location. Unless the shadows need the
+	// texture coverage callback, the shadow rays for the whole face are queued
+	// up and traced together.
+	CDeferredFaceLighting deferredLighting( sampleInfo );
 	for ( int grp = 0; grp < numGroups; ++grp )
 	{
 		int nSample = 4 * grp;
@@ -3141,8 +3677,44 @@ void BuildFacelights (int iThread, int facenum)
 				sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
 		}
 
-		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		if ( bCached )
+		{
+			// Samples outside every cluster pass every PVS test, so any changed light
+			// may reach them. Nothing has been gathered yet; start over and light the face.
+			if ( g_LightCache.HasLightChanges() )
+			{
+				for ( int i = 0; i < numSamples; i++ )
+				{
+					if ( sampleInfo.m_Clusters[i] < 0 )
+					{
+						bCached = false;
+						break;
+					}
+				}
+
+				if ( !bCached )
+				{
+					f->styles[0] = 0;
+					AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+					grp = -1;
+				}
+			}
+			continue;
+		}
+
+		// Iterate over all the lights and add their contribution to this group of spots.
+		// Texture shadows need the coverage callback, which only takes four rays, so
+		// there's nothing to gain from bigger packets there.
+		if ( g_bTextureShadows )
+			GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		else
+			deferredLighting.GatherGroup( nSample, numSamples );
+	}
+	deferredLighting.Flush();
+
+	if ( bCached )
+	{
+		g_LightCache.RestoreFace( facenum, f, fl );
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3733,8 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	// (cached faces were supersampled when they were lit)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bCached)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -87,6 +87,10 @@ extern directlight_t	*freelights;
 extern facelight_t		facelight[MAX_MAP_FACES];
 extern int				numdlights;
 
+// Facelight data lives until vrad exits, so it's carved out of per-thread arenas
+// instead of being calloc'd piece by piece. Returns zeroed, 16-byte aligned memory.
+void *FaceLightAlloc( size_t nBytes );
+
 
 //==============================================
 
@@ -135,6 +139,12 @@ extern void InitLightinfo( lightinfo_t *l, int facenum );
 
 void FreeDLights();
 
+// per-cluster light lists used to skip lights that can't reach a face
+extern bool g_bLightCulling;
+extern float g_flLightCullThreshold;
+void BuildClusterLightLists( void );
+void PrintLightCullingStats( void );
+
 void ExportDirectLightsToWorldLights();
 
 
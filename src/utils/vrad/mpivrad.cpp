@@ -9,8 +9,10 @@
 // mpivrad.cpp
 //
 
+#ifdef _WIN32
 #include <windows.h>
 #include <conio.h>
+#endif
 #include "vrad.h"
 #include "physdll.h"
 #include "lightmap.h"
@@ -295,7 +297,14 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		int numtransfers;
 		pBuf->read( &numtransfers, sizeof(numtransfers) );
 		patch->numtransfers = numtransfers;
-		if (numtransfers) 
+		if (numtransfers && g_bCompactTransfers)
+		{
+			CUtlVector<transfer_t> transfers;
+			transfers.SetCount( numtransfers );
+			pBuf->read( transfers.Base(), numtransfers * sizeof(transfer_t) );
+			PackPatchTransfers( patch, transfers.Base(), numtransfers );
+		}
+		else if (numtransfers) 
 		{
 			patch->transfers = new transfer_t[numtransfers];
 			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
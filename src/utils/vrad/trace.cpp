@@ -179,6 +179,50 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
 }
 
+void TestLine8( FourVectors const start[2], FourVectors const stop[2],
+				fltx4 pFractionVisible[2], int static_prop_index_to_ignore )
+{
+	// the texture coverage callback only understands four rays at a time
+	if ( g_bTextureShadows )
+	{
+		TestLine( start[0], stop[0], &pFractionVisible[0], static_prop_index_to_ignore );
+		TestLine( start[1], stop[1], &pFractionVisible[1], static_prop_index_to_ignore );
+		return;
+	}
+
+	EightRays myrays;
+	float tmin[8], len[8];
+	for ( int h = 0; h < 2; h++ )
+	{
+		FourRays halfrays;
+		halfrays.origin = start[h];
+		halfrays.direction = stop[h];
+		halfrays.direction -= halfrays.origin;
+		fltx4 halflen = halfrays.direction.length();
+		halfrays.direction *= ReciprocalSIMD( halflen );
+		myrays.Set4Rays( h, halfrays );
+		StoreUnalignedSIMD( tmin + 4 * h, Four_Zeros );
+		StoreUnalignedSIMD( len + 4 * h, halflen );
+	}
+
+	RayTracingResult8 rt_result;
+	g_RtEnv.Trace8Rays( myrays, tmin, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore );
+
+	// Assume we can see the targets unless we get hits
+	float visibility[8];
+	for ( int i = 0; i < 8; i++ )
+	{
+		visibility[i] = 1.0f;
+		if ( ( rt_result.HitIds[i] != -1 ) &&
+		     ( rt_result.HitDistance[i] < len[i] ) )
+		{
+			visibility[i] = 0.0f;
+		}
+	}
+	pFractionVisible[0] = LoadUnalignedSIMD( visibility );
+	pFractionVisible[1] = LoadUnalignedSIMD( visibility + 4 );
+}
+
 
 
 /*
@@ -11,6 +11,8 @@
 #include "vrad.h"
 #include "physdll.h"
 #include "lightmap.h"
+#include "lightcache.h"
+#include "imagepacker.h"
 #include "tier1/strtools.h"
 #include "vmpi.h"
 #include "macro_texture.h"
@@ -19,6 +21,7 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "vstdlib/random.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,6 +60,8 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bRayTraceBenchmark = false;
+bool		g_bRayTraceCache = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -80,6 +85,8 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		rtcachefile[_MAX_PATH] = "";
+char		lightcachefile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -1057,6 +1064,155 @@ MakeScales
 */
 int	total_transfer;
 int max_transfer;
+int64 total_packed_transfer_bytes;
+
+bool g_bCompactTransfers = false;
+
+
+//-----------------------------------------------------------------------------
+// -compacttransfers: transfer lists can run to gigabytes with small chop sizes,
+// so they can be kept packed instead. The transfers of a patch are sorted by
+// patch index and split into blocks of TRANSFER_BLOCK_SIZE. Each block is:
+//
+//		byte	count
+//		float	scale				// weight = quantized weight * scale
+//		uint16	weights[count]
+//		varint	patch deltas[count]	// from the previous transfer's patch
+//
+// which is 3-4 bytes a transfer instead of 8, and a block decodes into a small
+// array of transfer_t that stays in cache.
+//-----------------------------------------------------------------------------
+static int CompareTransferPatch( const void *pA, const void *pB )
+{
+	return ( (transfer_t const *)pA )->patch - ( (transfer_t const *)pB )->patch;
+}
+
+// Packs the transfers of a patch into patch->packedTransfers. Sorts pTransfers.
+void PackPatchTransfers( CPatch *patch, transfer_t *pTransfers, int numtransfers )
+{
+	qsort( pTransfers, numtransfers, sizeof( transfer_t ), CompareTransferPatch );
+
+	// worst case: 5 byte varints
+	int nMaxBlocks = ( numtransfers + TRANSFER_BLOCK_SIZE - 1 ) / TRANSFER_BLOCK_SIZE;
+	byte *pBuf = (byte *)malloc( nMaxBlocks * ( 1 + sizeof( float ) ) + numtransfers * ( sizeof( uint16 ) + 5 ) );
+	byte *pOut = pBuf;
+
+	int prevPatch = 0;
+	for ( int nFirst = 0; nFirst < numtransfers; nFirst += TRANSFER_BLOCK_SIZE )
+	{
+		int count = min( numtransfers - nFirst, TRANSFER_BLOCK_SIZE );
+		transfer_t const *t = pTransfers + nFirst;
+
+		float flMax = 0.0f;
+		for ( int k = 0; k < count; k++ )
+		{
+			flMax = max( flMax, t[k].transfer );
+		}
+		float flScale = flMax / 65535.0f;
+		float flInvScale = ( flMax > 0.0f ) ? 65535.0f / flMax : 0.0f;
+
+		*pOut++ = (byte)count;
+		memcpy( pOut, &flScale, sizeof( flScale ) );
+		pOut += sizeof( flScale );
+
+		for ( int k = 0; k < count; k++ )
+		{
+			int nWeight = clamp( (int)( t[k].transfer * flInvScale + 0.5f ), 0, 65535 );
+			uint16 nQuantized = (uint16)nWeight;
+			memcpy( pOut, &nQuantized, sizeof( nQuantized ) );
+			pOut += sizeof( nQuantized );
+		}
+
+		for ( int k = 0; k < count; k++ )
+		{
+			unsigned int nDelta = t[k].patch - prevPatch;
+			prevPatch = t[k].patch;
+			while ( nDelta >= 0x80 )
+			{
+				*pOut++ = (byte)( nDelta | 0x80 );
+				nDelta >>= 7;
+			}
+			*pOut++ = (byte)nDelta;
+		}
+	}
+
+	int nBytes = pOut - pBuf;
+	patch->packedTransfers = (byte *)realloc( pBuf, nBytes );
+	patch->numtransfers = numtransfers;
+	patch->transfers = NULL;
+
+	ThreadLock();
+	total_packed_transfer_bytes += nBytes;
+	ThreadUnlock();
+}
+
+
+//-----------------------------------------------------------------------------
+// Walks the transfers of a patch a block at a time, whichever way they are stored.
+// NextBlock returns the number of transfers in the block, 0 at the end.
+//-----------------------------------------------------------------------------
+class CTransferReader
+{
+public:
+	CTransferReader( CPatch const *patch ) :
+		m_pPatch( patch ), m_pIn( patch->packedTransfers ), m_nRemaining( patch->numtransfers ), m_nPrevPatch( 0 )
+	{
+	}
+
+	int NextBlock( transfer_t const **ppTransfers )
+	{
+		if ( m_nRemaining <= 0 )
+			return 0;
+
+		if ( !m_pIn )
+		{
+			*ppTransfers = m_pPatch->transfers;
+			int count = m_nRemaining;
+			m_nRemaining = 0;
+			return count;
+		}
+
+		int count = *m_pIn++;
+		float flScale;
+		memcpy( &flScale, m_pIn, sizeof( flScale ) );
+		m_pIn += sizeof( flScale );
+
+		for ( int k = 0; k < count; k++ )
+		{
+			uint16 nQuantized;
+			memcpy( &nQuantized, m_pIn, sizeof( nQuantized ) );
+			m_pIn += sizeof( nQuantized );
+			m_Block[k].transfer = nQuantized * flScale;
+		}
+
+		for ( int k = 0; k < count; k++ )
+		{
+			unsigned int nDelta = 0;
+			int nShift = 0;
+			byte b;
+			do
+			{
+				b = *m_pIn++;
+				nDelta |= ( b & 0x7f ) << nShift;
+				nShift += 7;
+			} while ( b & 0x80 );
+
+			m_nPrevPatch += nDelta;
+			m_Block[k].patch = m_nPrevPatch;
+		}
+
+		m_nRemaining -= count;
+		*ppTransfers = m_Block;
+		return count;
+	}
+
+private:
+	CPatch const *m_pPatch;
+	byte const *m_pIn;
+	int m_nRemaining;
+	int m_nPrevPatch;
+	transfer_t m_Block[TRANSFER_BLOCK_SIZE];
+};
 
 
 //-----------------------------------------------------------------------------
@@ -1210,8 +1366,43 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		return;
 	CPatch *patch = &g_Patches.Element( ndxPatch );
 
+	// MPI workers send back the exact transfers, and the master packs them as they arrive
+	bool bPack = g_bCompactTransfers;
+#ifdef MPI
+	if ( g_bUseMPI )
+		bPack = false;
+#endif
+
 	// copy the transfers out
-	if (patch->numtransfers)
+	if (patch->numtransfers && bPack)
+	{
+		if (patch->numtransfers > max_transfer)
+		{
+			max_transfer = patch->numtransfers;
+		}
+
+		// get total transfer energy
+		t2 = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+		{
+			total += t2->transfer;
+		}
+
+		// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
+		if (total > M_PI)
+			total = 1.0f/total;
+		else	
+			total = 1.0f/M_PI;
+
+		// all_transfers is scratch, so scale it in place and pack it from there
+		t2 = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+		{
+			t2->transfer *= total;
+		}
+		PackPatchTransfers( patch, all_transfers, patch->numtransfers );
+	}
+	else if (patch->numtransfers)
 	{
 		if (patch->numtransfers > max_transfer)
 		{
@@ -1532,10 +1723,14 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+// emitlight * reflectivity of every patch for the current bounce, so gathering
+// only has to read one vector per transfer
+static CUtlVector<Vector> s_ShootLight;
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
-	transfer_t	*trans;
+	transfer_t	const *trans;
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
@@ -1548,8 +1743,7 @@ void GatherLight (int threadnum, void *pUserData)
 
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
+		CTransferReader transfers( patch );
 		if ( patch->needsBumpmap )
 		{
 			Vector delta;
@@ -1589,33 +1783,33 @@ void GatherLight (int threadnum, void *pUserData)
 			}
 
 			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+			for ( num = transfers.NextBlock( &trans ); num; num = transfers.NextBlock( &trans ) )
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
-
-				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
-				for(i=0; i<3; i++)
+				for (k=0 ; k<num ; k++, trans++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
-				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
-				
-				Vector bumpTransfer;
-				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-				{
-					dot = DotProduct( delta, normals[i] );
-					if ( dot <= 0 )
+					CPatch *patch2 = &g_Patches[trans->patch];
+
+					// get vector to other patch
+					VectorSubtract (patch2->origin, patch->origin, delta);
+					VectorNormalize (delta);
+					// find light emitted from other patch
+					v = s_ShootLight[trans->patch];
+					// remove normal already factored into transfer steradian
+					float scale = 1.0f / DotProduct (delta, patch->normal);
+					VectorScale( v, trans->transfer * scale, v );
+					
+					Vector bumpTransfer;
+					for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 					{
-//						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
+						dot = DotProduct( delta, normals[i] );
+						if ( dot <= 0 )
+						{
+//							Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
+							continue;
+						}
+						bumpTransfer = v * dot;
+						VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 				}
 			}
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1626,14 +1820,13 @@ void GatherLight (int threadnum, void *pUserData)
 		else
 		{
 			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			for ( num = transfers.NextBlock( &trans ); num; num = transfers.NextBlock( &trans ) )
 			{
-				for(i=0; i<3; i++)
+				for (k=0 ; k<num ; k++, trans++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					VectorScale( s_ShootLight[trans->patch], trans->transfer, v );
+					VectorAdd( sum, v, sum );
 				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
 		}
@@ -1706,6 +1899,14 @@ void BounceLight (void)
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
+		s_ShootLight.SetCount( uiPatchCount );
+		for ( unsigned int iPatch = 0; iPatch < uiPatchCount; iPatch++ )
+		{
+			for ( int c = 0; c < 3; c++ )
+			{
+				s_ShootLight[iPatch][c] = emitlight[iPatch][c] * g_Patches[iPatch].reflectivity[c];
+			}
+		}
 		RunThreadsOn (uiPatchCount, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
@@ -1746,6 +1947,196 @@ int CountClusters( void )
 }
 
 
+//-----------------------------------------------------------------------------
+// -rtbench: build both acceleration structures over the triangles of the loaded
+// map, then trace the same random rays through each and compare.
+//-----------------------------------------------------------------------------
+#define RTBENCH_NUM_PACKETS ( 256 * 1024 )
+
+static float RayTraceBenchmarkPass( FourRays const *pRays, RayTracingResult *pResults, fltx4 TMax )
+{
+	float start = Plat_FloatTime();
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS; i++ )
+	{
+		g_RtEnv.Trace4Rays( pRays[i], Four_Zeros, TMax, &pResults[i] );
+	}
+	return Plat_FloatTime() - start;
+}
+
+// Traces the same rays as RayTraceBenchmarkPass, paired up into eight ray packets
+static float RayTraceBenchmarkPass8( EightRays const *pRays, RayTracingResult8 *pResults, float flTMax )
+{
+	float tmin[8], tmax[8];
+	for ( int j = 0; j < 8; j++ )
+	{
+		tmin[j] = 0.0f;
+		tmax[j] = flTMax;
+	}
+
+	float start = Plat_FloatTime();
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS / 2; i++ )
+	{
+		g_RtEnv.Trace8Rays( pRays[i], tmin, tmax, &pResults[i] );
+	}
+	return Plat_FloatTime() - start;
+}
+
+// Queues the same rays one at a time and flushes them across all threads
+class CRayTraceBenchmarkQueue : public IRayQueueCallback
+{
+public:
+	virtual void RayQueueResult( int nUserData, const RayTracingSingleResult &result )
+	{
+		m_pHitIds[nUserData] = result.HitID;
+	}
+
+	int32 *m_pHitIds;
+};
+
+static float RayTraceBenchmarkQueuePass( FourRays const *pRays, int32 *pHitIds, float flTMax )
+{
+	CRayTraceBenchmarkQueue callback;
+	callback.m_pHitIds = pHitIds;
+
+	float start = Plat_FloatTime();
+	RayQueue queue;
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS; i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			Vector vecStart = pRays[i].origin.Vec( j );
+			Vector vecEnd = vecStart + flTMax * pRays[i].direction.Vec( j );
+			queue.AddRay( vecStart, vecEnd, &callback, 4 * i + j );
+		}
+	}
+	g_RtEnv.FlushRayQueue( queue, true );
+	return Plat_FloatTime() - start;
+}
+
+static void RunRayTraceBenchmark()
+{
+	Msg( "Ray-trace benchmark (%d triangles, %d rays, 1 thread for tracing)\n",
+		g_RtEnv.OptimizedTriangleList.Count(), RTBENCH_NUM_PACKETS * 4 );
+
+	float start = Plat_FloatTime();
+	g_RtEnv.BuildKDTree();
+	float flKDBuildTime = Plat_FloatTime() - start;
+
+	start = Plat_FloatTime();
+	g_RtEnv.BuildBVH();
+	float flBVHBuildTime = Plat_FloatTime() - start;
+
+	g_RtEnv.ConvertTrianglesToIntersectionFormat();
+
+	// random rays from inside the world bounds, long enough to cross the whole map
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+	Vector vecMins = g_RtEnv.m_MinBound;
+	Vector vecMaxs = g_RtEnv.m_MaxBound;
+	float flLength = ( vecMaxs - vecMins ).Length();
+
+	FourRays *pRays = new FourRays[RTBENCH_NUM_PACKETS];
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS; i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			Vector vecOrigin( random.RandomFloat( vecMins.x, vecMaxs.x ),
+							  random.RandomFloat( vecMins.y, vecMaxs.y ),
+							  random.RandomFloat( vecMins.z, vecMaxs.z ) );
+			Vector vecDir( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+			VectorNormalize( vecDir );
+			pRays[i].origin.X( j ) = vecOrigin.x;
+			pRays[i].origin.Y( j ) = vecOrigin.y;
+			pRays[i].origin.Z( j ) = vecOrigin.z;
+			pRays[i].direction.X( j ) = vecDir.x;
+			pRays[i].direction.Y( j ) = vecDir.y;
+			pRays[i].direction.Z( j ) = vecDir.z;
+		}
+	}
+
+	RayTracingResult *pKDResults = new RayTracingResult[RTBENCH_NUM_PACKETS];
+	RayTracingResult *pBVHResults = new RayTracingResult[RTBENCH_NUM_PACKETS];
+	fltx4 TMax = ReplicateX4( flLength );
+
+	g_RtEnv.Flags &= ~RTE_FLAGS_USE_BVH;
+	float flKDTraceTime = RayTraceBenchmarkPass( pRays, pKDResults, TMax );
+	g_RtEnv.Flags |= RTE_FLAGS_USE_BVH;
+	float flBVHTraceTime = RayTraceBenchmarkPass( pRays, pBVHResults, TMax );
+
+	EightRays *pRays8 = new EightRays[RTBENCH_NUM_PACKETS / 2];
+	RayTracingResult8 *pResults8 = new RayTracingResult8[RTBENCH_NUM_PACKETS / 2];
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS / 2; i++ )
+	{
+		pRays8[i].Set4Rays( 0, pRays[2 * i] );
+		pRays8[i].Set4Rays( 1, pRays[2 * i + 1] );
+	}
+	g_RtEnv.Flags &= ~RTE_FLAGS_USE_BVH;
+	float flKDTraceTime8 = RayTraceBenchmarkPass8( pRays8, pResults8, flLength );
+	g_RtEnv.Flags |= RTE_FLAGS_USE_BVH;
+	float flBVHTraceTime8 = RayTraceBenchmarkPass8( pRays8, pResults8, flLength );
+
+	// the 8 wide bvh pass has to match the 4 wide one exactly
+	int nMismatches8 = 0;
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS; i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			int k = 4 * ( i & 1 ) + j;
+			if ( pBVHResults[i].HitIds[j] != pResults8[i / 2].HitIds[k] ||
+				 SubFloat( pBVHResults[i].HitDistance, j ) != pResults8[i / 2].HitDistance[k] )
+			{
+				nMismatches8++;
+			}
+		}
+	}
+
+	// the queue sorts the rays so the packets differ, but each ray should hit the same thing
+	int32 *pQueueHitIds = new int32[RTBENCH_NUM_PACKETS * 4];
+	float flQueueTraceTime = RayTraceBenchmarkQueuePass( pRays, pQueueHitIds, flLength );
+	int nQueueMismatches = 0;
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS * 4; i++ )
+	{
+		if ( pQueueHitIds[i] != pBVHResults[i / 4].HitIds[i & 3] )
+			nQueueMismatches++;
+	}
+
+	// both should find the same closest hit, though not necessarily the same triangle on ties
+	int nMismatches = 0;
+	for ( int i = 0; i < RTBENCH_NUM_PACKETS; i++ )
+	{
+		for ( int j = 0; j < 4; j++ )
+		{
+			bool bKDHit = ( pKDResults[i].HitIds[j] != -1 );
+			bool bBVHHit = ( pBVHResults[i].HitIds[j] != -1 );
+			if ( bKDHit != bBVHHit ||
+				 ( bKDHit && fabs( SubFloat( pKDResults[i].HitDistance, j ) - SubFloat( pBVHResults[i].HitDistance, j ) ) > 0.01f ) )
+			{
+				nMismatches++;
+			}
+		}
+	}
+
+	float flNumRays = RTBENCH_NUM_PACKETS * 4.0f;
+	Msg( "  kd tree: %d nodes, build %.2f seconds, %.2f Mrays/sec\n",
+		g_RtEnv.OptimizedKDTree.Count(), flKDBuildTime, flNumRays / ( flKDTraceTime * 1.0e6 ) );
+	Msg( "  bvh    : %d nodes, build %.2f seconds (%d threads), %.2f Mrays/sec\n",
+		g_RtEnv.OptimizedBVH.Count(), flBVHBuildTime, numthreads, flNumRays / ( flBVHTraceTime * 1.0e6 ) );
+	Msg( "  %d of %d rays had different results\n", nMismatches, RTBENCH_NUM_PACKETS * 4 );
+	Msg( "  8 wide (%s): kd tree %.2f Mrays/sec, bvh %.2f Mrays/sec, %d rays different from 4 wide\n",
+		RayTracingEnvironment::Has8WideTracing() ? "avx2" : "no avx2, traced 4 at a time",
+		flNumRays / ( flKDTraceTime8 * 1.0e6 ), flNumRays / ( flBVHTraceTime8 * 1.0e6 ), nMismatches8 );
+	Msg( "  ray queue (bvh, %d threads, includes sorting): %.2f Mrays/sec, %d rays different from 4 wide\n",
+		numthreads, flNumRays / ( flQueueTraceTime * 1.0e6 ), nQueueMismatches );
+
+	delete[] pRays;
+	delete[] pRays8;
+	delete[] pResults8;
+	delete[] pQueueHitIds;
+	delete[] pKDResults;
+	delete[] pBVHResults;
+}
+
+
 /*
 =============
 RadWorld
@@ -1830,10 +2221,43 @@ void RadWorld_Start()
 }
 
 
-// This function should fill in the indices into g_pFaces[] for the faces
-// with displacements that touch the specified leaf.
-void STUB_GetDisplacementsTouchingLeaf( int iLeaf, CUtlVector<int> &dispFaces )
+//-----------------------------------------------------------------------------
+// Sets the bit in pFaceBits for every face (displacements included) in a leaf
+// of one of the clusters set in pClusters.
+//-----------------------------------------------------------------------------
+void MarkFacesInClusters( byte const *pClusters, byte *pFaceBits )
 {
+	CUtlVector<int> dispFaces;
+	for( int iCluster=0; iCluster < dvis->numclusters; iCluster++ )
+	{
+		if( !g_ClusterLeaves[iCluster].leafCount || !( pClusters[iCluster>>3] & (1 << (iCluster & 7)) ) )
+			continue;
+
+		for ( int i = 0; i < g_ClusterLeaves[iCluster].leafCount; i++ )
+		{
+			int iLeaf = g_ClusterLeaves[iCluster].leafs[i];
+
+			// Tag all the faces.
+			int iFace;
+			for( iFace=0; iFace < dleafs[iLeaf].numleaffaces; iFace++ )
+			{
+				int index = dleafs[iLeaf].firstleafface + iFace;
+				index = dleaffaces[index];
+				
+				assert( index < numfaces );
+				pFaceBits[index >> 3] |= (1 << (index & 7));
+			}
+
+			// Displacements aren't in the leaf face lists.
+			dispFaces.RemoveAll();
+			StaticDispMgr()->GetDispFacesInLeaf( iLeaf, dispFaces );
+			for( iFace=0; iFace < dispFaces.Count(); iFace++ )
+			{
+				int index = dispFaces[iFace];
+				pFaceBits[index >> 3] |= (1 << (index & 7));
+			}
+		}
+	}
 }
 
 
@@ -1876,40 +2300,8 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 
 	// Now tag any faces that are visible to this monster PVS.
-	for( int iCluster=0; iCluster < dvis->numclusters; iCluster++ )
-	{
-		if( g_ClusterLeaves[iCluster].leafCount )
-		{
-			if( aggregate[iCluster>>3] & (1 << (iCluster & 7)) )
-			{
-				for ( int i = 0; i < g_ClusterLeaves[iCluster].leafCount; i++ )
-				{
-					int iLeaf = g_ClusterLeaves[iCluster].leafs[i];
-
-					// Tag all the faces.
-					int iFace;
-					for( iFace=0; iFace < dleafs[iLeaf].numleaffaces; iFace++ )
-					{
-						int index = dleafs[iLeaf].firstleafface + iFace;
-						index = dleaffaces[index];
-						
-						assert( index < numfaces );
-						g_FacesVisibleToLights[index >> 3] |= (1 << (index & 7));
-					}
-
-					// Fill in STUB_GetDisplacementsTouchingLeaf when it's available
-					// so displacements get relit.
-					CUtlVector<int> dispFaces;
-					STUB_GetDisplacementsTouchingLeaf( iLeaf, dispFaces );
-					for( iFace=0; iFace < dispFaces.Count(); iFace++ )
-					{
-						int index = dispFaces[iFace];
-						g_FacesVisibleToLights[index >> 3] |= (1 << (index & 7));
-					}
-				}
-			}
-		}
-	}
+	memset( g_FacesVisibleToLights.Base(), 0, g_FacesVisibleToLights.Count() );
+	MarkFacesInClusters( aggregate.Base(), g_FacesVisibleToLights.Base() );
 
 	// For stats.. figure out how many faces it's going to touch.
 	int nFacesToProcess = 0;
@@ -1934,6 +2326,12 @@ void MakeAllScales (void)
 
 	qprintf ("transfer lists: %5.1f megs\n"
 		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+
+	if ( total_packed_transfer_bytes )
+	{
+		Msg("packed transfer lists: %5.1f megs, %.2f bytes per transfer\n",
+			(float)total_packed_transfer_bytes / (1024*1024), (float)total_packed_transfer_bytes / max( total_transfer, 1 ) );
+	}
 }
 
 
@@ -2019,6 +2417,15 @@ bool RadWorld_Go()
 		BuildFacesVisibleToLights( true );
 	}
 
+	// Restore the faces the light changes since the last run can't reach.
+	if ( g_bIncrementalLighting )
+	{
+		g_LightCache.PrepareForLighting( lightcachefile );
+	}
+
+	// figure out which lights can reach each cluster
+	BuildClusterLightLists();
+
 	// build initial facelights
 #ifdef MPI
 	if (g_bUseMPI) 
@@ -2031,6 +2438,12 @@ bool RadWorld_Go()
 	{
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
 	}
+	PrintLightCullingStats();
+
+	if ( g_bIncrementalLighting )
+	{
+		g_LightCache.Save( lightcachefile );
+	}
 
 	// Was the process interrupted?
 	if( g_pIncremental && (g_iCurFace != numfaces) )
@@ -2188,6 +2601,18 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+	strcpy(rtcachefile, source);
+	Q_DefaultExtension(rtcachefile, ".rtc", sizeof(rtcachefile));
+	strcpy(lightcachefile, source);
+	Q_DefaultExtension(lightcachefile, g_bHDR ? ".hdr.vlc" : ".ldr.vlc", sizeof(lightcachefile));
+#ifdef MPI
+	// workers light faces without the cache
+	if ( g_bUseMPI && g_bIncrementalLighting )
+	{
+		Warning( "-incremental is ignored with -mpi.\n" );
+		g_bIncrementalLighting = false;
+	}
+#endif
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	Msg( "Loading %s\n", source );
@@ -2282,12 +2707,27 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	if ( g_bRayTraceBenchmark )
+	{
+		RunRayTraceBenchmark();
+		CmdLib_Exit( 0 );
+	}
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	bool bFromCache = false;
+#ifdef MPI
+	// workers can't write through the VMPI file system
+	if ( g_bUseMPI && !g_bMPIMaster )
+		g_bRayTraceCache = false;
+#endif
+	if ( g_bRayTraceCache )
+		bFromCache = g_RtEnv.SetupAccelerationStructureCached( rtcachefile );
+	else
+		g_RtEnv.SetupAccelerationStructure();
 	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+	printf ( "Done (%.2f seconds%s)\n", end-start, bFromCache ? ", loaded from cache" : "" );
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2334,6 +2774,7 @@ void VRAD_Finish()
 	if ( verbose )
 	{
 		PrintBSPFileSizes();
+		PrintLightmapPageStats();
 	}
 
 	Msg( "Writing %s\n", source );
@@ -2432,6 +2873,47 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-bvh" ) )
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_USE_BVH;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_bRayTraceBenchmark = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtcache" ) )
+		{
+			g_bRayTraceCache = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-incremental" ) )
+		{
+			g_bIncrementalLighting = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-compacttransfers" ) )
+		{
+			g_bCompactTransfers = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-nolightcull" ) )
+		{
+			g_bLightCulling = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-lightcullthreshold" ) )
+		{
+			if ( ++i < argc && *argv[i] )
+			{
+				g_flLightCullThreshold = atof( argv[i] );
+				if ( g_flLightCullThreshold < 0.0f )
+				{
+					Warning("Error: expected non-negative value after '-lightcullthreshold'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning("Error: expected a value after '-lightcullthreshold'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2836,6 +3318,19 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -bvh            : Trace rays through a bvh instead of a kd tree.\n"
+		"  -rtbench        : Compare kd tree and bvh build time and trace speed, then exit.\n"
+		"  -rtcache        : Keep the ray-trace acceleration structure in <mapname>.rtc and\n"
+		"                    reuse it on later runs if the map geometry hasn't changed.\n"
+		"  -incremental    : Keep each face's direct lighting in <mapname>.ldr.vlc (or\n"
+		"                    .hdr.vlc) and on later runs only relight the faces that\n"
+		"                    added, removed or changed lights can see.\n"
+		"  -compacttransfers : Store radiosity transfers with 16-bit weights to save\n"
+		"                    memory, at a small cost in bounce light precision.\n"
+		"  -nolightcull    : Test every light against every sample instead of using\n"
+		"                    per-cluster light lists.\n"
+		"  -lightcullthreshold # : Also cull lights without a hard falloff past the distance\n"
+		"                    where they fall below this intensity (default: 0, off).\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
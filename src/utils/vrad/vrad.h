@@ -238,6 +238,7 @@ struct CPatch
 
 	int			numtransfers;
 	transfer_t	*transfers;
+	byte		*packedTransfers;		// -compacttransfers: transfers is NULL and these are used instead
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -351,6 +352,7 @@ extern char		source[MAX_PATH];
 // There is a bit in here for each face telling whether or not any of the
 // active lights can see the face.
 extern CUtlVector<byte> g_FacesVisibleToLights;
+void MarkFacesInClusters( byte const *pClusters, byte *pFaceBits );
 
 void MakeTnodes (dmodel_t *bm);
 void PairEdges (void);
@@ -386,6 +388,9 @@ inline byte PVSCheck( const byte *pvs, int iCluster )
 // outputs 1 in fractionVisible if no occlusion, 0 if full occlusion, and in-between values
 void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFractionVisible, int static_prop_index_to_ignore=-1);
 
+// TestLine for two sets of four rays at once. They go through the raytracer as one eight ray packet.
+void TestLine8( FourVectors const start[2], FourVectors const stop[2], fltx4 pFractionVisible[2], int static_prop_index_to_ignore=-1);
+
 // returns 1 if the ray sees the sky, 0 if it doesn't, and in-between values for partial coverage
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
@@ -401,6 +406,12 @@ int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
 void MakeScales( int ndxPatch, transfer_t *all_transfers );
 
+// transfers per block of packed transfers
+#define TRANSFER_BLOCK_SIZE		32
+
+extern bool g_bCompactTransfers;
+void PackPatchTransfers( CPatch *patch, transfer_t *pTransfers, int numtransfers );
+
 // Run startup code like initialize mathlib.
 void VRAD_Init();
 
@@ -529,6 +540,7 @@ public:
 		int ndxLeaf, float& dist, Vector *pNormal ) = 0;
 	virtual void StartRayTest( DispTested_t &dispTested ) = 0;
 	virtual void AddPolysForRayTrace() = 0;
+	virtual void GetDispFacesInLeaf( int ndxLeaf, CUtlVector<int> &dispFaces ) = 0;
 
 	// general timing -- should be moved!!
 	virtual void StartTimer( const char *name ) = 0;
@@ -53,6 +53,18 @@ public:
 };
 
 
+//=============================================================================
+//
+// Displacements in a leaf
+//
+class CBSPDispLeafFacesEnumerator : public IBSPTreeDataEnumerator
+{
+public:
+	// IBSPTreeDataEnumerator
+	bool FASTCALL EnumerateElement( int userId, intp context );
+};
+
+
 //=============================================================================
 //
 // RayEnumerator
@@ -118,6 +130,7 @@ public:
 
 	void StartRayTest( DispTested_t &dispTested );
 	void AddPolysForRayTrace( void );
+	void GetDispFacesInLeaf( int ndxLeaf, CUtlVector<int> &dispFaces );
 
 	// general timing -- should be moved!!
 	void StartTimer( const char *name );
@@ -134,6 +147,8 @@ public:
 	bool DispFaceList_EnumerateLeaf( int ndxLeaf, int context );
 	bool DispFaceList_EnumerateElement( int userId, int context );
 
+	bool DispLeafFaces_EnumerateElement( int userId, CUtlVector<int> *pDispFaces );
+
 private:
 
 	//=========================================================================
@@ -227,6 +242,16 @@ bool FASTCALL CBSPDispFaceListEnumerator::EnumerateElement( int userId, intp con
 }
 
 
+//=============================================================================
+//
+// Displacements in a leaf
+//
+bool FASTCALL CBSPDispLeafFacesEnumerator::EnumerateElement( int userId, intp context )
+{
+	return s_DispMgr.DispLeafFaces_EnumerateElement( userId, (CUtlVector<int>*)context );
+}
+
+
 //=============================================================================
 //
 // RayEnumerator
@@ -626,6 +651,22 @@ void CVRadDispMgr::AddPolysForRayTrace( void )
 }
 
 
+//-----------------------------------------------------------------------------
+// Fills in the faces of the displacements that touch a leaf
+//-----------------------------------------------------------------------------
+void CVRadDispMgr::GetDispFacesInLeaf( int ndxLeaf, CUtlVector<int> &dispFaces )
+{
+	CBSPDispLeafFacesEnumerator leafFacesEnum;
+	m_pBSPTreeData->EnumerateElementsInLeaf( ndxLeaf, &leafFacesEnum, (intp)&dispFaces );
+}
+
+bool CVRadDispMgr::DispLeafFaces_EnumerateElement( int userId, CUtlVector<int> *pDispFaces )
+{
+	pDispFaces->AddToTail( m_DispTrees[userId].m_pDispTree->GetParentIndex() );
+	return true;
+}
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void CVRadDispMgr::GetDispSurfNormal( int ndxFace, Vector &pt, Vector &ptNormal,
@@ -1649,7 +1690,7 @@ bool CVRadDispMgr::BuildDispSamples( lightinfo_t *pLightInfo, facelight_t *pFace
 	// copy over samples
 	//
 	pFaceLight->numsamples = width * height;
-	pFaceLight->sample = ( sample_t* )calloc( pFaceLight->numsamples, sizeof( *pFaceLight->sample ) );
+	pFaceLight->sample = ( sample_t* )FaceLightAlloc( pFaceLight->numsamples * sizeof( *pFaceLight->sample ) );
 	if( !pFaceLight->sample )
 		return false;
 
@@ -1681,8 +1722,8 @@ bool CVRadDispMgr::BuildDispLuxels( lightinfo_t *pLightInfo, facelight_t *pFaceL
 
 	// calcuate actual luxel points
 	pFaceLight->numluxels = width * height;
-	pFaceLight->luxel = ( Vector* )calloc( pFaceLight->numluxels, sizeof( *pFaceLight->luxel ) );
-	pFaceLight->luxelNormals = ( Vector* )calloc( pFaceLight->numluxels, sizeof( Vector ) );
+	pFaceLight->luxel = ( Vector* )FaceLightAlloc( pFaceLight->numluxels * sizeof( *pFaceLight->luxel ) );
+	pFaceLight->luxelNormals = ( Vector* )FaceLightAlloc( pFaceLight->numluxels * sizeof( Vector ) );
 	if( !pFaceLight->luxel || !pFaceLight->luxelNormals )
 		return false;
 
@@ -1721,13 +1762,13 @@ bool CVRadDispMgr::BuildDispSamplesAndLuxels_DoFast( lightinfo_t *pLightInfo, fa
 
 	// calcuate actual luxel points
 	pFaceLight->numsamples = width * height;
-	pFaceLight->sample = ( sample_t* )calloc( pFaceLight->numsamples, sizeof( *pFaceLight->sample ) );
+	pFaceLight->sample = ( sample_t* )FaceLightAlloc( pFaceLight->numsamples * sizeof( *pFaceLight->sample ) );
 	if( !pFaceLight->sample )
 		return false;
 
 	pFaceLight->numluxels = width * height;
-	pFaceLight->luxel = ( Vector* )calloc( pFaceLight->numluxels, sizeof( *pFaceLight->luxel ) );
-	pFaceLight->luxelNormals = ( Vector* )calloc( pFaceLight->numluxels, sizeof( Vector ) );
+	pFaceLight->luxel = ( Vector* )FaceLightAlloc( pFaceLight->numluxels * sizeof( *pFaceLight->luxel ) );
+	pFaceLight->luxelNormals = ( Vector* )FaceLightAlloc( pFaceLight->numluxels * sizeof( Vector ) );
 	if( !pFaceLight->luxel || !pFaceLight->luxelNormals )
 		return false;
 
@@ -71,6 +71,27 @@ struct colorTexel_t
 
 };
 
+// a vertex or texel waiting to be lit
+struct lightingSample_t
+{
+	Vector	m_Position;
+	Vector	m_Normal;
+	Vector	*m_pColor;		// receives direct + indirect, points into the color arrays
+};
+
+// up to four samples that are lit together through one SSE gather
+#define MAX_SAMPLES_PER_BATCH	4
+
+struct lightingBatch_t
+{
+	int		m_nFirstSample;
+	int		m_nSamples;
+	int		m_nSkipProp;
+	int		m_nLFlags;
+	bool	m_bIndirect;
+	bool	m_bIgnoreNormals;
+};
+
 class CComputeStaticPropLightingResults
 {
 public:
@@ -79,9 +100,36 @@ public:
 		m_ColorVertsArrays.PurgeAndDeleteElements();
 		m_ColorTexelsArrays.PurgeAndDeleteElements();
 	}
-	
+
+	// Queues a point to be lit. Consecutive points with the same trace settings share a batch.
+	// pColor must stay put until the batches are lit, so size the color arrays first.
+	void AddSample( const Vector &position, const Vector &normal, Vector *pColor, int nSkipProp, int nLFlags, bool bIndirect, bool bIgnoreNormals )
+	{
+		lightingBatch_t *pBatch = m_Batches.Count() ? &m_Batches.Tail() : NULL;
+		if ( !pBatch || pBatch->m_nSamples == MAX_SAMPLES_PER_BATCH || pBatch->m_nSkipProp != nSkipProp ||
+			pBatch->m_nLFlags != nLFlags || pBatch->m_bIndirect != bIndirect || pBatch->m_bIgnoreNormals != bIgnoreNormals )
+		{
+			pBatch = &m_Batches[m_Batches.AddToTail()];
+			pBatch->m_nFirstSample = m_Samples.Count();
+			pBatch->m_nSamples = 0;
+			pBatch->m_nSkipProp = nSkipProp;
+			pBatch->m_nLFlags = nLFlags;
+			pBatch->m_bIndirect = bIndirect;
+			pBatch->m_bIgnoreNormals = bIgnoreNormals;
+		}
+
+		lightingSample_t &sample = m_Samples[m_Samples.AddToTail()];
+		sample.m_Position = position;
+		sample.m_Normal = normal;
+		sample.m_pColor = pColor;
+		pBatch->m_nSamples++;
+	}
+
 	CUtlVector< CUtlVector<colorVertex_t>* > m_ColorVertsArrays;
 	CUtlVector< CUtlVector<colorTexel_t>* > m_ColorTexelsArrays;
+
+	CUtlVector<lightingSample_t>	m_Samples;
+	CUtlVector<lightingBatch_t>		m_Batches;
 };
 
 //-----------------------------------------------------------------------------
@@ -231,9 +279,13 @@ IPhysicsCollision *s_pPhysCollision = NULL;
 static void ConvertTexelDataToTexture(unsigned int _resX, unsigned int _resY, ImageFormat _destFmt, const CUtlVector<colorTexel_t>& _srcTexels, CUtlMemory<byte>* _outTexture);
 
 // Such a monstrosity. :(
-static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _iThread, int _skipProp, int _nFlags, int _lightmapResX, int _lightmapResY, 
+static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _lightmapResX, int _lightmapResY, 
 											studiohdr_t* _pStudioHdr, mstudiomodel_t* _pStudioModel, OptimizedModel::ModelHeader_t* _pVtxModel, int _meshID, 
-											CComputeStaticPropLightingResults *_pResults );
+											CUtlVector<colorTexel_t>* _outTexels );
+
+// Queues the texels GenerateLightmapSamplesForMesh marked as worth lighting.
+static void AddLightmapSamples( int _skipProp, int _nFlags, int _lightmapResX, int _lightmapResY, CUtlVector<colorTexel_t>* _texels, 
+								CComputeStaticPropLightingResults *_pResults );
 
 // Debug function, converts lightmaps to linear space then dumps them out. 
 // TODO: Write out the file in a .dds instead of a .tga, in whatever format we're supposed to use.
@@ -268,8 +320,9 @@ private:
 #endif
 	
 	// local thread version
-	static void ThreadComputeStaticPropLighting( int iThread, void *pUserData );
-	void ComputeLightingForProp( int iThread, int iStaticProp );
+	static void ThreadAddLightingSamples( int iThread, int iWaveProp );
+	static void ThreadLightBatch( int iThread, int iWaveBatch );
+	void ComputeLightingThreaded();
 
 	// Methods associated with unserializing static props
 	void UnserializeModelDict( CUtlBuffer& buf );
@@ -337,6 +390,20 @@ private:
 
 	bool m_bIgnoreStaticPropTrace;
 
+	// The props being lit by ComputeLightingThreaded right now, and a flat list of all their batches.
+	struct WaveBatch_t
+	{
+		int		m_iWaveProp;
+		int		m_iBatch;
+	};
+
+	int m_iWaveFirstProp;
+	CUtlVector<CComputeStaticPropLightingResults *>	m_WaveResults;
+	CUtlVector<WaveBatch_t>	m_WaveBatches;
+
+	int EstimateLightingSamples( const CStaticProp &prop );
+	void AddLightingSamples( CStaticProp &prop, int prop_index, CComputeStaticPropLightingResults *pResults );
+	void LightBatch( CComputeStaticPropLightingResults *pResults, int iBatch, int iThread );
 	void ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults );
 	void ApplyLightingToStaticProp( int iStaticProp, CStaticProp &prop, const CComputeStaticPropLightingResults *pResults );
 
@@ -365,6 +432,7 @@ CVradStaticPropMgr::CVradStaticPropMgr()
 {
 	// set to ignore static prop traces
 	m_bIgnoreStaticPropTrace = false;
+	m_iWaveFirstProp = 0;
 }
 
 CVradStaticPropMgr::~CVradStaticPropMgr()
@@ -1147,17 +1215,36 @@ bool PositionInSolid( Vector &position )
 }
 
 //-----------------------------------------------------------------------------
-// Trace from a vertex to each direct light source, accumulating its contribution.
+// Trace from up to four vertexes to each direct light source, accumulating their
+// contributions. Each lane is lit exactly as if it had been traced on its own.
 //-----------------------------------------------------------------------------
-void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
-								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+void ComputeDirectLightingAtPoints( const Vector *pPositions, const Vector *pNormals, int nPoints, Vector *pOutColors, int iThread,
+									int static_prop_id_to_skip=-1, int nLFlags = 0 )
 {
+	Assert( nPoints > 0 && nPoints <= 4 );
+
 	SSE_sampleLightOutput_t	sampleOutput;
 
-	outColor.Init();
+	// pad the unused lanes with the last point, their results get dropped
+	int cluster[4];
+	Vector position[4], normal[4];
+	for ( int i = 0; i < 4; ++i )
+	{
+		int iPoint = MIN( i, nPoints - 1 );
+		position[i] = pPositions[iPoint];
+		normal[i] = pNormals[iPoint];
+		cluster[i] = ClusterFromPoint( position[i] );
+	}
+
+	for ( int i = 0; i < nPoints; ++i )
+	{
+		pOutColors[i].Init();
+	}
+
+	FourVectors normal4;
+	normal4.LoadAndSwizzle( normal[0], normal[1], normal[2], normal[3] );
 
 	// Iterate over all direct lights and accumulate their contribution
-	int cluster = ClusterFromPoint( position );
 	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
 	{
 		if ( dl->light.style )
@@ -1167,43 +1254,60 @@ void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &out
 		}
 
 		// is this lights cluster visible?
-		if ( !PVSCheck( dl->pvs, cluster ) )
+		bool bVisible[4];
+		bool bAnyVisible = false;
+		for ( int i = 0; i < nPoints; ++i )
+		{
+			bVisible[i] = PVSCheck( dl->pvs, cluster[i] ) != 0;
+			bAnyVisible |= bVisible[i];
+		}
+
+		if ( !bAnyVisible )
 			continue;
 
-		// push the vertex towards the light to avoid surface acne
-		Vector adjusted_pos = position;
+		// push the vertexes towards the light to avoid surface acne
+		Vector adjusted_pos[4];
 		float flEpsilon = 0.0;
 
-		if  (dl->light.type != emit_skyambient)
+		for ( int i = 0; i < 4; ++i )
 		{
-			// push towards the light
-			Vector fudge;
-			if ( dl->light.type == emit_skylight )
-				fudge = -( dl->light.normal);
-			else
+			adjusted_pos[i] = position[i];
+
+			if  (dl->light.type != emit_skyambient)
 			{
-				fudge = dl->light.origin-position;
-				VectorNormalize( fudge );
+				// push towards the light
+				Vector fudge;
+				if ( dl->light.type == emit_skylight )
+					fudge = -( dl->light.normal);
+				else
+				{
+					fudge = dl->light.origin-position[i];
+					VectorNormalize( fudge );
+				}
+				fudge *= 4.0;
+				adjusted_pos[i] += fudge;
+			}
+			else 
+			{
+				// push out along normal
+				adjusted_pos[i] += 4.0 * normal[i];
+//				flEpsilon = 1.0;
 			}
-			fudge *= 4.0;
-			adjusted_pos += fudge;
-		}
-		else 
-		{
-			// push out along normal
-			adjusted_pos += 4.0 * normal;
-//			flEpsilon = 1.0;
 		}
 
 		FourVectors adjusted_pos4;
-		FourVectors normal4;
-		adjusted_pos4.DuplicateVector( adjusted_pos );
-		normal4.DuplicateVector( normal );
+		adjusted_pos4.LoadAndSwizzle( adjusted_pos[0], adjusted_pos[1], adjusted_pos[2], adjusted_pos[3] );
 
 		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
 		                      static_prop_id_to_skip, flEpsilon );
-		
-		VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
+
+		for ( int i = 0; i < nPoints; ++i )
+		{
+			if ( bVisible[i] )
+			{
+				VectorMA( pOutColors[i], SubFloat( sampleOutput.m_flFalloff, i ) * SubFloat( sampleOutput.m_flDot[0], i ), dl->light.intensity, pOutColors[i] );
+			}
+		}
 	}
 }
 
@@ -1304,11 +1408,38 @@ void CVradStaticPropMgr::ApplyLightingToStaticProp( int iStaticProp, CStaticProp
 }
 
 //-----------------------------------------------------------------------------
-// Trace rays from each unique vertex, accumulating direct and indirect
-// sources at each ray termination. Use the winding data to distribute the unique vertexes
-// into the rendering layout.
+// Rough count of the samples AddLightingSamples will queue for a prop, used to
+// size the waves in ComputeLightingThreaded.
 //-----------------------------------------------------------------------------
-void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults )
+int CVradStaticPropMgr::EstimateLightingSamples( const CStaticProp &prop )
+{
+	studiohdr_t	*pStudioHdr = m_StaticPropDict[prop.m_ModelIdx].m_pStudioHdr;
+	if ( !pStudioHdr )
+		return 0;
+
+	int nSamples = 0;
+	for ( int bodyID = 0; bodyID < pStudioHdr->numbodyparts; ++bodyID )
+	{
+		mstudiobodyparts_t *pBodyPart = pStudioHdr->pBodypart( bodyID );
+		for ( int modelID = 0; modelID < pBodyPart->nummodels; ++modelID )
+		{
+			nSamples += pBodyPart->pModel( modelID )->numvertices;
+			if ( ( prop.m_Flags & STATIC_PROP_NO_PER_TEXEL_LIGHTING ) == 0 )
+			{
+				nSamples += prop.m_LightmapImageWidth * prop.m_LightmapImageHeight;
+			}
+		}
+	}
+	return nSamples;
+}
+
+//-----------------------------------------------------------------------------
+// Transform each unique vertex (and lightmap texel) into the world and queue it
+// for lighting. Use the winding data to distribute the unique vertexes
+// into the rendering layout. Vertexes embedded in solid are moved towards a
+// better position and queued from there.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::AddLightingSamples( CStaticProp &prop, int prop_index, CComputeStaticPropLightingResults *pResults )
 {
 	CUtlVector<badVertex_t>		badVerts;
 
@@ -1330,10 +1461,7 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 
 	const int skip_prop = (g_bDisablePropSelfShadowing || (prop.m_Flags & STATIC_PROP_NO_SELF_SHADOWING)) ? prop_index : -1;
 	const int nFlags = ( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS ) ? GATHERLFLAGS_IGNORE_NORMALS : 0;
-
-#ifdef MPI
-	VMPI_SetCurrentStage( "ComputeLighting" );
-#endif
+	const bool bIndirect = !g_bShowStaticPropNormals && numbounce >= 1;
 
 	matrix3x4_t	matPos, matNormal;
 	AngleMatrix(prop.m_Angles, prop.m_Origin, matPos);
@@ -1349,9 +1477,10 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 			OptimizedModel::ModelHeader_t* pVtxModel = pVtxBodyPart->pModel(modelID);
 			mstudiomodel_t *pStudioModel = pBodyPart->pModel( modelID );
 
+			CUtlVector<colorTexel_t> *pColorTexelArray = NULL;
 			if (withTexelLighting)
 			{
-				CUtlVector<colorTexel_t> *pColorTexelArray = new CUtlVector<colorTexel_t>;
+				pColorTexelArray = new CUtlVector<colorTexel_t>;
 				pResults->m_ColorTexelsArrays.AddToTail(pColorTexelArray);
 			}
 			
@@ -1371,10 +1500,9 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 
 				Assert(vertData); // This can only return NULL on X360 for now
 				
-				// TODO: Move this into its own function. In fact, refactor this whole function.
 				if (withTexelLighting)
 				{
-					GenerateLightmapSamplesForMesh( matPos, matNormal, iThread, skip_prop, nFlags, prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, pStudioHdr, pStudioModel, pVtxModel, meshID, pResults );
+					GenerateLightmapSamplesForMesh( matPos, matNormal, prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, pStudioHdr, pStudioModel, pVtxModel, meshID, pColorTexelArray );
 				}
 
 				// If we do lightmapping, we also do vertex lighting as a potential fallback. This may change.
@@ -1397,39 +1525,32 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 					}
 					else
 					{
-						Vector direct_pos=samplePosition;
-							
-						
-
-						Vector directColor(0,0,0);
-						ComputeDirectLightingAtPoint( direct_pos,
-														sampleNormal, directColor, iThread,
-														skip_prop, nFlags );
-						Vector indirectColor(0,0,0);
+						colorVerts[numVertexes].m_bValid = true;
+						colorVerts[numVertexes].m_Position = samplePosition;
 
 						if (g_bShowStaticPropNormals)
 						{
-							directColor= sampleNormal;
+							Vector directColor = sampleNormal;
 							directColor += Vector(1.0,1.0,1.0);
 							directColor *= 50.0;
+							colorVerts[numVertexes].m_Color = directColor;
 						}
 						else
 						{
-							if (numbounce >= 1)
-								ComputeIndirectLightingAtPoint( 
-									samplePosition, sampleNormal, 
-									indirectColor, iThread, true,
-									( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
+							pResults->AddSample( samplePosition, sampleNormal, &colorVerts[numVertexes].m_Color,
+												 skip_prop, nFlags, bIndirect, ( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
 						}
-						
-						colorVerts[numVertexes].m_bValid = true;
-						colorVerts[numVertexes].m_Position = samplePosition;
-						VectorAdd( directColor, indirectColor, colorVerts[numVertexes].m_Color );
 					}
 					
 					numVertexes++;
 				}
 			}
+
+			// Each mesh rebuilds the model's lightmap from scratch, so only the last one is lit.
+			if (withTexelLighting)
+			{
+				AddLightmapSamples( skip_prop, nFlags, prop.m_LightmapImageWidth, prop.m_LightmapImageHeight, pColorTexelArray, pResults );
+			}
 			
 			// color in the bad vertexes
 			// when entire model has no lighting origin and no valid neighbors
@@ -1484,17 +1605,11 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 					}
 
 					// re-light from better position
-					Vector directColor;
-					ComputeDirectLightingAtPoint( bestPosition, badVerts[nBadVertex].m_Normal, directColor, iThread );
-
-					Vector indirectColor;
-					ComputeIndirectLightingAtPoint( bestPosition, badVerts[nBadVertex].m_Normal,
-													indirectColor, iThread, true );
-
 					// save results, not changing valid status
 					// to ensure this offset position is not considered as a viable candidate
-					colorVerts[badVerts[nBadVertex].m_ColorVertex].m_Position = bestPosition;
-					VectorAdd( directColor, indirectColor, colorVerts[badVerts[nBadVertex].m_ColorVertex].m_Color );
+					colorVertex_t &colorVert = colorVerts[badVerts[nBadVertex].m_ColorVertex];
+					colorVert.m_Position = bestPosition;
+					pResults->AddSample( bestPosition, badVerts[nBadVertex].m_Normal, &colorVert.m_Color, -1, 0, true, false );
 				}
 			}
 			
@@ -1504,6 +1619,53 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Light one batch of queued samples: direct light four at a time through
+// the SSE gather, then the indirect hemisphere for each.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::LightBatch( CComputeStaticPropLightingResults *pResults, int iBatch, int iThread )
+{
+	const lightingBatch_t &batch = pResults->m_Batches[iBatch];
+	const lightingSample_t *pSamples = &pResults->m_Samples[batch.m_nFirstSample];
+
+	Vector positions[MAX_SAMPLES_PER_BATCH], normals[MAX_SAMPLES_PER_BATCH], directColors[MAX_SAMPLES_PER_BATCH];
+	for ( int i = 0; i < batch.m_nSamples; ++i )
+	{
+		positions[i] = pSamples[i].m_Position;
+		normals[i] = pSamples[i].m_Normal;
+	}
+
+	ComputeDirectLightingAtPoints( positions, normals, batch.m_nSamples, directColors, iThread, batch.m_nSkipProp, batch.m_nLFlags );
+
+	for ( int i = 0; i < batch.m_nSamples; ++i )
+	{
+		Vector indirectColor(0,0,0);
+		if ( batch.m_bIndirect )
+		{
+			ComputeIndirectLightingAtPoint( positions[i], normals[i], indirectColor, iThread, true, batch.m_bIgnoreNormals );
+		}
+
+		VectorAdd( directColors[i], indirectColor, *pSamples[i].m_pColor );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Compute a single prop's lighting on the calling thread.
+//-----------------------------------------------------------------------------
+void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int prop_index, CComputeStaticPropLightingResults *pResults )
+{
+#ifdef MPI
+	VMPI_SetCurrentStage( "ComputeLighting" );
+#endif
+
+	AddLightingSamples( prop, prop_index, pResults );
+
+	for ( int iBatch = 0; iBatch < pResults->m_Batches.Count(); ++iBatch )
+	{
+		LightBatch( pResults, iBatch, iThread );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Write the lighitng to bsp pak lump
 //-----------------------------------------------------------------------------
@@ -1748,23 +1910,74 @@ void CVradStaticPropMgr::VMPI_ReceiveStaticPropResults( int iStaticProp, Message
 }
 #endif
 
-void CVradStaticPropMgr::ComputeLightingForProp( int iThread, int iStaticProp )
+void CVradStaticPropMgr::ThreadAddLightingSamples( int iThread, int iWaveProp )
 {
-	// Compute the lighting.
-	CComputeStaticPropLightingResults results;
-	ComputeLighting( m_StaticProps[iStaticProp], iThread, iStaticProp, &results );
-	ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], &results );
+	int iStaticProp = g_StaticPropMgr.m_iWaveFirstProp + iWaveProp;
+	g_StaticPropMgr.AddLightingSamples( g_StaticPropMgr.m_StaticProps[iStaticProp], iStaticProp, g_StaticPropMgr.m_WaveResults[iWaveProp] );
 }
 
-void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUserData )
+void CVradStaticPropMgr::ThreadLightBatch( int iThread, int iWaveBatch )
 {
-	while (1)
+	const WaveBatch_t &waveBatch = g_StaticPropMgr.m_WaveBatches[iWaveBatch];
+	g_StaticPropMgr.LightBatch( g_StaticPropMgr.m_WaveResults[waveBatch.m_iWaveProp], waveBatch.m_iBatch, iThread );
+}
+
+//-----------------------------------------------------------------------------
+// Lights the props a wave at a time. The props in a wave queue their samples
+// on threads, then all of their batches are spread across the threads together,
+// so a single large model no longer holds up the whole pass. Waves keep the
+// number of queued samples (and unencoded texels) in memory bounded.
+//-----------------------------------------------------------------------------
+#define MAX_SAMPLES_PER_WAVE	(1024 * 1024)
+
+void CVradStaticPropMgr::ComputeLightingThreaded()
+{
+	int count = m_StaticProps.Count();
+	for ( int iFirstProp = 0; iFirstProp < count; )
 	{
-		int j = GetThreadWork ();
-		if (j == -1)
-			break;
-		CComputeStaticPropLightingResults results;
-		g_StaticPropMgr.ComputeLightingForProp( iThread, j );
+		int iEndProp = iFirstProp;
+		int nEstimatedSamples = 0;
+		while ( iEndProp < count && ( iEndProp == iFirstProp || nEstimatedSamples < MAX_SAMPLES_PER_WAVE ) )
+		{
+			nEstimatedSamples += EstimateLightingSamples( m_StaticProps[iEndProp] );
+			++iEndProp;
+		}
+
+		m_iWaveFirstProp = iFirstProp;
+		for ( int i = iFirstProp; i < iEndProp; ++i )
+		{
+			m_WaveResults.AddToTail( new CComputeStaticPropLightingResults );
+		}
+
+		// Transforming and rasterizing is cheap next to the traces, keep it quiet.
+		SuppressPacifier( true );
+		RunThreadsOnIndividual( m_WaveResults.Count(), false, ThreadAddLightingSamples );
+		SuppressPacifier( false );
+
+		for ( int iWaveProp = 0; iWaveProp < m_WaveResults.Count(); ++iWaveProp )
+		{
+			for ( int iBatch = 0; iBatch < m_WaveResults[iWaveProp]->m_Batches.Count(); ++iBatch )
+			{
+				WaveBatch_t &waveBatch = m_WaveBatches[m_WaveBatches.AddToTail()];
+				waveBatch.m_iWaveProp = iWaveProp;
+				waveBatch.m_iBatch = iBatch;
+			}
+		}
+
+		if ( m_WaveBatches.Count() )
+		{
+			RunThreadsOnIndividual( m_WaveBatches.Count(), true, ThreadLightBatch );
+		}
+
+		for ( int iWaveProp = 0; iWaveProp < m_WaveResults.Count(); ++iWaveProp )
+		{
+			int iStaticProp = iFirstProp + iWaveProp;
+			ApplyLightingToStaticProp( iStaticProp, m_StaticProps[iStaticProp], m_WaveResults[iWaveProp] );
+		}
+
+		m_WaveResults.PurgeAndDeleteElements();
+		m_WaveBatches.Purge();
+		iFirstProp = iEndProp;
 	}
 }
 
@@ -1801,7 +2014,7 @@ void CVradStaticPropMgr::ComputeLighting( int iThread )
 	else
 #endif
 	{
-		RunThreadsOn(count, true, ThreadComputeStaticPropLighting);
+		ComputeLightingThreaded();
 	}
 
 	// restore default
@@ -2282,14 +2495,14 @@ inline float ComputeBarycentricDistanceToTri( Vector _barycentricCoord, Vector2D
 }
 
 // ------------------------------------------------------------------------------------------------
-static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _iThread, int _skipProp, int _flags, int _lightmapResX, int _lightmapResY, studiohdr_t* _pStudioHdr, mstudiomodel_t* _pStudioModel, OptimizedModel::ModelHeader_t* _pVtxModel, int _meshID, CComputeStaticPropLightingResults *_outResults )
+static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const matrix3x4_t& _matNormal, int _lightmapResX, int _lightmapResY, studiohdr_t* _pStudioHdr, mstudiomodel_t* _pStudioModel, OptimizedModel::ModelHeader_t* _pVtxModel, int _meshID, CUtlVector<colorTexel_t>* _outTexels )
 {
 	// Could iterate and gen this if needed.
 	int nLod = 0;
 
 	OptimizedModel::ModelLODHeader_t *pVtxLOD = _pVtxModel->pLOD(nLod);
 
-	CUtlVector<colorTexel_t> &colorTexels = (*_outResults->m_ColorTexelsArrays.Tail());
+	CUtlVector<colorTexel_t> &colorTexels = *_outTexels;
 	const int cTotalPixelCount = _lightmapResX * _lightmapResY;
 	colorTexels.EnsureCount(cTotalPixelCount);
 	memset(colorTexels.Base(), 0, colorTexels.Count() * sizeof(colorTexel_t));
@@ -2400,6 +2613,17 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 			}
 		}
 	}
+}
+
+// ------------------------------------------------------------------------------------------------
+static void AddLightmapSamples( int _skipProp, int _flags, int _lightmapResX, int _lightmapResY, CUtlVector<colorTexel_t>* _texels, CComputeStaticPropLightingResults *_outResults )
+{
+	CUtlVector<colorTexel_t> &colorTexels = *_texels;
+	if ( colorTexels.Count() == 0 )
+	{
+		// model has no meshes
+		return;
+	}
 
 	// Process neighbors to the valid region. Walk through the existing array, look for samples that
 	// are not valid but are adjacent to valid samples. Works if we are only bilinearly sampling
@@ -2431,17 +2655,8 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 
 			if (shouldProcess)
 			{
-				Vector directColor(0, 0, 0),
-					   indirectColor(0, 0, 0);
-
-
-				ComputeDirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, directColor, _iThread, _skipProp, _flags);
-
-				if (numbounce >= 1) {
-					ComputeIndirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, indirectColor, _iThread, true, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
-				}
-
-				VectorAdd(directColor, indirectColor, colorTexels[linearPos].m_Color);
+				_outResults->AddSample( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, &colorTexels[linearPos].m_Color, 
+										_skipProp, _flags, numbounce >= 1, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
 			}
 
 			++linearPos;
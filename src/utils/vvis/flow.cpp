@@ -7,6 +7,7 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "mathlib/ssemath.h"
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -55,6 +56,55 @@ extern bool g_bVMPIEarlyExit;
 #endif
 
 
+//-----------------------------------------------------------------------------
+// Finished portalvis bit vectors, indexed by portal number. A portal's entry is
+// set exactly once, when its flow is complete, and RecursiveLeafFlow uses it in
+// place of the much looser portalflood for every portal it passes through. The
+// entries only ever go from NULL to the final bits, so no lock is needed to read
+// them; the exchange that publishes them makes sure the bits are visible first.
+//-----------------------------------------------------------------------------
+static byte * volatile *g_pPublishedPortalVis;
+
+// per portal PortalFlow stats, for -portaltimes
+static float *g_pPortalFlowTime;
+static int *g_pPortalFlowChains;
+
+
+void InitPortalFlow (void)
+{
+	int nPortals = g_numportals*2;
+
+	free ((void *)g_pPublishedPortalVis);
+	g_pPublishedPortalVis = (byte * volatile *)calloc (nPortals, sizeof(byte *));
+
+	free (g_pPortalFlowTime);
+	g_pPortalFlowTime = (float *)calloc (nPortals, sizeof(float));
+
+	free (g_pPortalFlowChains);
+	g_pPortalFlowChains = (int *)calloc (nPortals, sizeof(int));
+
+	for (int i=0 ; i<nPortals ; i++)
+	{
+		if (portals[i].status == stat_done)
+			g_pPublishedPortalVis[i] = portals[i].portalvis;
+	}
+}
+
+
+void PublishPortalVis (portal_t *p)
+{
+	p->status = stat_done;
+	if (g_pPublishedPortalVis)
+		ThreadInterlockedExchangePointer ((void * volatile *)&g_pPublishedPortalVis[p - portals], p->portalvis);
+}
+
+
+static inline byte *GetPublishedPortalVis (int pnum)
+{
+	return g_pPublishedPortalVis[pnum];
+}
+
+
 void CheckStack (leaf_t *leaf, threaddata_t *thread)
 {
 	pstack_t	*p, *p2;
@@ -104,6 +154,45 @@ void FreeStackWinding (winding_t *w, pstack_t *stack)
 	stack->freewindings[i] = 1;
 }
 
+/*
+===============================================================================
+
+SIMD winding kernels
+
+ClipToSeperators spends nearly all of its time building candidate seperating
+planes and classifying the source and pass points against them. The SIMD
+version does four candidate planes at once, using the same operations in the
+same order as the scalar code so the planes and the point classifications come
+out bit identical. -validateclip checks that the final PVS matches the scalar
+path exactly.
+
+===============================================================================
+*/
+
+bool	g_bScalarWindingClip = false;
+
+// Lanes past numpoints repeat the last point.
+struct SoAWinding_t
+{
+	FourVectors	points[MAX_POINTS_ON_WINDING/4];
+	int			numpoints;
+	int			numgroups;
+};
+
+static void LoadSoAWinding (winding_t const *w, SoAWinding_t *out)
+{
+	int last = w->numpoints - 1;
+
+	out->numpoints = w->numpoints;
+	out->numgroups = (w->numpoints + 3) >> 2;
+	for (int g=0 ; g<out->numgroups ; g++)
+	{
+		int i = 4*g;
+		out->points[g].LoadAndSwizzle (w->points[i], w->points[MIN(i+1, last)],
+			w->points[MIN(i+2, last)], w->points[MIN(i+3, last)]);
+	}
+}
+
 /*
 ==============
 ChopWinding
@@ -236,7 +325,7 @@ order goes source, pass, target.  If the order goes pass, source, target then
 flipclip should be set.
 ==============
 */
-winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
+static winding_t	*ClipToSeperatorsScalar (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
 {
 	int			i, j, k, l;
 	plane_t		plane;
@@ -375,6 +464,155 @@ winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *targ
 }
 
 
+/*
+==============
+ClipToSeperatorsSIMD
+
+Same as ClipToSeperatorsScalar, but builds and tests the candidate planes for
+four pass points at a time. The planes are computed with the same operations
+as the scalar code so they are bit identical, and the ones that turn out to be
+seperating planes are applied in the same order.
+==============
+*/
+static winding_t	*ClipToSeperatorsSIMD (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
+{
+	int			i, k, l, g, lane;
+	plane_t		plane;
+	SoAWinding_t	soaPass;
+	ALIGN16 float	scale[4] ALIGN16_POST;
+
+	// ON_VIS_EPSILON is a double; it rounds down to the float just below it, and as there
+	// are no floats in between, d > eps in float is the same test as d > ON_VIS_EPSILON.
+	fltx4		eps = ReplicateX4 ((float)ON_VIS_EPSILON);
+	fltx4		negeps = ReplicateX4 (-(float)ON_VIS_EPSILON);
+
+	LoadSoAWinding (pass, &soaPass);
+
+// check all combinations	
+	for (i=0 ; i<source->numpoints ; i++)
+	{
+		l = (i+1)%source->numpoints;
+		FourVectors v1, srcpoint;
+		v1.DuplicateVector (source->points[l] - source->points[i]);
+		srcpoint.DuplicateVector (source->points[i]);
+
+		for (g=0 ; g<soaPass.numgroups ; g++)
+		{
+			int nLanes = MIN (4, pass->numpoints - 4*g);
+
+			FourVectors v2 = soaPass.points[g];
+			v2 -= srcpoint;
+
+			FourVectors normal;
+			normal.x = SubSIMD (MulSIMD (v1.y, v2.z), MulSIMD (v1.z, v2.y));
+			normal.y = SubSIMD (MulSIMD (v1.z, v2.x), MulSIMD (v1.x, v2.z));
+			normal.z = SubSIMD (MulSIMD (v1.x, v2.y), MulSIMD (v1.y, v2.x));
+
+		// if points don't make a valid plane, skip it
+			fltx4 length = AddSIMD (AddSIMD (MulSIMD (normal.x, normal.x), MulSIMD (normal.y, normal.y)), MulSIMD (normal.z, normal.z));
+			int valid = TestSignSIMD (CmpGtSIMD (length, eps)) & ((1 << nLanes) - 1);
+			if (!valid)
+				continue;
+
+			// the scalar code normalizes in double precision, so do the same per lane
+			StoreAlignedSIMD (scale, length);
+			for (lane=0 ; lane<4 ; lane++)
+				scale[lane] = (valid & (1 << lane)) ? 1/sqrt(scale[lane]) : 0.0f;
+			fltx4 s4 = LoadAlignedSIMD (scale);
+			normal.x = MulSIMD (normal.x, s4);
+			normal.y = MulSIMD (normal.y, s4);
+			normal.z = MulSIMD (normal.z, s4);
+
+			fltx4 dist = AddSIMD (AddSIMD (MulSIMD (soaPass.points[g].x, normal.x), MulSIMD (soaPass.points[g].y, normal.y)),
+				MulSIMD (soaPass.points[g].z, normal.z));
+
+		//
+		// find out which side of the generated seperating planes has the
+		// source portal - the first source point off the plane decides
+		//
+			int decided = 0, fliptest = 0;
+			for (k=0 ; k<source->numpoints && (valid & ~decided) ; k++)
+			{
+				if (k == i || k == l)
+					continue;
+				FourVectors pt;
+				pt.DuplicateVector (source->points[k]);
+				fltx4 d = SubSIMD (AddSIMD (AddSIMD (MulSIMD (pt.x, normal.x), MulSIMD (pt.y, normal.y)), MulSIMD (pt.z, normal.z)), dist);
+				int back = TestSignSIMD (CmpLtSIMD (d, negeps)) & ~decided;
+				int front = TestSignSIMD (CmpGtSIMD (d, eps)) & ~decided;
+				fliptest |= front;
+				decided |= front | back;
+			}
+			valid &= decided;		// the rest are planar with the source portal
+			if (!valid)
+				continue;
+
+		//
+		// if all of the pass portal points are on the positive side of the
+		// (flipped) plane, this is the seperating plane. Flipping the plane
+		// just negates the distances, so swap the sides instead.
+		//
+			int negative = 0, positive = 0;
+			for (k=0 ; k<pass->numpoints && (valid & ~negative) ; k++)
+			{
+				FourVectors pt;
+				pt.DuplicateVector (pass->points[k]);
+				fltx4 d = SubSIMD (AddSIMD (AddSIMD (MulSIMD (pt.x, normal.x), MulSIMD (pt.y, normal.y)), MulSIMD (pt.z, normal.z)), dist);
+				int back = TestSignSIMD (CmpLtSIMD (d, negeps));
+				int front = TestSignSIMD (CmpGtSIMD (d, eps));
+				int self = (k >= 4*g && k < 4*g + 4) ? (1 << (k - 4*g)) : 0;
+				negative |= ((back & ~fliptest) | (front & fliptest)) & ~self;
+				positive |= ((front & ~fliptest) | (back & fliptest)) & ~self;
+			}
+			valid &= ~negative & positive;
+
+		//
+		// clip target by the seperating planes
+		//
+			for (lane=0 ; valid ; lane++, valid >>= 1)
+			{
+				if (!(valid & 1))
+					continue;
+
+				plane.normal.Init (SubFloat (normal.x, lane), SubFloat (normal.y, lane), SubFloat (normal.z, lane));
+				plane.dist = SubFloat (dist, lane);
+
+			//
+			// flip the normal if the source portal is backwards
+			//
+				if (fliptest & (1 << lane))
+				{
+					VectorSubtract (vec3_origin, plane.normal, plane.normal);
+					plane.dist = -plane.dist;
+				}
+
+			//
+			// flip the normal if we want the back side
+			//
+				if (flipclip)
+				{
+					VectorSubtract (vec3_origin, plane.normal, plane.normal);
+					plane.dist = -plane.dist;
+				}
+
+				target = ChopWinding (target, stack, &plane);
+				if (!target)
+					return NULL;		// target is not visible
+			}
+		}
+	}
+	
+	return target;
+}
+
+winding_t	*ClipToSeperators (winding_t *source, winding_t *pass, winding_t *target, bool flipclip, pstack_t *stack)
+{
+	if (g_bScalarWindingClip)
+		return ClipToSeperatorsScalar (source, pass, target, flipclip, stack);
+	return ClipToSeperatorsSIMD (source, pass, target, flipclip, stack);
+}
+
+
 class CPortalTrace
 {
 public:
@@ -526,11 +764,8 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 
 		// if the portal can't see anything we haven't allready seen, skip it
-		if (p->status == stat_done)
-		{
-			test = (long *)p->portalvis;
-		}
-		else
+		test = (long *)GetPublishedPortalVis (pnum);
+		if (!test)
 		{
 			test = (long *)p->portalflood;
 		}
@@ -636,7 +871,11 @@ void PortalFlow (int iThread, int portalnum)
 	int				c_might, c_can;
 
 	p = sorted_portals[portalnum];
+	if (p->status == stat_done)
+		return;		// reused from the incremental vis cache
 	p->status = stat_working;
+
+	double start = Plat_FloatTime();
 				
 	c_might = CountBits (p->portalflood, g_numportals*2);
 
@@ -652,12 +891,65 @@ void PortalFlow (int iThread, int portalnum)
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
 
-	p->status = stat_done;
+	PublishPortalVis (p);
+
+	float elapsed = Plat_FloatTime() - start;
+	g_pPortalFlowTime[p - portals] = elapsed;
+	g_pPortalFlowChains[p - portals] = data.c_chains;
 
 	c_can = CountBits (p->portalvis, g_numportals*2);
 
-	qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (%i chains)\n", 
-		(int)(p - portals),	c_might, c_can, data.c_chains);
+	qprintf ("portal:%4i  mightsee:%4i  cansee:%4i (%i chains, %.3f sec)\n", 
+		(int)(p - portals),	c_might, c_can, data.c_chains, elapsed);
+}
+
+
+/*
+===============
+ReportPortalFlowTimes
+
+Lists the portals that took the longest in PortalFlow, so the ones that make
+a map slow to vis can be found and fixed.
+===============
+*/
+static int PortalFlowTimeCompare (const void *a, const void *b)
+{
+	float ta = g_pPortalFlowTime[*(int *)a];
+	float tb = g_pPortalFlowTime[*(int *)b];
+	if (ta == tb)
+		return 0;
+	return (ta > tb) ? -1 : 1;
+}
+
+void ReportPortalFlowTimes (int count)
+{
+	int nPortals = g_numportals*2;
+	if (!g_pPortalFlowTime || !nPortals)
+		return;
+
+	int *order = (int *)malloc (nPortals * sizeof(int));
+	double total = 0;
+	for (int i=0 ; i<nPortals ; i++)
+	{
+		order[i] = i;
+		total += g_pPortalFlowTime[i];
+	}
+	qsort (order, nPortals, sizeof(order[0]), PortalFlowTimeCompare);
+
+	count = MIN (count, nPortals);
+	Msg ("Slowest %d portals (%.2f seconds of PortalFlow in total):\n", count, total);
+	for (int i=0 ; i<count ; i++)
+	{
+		portal_t *p = &portals[order[i]];
+		if (g_pPortalFlowTime[order[i]] <= 0)
+			break;
+		Msg ("  portal %5d into cluster %5d at (%.0f %.0f %.0f): %8.2f sec (%4.1f%%), mightsee %5d, cansee %5d, %d chains\n",
+			order[i], p->leaf, p->origin.x, p->origin.y, p->origin.z,
+			g_pPortalFlowTime[order[i]], total > 0 ? 100.0 * g_pPortalFlowTime[order[i]] / total : 0.0,
+			p->nummightsee, CountBits (p->portalvis, nPortals), g_pPortalFlowChains[order[i]]);
+	}
+
+	free (order);
 }
 
 
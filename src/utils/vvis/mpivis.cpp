@@ -6,7 +6,9 @@
 //
 //=============================================================================//
 
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include "vis.h"
 #include "threads.h"
 #include "stdlib.h"
@@ -20,7 +22,9 @@
 #include "threadhelpers.h"
 #include "vstdlib/random.h"
 #include "vmpi_tools_shared.h"
+#ifdef _WIN32
 #include <conio.h>
+#endif
 #include "scratchpad_helpers.h"
 #include "tier0/fasttimer.h"
 
@@ -50,10 +54,13 @@ CCycleCount g_CPUTime;
 
 
 // This stuff is all for the multicast channel the master uses to send out the portal results.
+// Elsewhere, the master forwards the results to the workers over their VMPI connections instead.
 ISocket *g_pPortalMCSocket = NULL;
 CIPAddr g_PortalMCAddr;
 bool g_bGotMCAddr = false;
+#ifdef _WIN32
 HANDLE g_hMCThread = NULL;
+#endif
 CEvent g_MCThreadExitEvent;
 unsigned long g_PortalMCThreadUniqueID = 0;
 int g_nMulticastPortalsReceived = 0;
@@ -98,6 +105,28 @@ bool VVIS_DispatchFn( MessageBuffer *pBuf, int iSource, int iPacketID )
 			return true;
 		}
 
+#ifndef _WIN32
+		case VMPI_PORTALFLOW_RESULTS:
+		{
+			// Another worker's portal, forwarded by the master in ReceivePortalFlow.
+			uint64 iWorkUnit;
+			pBuf->setOffset( 2 );
+			if ( pBuf->getLen() == 2 + (int)sizeof( iWorkUnit ) + portalbytes && 
+				pBuf->read( &iWorkUnit, sizeof( iWorkUnit ) ) != -1 &&
+				iWorkUnit < (uint64)g_numportals*2 )
+			{
+				portal_t *p = sorted_portals[iWorkUnit];
+				if ( p && p->status == stat_none )
+				{
+					++g_nMulticastPortalsReceived;
+					pBuf->read( p->portalvis, portalbytes );
+					PublishPortalVis( p );
+				}
+			}
+			return true;
+		}
+#endif
+
 		default:
 		{
 			return false;
@@ -110,6 +139,7 @@ CDispatchReg g_VVISDispatchReg( VMPI_VVIS_PACKET_ID, VVIS_DispatchFn ); // regis
 
 void VMPI_DeletePortalMCSocket()
 {
+#ifdef _WIN32
 	// Stop the thread if it exists.
 	if ( g_hMCThread )
 	{
@@ -118,6 +148,7 @@ void VMPI_DeletePortalMCSocket()
 		CloseHandle( g_hMCThread );
 		g_hMCThread = NULL;
 	}
+#endif
 
 	if ( g_pPortalMCSocket )
 	{
@@ -332,7 +363,7 @@ void ReceivePortalFlow( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
 	if ( p->status != stat_done )
 	{
 		pBuf->read( p->portalvis, portalbytes );
-		p->status = stat_done;
+		PublishPortalVis( p );
 
 		
 		// Multicast the status of this portal out.
@@ -344,10 +375,20 @@ void ReceivePortalFlow( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
 
 			g_pPortalMCSocket->SendChunksTo( &g_PortalMCAddr, chunks, chunkLengths, ARRAYSIZE( chunks ) );
 		}
+
+#ifndef _WIN32
+		char cPacketID[2] = { VMPI_VVIS_PACKET_ID, VMPI_PORTALFLOW_RESULTS };
+		for ( int iProc=1; iProc < VMPI_GetCurrentNumberOfConnections(); iProc++ )
+		{
+			if ( iProc != iWorker && VMPI_IsProcConnected( iProc ) )
+				VMPI_Send3Chunks( cPacketID, sizeof( cPacketID ), &iWorkUnit, sizeof( iWorkUnit ), p->portalvis, portalbytes, iProc );
+		}
+#endif
 	}
 }
 
 
+#ifdef _WIN32
 DWORD WINAPI PortalMCThreadFn( LPVOID p )
 {
 	CUtlVector<char> data;
@@ -380,7 +421,7 @@ DWORD WINAPI PortalMCThreadFn( LPVOID p )
 							{
 								++g_nMulticastPortalsReceived;
 								memcpy( p->portalvis, &data[10], portalbytes );
-								p->status = stat_done;
+								PublishPortalVis( p );
 								waitTime = 0;
 							}
 						}
@@ -392,6 +433,7 @@ DWORD WINAPI PortalMCThreadFn( LPVOID p )
 	
 	return 0;
 }
+#endif
 
 
 void MCThreadCleanupFn()
@@ -416,6 +458,7 @@ public:
 	
 	virtual bool Update()
 	{
+#ifdef _WIN32
 		if ( kbhit() )
 		{
 			int key = toupper( getch() );
@@ -475,6 +518,7 @@ public:
 				}
 			}
 		}
+#endif
 		
 		return false;
 	}
@@ -524,6 +568,7 @@ void RunMPIPortalFlow()
 	if ( g_bMPIMaster )
 		StartPacifier("");
 
+#ifdef _WIN32
 	// Workers wait until we get the MC socket address.
 	g_PortalMCThreadUniqueID = StatsDB_GetUniqueJobID();
 	if ( g_bMPIMaster )
@@ -592,6 +637,7 @@ void RunMPIPortalFlow()
 			Error( "RunMPIPortalFlow: CreateThread failed for multicast receive thread." );
 		}			
 	}
+#endif
 
 	VMPI_SetCurrentStage( "RunMPIBasePortalFlow" );
 
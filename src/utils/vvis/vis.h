@@ -113,6 +113,14 @@ void LeafFlow (int leafnum);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void InitPortalFlow (void);
+extern bool g_bScalarWindingClip;		// use the original scalar ChopWinding/ClipToSeperators
+void PublishPortalVis (portal_t *p);
+void ReportPortalFlowTimes (int count);
+
+extern bool g_bIncrementalVis;
+void LoadVisCache (const char *pPortalFile);
+void SaveVisCache (const char *pPortalFile);
 void WritePortalTrace( const char *source );
 
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
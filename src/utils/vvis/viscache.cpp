@@ -0,0 +1,425 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Incremental vis. The portalvis of every portal is saved next to the
+//			.prt file, and on the next compile the portals whose flow can't
+//			have been affected by the edit take their old results instead of
+//			being flowed again.
+//
+//			A portal's flow only looks at the portals in its portalflood and
+//			the leafs on either side of them. So if the portal itself, every
+//			portal in its portalflood, and all of their leafs are unchanged,
+//			the old portalvis is still right. Portals are matched between the
+//			two compiles by a hash of their winding, since a small edit can
+//			renumber every portal and cluster in the map.
+//
+//=============================================================================//
+#include "vis.h"
+#include "tier1/checksum_md5.h"
+
+#define VISCACHE_ID			( ( 'C' << 24 ) + ( 'I' << 16 ) + ( 'V' << 8 ) + 'V' )
+#define VISCACHE_VERSION	1
+
+struct VisCacheHeader_t
+{
+	int32	m_nId;
+	int32	m_nVersion;
+	int32	m_nPortals;			// memory portals, so twice the number in the .prt
+	int32	m_nPortalBytes;
+	int32	m_bUseRadius;
+	double	m_flVisRadius;
+};
+
+// followed by one of these per portal, each followed by m_nVisBytes of compressed portalvis
+struct VisCachePortal_t
+{
+	uint8	m_Hash[MD5_DIGEST_LENGTH];
+	int32	m_nLeaf;
+	int32	m_nVisBytes;
+};
+
+struct PortalHash_t
+{
+	uint8	m_Hash[MD5_DIGEST_LENGTH];
+	int		m_nPortal;
+};
+
+static int __cdecl PortalHashCompare( const PortalHash_t *a, const PortalHash_t *b )
+{
+	return memcmp( a->m_Hash, b->m_Hash, MD5_DIGEST_LENGTH );
+}
+
+// returns the index of the only entry with this hash, or -1 if there are none or several
+static int FindUniqueHash( CUtlVector<PortalHash_t> const &hashes, uint8 const hash[MD5_DIGEST_LENGTH] )
+{
+	int lo = 0, hi = hashes.Count();
+	while ( lo < hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if ( memcmp( hashes[mid].m_Hash, hash, MD5_DIGEST_LENGTH ) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ( lo >= hashes.Count() || memcmp( hashes[lo].m_Hash, hash, MD5_DIGEST_LENGTH ) )
+		return -1;
+	if ( lo + 1 < hashes.Count() && !memcmp( hashes[lo+1].m_Hash, hash, MD5_DIGEST_LENGTH ) )
+		return -1;
+	return lo;
+}
+
+bool g_bIncrementalVis = false;
+
+
+static void HashPortal( portal_t *p, uint8 hash[MD5_DIGEST_LENGTH] )
+{
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+	MD5Update( &ctx, (unsigned char const *)&p->winding->numpoints, sizeof( p->winding->numpoints ) );
+	MD5Update( &ctx, (unsigned char const *)p->winding->points, p->winding->numpoints * sizeof( Vector ) );
+	MD5Final( hash, &ctx );
+}
+
+
+//-----------------------------------------------------------------------------
+// The portalvis bits are mostly zeros, so runs of zero bytes are stored as a
+// zero followed by the run length, the same way the bsp stores the PVS.
+//-----------------------------------------------------------------------------
+static int CompressPortalBits( byte const *in, int nBytes, byte *out )
+{
+	byte *dest = out;
+	for ( int i = 0; i < nBytes; i++ )
+	{
+		*dest++ = in[i];
+		if ( in[i] )
+			continue;
+
+		int nRun = 1;
+		while ( i + 1 < nBytes && !in[i+1] && nRun < 255 )
+		{
+			nRun++;
+			i++;
+		}
+		*dest++ = nRun;
+	}
+	return dest - out;
+}
+
+static bool DecompressPortalBits( byte const *in, int nInBytes, byte *out, int nOutBytes )
+{
+	int nOut = 0;
+	for ( int i = 0; i < nInBytes; i++ )
+	{
+		if ( in[i] )
+		{
+			if ( nOut >= nOutBytes )
+				return false;
+			out[nOut++] = in[i];
+			continue;
+		}
+
+		if ( ++i >= nInBytes || nOut + in[i] > nOutBytes )
+			return false;
+		memset( out + nOut, 0, in[i] );
+		nOut += in[i];
+	}
+	return nOut == nOutBytes;
+}
+
+
+static void GetVisCacheFileName( const char *pPortalFile, char *pFileName, int nMaxLen )
+{
+	V_strncpy( pFileName, pPortalFile, nMaxLen );
+	V_SetExtension( pFileName, ".vvc", nMaxLen );
+}
+
+
+//-----------------------------------------------------------------------------
+// Everything read back from a cache file
+//-----------------------------------------------------------------------------
+struct OldVisData_t
+{
+	int							m_nPortals;
+	int							m_nPortalBytes;
+	CUtlVector<VisCachePortal_t>	m_Portals;
+	CUtlVector<int>				m_VisOffset;		// into m_VisData
+	CUtlVector<byte>			m_VisData;
+};
+
+static bool ReadVisCache( const char *pFileName, OldVisData_t &old )
+{
+	FILE *f = fopen( pFileName, "rb" );
+	if ( !f )
+		return false;
+
+	VisCacheHeader_t header;
+	bool bOk = fread( &header, sizeof( header ), 1, f ) == 1 &&
+		header.m_nId == VISCACHE_ID &&
+		header.m_nVersion == VISCACHE_VERSION &&
+		header.m_nPortals > 0 && header.m_nPortals < MAX_PORTALS &&
+		header.m_nPortalBytes == ( ( header.m_nPortals + 63 ) & ~63 ) >> 3 &&
+		header.m_bUseRadius == (int32)g_bUseRadius &&
+		( !g_bUseRadius || header.m_flVisRadius == g_VisRadius );
+	if ( !bOk )
+	{
+		fclose( f );
+		return false;
+	}
+
+	old.m_nPortals = header.m_nPortals;
+	old.m_nPortalBytes = header.m_nPortalBytes;
+	old.m_Portals.SetCount( old.m_nPortals );
+	old.m_VisOffset.SetCount( old.m_nPortals );
+	for ( int i = 0; i < old.m_nPortals && bOk; i++ )
+	{
+		VisCachePortal_t &p = old.m_Portals[i];
+		bOk = fread( &p, sizeof( p ), 1, f ) == 1 &&
+			p.m_nLeaf >= 0 && p.m_nVisBytes >= 0 && p.m_nVisBytes <= 2 * old.m_nPortalBytes;
+		if ( bOk )
+		{
+			old.m_VisOffset[i] = old.m_VisData.AddMultipleToTail( p.m_nVisBytes );
+			bOk = !p.m_nVisBytes || fread( old.m_VisData.Base() + old.m_VisOffset[i], p.m_nVisBytes, 1, f ) == 1;
+		}
+	}
+	fclose( f );
+	return bOk;
+}
+
+
+/*
+==================
+LoadVisCache
+
+Fills in the portalvis of every portal whose old result can be reused and
+marks it done, so PortalFlow skips it. Call after BasePortalVis.
+==================
+*/
+void LoadVisCache( const char *pPortalFile )
+{
+	char szFileName[MAX_PATH];
+	GetVisCacheFileName( pPortalFile, szFileName, sizeof( szFileName ) );
+
+	OldVisData_t old;
+	if ( !ReadVisCache( szFileName, old ) )
+	{
+		Msg( "No usable vis cache %s, flowing all portals\n", szFileName );
+		return;
+	}
+
+	int nPortals = g_numportals*2;
+
+	// match the new portals up with the old ones by hash. Hashes that show
+	// up more than once in either set are left unmatched.
+	CUtlVector<PortalHash_t> oldHashes;
+	oldHashes.SetCount( old.m_nPortals );
+	for ( int i = 0; i < old.m_nPortals; i++ )
+	{
+		memcpy( oldHashes[i].m_Hash, old.m_Portals[i].m_Hash, MD5_DIGEST_LENGTH );
+		oldHashes[i].m_nPortal = i;
+	}
+	oldHashes.Sort( PortalHashCompare );
+
+	CUtlVector<int> newToOld, oldToNew;
+	newToOld.SetCount( nPortals );
+	oldToNew.SetCount( old.m_nPortals );
+	for ( int i = 0; i < old.m_nPortals; i++ )
+		oldToNew[i] = -1;
+
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		newToOld[i] = -1;
+
+		uint8 hash[MD5_DIGEST_LENGTH];
+		HashPortal( &portals[i], hash );
+		int nFound = FindUniqueHash( oldHashes, hash );
+		if ( nFound < 0 )
+			continue;
+
+		int nOld = oldHashes[nFound].m_nPortal;
+		if ( oldToNew[nOld] == -2 )
+			continue;
+		if ( oldToNew[nOld] >= 0 )
+		{
+			// two new portals with the same winding
+			newToOld[oldToNew[nOld]] = -1;
+			oldToNew[nOld] = -2;
+			continue;
+		}
+
+		newToOld[i] = nOld;
+		oldToNew[nOld] = i;
+	}
+
+	// the two sides of a portal have to match the two sides of the same old portal
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		if ( newToOld[i] >= 0 && newToOld[i^1] != ( newToOld[i] ^ 1 ) )
+			newToOld[i] = -1;
+	}
+
+	// A leaf is unchanged if all of its portals matched portals of the same old
+	// leaf, and that leaf had no other portals. A portal sits in the leaf its
+	// other side points into.
+	CUtlVector<int> oldLeafPortals;
+	for ( int i = 0; i < old.m_nPortals; i++ )
+	{
+		int nLeaf = old.m_Portals[i^1].m_nLeaf;
+		if ( nLeaf >= oldLeafPortals.Count() )
+		{
+			int nFirst = oldLeafPortals.AddMultipleToTail( nLeaf + 1 - oldLeafPortals.Count() );
+			for ( int j = nFirst; j < oldLeafPortals.Count(); j++ )
+				oldLeafPortals[j] = 0;
+		}
+		oldLeafPortals[nLeaf]++;
+	}
+
+	CUtlVector<bool> leafUnchanged;
+	leafUnchanged.SetCount( portalclusters );
+	for ( int i = 0; i < portalclusters; i++ )
+	{
+		leaf_t *l = &leafs[i];
+		int nOldLeaf = -1;
+		bool bUnchanged = true;
+		for ( int j = 0; j < l->portals.Count() && bUnchanged; j++ )
+		{
+			int nOld = newToOld[l->portals[j] - portals];
+			if ( nOld < 0 )
+			{
+				bUnchanged = false;
+				break;
+			}
+			int nOldPortalLeaf = old.m_Portals[nOld^1].m_nLeaf;
+			if ( nOldLeaf == -1 )
+				nOldLeaf = nOldPortalLeaf;
+			bUnchanged = ( nOldPortalLeaf == nOldLeaf );
+		}
+		leafUnchanged[i] = bUnchanged && ( nOldLeaf == -1 || oldLeafPortals[nOldLeaf] == l->portals.Count() );
+	}
+
+	byte *pChanged = (byte *)malloc( portalbytes );
+	memset( pChanged, 0, portalbytes );
+	int nChanged = 0;
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		if ( newToOld[i] < 0 || !leafUnchanged[portals[i].leaf] || !leafUnchanged[portals[i^1].leaf] )
+		{
+			SetBit( pChanged, i );
+			nChanged++;
+		}
+	}
+
+	// reuse the old portalvis for unchanged portals that can't see into a changed area
+	int nReused = 0;
+	byte *pOldVis = (byte *)malloc( old.m_nPortalBytes );
+	for ( int i = 0; i < nPortals; i++ )
+	{
+		portal_t *p = &portals[i];
+		if ( CheckBit( pChanged, i ) )
+			continue;
+
+		bool bReuse = true;
+		for ( int j = 0; j < portallongs && bReuse; j++ )
+		{
+			if ( ((long *)p->portalflood)[j] & ((long *)pChanged)[j] )
+				bReuse = false;
+		}
+		if ( !bReuse )
+			continue;
+
+		int nOld = newToOld[i];
+		if ( !DecompressPortalBits( old.m_VisData.Base() + old.m_VisOffset[nOld], old.m_Portals[nOld].m_nVisBytes,
+			pOldVis, old.m_nPortalBytes ) )
+			continue;
+
+		memset( p->portalvis, 0, portalbytes );
+		for ( int j = 0; j < old.m_nPortals && bReuse; j++ )
+		{
+			if ( !CheckBit( pOldVis, j ) )
+				continue;
+			if ( oldToNew[j] < 0 )
+				bReuse = false;
+			else
+				SetBit( p->portalvis, oldToNew[j] );
+		}
+		if ( !bReuse )
+		{
+			memset( p->portalvis, 0, portalbytes );
+			continue;
+		}
+
+		p->status = stat_done;
+		nReused++;
+	}
+	free( pOldVis );
+	free( pChanged );
+
+	Msg( "Incremental vis: %d of %d portals changed, reusing %d, flowing %d\n",
+		nChanged, nPortals, nReused, nPortals - nReused );
+}
+
+
+/*
+==================
+SaveVisCache
+==================
+*/
+void SaveVisCache( const char *pPortalFile )
+{
+	char szFileName[MAX_PATH];
+	GetVisCacheFileName( pPortalFile, szFileName, sizeof( szFileName ) );
+
+	// Written to the side and renamed into place, so a failed write never leaves a
+	// truncated cache behind for the next compile to trust
+	char szTempName[MAX_PATH];
+	V_snprintf( szTempName, sizeof( szTempName ), "%s.tmp", szFileName );
+
+	FILE *f = fopen( szTempName, "wb" );
+	if ( !f )
+	{
+		Warning( "Unable to write vis cache %s\n", szTempName );
+		return;
+	}
+
+	VisCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = VISCACHE_ID;
+	header.m_nVersion = VISCACHE_VERSION;
+	header.m_nPortals = g_numportals*2;
+	header.m_nPortalBytes = portalbytes;
+	header.m_bUseRadius = g_bUseRadius;
+	header.m_flVisRadius = g_bUseRadius ? g_VisRadius : 0;
+	bool bOK = ( fwrite( &header, sizeof( header ), 1, f ) == 1 );
+
+	// worst case is every other byte being zero
+	byte *pCompressed = (byte *)malloc( 2 * portalbytes );
+	for ( int i = 0; bOK && i < g_numportals*2; i++ )
+	{
+		VisCachePortal_t p;
+		memset( &p, 0, sizeof( p ) );
+		HashPortal( &portals[i], p.m_Hash );
+		p.m_nLeaf = portals[i].leaf;
+		p.m_nVisBytes = CompressPortalBits( portals[i].portalvis, portalbytes, pCompressed );
+		bOK = ( fwrite( &p, sizeof( p ), 1, f ) == 1 ) &&
+			( !p.m_nVisBytes || fwrite( pCompressed, p.m_nVisBytes, 1, f ) == 1 );
+	}
+	free( pCompressed );
+
+	if ( fclose( f ) != 0 )
+	{
+		bOK = false;
+	}
+
+	if ( bOK )
+	{
+#ifdef _WIN32
+		// rename won't replace an existing file here
+		remove( szFileName );
+#endif
+		bOK = ( rename( szTempName, szFileName ) == 0 );
+	}
+
+	if ( !bOK )
+	{
+		Warning( "Unable to write vis cache %s\n", szFileName );
+		remove( szTempName );
+	}
+}
@@ -28,6 +28,7 @@ int			g_numportals;
 int			portalclusters;
 
 char		inbase[32];
+char		portalfile[1024];
 
 portal_t	*portals;
 leaf_t		*leafs;
@@ -56,6 +57,10 @@ double		g_VisRadius = 4096.0f * 4096.0f;
 
 bool		g_bLowPriority = false;
 
+int			g_nPortalTimesToReport = 0;		// -portaltimes
+bool		g_bValidateWindingClip = false;	// -validateclip
+bool		g_bPrintSizesOnly = false;		// -size
+
 //=============================================================================
 
 void PlaneFromWinding (winding_t *w, plane_t *plane)
@@ -281,6 +286,52 @@ static int CompressAndCrosscheckClusterVis( int clusternum )
 }
 
 
+/*
+==================
+ValidateWindingClip
+
+Flows all of the portals again with the scalar ClipToSeperators and checks
+that it produces exactly the same portalvis bits as the SIMD one.
+==================
+*/
+static void ValidateWindingClip (void)
+{
+	int		i;
+	int		nPortals = g_numportals*2;
+	byte	*pSIMDVis = (byte*)malloc (nPortals * portalbytes);
+
+	for (i=0 ; i<nPortals ; i++)
+	{
+		memcpy (pSIMDVis + i*portalbytes, portals[i].portalvis, portalbytes);
+		memset (portals[i].portalvis, 0, portalbytes);
+		portals[i].status = stat_none;
+	}
+
+	bool bScalar = g_bScalarWindingClip;
+	g_bScalarWindingClip = true;
+	InitPortalFlow ();
+	RunThreadsOnIndividualInOrder (nPortals, true, PortalFlow);
+	g_bScalarWindingClip = bScalar;
+
+	int nMismatched = 0;
+	for (i=0 ; i<nPortals ; i++)
+	{
+		if (memcmp (pSIMDVis + i*portalbytes, portals[i].portalvis, portalbytes))
+			nMismatched++;
+	}
+	free (pSIMDVis);
+
+	if (nMismatched)
+	{
+		Warning ("-validateclip: %d of %d portals have different visibility with the scalar winding clipping\n", nMismatched, nPortals);
+	}
+	else
+	{
+		Msg ("-validateclip: scalar winding clipping gives identical visibility for all %d portals\n", nPortals);
+	}
+}
+
+
 /*
 ==================
 CalcPortalVis
@@ -310,7 +361,12 @@ void CalcPortalVis (void)
 	else 
 #endif
 	{
-		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
+		// the portals are sorted so each one can reuse the results of the simpler ones
+		// before it, so hand them out in that order
+		RunThreadsOnIndividualInOrder (g_numportals*2, true, PortalFlow);
+
+		if (g_bValidateWindingClip)
+			ValidateWindingClip ();
 	}
 }
 
@@ -321,6 +377,7 @@ void CalcVisTrace (void)
 	BuildTracePortals( g_TraceClusterStart );
 	// NOTE: We only schedule the one-way portals out of the start cluster here
 	// so don't run g_numportals*2 in this case
+	InitPortalFlow ();
 	RunThreadsOnIndividual (g_numportals, true, PortalFlow);
 }
 
@@ -346,8 +403,31 @@ void CalcVis (void)
 
 	SortPortals ();
 
+	bool bIncremental = g_bIncrementalVis && !fastvis;
+#ifdef MPI
+	// the cache lives with the master's copy of the .prt
+	if ( g_bUseMPI && !g_bMPIMaster )
+		bIncremental = false;
+#endif
+
+	if ( bIncremental )
+	{
+		LoadVisCache( portalfile );
+	}
+
+	InitPortalFlow ();
 	CalcPortalVis ();
 
+	if ( bIncremental )
+	{
+		SaveVisCache( portalfile );
+	}
+
+	if ( g_nPortalTimesToReport > 0 )
+	{
+		ReportPortalFlowTimes( g_nPortalTimesToReport );
+	}
+
 	//
 	// assemble the leaf vis lists by oring the portal lists
 	//
@@ -423,6 +503,7 @@ void LoadPortals (char *name)
 	{
 		// If we're using MPI, copy off the file to a temporary first. This will download the file
 		// from the MPI master, then we get to use nice functions like fscanf on it.
+#ifdef _WIN32
 		char tempPath[MAX_PATH], tempFile[MAX_PATH];
 		if ( GetTempPath( sizeof( tempPath ), tempPath ) == 0 )
 		{
@@ -433,6 +514,7 @@ void LoadPortals (char *name)
 		{
 			Error( "LoadPortals: GetTempFileName failed.\n" );
 		}
+#endif
 
 		// Read all the data from the network file into memory.
 		FileHandle_t hFile = g_pFileSystem->Open(name, "r");
@@ -445,12 +527,21 @@ void LoadPortals (char *name)
 		g_pFileSystem->Close( hFile );
 
 		// Dump it into a temp file.
+#ifdef _WIN32
 		f = fopen( tempFile, "wt" );
 		fwrite( data.Base(), 1, data.Count(), f );
 		fclose( f );
 
 		// Open the temp file up.
 		f = fopen( tempFile, "rSTD" ); // read only, sequential, temporary, delete on close
+#else
+		f = tmpfile(); // removed on close
+		if ( f )
+		{
+			fwrite( data.Base(), 1, data.Count(), f );
+			rewind( f );
+		}
+#endif
 	}
 	else
 #endif
@@ -953,12 +1044,37 @@ int ParseCommandLine( int argc, char **argv )
 			Msg ("nosort = true\n");
 			nosort = true;
 		}
+		else if (!Q_stricmp (argv[i],"-portaltimes"))
+		{
+			g_nPortalTimesToReport = 20;
+			if ( i+2 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9' )
+			{
+				g_nPortalTimesToReport = atoi (argv[i+1]);
+				i++;
+			}
+		}
+		else if (!Q_stricmp (argv[i],"-incremental"))
+		{
+			g_bIncrementalVis = true;
+		}
+		else if (!Q_stricmp (argv[i],"-scalarclip"))
+		{
+			g_bScalarWindingClip = true;
+		}
+		else if (!Q_stricmp (argv[i],"-validateclip"))
+		{
+			g_bValidateWindingClip = true;
+		}
 		else if (!Q_stricmp (argv[i],"-tmpin"))
 			strcpy (inbase, "/tmp");
 		else if( !Q_stricmp( argv[i], "-low" ) )
 		{
 			g_bLowPriority = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-size" ) )
+		{
+			g_bPrintSizesOnly = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1042,6 +1158,12 @@ void PrintUsage( int argc, char **argv )
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
+		"  -incremental    : Save the portal visibility next to the .prt file, and only\n"
+		"                    recompute the portals affected by changes since the last run.\n"
+		"  -portaltimes [n]: List the n (default 20) portals that took the longest to flow.\n"
+		"  -scalarclip     : Use the scalar winding clipping code instead of the SIMD one.\n"
+		"  -size           : Print the lump sizes of the .bsp and exit without running vis.\n"
+		"  -validateclip   : Vis again with the scalar winding clipping and compare.\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
 		"  -trace <start cluster> <end cluster> : Writes a linefile that traces the vis from one cluster to another for debugging map vis.\n"
@@ -1082,7 +1204,6 @@ void PrintUsage( int argc, char **argv )
 
 int RunVVis( int argc, char **argv )
 {
-	char	portalfile[1024];
 	char		source[1024];
 	char		mapFile[1024];
 	double		start, end;
@@ -1119,6 +1240,15 @@ int RunVVis( int argc, char **argv )
 		CmdLib_Exit( 1 );
 	}
 
+	if ( g_bPrintSizesOnly )
+	{
+		// Reads the lump headers and faces in place, nothing is loaded
+		PrintBSPFileSizes( mapFile );
+		DeleteCmdLine( argc, argv );
+		CmdLib_Cleanup();
+		return 0;
+	}
+
 	start = Plat_FloatTime();
 
 #ifdef MPI